@@ -16,260 +16,355 @@ struct HiSeqXAdapters_;
 typedef Tag<HiSeqXAdapters_> HiSeqXAdapters;
 
 
+constexpr unsigned
+_adapterOrdValue(char c)
+{
+    return c == 'A' ? 0 : c == 'C' ? 1 : c == 'G' ? 2 : c == 'T' ? 3 : 4;
+}
+
+constexpr unsigned
+_adapterLength(char const * adapter)
+{
+    unsigned len = 0;
+    while (adapter[len] != '\0')
+        ++len;
+    return len;
+}
+
+// Adapter sequences sharing a common prefix (the head) together with the shift-and masks of the head.
+struct AdapterGroup
+{
+    char const * const * adapters;
+    unsigned count;
+    unsigned maxLength;
+    unsigned headLength;        // 1 to 64 bases
+    uint64_t masks[4];          // bit i of masks[c] is set if base i of the head has ordinal value c
+};
+
+template<unsigned N>
+constexpr AdapterGroup
+makeAdapterGroup(char const * const (&adapters)[N])
+{
+    AdapterGroup group {adapters, N, 0, 0, {0, 0, 0, 0}};
+
+    for (unsigned a = 0; a < N; ++a)
+        if (_adapterLength(adapters[a]) > group.maxLength)
+            group.maxLength = _adapterLength(adapters[a]);
+
+    for (; group.headLength < 64 && adapters[0][group.headLength] != '\0'; ++group.headLength)
+    {
+        for (unsigned a = 1; a < N; ++a)
+            if (adapters[a][group.headLength] != adapters[0][group.headLength])
+                return group;
+        group.masks[_adapterOrdValue(adapters[0][group.headLength])] |= 1ull << group.headLength;
+    }
+    return group;
+}
+
+struct AdapterSet
+{
+    AdapterGroup groups[2];
+    unsigned count;
+};
+
+// The sets are generated at compile time and shared by all threads.
 template<typename TTag>
-inline Dna5String
-getUniversal(TTag)
+inline AdapterSet const &
+universalAdapters(TTag)
+{
+    static constexpr char const * adapters[] = {
+        "ATCGGAAGAGCGTCGTGTAGGGAAAGAGTGTAGATCTCGGTGGTCGCCGTATCATT"
+    };
+    static constexpr AdapterSet set {{makeAdapterGroup(adapters)}, 1};
+    return set;
+}
+
+inline AdapterSet const &
+universalAdapters(HiSeqXAdapters)
+{
+    static constexpr char const * adapters[] = {
+        "ATCGGAAGAGCGTCGTGTAGGGAAAGAGTGTGCCTCTATGTGTAGATCTCGGTGGTCGCCGTATCATT"
+    };
+    static constexpr AdapterSet set {{makeAdapterGroup(adapters)}, 1};
+    return set;
+}
+
+inline AdapterSet const &
+truSeqAdapters(HiSeqAdapters)
 {
-    return "ATCGGAAGAGCGTCGTGTAGGGAAAGAGTGTAGATCTCGGTGGTCGCCGTATCATT";
+    static constexpr char const * adapters[] = {
+        "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "ATCACG"   "ATCTCGTATGCCGTCTTCTGCTTG",
+        "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "CGATGT"   "ATCTCGTATGCCGTCTTCTGCTTG",
+        "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "TTAGGC"   "ATCTCGTATGCCGTCTTCTGCTTG",
+        "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "TGACCA"   "ATCTCGTATGCCGTCTTCTGCTTG",
+        "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "ACAGTG"   "ATCTCGTATGCCGTCTTCTGCTTG",
+        "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "GCCAAT"   "ATCTCGTATGCCGTCTTCTGCTTG",
+        "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "CAGATC"   "ATCTCGTATGCCGTCTTCTGCTTG",
+        "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "ACTTGA"   "ATCTCGTATGCCGTCTTCTGCTTG",
+        "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "GATCAG"   "ATCTCGTATGCCGTCTTCTGCTTG",
+        "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "TAGCTT"   "ATCTCGTATGCCGTCTTCTGCTTG",
+        "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "GGCTAC"   "ATCTCGTATGCCGTCTTCTGCTTG",
+        "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "CTTGTA"   "ATCTCGTATGCCGTCTTCTGCTTG",
+        "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "AGTCAACA" "ATCTCGTATGCCGTCTTCTGCTTG",
+        "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "AGTTCCGT" "ATCTCGTATGCCGTCTTCTGCTTG",
+        "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "ATGTCAGA" "ATCTCGTATGCCGTCTTCTGCTTG",
+        "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "CCGTCCCG" "ATCTCGTATGCCGTCTTCTGCTTG",
+        "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "GTCCGCAC" "ATCTCGTATGCCGTCTTCTGCTTG",
+        "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "GTGAAACG" "ATCTCGTATGCCGTCTTCTGCTTG",
+        "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "GTGGCCTT" "ATCTCGTATGCCGTCTTCTGCTTG",
+        "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "GTTTCGGA" "ATCTCGTATGCCGTCTTCTGCTTG",
+        "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "CGTACGTA" "ATCTCGTATGCCGTCTTCTGCTTG",
+        "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "GAGTGGAT" "ATCTCGTATGCCGTCTTCTGCTTG",
+        "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "ACTGATAT" "ATCTCGTATGCCGTCTTCTGCTTG",
+        "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "ATTCCTTT" "ATCTCGTATGCCGTCTTCTGCTTG"
+    };
+    static constexpr AdapterSet set {{makeAdapterGroup(adapters)}, 1};
+    return set;
 }
 
-inline Dna5String
-getUniversal(HiSeqXAdapters)
+inline AdapterSet const &
+truSeqAdapters(HiSeqXAdapters)
 {
-    return "ATCGGAAGAGCGTCGTGTAGGGAAAGAGTGTGCCTCTATGTGTAGATCTCGGTGGTCGCCGTATCATT";
+    static constexpr char const * adaptersX[] = {
+        "AATGATACGGCGACCACCGAGATCTACAC" "TATAGCCT" "ACACTCTTTCCCTACACGACGCTCTTCCGATCT",
+        "AATGATACGGCGACCACCGAGATCTACAC" "ATAGAGGC" "ACACTCTTTCCCTACACGACGCTCTTCCGATCT",
+        "AATGATACGGCGACCACCGAGATCTACAC" "CCTATCCT" "ACACTCTTTCCCTACACGACGCTCTTCCGATCT",
+        "AATGATACGGCGACCACCGAGATCTACAC" "GGCTCTGA" "ACACTCTTTCCCTACACGACGCTCTTCCGATCT",
+        "AATGATACGGCGACCACCGAGATCTACAC" "AGGCGAAG" "ACACTCTTTCCCTACACGACGCTCTTCCGATCT",
+        "AATGATACGGCGACCACCGAGATCTACAC" "TAATCTTA" "ACACTCTTTCCCTACACGACGCTCTTCCGATCT",
+        "AATGATACGGCGACCACCGAGATCTACAC" "CAGGACGT" "ACACTCTTTCCCTACACGACGCTCTTCCGATCT",
+        "AATGATACGGCGACCACCGAGATCTACAC" "GTACTGAC" "ACACTCTTTCCCTACACGACGCTCTTCCGATCT"
+    };
+    static constexpr char const * adapters[] = {
+        "GATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "ATTACTCG" "ATCTCGTATGCCGTCTTCTGCTTG",
+        "GATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "TCCGGAGA" "ATCTCGTATGCCGTCTTCTGCTTG",
+        "GATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "CGCTCATT" "ATCTCGTATGCCGTCTTCTGCTTG",
+        "GATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "GAGATTCC" "ATCTCGTATGCCGTCTTCTGCTTG",
+        "GATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "ATTCAGAA" "ATCTCGTATGCCGTCTTCTGCTTG",
+        "GATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "GAATTCGT" "ATCTCGTATGCCGTCTTCTGCTTG",
+        "GATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "CTGAAGCT" "ATCTCGTATGCCGTCTTCTGCTTG",
+        "GATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "TAATGCGC" "ATCTCGTATGCCGTCTTCTGCTTG",
+        "GATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "CGGCTATG" "ATCTCGTATGCCGTCTTCTGCTTG",
+        "GATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "TCCGCGAA" "ATCTCGTATGCCGTCTTCTGCTTG",
+        "GATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "TCTCGCGC" "ATCTCGTATGCCGTCTTCTGCTTG",
+        "GATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "AGCGATAG" "ATCTCGTATGCCGTCTTCTGCTTG"
+    };
+    static constexpr AdapterSet set {{makeAdapterGroup(adaptersX), makeAdapterGroup(adapters)}, 2};
+    return set;
 }
-inline Dna5String
+
+constexpr char const *
 getTruSeqPrefix(HiSeqAdapters)
 {
     return "ATCGGAAGAGCACACGTCTGAACTCCAGTCAC";
 }
 
-inline Dna5String
+constexpr char const *
 getTruSeqSuffix(HiSeqAdapters)
 {
     return "ATCTCGTATGCCGTCTTCTGCTTG";
 }
 
-inline Dna5String
+constexpr char const *
 getTruSeqPrefix(HiSeqXAdapters)
 {
     return "AATGATACGGCGACCACCGAGATCTACAC";
 }
 
-inline Dna5String
+constexpr char const *
 getTruSeqSuffix(HiSeqXAdapters)
 {
     return "ACACTCTTTCCCTACACGACGCTCTTCCGATCT";
 }
 
-template<typename TTag>
-inline StringSet<Dna5String>
-reverseUniversalOneError(TTag tag)
+// Ordinal values of the read bases in sequencing direction (4 for N), i.e. reverse complemented on the fly for
+// reads on the reverse strand.
+struct AdapterReadView
 {
-    typedef Dna5String TSeq;
-    typedef Size<TSeq>::Type TSize;
-    typedef Dna TAlphabet;
+    IupacString const & seq;
+    unsigned readLength;
+    bool reverseComplemented;
 
-    // Append the error-free sequence to sequence set.
-    StringSet<TSeq> adaptSeqs;
-    appendValue(adaptSeqs, getUniversal(tag));
+    AdapterReadView(IupacString const & seq_, bool reverseComplemented_) :
+        seq(seq_), readLength(length(seq_)), reverseComplemented(reverseComplemented_)
+    {}
 
-    reverse(adaptSeqs[0]);
+    inline unsigned
+    operator[](unsigned i) const
+    {
+        if (!reverseComplemented)
+            return ordValue(Dna5(seq[i]));
+        unsigned c = ordValue(Dna5(seq[readLength - 1 - i]));
+        return c < 4 ? 3 - c : c;
+    }
+};
 
-    // Append all sequences with one mismatch to sequence set.
-    TSeq errSeq = adaptSeqs[0];
-    for (TSize i = 0; i < length(adaptSeqs[0]); ++i)
+// Global alignment score of adapter[0..len) and read[readBegin..readBegin+len) with match 1, mismatch 0, free gaps
+// and a band of two diagonals, computed on two rows of the band.
+inline int
+_bandedAdapterScore(char const * adapter, AdapterReadView const & read, unsigned readBegin, unsigned len)
+{
+    int prev[5], curr[5];
+    for (int d = -2; d <= 2; ++d)
+        prev[d + 2] = (d >= 0 && d <= (int)len) ? 0 : -1;
+
+    for (int i = 1; i <= (int)len; ++i)
     {
-        for (TSize c = 0; c < ValueSize<TAlphabet>::VALUE; ++c)
+        unsigned c = _adapterOrdValue(adapter[i - 1]);
+        for (int d = -2; d <= 2; ++d)
         {
-            errSeq[i] = c;
-            appendValue(adaptSeqs, errSeq);
+            int j = i + d;
+            int score = -1;
+            if (j == 0)
+                score = 0;
+            else if (j > 0 && j <= (int)len)
+            {
+                score = prev[d + 2] + (c == read[readBegin + j - 1]);
+                if (d < 2 && prev[d + 3] > score) score = prev[d + 3];
+                if (d > -2 && curr[d + 1] > score) score = curr[d + 1];
+            }
+            curr[d + 2] = score;
         }
-        errSeq[i] = adaptSeqs[0][i];
+        for (int d = 0; d < 5; ++d)
+            prev[d] = curr[d];
     }
-
-    return adaptSeqs;
+    return prev[2];
 }
 
-template<typename TSequence>
-bool
-startsWithTruSeq(TSequence & seq, HiSeqXAdapters tag)
+inline bool
+startsWithTruSeq(AdapterReadView const & read, HiSeqXAdapters tag)
 {
-    TSequence truSeqPre = getTruSeqPrefix(tag);
-    unsigned preLen = _min(length(truSeqPre), length(seq));
-    int score = globalAlignmentScore(prefix(truSeqPre, preLen), prefix(seq, preLen), Score<int>(1,0,0), -2, 2);
+    const unsigned truSeqPreLen = _adapterLength(getTruSeqPrefix(tag));
+    const unsigned truSeqSufLen = _adapterLength(getTruSeqSuffix(tag));
+
+    unsigned preLen = _min(truSeqPreLen, read.readLength);
+    int score = _bandedAdapterScore(getTruSeqPrefix(tag), read, 0, preLen);
     if (score > (int)preLen - 5)
     {
-        TSequence truSeqSuf = getTruSeqSuffix(tag);
-        unsigned sufLen = _min(length(truSeqSuf), length(seq) - length(truSeqPre) - 8);
-        score += globalAlignmentScore(prefix(truSeqSuf, sufLen), infix(seq, length(truSeqPre) + 8, sufLen + 8 + length(truSeqPre)), Score<int>(1,0,0), -2, 2);
+        // Reads covering less than two bases of the suffix are not counted as TruSeq.
+        unsigned sufLen = read.readLength > truSeqPreLen + 8 ? _min(truSeqSufLen, read.readLength - truSeqPreLen - 8) : 0;
+        if (sufLen < 2) return 1;
+        score += _bandedAdapterScore(getTruSeqSuffix(tag), read, truSeqPreLen + 8, sufLen);
         if (score > (int)preLen + (int)sufLen - 10) return 0;
     }
     else
     {
-        truSeqPre = getTruSeqPrefix(HiSeqAdapters());
-        score = globalAlignmentScore(prefix(truSeqPre, preLen), prefix(seq, preLen), Score<int>(1,0,0), -2, 2);
-        if (score > (int)length(truSeqPre) - 5)
+        const unsigned hiSeqPreLen = _adapterLength(getTruSeqPrefix(HiSeqAdapters()));
+        const unsigned hiSeqSufLen = _adapterLength(getTruSeqSuffix(HiSeqAdapters()));
+
+        score = _bandedAdapterScore(getTruSeqPrefix(HiSeqAdapters()), read, 0, preLen);
+        if (score > (int)hiSeqPreLen - 5)
         {
-            if (length(seq) < length(truSeqPre) + 8) return 0;
-            TSequence truSeqSuf = getTruSeqSuffix(HiSeqAdapters());
-            unsigned sufLen = _min(length(truSeqSuf), length(seq)- length(truSeqPre) - 8);
-            score += globalAlignmentScore(prefix(truSeqSuf, sufLen), infix(seq, length(truSeqPre) + 8, length(truSeqPre) + 8 + sufLen), Score<int>(1,0,0), -2, 2);
+            if (read.readLength < hiSeqPreLen + 8) return 0;
+            unsigned sufLen = _min(hiSeqSufLen, read.readLength - hiSeqPreLen - 8);
+            if (sufLen < 2) return 1;
+            score += _bandedAdapterScore(getTruSeqSuffix(HiSeqAdapters()), read, hiSeqPreLen + 8, sufLen);
             if (score > (int)preLen + (int)sufLen - 10) return 0;
         }
     }
     return 1;
 }
 
-template<typename TSequence>
-bool
-startsWithTruSeq(TSequence & seq, HiSeqAdapters tag)
+inline bool
+startsWithTruSeq(AdapterReadView const & read, HiSeqAdapters tag)
 {
-    TSequence truSeqPre = getTruSeqPrefix(tag);
-    unsigned preLen = _min(length(truSeqPre), length(seq));
-    int score = globalAlignmentScore(prefix(truSeqPre, preLen), prefix(seq, preLen), Score<int>(1,0,0), -2, 2);
+    const unsigned truSeqPreLen = _adapterLength(getTruSeqPrefix(tag));
+    const unsigned truSeqSufLen = _adapterLength(getTruSeqSuffix(tag));
+
+    unsigned preLen = _min(truSeqPreLen, read.readLength);
+    int score = _bandedAdapterScore(getTruSeqPrefix(tag), read, 0, preLen);
     if (score > (int)preLen - 5)
     {
-        TSequence truSeqSuf = getTruSeqSuffix(tag);
-        unsigned sufLen = _min(length(truSeqSuf), length(seq) - length(truSeqPre) - 8);
-        score += globalAlignmentScore(prefix(truSeqSuf, sufLen), infix(seq, length(truSeqPre) + 8, sufLen + 8 + length(truSeqPre)), Score<int>(1,0,0), -2, 2);
+        // Reads covering less than two bases of the suffix are not counted as TruSeq.
+        unsigned sufLen = read.readLength > truSeqPreLen + 8 ? _min(truSeqSufLen, read.readLength - truSeqPreLen - 8) : 0;
+        if (sufLen < 2) return 1;
+        score += _bandedAdapterScore(getTruSeqSuffix(tag), read, truSeqPreLen + 8, sufLen);
         if (score > (int)preLen + (int)sufLen - 10) return 0;
     }
     return 1;
 }
 
-
-inline StringSet<Dna5String>
-truSeqs(NoAdapters &)
+// Returns true if the read lies within the adapter with at most one mismatch.
+inline bool
+_readWithinAdapter(char const * adapter, AdapterReadView const & read)
 {
-    // Nothing to be done.
-    return StringSet<Dna5String>();
+    unsigned adapterLen = _adapterLength(adapter);
+    for (unsigned offset = 0; offset + read.readLength <= adapterLen; ++offset)
+    {
+        unsigned i = 0;
+        for (unsigned errors = 0; i < read.readLength; ++i)
+        {
+            unsigned c = read[i];
+            if (c != _adapterOrdValue(adapter[offset + i]) && (c > 3 || ++errors > 1))
+                break;
+        }
+        if (i == read.readLength)
+            return true;
+    }
+    return false;
 }
 
-
-inline StringSet<Dna5String>
-truSeqs(HiSeqAdapters)
+// Returns true if read[readBegin..) is a prefix of the adapter with at most one mismatch in total.
+inline bool
+_readEndMatchesAdapter(char const * adapter, AdapterReadView const & read, unsigned readBegin, unsigned errors)
 {
-    StringSet<Dna5String> adaptSeqs;
-
-    appendValue(adaptSeqs, "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "ATCACG"   "ATCTCGTATGCCGTCTTCTGCTTG");
-    appendValue(adaptSeqs, "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "CGATGT"   "ATCTCGTATGCCGTCTTCTGCTTG");
-    appendValue(adaptSeqs, "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "TTAGGC"   "ATCTCGTATGCCGTCTTCTGCTTG");
-    appendValue(adaptSeqs, "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "TGACCA"   "ATCTCGTATGCCGTCTTCTGCTTG");
-    appendValue(adaptSeqs, "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "ACAGTG"   "ATCTCGTATGCCGTCTTCTGCTTG");
-    appendValue(adaptSeqs, "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "GCCAAT"   "ATCTCGTATGCCGTCTTCTGCTTG");
-    appendValue(adaptSeqs, "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "CAGATC"   "ATCTCGTATGCCGTCTTCTGCTTG");
-    appendValue(adaptSeqs, "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "ACTTGA"   "ATCTCGTATGCCGTCTTCTGCTTG");
-    appendValue(adaptSeqs, "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "GATCAG"   "ATCTCGTATGCCGTCTTCTGCTTG");
-    appendValue(adaptSeqs, "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "TAGCTT"   "ATCTCGTATGCCGTCTTCTGCTTG");
-    appendValue(adaptSeqs, "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "GGCTAC"   "ATCTCGTATGCCGTCTTCTGCTTG");
-    appendValue(adaptSeqs, "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "CTTGTA"   "ATCTCGTATGCCGTCTTCTGCTTG");
-    appendValue(adaptSeqs, "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "AGTCAACA" "ATCTCGTATGCCGTCTTCTGCTTG");
-    appendValue(adaptSeqs, "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "AGTTCCGT" "ATCTCGTATGCCGTCTTCTGCTTG");
-    appendValue(adaptSeqs, "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "ATGTCAGA" "ATCTCGTATGCCGTCTTCTGCTTG");
-    appendValue(adaptSeqs, "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "CCGTCCCG" "ATCTCGTATGCCGTCTTCTGCTTG");
-    appendValue(adaptSeqs, "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "GTCCGCAC" "ATCTCGTATGCCGTCTTCTGCTTG");
-    appendValue(adaptSeqs, "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "GTGAAACG" "ATCTCGTATGCCGTCTTCTGCTTG");
-    appendValue(adaptSeqs, "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "GTGGCCTT" "ATCTCGTATGCCGTCTTCTGCTTG");
-    appendValue(adaptSeqs, "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "GTTTCGGA" "ATCTCGTATGCCGTCTTCTGCTTG");
-    appendValue(adaptSeqs, "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "CGTACGTA" "ATCTCGTATGCCGTCTTCTGCTTG");
-    appendValue(adaptSeqs, "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "GAGTGGAT" "ATCTCGTATGCCGTCTTCTGCTTG");
-    appendValue(adaptSeqs, "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "ACTGATAT" "ATCTCGTATGCCGTCTTCTGCTTG");
-    appendValue(adaptSeqs, "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "ATTCCTTT" "ATCTCGTATGCCGTCTTCTGCTTG");
-
-    return adaptSeqs;
+    for (unsigned i = readBegin; i < read.readLength; ++i, ++adapter)
+    {
+        unsigned c = read[i];
+        if (*adapter == '\0')
+            return false;
+        if (c != _adapterOrdValue(*adapter) && (c > 3 || ++errors > 1))
+            return false;
+    }
+    return true;
 }
 
-inline StringSet<Dna5String>
-truSeqs(HiSeqXAdapters)
+// Returns the read length if the read lies within an adapter of the group, and otherwise the length of the longest
+// read suffix that is an adapter prefix, both with at most one mismatch. Shift-and with one error scans the read end
+// for the head of the group, the remaining adapter bases are compared only where the head matches.
+inline unsigned
+_adapterMatchLength(AdapterGroup const & group, AdapterReadView const & read)
 {
-    StringSet<Dna5String> adaptSeqs;
-    appendValue(adaptSeqs, "AATGATACGGCGACCACCGAGATCTACAC" "TATAGCCT" "ACACTCTTTCCCTACACGACGCTCTTCCGATCT");
-    appendValue(adaptSeqs, "AATGATACGGCGACCACCGAGATCTACAC" "ATAGAGGC" "ACACTCTTTCCCTACACGACGCTCTTCCGATCT");
-    appendValue(adaptSeqs, "AATGATACGGCGACCACCGAGATCTACAC" "CCTATCCT" "ACACTCTTTCCCTACACGACGCTCTTCCGATCT");
-    appendValue(adaptSeqs, "AATGATACGGCGACCACCGAGATCTACAC" "GGCTCTGA" "ACACTCTTTCCCTACACGACGCTCTTCCGATCT");
-    appendValue(adaptSeqs, "AATGATACGGCGACCACCGAGATCTACAC" "AGGCGAAG" "ACACTCTTTCCCTACACGACGCTCTTCCGATCT");
-    appendValue(adaptSeqs, "AATGATACGGCGACCACCGAGATCTACAC" "TAATCTTA" "ACACTCTTTCCCTACACGACGCTCTTCCGATCT");
-    appendValue(adaptSeqs, "AATGATACGGCGACCACCGAGATCTACAC" "CAGGACGT" "ACACTCTTTCCCTACACGACGCTCTTCCGATCT");
-    appendValue(adaptSeqs, "AATGATACGGCGACCACCGAGATCTACAC" "GTACTGAC" "ACACTCTTTCCCTACACGACGCTCTTCCGATCT");
-
-    appendValue(adaptSeqs, "GATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "ATTACTCG" "ATCTCGTATGCCGTCTTCTGCTTG");
-    appendValue(adaptSeqs, "GATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "TCCGGAGA" "ATCTCGTATGCCGTCTTCTGCTTG");
-    appendValue(adaptSeqs, "GATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "CGCTCATT" "ATCTCGTATGCCGTCTTCTGCTTG");
-    appendValue(adaptSeqs, "GATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "GAGATTCC" "ATCTCGTATGCCGTCTTCTGCTTG");
-    appendValue(adaptSeqs, "GATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "ATTCAGAA" "ATCTCGTATGCCGTCTTCTGCTTG");
-    appendValue(adaptSeqs, "GATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "GAATTCGT" "ATCTCGTATGCCGTCTTCTGCTTG");
-    appendValue(adaptSeqs, "GATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "CTGAAGCT" "ATCTCGTATGCCGTCTTCTGCTTG");
-    appendValue(adaptSeqs, "GATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "TAATGCGC" "ATCTCGTATGCCGTCTTCTGCTTG");
-    appendValue(adaptSeqs, "GATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "CGGCTATG" "ATCTCGTATGCCGTCTTCTGCTTG");
-    appendValue(adaptSeqs, "GATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "TCCGCGAA" "ATCTCGTATGCCGTCTTCTGCTTG");
-    appendValue(adaptSeqs, "GATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "TCTCGCGC" "ATCTCGTATGCCGTCTTCTGCTTG");
-    appendValue(adaptSeqs, "GATCGGAAGAGCACACGTCTGAACTCCAGTCAC" "AGCGATAG" "ATCTCGTATGCCGTCTTCTGCTTG");
-
-    return adaptSeqs;
-}
+    unsigned readLength = read.readLength;
 
-template<typename TAdapterTag>
-inline StringSet<Dna5String>
-reverseTruSeqsOneError(TAdapterTag tag)
-{
-    typedef Dna5String TSeq;
-    typedef Size<TSeq>::Type TSize;
-    typedef Dna TAlphabet;
+    if (readLength <= group.maxLength)
+        for (unsigned a = 0; a < group.count; ++a)
+            if (_readWithinAdapter(group.adapters[a], read))
+                return readLength;
 
-    StringSet<TSeq> adaptSeqs = truSeqs(tag);
+    // Bit i is set if head[0..i] matches the read bases up to the current one exactly or with one mismatch.
+    uint64_t exact = 0, oneError = 0;
+    uint64_t headEnd = 1ull << (group.headLength - 1);
 
-    // Append all sequences with one mismatch to sequence set.
-    TSize len = length(adaptSeqs);
-    for (TSize s = 0; s < len; ++s)
+    for (unsigned i = readLength > group.maxLength ? readLength - group.maxLength : 0; i < readLength; ++i)
     {
-        reverse(adaptSeqs[s]);
-        TSeq errSeq = adaptSeqs[s];
-        for (TSize i = 0; i < length(adaptSeqs[s]); ++i)
+        unsigned c = read[i];
+        if (c > 3)
         {
-            for (TSize c = 0; c < ValueSize<TAlphabet>::VALUE; ++c)
-            {
-                errSeq[i] = c;
-                appendValue(adaptSeqs, errSeq);
-            }
-            errSeq[i] = adaptSeqs[s][i];
+            exact = oneError = 0;
+            continue;
         }
+        oneError = (((oneError << 1) | 1) & group.masks[c]) | ((exact << 1) | 1);
+        exact = ((exact << 1) | 1) & group.masks[c];
+
+        // The head ends here and is followed by more read bases: the first adapter that matches up to the read
+        // end gives the longest match.
+        if ((oneError & headEnd) && i + 1 < readLength)
+            for (unsigned a = 0; a < group.count; ++a)
+                if (_readEndMatchesAdapter(group.adapters[a] + group.headLength, read, i + 1, (exact & headEnd) ? 0 : 1))
+                    return readLength - i - 1 + group.headLength;
     }
 
-    return adaptSeqs;
+    oneError &= headEnd | (headEnd - 1);
+    return oneError == 0 ? 0 : 64 - __builtin_clzll(oneError);
 }
 
-// Returns the length of the matching prefix.
-template<typename TIndexSeq, typename TSpec, typename TSequence>
-inline typename Size<TSequence>::Type
-prefixMatchLength(Index<TIndexSeq, TSpec> & suffixIndex, TSequence const & seq)
+inline unsigned
+adapterMatchLength(AdapterSet const & adapterSet, AdapterReadView const & read)
 {
-    typedef typename Size<TSequence>::Type TSize;
-    typedef Index<TIndexSeq, TSpec> TIndex;
-
-
-    typename Iterator<TIndex, TopDown<> >::Type it(suffixIndex);
-
-    TSize len = 0;   // length of matching prefix
-
-    while (goDown(it, seq[repLength(it)]))
-    {
-        // if end of seq reached
-        if (repLength(it) >= length(seq))
-        {
-            // if all of seq matches the beginning of some suffix
-            if (infix(representative(it), parentRepLength(it) + 1, length(seq)) ==
-                    infix(seq, parentRepLength(it) + 1, length(seq)))
-            {
-                len = length(seq);
-            }
-            break;
-        }
-
-        // if mismatch in remaining characters along this branch
-        if (infix(representative(it), parentRepLength(it) + 1, repLength(it)) !=
-                infix(seq, parentRepLength(it) + 1, repLength(it)))
-        {
-            break;
-        }
-
-        // if current prefix is a complete suffix
-        if (isRightTerminal(it))
-        {
-            len = repLength(it);
-        }
-    }
-
+    unsigned len = 0;
+    for (unsigned g = 0; g < adapterSet.count; ++g)
+        len = _max(len, _adapterMatchLength(adapterSet.groups[g], read));
     return len;
 }
 
@@ -335,146 +430,67 @@ cigarSuffix(String<CigarElement<> > const & cigar, TSize len)
     return suffixCigar;
 }
 
-template<typename TSequence, typename TTag>
+// Scans the read in sequencing direction, i.e. reads on the reverse strand through a reverse complement view.
+template<typename TTag>
 int
 removeAdapter(BamAlignmentRecord & record,
-        Index<StringSet<TSequence> > & indexUniversal,
-        Index<StringSet<TSequence> > & indexTruSeqs,
         unsigned minAdapterLength,
         TTag tag)
 {
-    typedef typename Size<TSequence>::Type TSize;
-    typedef ModifiedString<const TSequence, ModReverse> TRevSequence;
-    //  typedef ModifiedString<const TSequence, ModComplementDna5> TComplSequence;
-    //  typedef ModifiedString<const TComplSequence, ModReverse> TRevComplSequence; // TODO: This modifier seems to be buggy!
+    AdapterReadView read(record.seq, hasFlagRC(record));
+    unsigned seqLen = read.readLength;
 
-    TSize seqLen = length(record.seq);
-
-    if (hasFlagRC(record))
+    // Check for adapter at begin of read.
+    if (hasFlagFirst(record))
     {
-        TSequence complSeq = record.seq;
-        reverseComplement(complSeq);
-
-        // Check for adapter at begin of read.
-        if (hasFlagFirst(record))
-        {
-            // Compute alignment score to TruSeq (excluding barcode)
-            if (startsWithTruSeq(complSeq, tag) == 0)
-                return 2;
-        }
-        else
-        {
-            // Compute alignment score to reverse complement of Universal
-            TSequence universal = getUniversal(tag);
-            unsigned seqLen = _min(length(universal), length(complSeq));
-            int score = globalAlignmentScore(prefix(universal, seqLen), prefix(complSeq, seqLen), Score<int>(1,0,0), -2, 2);
-            if (score > (int)length(universal) - 5)
-                return 2;
-        }
-
-        // Search prefix of complemented read in *TruSeq* index.
-        reverse(complSeq);
-        //TComplSequence complSeq(record.seq);
-        TSize adaptLen = prefixMatchLength(indexTruSeqs, complSeq);
-
-        if (adaptLen == seqLen)
-        {
-            // Read starts with adapter.
-            //std::cerr << "Removing full read        " << record.seq << std::endl;
+        // Compute alignment score to TruSeq (excluding barcode)
+        if (startsWithTruSeq(read, tag) == 0)
             return 2;
-        }
-        else if (adaptLen >= minAdapterLength)
-        {
-            //std::cerr << "Removing first " << adaptLen << " bases from " << record.seq << std::endl;
-            replace(record.seq, 0, adaptLen, "");
-            replace(record.qual, 0, adaptLen, "");
-            record.cigar = cigarSuffix(record.cigar, adaptLen);
-            return 1;
-        }
+    }
+    else
+    {
+        // Compute alignment score to reverse complement of Universal
+        AdapterGroup const & universal = universalAdapters(tag).groups[0];
+        unsigned len = _min(universal.maxLength, seqLen);
+        int score = _bandedAdapterScore(universal.adapters[0], read, 0, len);
+        if (score > (int)(hasFlagRC(record) ? universal.maxLength : len) - 5)
+            return 2;
+    }
 
-        // Search prefix of complemented read in *Universal* index.
-        adaptLen = prefixMatchLength(indexUniversal, complSeq);
+    // Search the read end in the *TruSeq* adapters, then in the *Universal* adapter.
+    unsigned adaptLen = adapterMatchLength(truSeqAdapters(tag), read);
+    if (adaptLen != seqLen && adaptLen < minAdapterLength)
+        adaptLen = adapterMatchLength(universalAdapters(tag), read);
 
-        if (adaptLen == seqLen)
-        {
-            // Read starts with adapter.
-            //std::cerr << "Removing full read        " << record.seq << std::endl;
-            return 2;
-        }
-        else if (adaptLen >= minAdapterLength)
+    if (adaptLen == seqLen)
+    {
+        // Read starts with adapter.
+        return 2;
+    }
+    else if (adaptLen >= minAdapterLength)
+    {
+        if (hasFlagRC(record))
         {
             //std::cerr << "Removing first " << adaptLen << " bases from " << record.seq << std::endl;
             replace(record.seq, 0, adaptLen, "");
             replace(record.qual, 0, adaptLen, "");
             record.cigar = cigarSuffix(record.cigar, adaptLen);
-            return 1;
-        }
-    }
-    else
-    {
-        // Check for adapter at begin of read.
-        if (hasFlagFirst(record))
-        {
-            // Compute alignemnt score to TruSeq (excluding barcode)
-            if (startsWithTruSeq(record.seq, tag) == 0)
-                return 2;
         }
         else
-        {
-            // Compute alignment score to reverse complement of Universal
-            TSequence universal = getUniversal(tag);
-            unsigned seqLen = _min(length(universal), length(record.seq));
-            int score = globalAlignmentScore(prefix(universal, seqLen), prefix(record.seq, seqLen), Score<int>(1,0,0), -2, 2);
-            if (score > (int)seqLen - 5)
-                return 2;
-        }
-
-        // Search prefix of reversed read in *TruSeq* index.
-        TRevSequence revSeq(record.seq);
-        TSize adaptLen = prefixMatchLength(indexTruSeqs, revSeq);
-
-        if (adaptLen == seqLen)
-        {
-            // Read starts with adapter.
-            //std::cerr << "Removing full read        " << record.seq << std::endl;
-            return 2;
-        }
-        else if (adaptLen >= minAdapterLength)
-        {
-            //std::cerr << "Removing last " << adaptLen << " bases from  " << record.seq << std::endl;
-            replace(record.seq, seqLen-adaptLen, seqLen, "");
-            replace(record.qual, seqLen-adaptLen, seqLen, "");
-            record.cigar = cigarPrefix(record.cigar, adaptLen);
-            return 1;
-        }
-
-        // Search prefix of read in *Universal* index.
-        adaptLen = prefixMatchLength(indexUniversal, revSeq);
-
-        if (adaptLen == seqLen)
-        {
-            // Read starts with adapter.
-            //std::cerr << "Removing full read        " << record.seq << std::endl;
-            return 2;
-        }
-        else if (adaptLen >= minAdapterLength)
         {
             //std::cerr << "Removing last " << adaptLen << " bases from  " << record.seq << std::endl;
-            replace(record.seq, seqLen-adaptLen, seqLen, "");
-            replace(record.qual, seqLen-adaptLen, seqLen, "");
+            replace(record.seq, seqLen - adaptLen, seqLen, "");
+            replace(record.qual, seqLen - adaptLen, seqLen, "");
             record.cigar = cigarPrefix(record.cigar, adaptLen);
-            return 1;
         }
+        return 1;
     }
 
     return 0;
 }
 
-template<typename TSequence>
-int
+inline int
 removeAdapter(BamAlignmentRecord &,
-        Index<StringSet<TSequence> > &,
-        Index<StringSet<TSequence> > &,
         unsigned,
         NoAdapters)
 {
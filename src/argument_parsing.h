@@ -21,36 +21,22 @@ using namespace std;
 // =========================
 
 struct AssemblyOptions {
-    CharString mappingFile;
-    CharString matepairFile;
-    CharString referenceFile;
-
     CharString prefix;
     CharString sampleID;
 
-    unsigned kmerLength;
-    CharString adapters;
-    int humanSeqs;
+    unsigned k_init;
+    unsigned delta_k;
+    unsigned k_max;
 
     unsigned threads;
-    CharString memory;
-
-    bool use_velvet;
-    bool skip_assembly;
-    float alignment_score_factor;
 
     AssemblyOptions () :
-        matepairFile(""),
-        referenceFile(""),
         prefix("."),
         sampleID(""),
-        kmerLength(47),
-        humanSeqs(maxValue<int>()),
-        threads(1),
-        memory("768M"),
-        use_velvet(false),
-        skip_assembly(false),
-        alignment_score_factor(0.67f)
+        k_init(27),
+        delta_k(20),
+        k_max(63),
+        threads(1)
     {}
 };
 
@@ -68,10 +54,14 @@ struct CropUnmappedOptions {
     int humanSeqs;
 
     unsigned threads;
-    CharString memory;
+    unsigned maxMemory;
 
     bool use_velvet;
     bool skip_assembly;
+    bool singlePass;
+    bool splitRegions;
+    bool compressFastq;
+    bool qualityFilter;
     float alignment_score_factor;
 
     CropUnmappedOptions () :
@@ -82,9 +72,13 @@ struct CropUnmappedOptions {
         kmerLength(47),
         humanSeqs(maxValue<int>()),
         threads(1),
-        memory("768M"),
+        maxMemory(8192),
         use_velvet(false),
         skip_assembly(false),
+        singlePass(false),
+        splitRegions(false),
+        compressFastq(false),
+        qualityFilter(false),
         alignment_score_factor(0.67f)
     {}
 };
@@ -96,8 +90,9 @@ struct RemappingOptions {
     CharString workingDir;
     unsigned humanSeqs;
     unsigned threads;
-    CharString memory;
     CharString prefix;
+    bool compressFastq;
+    bool qualityFilter;
     float alignment_score_factor;
 
     RemappingOptions():
@@ -106,8 +101,9 @@ struct RemappingOptions {
         workingDir(""),
         humanSeqs(maxValue<int>()),
         threads(1),
-        memory("768M"),
         prefix("."),
+        compressFastq(false),
+        qualityFilter(false),
         alignment_score_factor(0.67f)
     {}
 };
@@ -192,13 +188,22 @@ struct MultikOptions {
 
     std::string prefixFilenameOut;
 
+    size_t nb_threads;
+    size_t max_memory;
+    bool direct_fastq;
+    bool resume;
+
     MultikOptions () :
         k_init(27),
         k_max(127),
         delta_k(20),
         samplePath(""),
         tempPath("auxMultik"),
-        prefixFilenameOut("ccdbg")
+        prefixFilenameOut("ccdbg"),
+        nb_threads(16),
+        max_memory(4096),
+        direct_fastq(false),
+        resume(false)
     {}
 };
 
@@ -296,38 +301,48 @@ struct GenotypingOptions {
 };
 
 
+struct BatchOptions {
+    CharString commands;                // comma-separated commands run per sample
+    CharString sampleFile;
+    CharString prefix;
+
+    String<CharString> commandOptions;  // "COMMAND:OPTIONS" forwarded to a command
+
+    unsigned threads;
+    CharString memory;
+    unsigned maxMemory;
+    unsigned jobThreads;
+    unsigned ioJobs;
+
+    BatchOptions() :
+        prefix("."),
+        threads(1),
+        memory("768M"),
+        maxMemory(0),
+        jobThreads(4),
+        ioJobs(2)
+    {}
+};
+
+
 // =========================
 // Option transfer functions
 // =========================
 
 bool getOptionValues(AssemblyOptions & options, ArgumentParser const & parser){
 
-    getArgumentValue(options.mappingFile, parser, 0);
+    getArgumentValue(options.sampleID, parser, 0);
 
     if (isSet(parser, "prefix"))
        getOptionValue(options.prefix, parser, "prefix");
-    if (isSet(parser, "sample"))
-       getOptionValue(options.sampleID, parser, "sample");
-    if (isSet(parser, "matePair"))
-        getOptionValue(options.matepairFile, parser, "matePair");
-    if (isSet(parser, "adapters"))
-        getOptionValue(options.adapters, parser, "adapters");
-    if (isSet(parser, "reference"))
-        getOptionValue(options.referenceFile, parser, "reference");
-    if (isSet(parser, "filter"))
-        getOptionValue(options.humanSeqs, parser, "filter");
-    if (isSet(parser, "use-velvet"))
-        getOptionValue(options.use_velvet, parser, "use-velvet");
-    if (isSet(parser, "skip-assembly"))
-        getOptionValue(options.skip_assembly, parser, "skip-assembly");
-    if (isSet(parser, "kmerLength"))
-        getOptionValue(options.kmerLength, parser, "kmerLength");
+    if (isSet(parser, "k-init"))
+        getOptionValue(options.k_init, parser, "k-init");
+    if (isSet(parser, "delta-k"))
+        getOptionValue(options.delta_k, parser, "delta-k");
+    if (isSet(parser, "k-max"))
+        getOptionValue(options.k_max, parser, "k-max");
     if (isSet(parser, "threads"))
         getOptionValue(options.threads, parser, "threads");
-    if (isSet(parser, "memory"))
-        getOptionValue(options.memory, parser, "memory");
-    if (isSet(parser, "alignment-score-factor"))
-        getOptionValue(options.alignment_score_factor, parser, "alignment-score-factor");
 
     return true;
 }
@@ -356,8 +371,16 @@ bool getOptionValues(CropUnmappedOptions & options, ArgumentParser const & parse
         getOptionValue(options.kmerLength, parser, "kmerLength");
     if (isSet(parser, "threads"))
         getOptionValue(options.threads, parser, "threads");
-    if (isSet(parser, "memory"))
-        getOptionValue(options.memory, parser, "memory");
+    if (isSet(parser, "max-memory"))
+        getOptionValue(options.maxMemory, parser, "max-memory");
+    if (isSet(parser, "single-pass"))
+        getOptionValue(options.singlePass, parser, "single-pass");
+    if (isSet(parser, "split-regions"))
+        getOptionValue(options.splitRegions, parser, "split-regions");
+    if (isSet(parser, "compress-fastq"))
+        getOptionValue(options.compressFastq, parser, "compress-fastq");
+    if (isSet(parser, "quality-filter"))
+        getOptionValue(options.qualityFilter, parser, "quality-filter");
     if (isSet(parser, "alignment-score-factor"))
         getOptionValue(options.alignment_score_factor, parser, "alignment-score-factor");
 
@@ -375,8 +398,10 @@ bool getOptionValues(RemappingOptions & options, ArgumentParser const & parser){
         getOptionValue(options.referenceFile, parser, "reference");
     if (isSet(parser, "threads"))
         getOptionValue(options.threads, parser, "threads");
-    if (isSet(parser, "memory"))
-        getOptionValue(options.memory, parser, "memory");
+    if (isSet(parser, "compress-fastq"))
+        getOptionValue(options.compressFastq, parser, "compress-fastq");
+    if (isSet(parser, "quality-filter"))
+        getOptionValue(options.qualityFilter, parser, "quality-filter");
     if (isSet(parser, "alignment-score-factor"))
         getOptionValue(options.alignment_score_factor, parser, "alignment-score-factor");
 
@@ -487,6 +512,14 @@ bool getOptionValues(MultikOptions &options, seqan::ArgumentParser &parser){
         getOptionValue(options.k_max, parser, "k-max");
     if (isSet(parser, "delta-k"))
         getOptionValue(options.delta_k, parser, "delta-k");
+    if (isSet(parser, "direct-fastq"))
+        getOptionValue(options.direct_fastq, parser, "direct-fastq");
+    if (isSet(parser, "resume"))
+        getOptionValue(options.resume, parser, "resume");
+    if (isSet(parser, "threads"))
+        getOptionValue(options.nb_threads, parser, "threads");
+    if (isSet(parser, "max-memory"))
+        getOptionValue(options.max_memory, parser, "max-memory");
 
     return true;
 }
@@ -625,14 +658,39 @@ bool getOptionValues(GenotypingOptions &options, seqan::ArgumentParser &parser){
 }
 
 
+bool getOptionValues(BatchOptions &options, seqan::ArgumentParser &parser){
+    getArgumentValue(options.commands, parser, 0);
+    getArgumentValue(options.sampleFile, parser, 1);
+
+    if (isSet(parser, "prefix"))
+        getOptionValue(options.prefix, parser, "prefix");
+    for (unsigned i = 0; i < getOptionValueCount(parser, "options"); ++i)
+    {
+        CharString value;
+        getOptionValue(value, parser, "options", i);
+        appendValue(options.commandOptions, value);
+    }
+    if (isSet(parser, "threads"))
+        getOptionValue(options.threads, parser, "threads");
+    if (isSet(parser, "memory"))
+        getOptionValue(options.memory, parser, "memory");
+    if (isSet(parser, "max-memory"))
+        getOptionValue(options.maxMemory, parser, "max-memory");
+    if (isSet(parser, "job-threads"))
+        getOptionValue(options.jobThreads, parser, "job-threads");
+    if (isSet(parser, "io-jobs"))
+        getOptionValue(options.ioJobs, parser, "io-jobs");
+
+    return true;
+}
+
+
 // =========================
 // Hide options functions
 // =========================
 
 void setHiddenOptions(ArgumentParser & parser, bool hide, AssemblyOptions &){
-    hideOption(parser, "matePair", hide);
-    hideOption(parser, "kmerLength", hide);
-    hideOption(parser, "alignment-score-factor", hide);
+    hideOption(parser, "delta-k", hide);
 }
 
 void setHiddenOptions(ArgumentParser & parser, bool hide, CropUnmappedOptions &){
@@ -702,6 +760,11 @@ void setHiddenOptions(seqan::ArgumentParser &parser, bool hide, GenotypingOption
 }
 
 
+void setHiddenOptions(seqan::ArgumentParser &parser, bool hide, BatchOptions &){
+   hideOption(parser, "io-jobs", hide);
+}
+
+
 // ==========================================================================
 // Functions setupParser()
 // ==========================================================================
@@ -712,47 +775,39 @@ void setupParser(ArgumentParser & parser, AssemblyOptions & options){
     setDate(parser, DATE);
 
     // Define usage line and long description.
-    addUsageLine(parser, "[\\fIOPTIONS\\fP] \\fIBAM_FILE\\fP");
-    addDescription(parser, "Finds reads without high-quality alignment in the \\fIBAM FILE\\fP, quality filters them "
-          "using SICKLE and assembles them into contigs using MINIA (default) or VELVET. If the option "
-          "\'--reference \\fIFASTA FILE\\fP\' is set, the reads are first remapped to this reference using BWA-MEM and "
-          "only reads that remain without high-quality alignment after remapping are quality-filtered and assembled.");
+    addUsageLine(parser, "[\\fIOPTIONS\\fP] \\fISAMPLE_ID\\fP");
+    addDescription(parser, "Assembles the reads cropped from the sample \\fISAMPLE_ID\\fP by crop-unmapped (and remapping) "
+          "into contigs. A compacted de Bruijn graph is built from the reads for k from \\fIk-init\\fP to \\fIk-max\\fP in "
+          "steps of \\fIdelta-k\\fP, each graph includes the unitigs of the previous one. The unitigs of the last graph are "
+          "written to assembly_final.contigs.fa in the sample directory.");
 
-    // Require a bam file as argument.
-    addArgument(parser, ArgParseArgument(ArgParseArgument::INPUT_FILE, "BAM_FILE"));
+    // Require a sample ID as argument.
+    addArgument(parser, ArgParseArgument(ArgParseArgument::STRING, "SAMPLE_ID"));
 
     // Setup the options.
     addSection(parser, "Input/output options");
     addOption(parser, ArgParseOption("p", "prefix", "Path to the sample directories.", ArgParseArgument::STRING, "PATH"));
-    addOption(parser, ArgParseOption("s", "sample", "An ID for the sample.", ArgParseArgument::STRING, "SAMPLE_ID"));
-    addOption(parser, ArgParseOption("mp", "matePair", "(Currently only available for Velvet.)", ArgParseArgument::INPUT_FILE, "BAM FILE"));
 
     addSection(parser, "Algorithm options");
-    addOption(parser, ArgParseOption("a", "adapters", "Enable adapter removal for Illumina reads. Default: \\fIno adapter removal\\fP.", ArgParseArgument::STRING, "STR"));
-    addOption(parser, ArgParseOption("r", "reference", "Remap reads to this reference before assembly. Default: \\fIno remapping\\fP.", ArgParseArgument::INPUT_FILE, "FASTA_FILE"));
-    addOption(parser, ArgParseOption("f", "filter", "Treat reads aligned to all but the first INT reference sequences after remapping as high-quality aligned even if their alignment quality is low. "
-          "Recommended for non-human reference sequences.", ArgParseArgument::INTEGER, "INT"));
-    addOption(parser, ArgParseOption("vel", "use-velvet", "Use the velvet assembler. Default: Minia."));
-    addOption(parser, ArgParseOption("n", "skip-assembly", "Skip assembly per sample."));
-    addOption(parser, ArgParseOption("k", "kmerLength", "The k-mer size if the velvet assembler is used.", ArgParseArgument::INTEGER, "INT"));
-    addOption(parser, ArgParseOption("c", "alignment-score-factor", "A record is considered low quality if the alignment score (AS) is below FLOAT*read length", seqan::ArgParseArgument::DOUBLE, "FLOAT"));
+    addOption(parser, ArgParseOption("k", "k-init", "The k-mer size of the first graph.", ArgParseArgument::INTEGER, "INT"));
+    addOption(parser, ArgParseOption("d", "delta-k", "The increase of the k-mer size per iteration.", ArgParseArgument::INTEGER, "INT"));
+    addOption(parser, ArgParseOption("K", "k-max", "The maximal k-mer size.", ArgParseArgument::INTEGER, "INT"));
+
     addSection(parser, "Compute resource options");
-    addOption(parser, ArgParseOption("t", "threads", "Number of threads to use for BWA and samtools sort.", ArgParseArgument::INTEGER, "INT"));
-    addOption(parser, ArgParseOption("m", "memory", "Maximum memory per thread for samtools sort; suffix K/M/G recognized.", ArgParseArgument::STRING, "STR"));
+    addOption(parser, ArgParseOption("t", "threads", "Number of threads to use for building the graphs.", ArgParseArgument::INTEGER, "INT"));
 
     // Set valid and default values.
-    setValidValues(parser, "adapters", "HiSeq HiSeqX");
-    setValidValues(parser, "reference", "fa fna fasta gz");
     setDefaultValue(parser, "prefix", "\'.\'");
-    setDefaultValue(parser, "sample", "retrieval from BAM file header");
-    setDefaultValue(parser, "kmerLength", options.kmerLength);
+    setDefaultValue(parser, "k-init", options.k_init);
+    setDefaultValue(parser, "delta-k", options.delta_k);
+    setDefaultValue(parser, "k-max", options.k_max);
     setDefaultValue(parser, "threads", options.threads);
-    setDefaultValue(parser, "memory", options.memory);
-    setDefaultValue(parser, "alignment-score-factor", options.alignment_score_factor);
 
+    setMinValue(parser, "k-init", "3");
+    setMaxValue(parser, "k-init", std::to_string(MAX_KMER_SIZE-1));
+    setMaxValue(parser, "k-max", std::to_string(MAX_KMER_SIZE-1));
+    setMinValue(parser, "delta-k", "1");
     setMinValue(parser, "threads", "1");
-    setMinValue(parser, "alignment-score-factor", "0.0");
-    setMaxValue(parser, "alignment-score-factor", "1.0");
 
     // Hide some options from default help.
     setHiddenOptions(parser, true, options);
@@ -780,6 +835,7 @@ void setupParser(ArgumentParser & parser, CropUnmappedOptions & options){
     addOption(parser, ArgParseOption("p", "prefix", "Path to the sample directories.", ArgParseArgument::STRING, "PATH"));
     addOption(parser, ArgParseOption("s", "sample", "An ID for the sample.", ArgParseArgument::STRING, "SAMPLE_ID"));
     addOption(parser, ArgParseOption("mp", "matePair", "(Currently only available for Velvet.)", ArgParseArgument::INPUT_FILE, "BAM FILE"));
+    addOption(parser, ArgParseOption("cf", "compress-fastq", "Write the FASTQ files block-gzip compressed on the threads. The file names are kept."));
 
     addSection(parser, "Algorithm options");
     addOption(parser, ArgParseOption("a", "adapters", "Enable adapter removal for Illumina reads. Default: \\fIno adapter removal\\fP.", ArgParseArgument::STRING, "STR"));
@@ -790,9 +846,13 @@ void setupParser(ArgumentParser & parser, CropUnmappedOptions & options){
     addOption(parser, ArgParseOption("n", "skip-assembly", "Skip assembly per sample."));
     addOption(parser, ArgParseOption("k", "kmerLength", "The k-mer size if the velvet assembler is used.", ArgParseArgument::INTEGER, "INT"));
     addOption(parser, ArgParseOption("c", "alignment-score-factor", "A record is considered low quality if the alignment score (AS) is below FLOAT*read length", seqan::ArgParseArgument::DOUBLE, "FLOAT"));
+    addOption(parser, ArgParseOption("qf", "quality-filter", "Trim and filter the reads like 'sickle -q 20 -l 60 -x -n' while writing the FASTQ files. "
+          "The remaining read of a pair with one discarded read end is written to the single end reads."));
+    addOption(parser, ArgParseOption("sp", "single-pass", "Collect the mates of low quality mapping reads while reading the coordinate-sorted BAM file once. Only mates out of reach are fetched in a second, indexed pass."));
     addSection(parser, "Compute resource options");
-    addOption(parser, ArgParseOption("t", "threads", "Number of threads to use for BWA and samtools sort.", ArgParseArgument::INTEGER, "INT"));
-    addOption(parser, ArgParseOption("m", "memory", "Maximum memory per thread for samtools sort; suffix K/M/G recognized.", ArgParseArgument::STRING, "STR"));
+    addOption(parser, ArgParseOption("t", "threads", "Number of threads to use for cropping.", ArgParseArgument::INTEGER, "INT"));
+    addOption(parser, ArgParseOption("M", "max-memory", "Maximum memory in MB for reads waiting for their mate; further reads are spilled to disk.", ArgParseArgument::INTEGER, "INT"));
+    addOption(parser, ArgParseOption("sr", "split-regions", "Crop regions of the indexed BAM file independently on all threads and merge the results. Requires a BAI index file."));
 
     // Set valid and default values.
     setValidValues(parser, "adapters", "HiSeq HiSeqX");
@@ -801,10 +861,11 @@ void setupParser(ArgumentParser & parser, CropUnmappedOptions & options){
     setDefaultValue(parser, "sample", "retrieval from BAM file header");
     setDefaultValue(parser, "kmerLength", options.kmerLength);
     setDefaultValue(parser, "threads", options.threads);
-    setDefaultValue(parser, "memory", options.memory);
+    setDefaultValue(parser, "max-memory", options.maxMemory);
     setDefaultValue(parser, "alignment-score-factor", options.alignment_score_factor);
 
     setMinValue(parser, "threads", "1");
+    setMinValue(parser, "max-memory", "1");
     setMinValue(parser, "alignment-score-factor", "0.0");
     setMaxValue(parser, "alignment-score-factor", "1.0");
 
@@ -833,6 +894,7 @@ void setupParser(ArgumentParser & parser, RemappingOptions & options){
     addOption(parser, ArgParseOption("p", "prefix", "Path to the sample directories.", ArgParseArgument::STRING, "PATH"));
     addOption(parser, ArgParseOption("s", "sample", "An ID for the sample.", ArgParseArgument::STRING, "SAMPLE_ID"));
     addOption(parser, ArgParseOption("mp", "matePair", "(Currently only available for Velvet.)", ArgParseArgument::INPUT_FILE, "BAM FILE"));
+    addOption(parser, ArgParseOption("cf", "compress-fastq", "Write the FASTQ files block-gzip compressed on the threads. The file names are kept."));
 
     addSection(parser, "Algorithm options");
     addOption(parser, ArgParseOption("a", "adapters", "Enable adapter removal for Illumina reads. Default: \\fIno adapter removal\\fP.", ArgParseArgument::STRING, "STR"));
@@ -840,9 +902,10 @@ void setupParser(ArgumentParser & parser, RemappingOptions & options){
     addOption(parser, ArgParseOption("f", "filter", "Treat reads aligned to all but the first INT reference sequences after remapping as high-quality aligned even if their alignment quality is low. "
           "Recommended for non-human reference sequences.", ArgParseArgument::INTEGER, "INT"));
     addOption(parser, ArgParseOption("c", "alignment-score-factor", "A record is considered low quality if the alignment score (AS) is below FLOAT*read length", seqan::ArgParseArgument::DOUBLE, "FLOAT"));
+    addOption(parser, ArgParseOption("qf", "quality-filter", "Trim and filter the reads like 'sickle -q 20 -l 60 -x -n' while writing the FASTQ files. "
+          "The remaining read of a pair with one discarded read end is written to the single end reads."));
     addSection(parser, "Compute resource options");
-    addOption(parser, ArgParseOption("t", "threads", "Number of threads to use for BWA and samtools sort.", ArgParseArgument::INTEGER, "INT"));
-    addOption(parser, ArgParseOption("m", "memory", "Maximum memory per thread for samtools sort; suffix K/M/G recognized.", ArgParseArgument::STRING, "STR"));
+    addOption(parser, ArgParseOption("t", "threads", "Number of threads to use for BWA, cropping and compressing the FASTQ files.", ArgParseArgument::INTEGER, "INT"));
 
     // Set valid and default values.
     setValidValues(parser, "adapters", "HiSeq HiSeqX");
@@ -850,7 +913,6 @@ void setupParser(ArgumentParser & parser, RemappingOptions & options){
     setDefaultValue(parser, "prefix", "\'.\'");
     setDefaultValue(parser, "sample", "retrieval from BAM file header");
     setDefaultValue(parser, "threads", options.threads);
-    setDefaultValue(parser, "memory", options.memory);
     setDefaultValue(parser, "alignment-score-factor", options.alignment_score_factor);
 
     setMinValue(parser, "threads", "1");
@@ -962,18 +1024,29 @@ void setupParser(seqan::ArgumentParser &parser, MultikOptions &options){
     seqan::addOption(parser, seqan::ArgParseOption("s", "sample-path",   "Source directory with FASTA/Q files", seqan::ArgParseArgument::STRING, "DIR"));
     seqan::addOption(parser, seqan::ArgParseOption("a", "temp-path",     "Auxiliary directory for temporary files.", seqan::ArgParseArgument::STRING, "DIR"));
     seqan::addOption(parser, seqan::ArgParseOption("p", "outputfile-prefix", "Specify a prefix for the output files", seqan::ArgParseArgument::STRING, "STRING"));
+    seqan::addOption(parser, seqan::ArgParseOption("x", "direct-fastq",  "Build the first dBG from the input files directly and convert them to FASTA meanwhile"));
+    seqan::addOption(parser, seqan::ArgParseOption("r", "resume",        "Resume from the last completed iteration recorded in the temp-path"));
 
     seqan::addSection(parser, "Algorithm options");
     seqan::addOption(parser, seqan::ArgParseOption("k", "k-init",    "Initial kmer length to start the multi-k iteration", seqan::ArgParseArgument::INTEGER, "INT"));
     seqan::addOption(parser, seqan::ArgParseOption("m", "k-max",     "Maximal kmer length to build a dBG with", seqan::ArgParseArgument::INTEGER, "INT"));
     seqan::addOption(parser, seqan::ArgParseOption("d", "delta-k",   "Step size to increase k", seqan::ArgParseArgument::INTEGER, "INT"));
 
+    seqan::addSection(parser, "Compute resource options");
+    seqan::addOption(parser, seqan::ArgParseOption("t", "threads", "Amount of threads for parallel processing", seqan::ArgParseArgument::INTEGER, "INT"));
+    seqan::addOption(parser, seqan::ArgParseOption("M", "max-memory", "Memory cap in MB for the FASTQ to FASTA conversion", seqan::ArgParseArgument::INTEGER, "INT"));
+
     // Setup option constraints
     seqan::setDefaultValue(parser, "p",   options.prefixFilenameOut);
     seqan::setDefaultValue(parser, "a",   options.tempPath);
     seqan::setDefaultValue(parser, "k",   options.k_init);
     seqan::setDefaultValue(parser, "m",   options.k_max);
     seqan::setDefaultValue(parser, "d",   options.delta_k);
+    seqan::setDefaultValue(parser, "t",   options.nb_threads);
+    seqan::setDefaultValue(parser, "M",   options.max_memory);
+
+    seqan::setMinValue(parser, "t", "1");
+    seqan::setMinValue(parser, "M", "1");
 
     // Setup hidden options
     setHiddenOptions(parser, true, options);
@@ -1005,8 +1078,8 @@ void setupParser(seqan::ArgumentParser &parser, ContigMapOptions &options){
     addOption(parser, ArgParseOption("d", "noNonRefNew", "Delete the non_ref_new.bam file after writing locations."));
 
     addSection(parser, "Compute resource options");
-    addOption(parser, ArgParseOption("t", "threads", "Number of threads to use for BWA and samtools sort.", ArgParseArgument::INTEGER, "INT"));
-    addOption(parser, ArgParseOption("m", "memory", "Maximum memory per thread for samtools sort; suffix K/M/G recognized.", ArgParseArgument::STRING, "STR"));
+    addOption(parser, ArgParseOption("t", "threads", "Number of threads to use for BWA and sorting bam files.", ArgParseArgument::INTEGER, "INT"));
+    addOption(parser, ArgParseOption("m", "memory", "Maximum memory per thread for sorting bam files; suffix K/M/G recognized.", ArgParseArgument::STRING, "STR"));
 
     // Set valid values.
     setMinValue(parser, "threads", "1");
@@ -1235,6 +1308,53 @@ void setupParser(seqan::ArgumentParser &parser, GenotypingOptions &options){
 }
 
 
+void setupParser(seqan::ArgumentParser &parser, BatchOptions &options){
+    setShortDescription(parser, "Run per-sample commands for many samples in one process.");
+    setVersion(parser, VERSION);
+    setDate(parser, DATE);
+
+    // Define usage line and long description.
+    addUsageLine(parser, "[\\fIOPTIONS\\fP] \\fICOMMANDS\\fP \\fISAMPLE_FILE\\fP");
+    addDescription(parser, "Runs a comma-separated list of the per-sample commands crop-unmapped, remapping, contigmap, "
+            "place-splitalign and genotype in the given order for every sample listed in the SAMPLE_FILE. The "
+            "SAMPLE_FILE lists a sample ID and, for crop-unmapped, the sample's BAM file per line, separated by a tab. "
+            "The samples are processed concurrently; the available threads and memory are shared between the "
+            "running commands. Options of a command are passed with -O, e.g. -O \'contigmap:-c supercontigs.fa -r genome.fa\'.");
+
+    addArgument(parser, ArgParseArgument(ArgParseArgument::STRING, "COMMANDS"));
+    addArgument(parser, ArgParseArgument(ArgParseArgument::INPUT_FILE, "SAMPLE_FILE"));
+
+    // Setup the options.
+    addSection(parser, "Input/output options");
+    addOption(parser, ArgParseOption("p", "prefix", "Path to the sample directories.", ArgParseArgument::STRING, "PATH"));
+    addOption(parser, ArgParseOption("O", "options", "Options passed to a command, given as COMMAND:OPTIONS.", ArgParseArgument::STRING, "STR", true));
+
+    addSection(parser, "Compute resource options");
+    addOption(parser, ArgParseOption("t", "threads", "Total number of threads to share between the samples.", ArgParseArgument::INTEGER, "INT"));
+    addOption(parser, ArgParseOption("m", "memory", "Memory reserved per thread of a command; suffix K/M/G recognized.", ArgParseArgument::STRING, "STR"));
+    addOption(parser, ArgParseOption("M", "max-memory", "Total memory in MB to share between the samples (0 for threads times memory per thread).", ArgParseArgument::INTEGER, "INT"));
+    addOption(parser, ArgParseOption("j", "job-threads", "Maximum number of threads of a single remapping or contigmap command.", ArgParseArgument::INTEGER, "INT"));
+    addOption(parser, ArgParseOption("i", "io-jobs", "Maximum number of concurrent crop-unmapped commands.", ArgParseArgument::INTEGER, "INT"));
+
+    // Set valid values.
+    setMinValue(parser, "threads", "1");
+    setMinValue(parser, "max-memory", "0");
+    setMinValue(parser, "job-threads", "1");
+    setMinValue(parser, "io-jobs", "1");
+
+    // Set default values.
+    setDefaultValue(parser, "prefix", "\'.\'");
+    setDefaultValue(parser, "threads", options.threads);
+    setDefaultValue(parser, "memory", options.memory);
+    setDefaultValue(parser, "max-memory", options.maxMemory);
+    setDefaultValue(parser, "job-threads", options.jobThreads);
+    setDefaultValue(parser, "io-jobs", options.ioJobs);
+
+    // Hide some options from default help.
+    setHiddenOptions(parser, true, options);
+}
+
+
 // ==========================================================================
 // Function checkInput()
 // ==========================================================================
@@ -1249,23 +1369,9 @@ ArgumentParser::ParseResult checkInput(AssemblyOptions & options){
         res = ArgumentParser::PARSE_ERROR;
     }
 
-    if (!exists(options.mappingFile))
-    {
-        std::cerr << "ERROR: Input BAM file \'" << options.mappingFile << "\' does not exist." << std::endl;
-        res = ArgumentParser::PARSE_ERROR;
-    }
-
-    CharString baiFile = options.mappingFile;
-    baiFile += ".bai";
-    if (!exists(baiFile))
-    {
-        std::cerr << "ERROR: BAM index file \'" << baiFile << "\' does not exist." << std::endl;
-        res = ArgumentParser::PARSE_ERROR;
-    }
-
-    if (options.matepairFile != "" && !exists(options.matepairFile))
+    if (options.k_init > options.k_max)
     {
-        std::cerr << "ERROR: Input BAM file \'" << options.matepairFile << "\' does not exist." << std::endl;
+        std::cerr << "ERROR: The initial k-mer size " << options.k_init << " exceeds the maximal k-mer size " << options.k_max << "." << std::endl;
         res = ArgumentParser::PARSE_ERROR;
     }
 
@@ -1531,6 +1637,26 @@ ArgumentParser::ParseResult checkInput(GenotypingOptions &options){
 }
 
 
+ArgumentParser::ParseResult checkInput(BatchOptions &options){
+
+	ArgumentParser::ParseResult res = ArgumentParser::PARSE_OK;
+
+	if (options.prefix != "." && !exists(options.prefix))
+	{
+		std::cerr << "ERROR: Path to sample directories \'" << options.prefix << "\' does not exist." << std::endl;
+		res = ArgumentParser::PARSE_ERROR;
+	}
+
+	if (!exists(options.sampleFile))
+	{
+		std::cerr << "ERROR: Sample file \'" << options.sampleFile << "\' does not exist." << std::endl;
+		res = ArgumentParser::PARSE_ERROR;
+	}
+
+	return res;
+}
+
+
 // =========================
 // Print functions
 // =========================
@@ -1543,6 +1669,7 @@ void printHelp(char const * name){
     std::cerr << "    \033[1m" << name << " COMMAND\033[0m [\033[4mOPTIONS\033[0m]" << std::endl;
     std::cerr << std::endl;
     std::cerr << "\033[1mCOMMAND\033[0m" << std::endl;
+    std::cerr << "    \033[1massemble\033[0m            Assemble the unmapped reads of a sample into contigs." << std::endl;
     std::cerr << "    \033[1mcrop-unmapped\033[0m       Clip unmapped and poorly aligned reads from a sample." << std::endl;
     std::cerr << "    \033[1mmerge-set-mate\033[0m      Merge and mate poorly aligned reads into contigs." << std::endl;
     std::cerr << "    \033[1mremapping\033[0m           Remap sample to reference (optional)." << std::endl;
@@ -1553,6 +1680,7 @@ void printHelp(char const * name){
     std::cerr << "    \033[1mplace-splitalign\033[0m    Find position of (super-)contigs by split-read alignment (per sample)." << std::endl;
     std::cerr << "    \033[1mplace-finish\033[0m        Combine position found by split-read alignment from all samples." << std::endl;
     std::cerr << "    \033[1mgenotype\033[0m            Determine genotypes of all insertions in a sample." << std::endl;
+    std::cerr << "    \033[1mbatch\033[0m               Run per-sample commands for many samples sharing threads and memory." << std::endl;
     std::cerr << std::endl;
     std::cerr << "\033[1mVERSION\033[0m" << std::endl;
     std::cerr << "    " << VERSION << ", Date: " << DATE << std::endl;
@@ -1597,6 +1725,10 @@ void printMultikOptions(const MultikOptions &options){
     cout << "k-init             : " << options.k_init                   << endl;
     cout << "k-max              : " << options.k_max                    << endl;
     cout << "delta-k            : " << options.delta_k                  << endl;
+    cout << "direct-fastq       : " << (options.direct_fastq ? "true" : "false") << endl;
+    cout << "resume             : " << (options.resume ? "true" : "false") << endl;
+    cout << "threads            : " << options.nb_threads               << endl;
+    cout << "max-memory         : " << options.max_memory               << endl;
     cout << "=========================================================" << endl;
 }
 
@@ -0,0 +1,281 @@
+#ifndef POPINS2_BAM_RECORD_VIEW_H_
+#define POPINS2_BAM_RECORD_VIEW_H_
+
+#include <cstring>
+
+#include <seqan/bam_io.h>
+
+
+using namespace seqan;
+
+
+// ==========================================================================
+// Struct BamRecordView
+// ==========================================================================
+
+/**
+ * A bam record that is not decoded.
+ *
+ * The raw bytes of the record (without the leading block size) are kept in a buffer that
+ * is reused from record to record. Only the fixed-size core (rID, beginPos, mapQ, flag,
+ * rNextId, pNext, ...) is copied out of the buffer, with the reference ids translated like
+ * readRecord() does. Cigar operations and tags are looked up in the raw bytes, the query
+ * name is an infix of the buffer. Scanning a file with views thus does not allocate once
+ * the buffer is large enough, and decodeRecord() turns the few records that pass the
+ * cheap filters into a BamAlignmentRecord.
+ */
+struct BamRecordView : public BamAlignmentRecordCore
+{
+    CharString buffer;
+
+    BamRecordView()
+    {
+        std::memset(static_cast<BamAlignmentRecordCore *>(this), 0, sizeof(BamAlignmentRecordCore));
+    }
+};
+
+// --------------------------------------------------------------------------
+// Function readRecord()
+// --------------------------------------------------------------------------
+
+// Reads the next record of a bam file into the view.
+template <typename TSpec>
+inline void
+readRecord(BamRecordView & view, FormattedFile<Bam, Input, TSpec> & file)
+{
+    BamAlignmentRecordCore & core = view;
+
+    if (!isEqual(format(file), Bam()))
+    {
+        // Sam input has no raw bam record, it is encoded as SeqAn writes it to a bam file.
+        BamAlignmentRecord record;
+        readRecord(record, file);
+        updateLengths(record);
+        clear(view.buffer);
+        _writeBamRecord(view.buffer, record, Bam());
+        core = record;
+        return;
+    }
+
+    _readBamRecordWithoutSize(view.buffer, file.iter);
+    SEQAN_ASSERT_GEQ(length(view.buffer), sizeof(BamAlignmentRecordCore));
+    std::memcpy(&core, begin(view.buffer, Standard()), sizeof(BamAlignmentRecordCore));
+
+    // Translate file local rIDs into global rIDs, as readRecord() for a BamAlignmentRecord does.
+    String<unsigned> const & translate = context(file).translateFile2GlobalRefId;
+    if (view.rID >= 0 && !empty(translate))
+        view.rID = translate[view.rID];
+    if (view.rNextId >= 0 && !empty(translate))
+        view.rNextId = translate[view.rNextId];
+}
+
+// --------------------------------------------------------------------------
+// Functions hasFlag*()
+// --------------------------------------------------------------------------
+
+inline bool hasFlagFirst(BamRecordView const & view) { return (view.flag & BAM_FLAG_FIRST) != 0; }
+inline bool hasFlagUnmapped(BamRecordView const & view) { return (view.flag & BAM_FLAG_UNMAPPED) != 0; }
+inline bool hasFlagNextUnmapped(BamRecordView const & view) { return (view.flag & BAM_FLAG_NEXT_UNMAPPED) != 0; }
+inline bool hasFlagRC(BamRecordView const & view) { return (view.flag & BAM_FLAG_RC) != 0; }
+inline bool hasFlagNextRC(BamRecordView const & view) { return (view.flag & BAM_FLAG_NEXT_RC) != 0; }
+inline bool hasFlagSecondary(BamRecordView const & view) { return (view.flag & BAM_FLAG_SECONDARY) != 0; }
+inline bool hasFlagQCNoPass(BamRecordView const & view) { return (view.flag & BAM_FLAG_QC_NO_PASS) != 0; }
+inline bool hasFlagDuplicate(BamRecordView const & view) { return (view.flag & BAM_FLAG_DUPLICATE) != 0; }
+inline bool hasFlagSupplementary(BamRecordView const & view) { return (view.flag & BAM_FLAG_SUPPLEMENTARY) != 0; }
+
+// --------------------------------------------------------------------------
+// Functions for the variable-length fields
+// --------------------------------------------------------------------------
+
+inline char const *
+_qNameBegin(BamRecordView const & view)
+{
+    return begin(view.buffer, Standard()) + sizeof(BamAlignmentRecordCore);
+}
+
+inline char const *
+_cigarBegin(BamRecordView const & view)
+{
+    return _qNameBegin(view) + view._l_qname;
+}
+
+inline char const *
+_seqBegin(BamRecordView const & view)
+{
+    return _cigarBegin(view) + 4 * view._n_cigar;
+}
+
+inline char const *
+_qualBegin(BamRecordView const & view)
+{
+    return _seqBegin(view) + (view._l_qseq + 1) / 2;
+}
+
+inline char const *
+_tagsBegin(BamRecordView const & view)
+{
+    return _qualBegin(view) + view._l_qseq;
+}
+
+// The query name, without the trailing '\0'.
+inline Infix<CharString const>::Type
+getQName(BamRecordView const & view)
+{
+    return infix(view.buffer, sizeof(BamAlignmentRecordCore), sizeof(BamAlignmentRecordCore) + view._l_qname - 1);
+}
+
+inline unsigned
+getSeqLength(BamRecordView const & view)
+{
+    return view._l_qseq;
+}
+
+inline unsigned
+getCigarLength(BamRecordView const & view)
+{
+    return view._n_cigar;
+}
+
+inline CigarElement<>
+getCigarElement(BamRecordView const & view, unsigned i)
+{
+    static char const * CIGAR_MAPPING = "MIDNSHP=X*******";
+
+    uint32_t opAndCnt;
+    std::memcpy(&opAndCnt, _cigarBegin(view) + 4 * i, 4);
+    return CigarElement<>(CIGAR_MAPPING[opAndCnt & 15], opAndCnt >> 4);
+}
+
+// Decodes only the cigar string, into a string that may be reused from record to record.
+inline void
+decodeCigar(String<CigarElement<> > & cigar, BamRecordView const & view)
+{
+    resize(cigar, view._n_cigar, Exact());
+    for (unsigned i = 0; i < view._n_cigar; ++i)
+        cigar[i] = getCigarElement(view, i);
+}
+
+// Number of reference bases covered by the alignment, as getAlignmentLengthInRef() for a BamAlignmentRecord.
+inline unsigned
+getAlignmentLengthInRef(BamRecordView const & view)
+{
+    unsigned len = 0;
+    for (unsigned i = 0; i < view._n_cigar; ++i)
+    {
+        CigarElement<> el = getCigarElement(view, i);
+        if (el.operation != 'S' && el.operation != 'H' && el.operation != 'I')
+            len += el.count;
+    }
+    return len;
+}
+
+// --------------------------------------------------------------------------
+// Function findTag()
+// --------------------------------------------------------------------------
+
+// Returns a pointer to the type character of the first tag with the given key, or NULL if there is none.
+inline char const *
+findTag(BamRecordView const & view, char const * key)
+{
+    char const * it = _tagsBegin(view);
+    char const * itEnd = end(view.buffer, Standard());
+
+    while (it + 3 <= itEnd)
+    {
+        if (it[0] == key[0] && it[1] == key[1])
+            return it + 2;
+
+        // Skip the tag name and type and the value.
+        char c = it[2];
+        it += 3;
+        if (c == 'H' || c == 'Z')
+        {
+            while (it < itEnd && *it != '\0')
+                ++it;
+            ++it;
+        }
+        else if (c == 'B')
+        {
+            c = *(it++);
+            uint32_t len;
+            std::memcpy(&len, it, 4);
+            it += 4 + len * getBamTypeSize(c);
+        }
+        else
+        {
+            int size = getBamTypeSize(c);
+            if (size < 0)
+                return NULL;    // Malformed tags.
+            it += size;
+        }
+    }
+    return NULL;
+}
+
+// --------------------------------------------------------------------------
+// Function extractTagValue()
+// --------------------------------------------------------------------------
+
+// Extracts an "atomic" value like extractTagValue() of a BamTagsDict, given the tag found by findTag().
+template <typename TResultValue>
+inline bool
+extractTagValue(TResultValue & val, char const * tag)
+{
+    if (tag == NULL || *tag == 'Z')
+        return false;
+
+    ExtractTagValueHelper_<TResultValue, char const *> func(val, *tag, tag + 1);
+    return tagApply(func, BamTagTypes());
+}
+
+// --------------------------------------------------------------------------
+// Function decodeRecord()
+// --------------------------------------------------------------------------
+
+// Decodes the view into a record exactly as readRecord() would have read it.
+inline void
+decodeRecord(BamAlignmentRecord & record, BamRecordView const & view)
+{
+    typedef Iterator<IupacString, Standard>::Type SEQAN_RESTRICT TSeqIter;
+    typedef Iterator<CharString, Standard>::Type SEQAN_RESTRICT  TQualIter;
+
+    static_cast<BamAlignmentRecordCore &>(record) = view;
+
+    // query name.
+    resize(record.qName, record._l_qname - 1, Exact());
+    arrayCopyForward(_qNameBegin(view), _qNameBegin(view) + record._l_qname - 1, begin(record.qName, Standard()));
+
+    // cigar string.
+    decodeCigar(record.cigar, view);
+
+    // query sequence.
+    char const * it = _seqBegin(view);
+    resize(record.seq, record._l_qseq, Exact());
+    TSeqIter sit = begin(record.seq, Standard());
+    TSeqIter sitEnd = sit + (record._l_qseq & ~1);
+    while (sit != sitEnd)
+    {
+        unsigned char ui = *it++;
+        assignValue(sit, Iupac(ui >> 4));
+        ++sit;
+        assignValue(sit, Iupac(ui & 0x0f));
+        ++sit;
+    }
+    if (record._l_qseq & 1)
+        *sit++ = Iupac((uint8_t)*it++ >> 4);
+
+    // phred quality, cleared under the same condition as in readRecord().
+    resize(record.qual, record._l_qseq, Exact());
+    TQualIter qitEnd = end(record.qual, Standard());
+    for (TQualIter qit = begin(record.qual, Standard()); qit != qitEnd;)
+        *qit++ = '!' + *it++;
+    if (!empty(record.qual) && record.qual[0] == '\xff')
+        clear(record.qual);
+
+    // tags
+    char const * tagsEnd = end(view.buffer, Standard());
+    resize(record.tags, tagsEnd - it, Exact());
+    arrayCopyForward(it, tagsEnd, begin(record.tags, Standard()));
+}
+
+#endif // #ifndef POPINS2_BAM_RECORD_VIEW_H_
@@ -0,0 +1,1055 @@
+#ifndef POPINS2_BAM_SORT_H_
+#define POPINS2_BAM_SORT_H_
+
+#include <atomic>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <queue>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <memory>
+
+#include <seqan/bam_io.h>
+#include <seqan/stream.h>
+
+#include "bam_record_view.h"
+
+
+using namespace seqan;
+
+
+// --------------------------------------------------------------------------
+// Function setSortOrder()
+// --------------------------------------------------------------------------
+
+// Sets the sort order (SO) in the @HD line of the header, which is added if missing.
+inline void
+setSortOrder(BamHeader & header, char const * sortOrder)
+{
+    typedef BamHeaderRecord::TTag TTag;
+
+    for (unsigned i = 0; i < length(header); ++i)
+    {
+        if (header[i].type != BamHeaderRecordType::BAM_HEADER_FIRST)
+            continue;
+
+        for (unsigned j = 0; j < length(header[i].tags); ++j)
+        {
+            if (header[i].tags[j].i1 == "SO")
+            {
+                header[i].tags[j].i2 = sortOrder;
+                return;
+            }
+        }
+        appendValue(header[i].tags, TTag("SO", sortOrder));
+        return;
+    }
+
+    BamHeaderRecord first;
+    first.type = BamHeaderRecordType::BAM_HEADER_FIRST;
+    appendValue(first.tags, TTag("VN", "1.4"));
+    appendValue(first.tags, TTag("SO", sortOrder));
+    insertValue(header, 0, first);
+}
+
+// --------------------------------------------------------------------------
+// Function compare_qName()
+// --------------------------------------------------------------------------
+
+// This function is adapted from samtools code (fuction strnum_cmp in bam_sort.c) to ensure the exact same sort order.
+inline int
+compare_qName(char const * _a, char const * _b)
+{
+    const unsigned char *a = (const unsigned char*)_a, *b = (const unsigned char*)_b;
+    const unsigned char *pa = a, *pb = b;
+    while (*pa && *pb) {
+        if (isdigit(*pa) && isdigit(*pb)) {
+            while (*pa == '0') ++pa;
+            while (*pb == '0') ++pb;
+            while (isdigit(*pa) && isdigit(*pb) && *pa == *pb) ++pa, ++pb;
+            if (isdigit(*pa) && isdigit(*pb)) {
+                int i = 0;
+                while (isdigit(pa[i]) && isdigit(pb[i])) ++i;
+                return isdigit(pa[i])? 1 : isdigit(pb[i])? -1 : (int)*pa - (int)*pb;
+            } else if (isdigit(*pa)) return 1;
+            else if (isdigit(*pb)) return -1;
+            else if (pa - a != pb - b) return pa - a < pb - b? 1 : -1;
+        } else {
+            if (*pa != *pb) return (int)*pa - (int)*pb;
+            ++pa; ++pb;
+        }
+    }
+    return *pa? 1 : *pb? -1 : 0;
+}
+
+inline int
+compare_qName(CharString & nameA, CharString & nameB)
+{
+    return compare_qName(toCString(nameA), toCString(nameB));
+}
+
+// --------------------------------------------------------------------------
+// Function qNameSortKey()
+// --------------------------------------------------------------------------
+
+// Computes a key of the read name such that compareSortKeys() on the keys orders as compare_qName() on
+// the names. Other characters are copied. A run of digits becomes the byte '0', the number of digits
+// without leading zeros, these digits, and 255 minus the number of leading zeros, as the number with more
+// leading zeros comes first. Read names in BAM files have at most 254 characters, such that counts fit a byte.
+inline void
+qNameSortKey(CharString & key, CharString const & qName)
+{
+    clear(key);
+    char const * p = begin(qName, Standard());
+    char const * nameEnd = end(qName, Standard());
+    while (p != nameEnd)
+    {
+        if (!isdigit((unsigned char)*p))
+        {
+            appendValue(key, *p);
+            ++p;
+            continue;
+        }
+
+        char const * digits = p;
+        while (digits != nameEnd && *digits == '0')
+            ++digits;
+        char const * runEnd = digits;
+        while (runEnd != nameEnd && isdigit((unsigned char)*runEnd))
+            ++runEnd;
+
+        appendValue(key, '0');
+        appendValue(key, (char)std::min<size_t>(runEnd - digits, 254));
+        append(key, infix(qName, digits - begin(qName, Standard()), runEnd - begin(qName, Standard())));
+        appendValue(key, (char)(255 - std::min<size_t>(digits - p, 254)));
+        p = runEnd;
+    }
+}
+
+// --------------------------------------------------------------------------
+// Function compareSortKeys()
+// --------------------------------------------------------------------------
+
+inline int
+compareSortKeys(CharString const & keyA, CharString const & keyB)
+{
+    size_t lenA = length(keyA);
+    size_t lenB = length(keyB);
+    int cmp = std::memcmp(begin(keyA, Standard()), begin(keyB, Standard()), std::min(lenA, lenB));
+    if (cmp != 0)
+        return cmp;
+    return lenA < lenB ? -1 : lenA > lenB ? 1 : 0;
+}
+
+// --------------------------------------------------------------------------
+// Function coordinateSortKey()
+// --------------------------------------------------------------------------
+
+// The order of 'samtools sort': reference, position, and strand. Records without reference come last.
+inline uint64_t
+coordinateSortKey(int32_t rID, int32_t beginPos, bool rc)
+{
+    return ((uint64_t)(uint32_t)rID << 32) | ((uint64_t)(uint32_t)(beginPos + 1) << 1) | (rc ? 1 : 0);
+}
+
+// --------------------------------------------------------------------------
+// Function parseMemorySize()
+// --------------------------------------------------------------------------
+
+// Parses a memory size like '768M' with an optional suffix K, M, or G into bytes.
+inline bool
+parseMemorySize(uint64_t & bytes, CharString const & str)
+{
+    if (empty(str))
+        return false;
+
+    uint64_t factor = 1;
+    CharString number = str;
+    char suffix = toupper(back(str));
+    if (suffix == 'K' || suffix == 'M' || suffix == 'G')
+    {
+        factor = suffix == 'K' ? 1ull << 10 : suffix == 'M' ? 1ull << 20 : 1ull << 30;
+        resize(number, length(number) - 1);
+    }
+
+    if (!lexicalCast(bytes, number))
+        return false;
+    bytes *= factor;
+    return true;
+}
+
+// ==========================================================================
+// Struct BgzfWriter
+// ==========================================================================
+
+/**
+ * BGZF output that knows the block of every byte written.
+ *
+ * The data is cut into blocks as htslib does, a record that fits into a block is not split.
+ * Full blocks are compressed by a pool of threads in batches. virtualOffset() returns the
+ * position of the next byte as the index of its block and the offset within the block,
+ * blockOffsets maps block indices to file offsets once the blocks are written (if
+ * keepOffsets is set), such that a BAI index can be built while writing.
+ */
+struct BgzfWriter
+{
+    std::ofstream file;
+    unsigned threads;
+    String<CharString> blocks;      // blocks waiting for compression, the last one is being filled
+    uint64_t numWritten;            // number of blocks written to the file
+    uint64_t fileSize;
+    bool keepOffsets;
+    String<uint64_t> blockOffsets;  // file offsets of the written blocks
+
+    BgzfWriter() : threads(1), numWritten(0), fileSize(0), keepOffsets(false)
+    {}
+};
+
+inline bool
+open(BgzfWriter & writer, char const * fileName, unsigned threads = 1, bool keepOffsets = false)
+{
+    writer.file.open(fileName, std::ios::binary | std::ios::out | std::ios::trunc);
+    writer.threads = std::max(threads, 1u);
+    writer.keepOffsets = keepOffsets;
+    clear(writer.blocks);
+    appendValue(writer.blocks, CharString());
+    return writer.file.is_open();
+}
+
+// Compresses the first numBlocks blocks and writes them to the file.
+inline void
+_writeBgzfBlocks(BgzfWriter & writer, unsigned numBlocks)
+{
+    String<CharString> compressed;
+    resize(compressed, numBlocks);
+    std::atomic<unsigned> next(0);
+
+    auto worker = [&]()
+    {
+        CompressionContext<BgzfFile> ctx;
+        for (unsigned i = next++; i < numBlocks; i = next++)
+        {
+            resize(compressed[i], BGZF_MAX_BLOCK_SIZE);
+            size_t len = _compressBlock(begin(compressed[i], Standard()), BGZF_MAX_BLOCK_SIZE,
+                                        begin(writer.blocks[i], Standard()), length(writer.blocks[i]), ctx);
+            resize(compressed[i], len);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned t = 1; t < std::min(writer.threads, numBlocks); ++t)
+        workers.push_back(std::thread(worker));
+    worker();
+    for (unsigned t = 0; t < workers.size(); ++t)
+        workers[t].join();
+
+    for (unsigned i = 0; i < numBlocks; ++i)
+    {
+        if (writer.keepOffsets)
+            appendValue(writer.blockOffsets, writer.fileSize);
+        writer.file.write(begin(compressed[i], Standard()), length(compressed[i]));
+        writer.fileSize += length(compressed[i]);
+    }
+    writer.numWritten += numBlocks;
+    erase(writer.blocks, 0, numBlocks);
+}
+
+inline void
+_newBgzfBlock(BgzfWriter & writer)
+{
+    unsigned batchSize = 8 * writer.threads;
+    if (length(writer.blocks) >= batchSize)
+        _writeBgzfBlocks(writer, length(writer.blocks));
+
+    appendValue(writer.blocks, CharString());
+    reserve(back(writer.blocks), BGZF_BLOCK_SIZE, Exact());
+}
+
+// Returns the block index and offset within the block of the next byte, as a virtual offset.
+inline uint64_t
+virtualOffset(BgzfWriter const & writer)
+{
+    return ((writer.numWritten + length(writer.blocks) - 1) << 16) | length(back(writer.blocks));
+}
+
+inline void
+writeBytes(BgzfWriter & writer, char const * data, size_t len)
+{
+    if (len <= BGZF_BLOCK_SIZE && length(back(writer.blocks)) + len > BGZF_BLOCK_SIZE)
+        _newBgzfBlock(writer);
+
+    while (len > 0)
+    {
+        if (length(back(writer.blocks)) == BGZF_BLOCK_SIZE)
+            _newBgzfBlock(writer);
+
+        size_t n = std::min(len, (size_t)(BGZF_BLOCK_SIZE - length(back(writer.blocks))));
+        CharString & block = back(writer.blocks);
+        size_t oldLen = length(block);
+        resize(block, oldLen + n);
+        std::memcpy(begin(block, Standard()) + oldLen, data, n);
+        data += n;
+        len -= n;
+    }
+}
+
+// Writes the remaining blocks and the empty end-of-file block. The offset after the last block is appended to the
+// block offsets, such that virtual offsets at the end of the data can be resolved.
+inline bool
+close(BgzfWriter & writer)
+{
+    if (!writer.file.is_open())
+        return true;
+
+    if (empty(back(writer.blocks)))
+        eraseBack(writer.blocks);
+    if (!empty(writer.blocks))
+        _writeBgzfBlocks(writer, length(writer.blocks));
+    appendValue(writer.blocks, CharString());
+    if (writer.keepOffsets)
+        appendValue(writer.blockOffsets, writer.fileSize);
+
+    // The end-of-file marker is an empty block.
+    char eofBlock[BGZF_MAX_BLOCK_SIZE];
+    CompressionContext<BgzfFile> ctx;
+    size_t len = _compressBlock(eofBlock, BGZF_MAX_BLOCK_SIZE, eofBlock, 0u, ctx);
+    writer.file.write(eofBlock, len);
+
+    writer.file.close();
+    return !writer.file.fail();
+}
+
+// ==========================================================================
+// Struct BgzfReader
+// ==========================================================================
+
+// Sequential BGZF input, inflated block by block in the reading thread.
+struct BgzfReader
+{
+    std::ifstream file;
+    CharString compressed;
+    CharString block;
+    size_t pos;
+    CompressionContext<BgzfFile> ctx;
+
+    BgzfReader() : pos(0)
+    {}
+};
+
+inline bool
+open(BgzfReader & reader, char const * fileName)
+{
+    reader.file.open(fileName, std::ios::binary | std::ios::in);
+    clear(reader.block);
+    reader.pos = 0;
+    return reader.file.is_open();
+}
+
+// Reads and inflates the next non-empty block. Returns false at the end of the file.
+inline bool
+_readBgzfBlock(BgzfReader & reader)
+{
+    const unsigned headerLength = BGZF_BLOCK_HEADER_LENGTH;
+
+    do
+    {
+        resize(reader.compressed, headerLength);
+        reader.file.read(begin(reader.compressed, Standard()), headerLength);
+        if (reader.file.gcount() == 0)
+            return false;
+        if ((unsigned)reader.file.gcount() != headerLength || !_bgzfCheckHeader(begin(reader.compressed, Standard())))
+            throw IOError("Invalid BGZF block header.");
+
+        size_t blockLength = _bgzfUnpack16(begin(reader.compressed, Standard()) + 16) + 1u;
+        resize(reader.compressed, blockLength);
+        reader.file.read(begin(reader.compressed, Standard()) + headerLength, blockLength - headerLength);
+        if ((size_t)reader.file.gcount() != blockLength - headerLength)
+            throw IOError("Truncated BGZF block.");
+
+        unsigned uncompressedLength = _bgzfUnpack32(begin(reader.compressed, Standard()) + blockLength - 4);
+        resize(reader.block, uncompressedLength);
+        if (uncompressedLength != 0)
+            _decompressBlock(begin(reader.block, Standard()), uncompressedLength,
+                             begin(reader.compressed, Standard()), blockLength, reader.ctx);
+    }
+    while (empty(reader.block));
+
+    reader.pos = 0;
+    return true;
+}
+
+// Reads len bytes into data. Returns false if the file ends before.
+inline bool
+readBytes(BgzfReader & reader, char * data, size_t len)
+{
+    while (len > 0)
+    {
+        if (reader.pos == length(reader.block) && !_readBgzfBlock(reader))
+            return false;
+
+        size_t n = std::min(len, length(reader.block) - reader.pos);
+        std::memcpy(data, begin(reader.block, Standard()) + reader.pos, n);
+        reader.pos += n;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// ==========================================================================
+// Raw bam records
+// ==========================================================================
+
+// The records are handled as raw bytes without the leading block size, laid out as in BamAlignmentRecordCore
+// and followed by the query name, see BamRecordView.
+
+inline int32_t
+_rawRefId(char const * record)
+{
+    int32_t rID;
+    std::memcpy(&rID, record, 4);
+    return rID;
+}
+
+inline int32_t
+_rawBeginPos(char const * record)
+{
+    int32_t pos;
+    std::memcpy(&pos, record + 4, 4);
+    return pos;
+}
+
+inline uint16_t
+_rawFlag(char const * record)
+{
+    uint16_t flag;
+    std::memcpy(&flag, record + 14, 2);
+    return flag;
+}
+
+inline char const *
+_rawQName(char const * record)
+{
+    return record + sizeof(BamAlignmentRecordCore);
+}
+
+// End position on the reference as htslib's bam_endpos(): unmapped reads and reads without cigar cover one base.
+inline int32_t
+_rawEndPos(char const * record)
+{
+    int32_t beginPos = _rawBeginPos(record);
+    uint16_t numCigar;
+    std::memcpy(&numCigar, record + 12, 2);
+    if ((_rawFlag(record) & BAM_FLAG_UNMAPPED) != 0 || numCigar == 0)
+        return beginPos + 1;
+
+    char const * cigar = record + sizeof(BamAlignmentRecordCore) + (uint8_t)record[8];
+    int32_t len = 0;
+    for (unsigned i = 0; i < numCigar; ++i)
+    {
+        uint32_t opAndCnt;
+        std::memcpy(&opAndCnt, cigar + 4 * i, 4);
+        unsigned op = opAndCnt & 15;
+        if (op == 0 || op == 2 || op == 3 || op == 7 || op == 8)   // M, D, N, =, X consume the reference
+            len += opAndCnt >> 4;
+    }
+    return beginPos + std::max(len, 1);
+}
+
+inline uint64_t
+_rawCoordinateKey(char const * record)
+{
+    return coordinateSortKey(_rawRefId(record), _rawBeginPos(record), (_rawFlag(record) & BAM_FLAG_RC) != 0);
+}
+
+// Compares two records as 'samtools sort -n': by read name, then first before second read end.
+inline int
+_rawCompareQName(char const * a, char const * b)
+{
+    int cmp = compare_qName(_rawQName(a), _rawQName(b));
+    if (cmp != 0)
+        return cmp;
+    return (int)(_rawFlag(a) & 0xc0) - (int)(_rawFlag(b) & 0xc0);
+}
+
+inline bool
+_rawLess(char const * a, char const * b, BamSortOrder order)
+{
+    if (order == BAM_SORT_COORDINATE)
+        return _rawCoordinateKey(a) < _rawCoordinateKey(b);
+    return _rawCompareQName(a, b) < 0;
+}
+
+// ==========================================================================
+// Struct BamSortBuffer
+// ==========================================================================
+
+// Records read into memory, each stored with its block size. The slices of the buffer are sorted independently.
+struct BamSortBuffer
+{
+    CharString data;
+    String<uint64_t> offsets;       // offsets of the records' block sizes in data
+    std::vector<size_t> sliceEnds;  // ends of the sorted slices in offsets
+};
+
+inline char const *
+_record(BamSortBuffer const & buffer, size_t i)
+{
+    return begin(buffer.data, Standard()) + buffer.offsets[i] + 4;
+}
+
+inline uint32_t
+_recordSize(BamSortBuffer const & buffer, size_t i)
+{
+    uint32_t size;
+    std::memcpy(&size, begin(buffer.data, Standard()) + buffer.offsets[i], 4);
+    return size;
+}
+
+inline uint64_t
+_memoryUsage(BamSortBuffer const & buffer)
+{
+    return length(buffer.data) + 2 * sizeof(uint64_t) * length(buffer.offsets);
+}
+
+// ==========================================================================
+// Struct BamSortSource
+// ==========================================================================
+
+// A sorted sequence of records to merge: a slice of the buffer or a run file.
+struct BamSortSource
+{
+    BamSortBuffer const * buffer;
+    size_t pos;
+    size_t end;
+
+    std::unique_ptr<BgzfReader> run;
+    CharString runRecord;
+
+    char const * record;            // current record, NULL at the end
+    uint32_t recordSize;
+    uint64_t key;                   // coordinate key of the current record
+
+    BamSortSource() : buffer(NULL), pos(0), end(0), record(NULL), recordSize(0), key(0)
+    {}
+};
+
+// Moves to the next record of the source.
+inline void
+_nextRecord(BamSortSource & source, BamSortOrder order)
+{
+    source.record = NULL;
+    if (source.buffer != NULL)
+    {
+        if (source.pos == source.end)
+            return;
+        source.record = _record(*source.buffer, source.pos);
+        source.recordSize = _recordSize(*source.buffer, source.pos);
+        ++source.pos;
+    }
+    else
+    {
+        uint32_t size;
+        if (!readBytes(*source.run, reinterpret_cast<char *>(&size), 4))
+            return;
+        resize(source.runRecord, size);
+        if (!readBytes(*source.run, begin(source.runRecord, Standard()), size))
+            throw IOError("Truncated temporary run file.");
+        source.record = begin(source.runRecord, Standard());
+        source.recordSize = size;
+    }
+
+    if (order == BAM_SORT_COORDINATE)
+        source.key = _rawCoordinateKey(source.record);
+}
+
+// Orders the sources by their current record for a min-heap; ties go to the earlier source, which keeps the sort stable.
+struct BamSourceGreater
+{
+    std::vector<BamSortSource> const * sources;
+    BamSortOrder order;
+
+    BamSourceGreater(std::vector<BamSortSource> const & sources_, BamSortOrder order_) :
+        sources(&sources_), order(order_)
+    {}
+
+    bool operator()(unsigned a, unsigned b) const
+    {
+        BamSortSource const & sa = (*sources)[a];
+        BamSortSource const & sb = (*sources)[b];
+        if (order == BAM_SORT_COORDINATE)
+        {
+            if (sa.key != sb.key)
+                return sa.key > sb.key;
+        }
+        else
+        {
+            int cmp = _rawCompareQName(sa.record, sb.record);
+            if (cmp != 0)
+                return cmp > 0;
+        }
+        return a > b;
+    }
+};
+
+// ==========================================================================
+// Struct BaiBuilder
+// ==========================================================================
+
+/**
+ * A BAI index built from the records in the order they are written to a coordinate-sorted file.
+ *
+ * Consecutive records in the same bin form a chunk, the linear index holds the offset of the
+ * first record overlapping each 16 kbp window, as 'samtools index' computes them. The virtual
+ * offsets are those of the BgzfWriter, they are resolved to file offsets by finishBai().
+ */
+struct BaiBuilder
+{
+    BamIndex<Bai> index;
+    int32_t rID;
+    uint32_t bin;
+    uint64_t chunkBegin;
+    uint64_t lastEnd;
+    String<Pair<uint64_t> > refSpans;           // first and end offset of the records on each reference
+    String<Pair<uint64_t> > refCounts;          // number of mapped and unmapped records on each reference
+
+    BaiBuilder() : rID(-1), bin(maxValue<uint32_t>()), chunkBegin(0), lastEnd(0)
+    {
+        index._unalignedCount = 0;
+    }
+};
+
+inline void
+_closeBaiChunk(BaiBuilder & builder)
+{
+    if (builder.rID < 0 || builder.bin == maxValue<uint32_t>())
+        return;
+
+    String<Pair<uint64_t> > & chunks = builder.index._binIndices[builder.rID][builder.bin].chunkBegEnds;
+    if (!empty(chunks) && back(chunks).i2 == builder.chunkBegin)
+        back(chunks).i2 = builder.lastEnd;
+    else
+        appendValue(chunks, Pair<uint64_t>(builder.chunkBegin, builder.lastEnd));
+    builder.bin = maxValue<uint32_t>();
+}
+
+inline unsigned
+_reg2bin(int32_t beg, int32_t end)
+{
+    --end;
+    if (beg >> 14 == end >> 14) return ((1 << 15) - 1) / 7 + (beg >> 14);
+    if (beg >> 17 == end >> 17) return ((1 << 12) - 1) / 7 + (beg >> 17);
+    if (beg >> 20 == end >> 20) return ((1 << 9) - 1) / 7 + (beg >> 20);
+    if (beg >> 23 == end >> 23) return ((1 << 6) - 1) / 7 + (beg >> 23);
+    if (beg >> 26 == end >> 26) return ((1 << 3) - 1) / 7 + (beg >> 26);
+    return 0;
+}
+
+// Adds a record written from virtual offset recordBegin to recordEnd.
+inline void
+addRecord(BaiBuilder & builder, char const * record, uint64_t recordBegin, uint64_t recordEnd, unsigned numRefs)
+{
+    int32_t rID = _rawRefId(record);
+    if (rID < 0)
+    {
+        _closeBaiChunk(builder);
+        builder.rID = -1;
+        ++builder.index._unalignedCount;
+        builder.lastEnd = recordEnd;
+        return;
+    }
+
+    if (rID != builder.rID)
+    {
+        _closeBaiChunk(builder);
+        if (length(builder.index._binIndices) < numRefs)
+        {
+            resize(builder.index._binIndices, numRefs);
+            resize(builder.index._linearIndices, numRefs);
+            resize(builder.refSpans, numRefs, Pair<uint64_t>(0, 0));
+            resize(builder.refCounts, numRefs, Pair<uint64_t>(0, 0));
+        }
+        builder.rID = rID;
+        builder.refSpans[rID].i1 = recordBegin;
+    }
+
+    int32_t beginPos = std::max(_rawBeginPos(record), 0);
+    int32_t endPos = std::max(_rawEndPos(record), beginPos + 1);
+    unsigned bin = _reg2bin(beginPos, endPos);
+    if (bin != builder.bin)
+    {
+        _closeBaiChunk(builder);
+        builder.bin = bin;
+        builder.chunkBegin = recordBegin;
+    }
+
+    String<uint64_t> & linear = builder.index._linearIndices[rID];
+    unsigned firstWindow = beginPos >> BamIndex<Bai>::BAM_LIDX_SHIFT;
+    unsigned lastWindow = (endPos - 1) >> BamIndex<Bai>::BAM_LIDX_SHIFT;
+    if (length(linear) <= lastWindow)
+        resize(linear, lastWindow + 1, maxValue<uint64_t>());
+    for (unsigned w = firstWindow; w <= lastWindow; ++w)
+        if (linear[w] == maxValue<uint64_t>())
+            linear[w] = recordBegin;
+
+    if ((_rawFlag(record) & BAM_FLAG_UNMAPPED) != 0)
+        ++builder.refCounts[rID].i2;
+    else
+        ++builder.refCounts[rID].i1;
+    builder.refSpans[rID].i2 = recordEnd;
+    builder.lastEnd = recordEnd;
+}
+
+// Resolves the virtual offsets with the block offsets of the writer, fills the gaps in the linear indices and adds the
+// pseudo-bin 37450 with the span and number of records of each reference as samtools does.
+inline void
+finishBai(BaiBuilder & builder, BgzfWriter const & writer, unsigned numRefs)
+{
+    typedef BamIndex<Bai>::TBinIndex_::iterator TBinIter;
+
+    _closeBaiChunk(builder);
+    resize(builder.index._binIndices, numRefs);
+    resize(builder.index._linearIndices, numRefs);
+    resize(builder.refSpans, numRefs, Pair<uint64_t>(0, 0));
+    resize(builder.refCounts, numRefs, Pair<uint64_t>(0, 0));
+
+    String<uint64_t> const & blockOffsets = writer.blockOffsets;
+    auto resolve = [&](uint64_t offset) { return (blockOffsets[offset >> 16] << 16) | (offset & 0xffff); };
+
+    for (unsigned r = 0; r < numRefs; ++r)
+    {
+        for (TBinIter it = builder.index._binIndices[r].begin(); it != builder.index._binIndices[r].end(); ++it)
+            for (unsigned i = 0; i < length(it->second.chunkBegEnds); ++i)
+                it->second.chunkBegEnds[i] = Pair<uint64_t>(resolve(it->second.chunkBegEnds[i].i1),
+                                                            resolve(it->second.chunkBegEnds[i].i2));
+
+        String<uint64_t> & linear = builder.index._linearIndices[r];
+        uint64_t last = 0;
+        for (unsigned w = 0; w < length(linear); ++w)
+        {
+            if (linear[w] == maxValue<uint64_t>())
+                linear[w] = last;
+            else
+                last = linear[w] = resolve(linear[w]);
+        }
+
+        if (builder.refCounts[r].i1 + builder.refCounts[r].i2 == 0)
+            continue;
+        String<Pair<uint64_t> > & meta = builder.index._binIndices[r][37450].chunkBegEnds;
+        appendValue(meta, Pair<uint64_t>(resolve(builder.refSpans[r].i1), resolve(builder.refSpans[r].i2)));
+        appendValue(meta, builder.refCounts[r]);
+    }
+}
+
+// ==========================================================================
+// Function _sortBuffer()
+// ==========================================================================
+
+// Sorts the slices of the buffer on all threads. With a run prefix, every slice is written to a run file.
+inline bool
+_sortBuffer(BamSortBuffer & buffer, BamSortOrder order, unsigned threads, String<CharString> & runFiles,
+            CharString const * runPrefix)
+{
+    size_t numRecords = length(buffer.offsets);
+    unsigned numSlices = std::max(1u, std::min(threads, (unsigned)((numRecords + 1023) / 1024)));
+    buffer.sliceEnds.resize(numSlices);
+    for (unsigned s = 0; s < numSlices; ++s)
+        buffer.sliceEnds[s] = numRecords * (s + 1) / numSlices;
+
+    unsigned firstRun = length(runFiles);
+    if (runPrefix != NULL)
+    {
+        for (unsigned s = 0; s < numSlices; ++s)
+        {
+            char suffix[32];
+            std::snprintf(suffix, sizeof(suffix), ".tmp.%04u.bam", firstRun + s);
+            appendValue(runFiles, *runPrefix);
+            append(back(runFiles), suffix);
+        }
+    }
+
+    std::atomic<unsigned> nextSlice(0);
+    std::atomic<bool> failed(false);
+    auto worker = [&]()
+    {
+        for (unsigned s = nextSlice++; s < numSlices; s = nextSlice++)
+        {
+            uint64_t * sliceBegin = begin(buffer.offsets, Standard()) + (s == 0 ? 0 : buffer.sliceEnds[s - 1]);
+            uint64_t * sliceEnd = begin(buffer.offsets, Standard()) + buffer.sliceEnds[s];
+            char const * data = begin(buffer.data, Standard()) + 4;
+            std::stable_sort(sliceBegin, sliceEnd, [&](uint64_t a, uint64_t b) {
+                return _rawLess(data + a, data + b, order);
+            });
+
+            if (runPrefix == NULL)
+                continue;
+
+            BgzfWriter run;
+            if (!open(run, toCString(runFiles[firstRun + s])))
+            {
+                failed = true;
+                continue;
+            }
+            for (uint64_t * it = sliceBegin; it != sliceEnd; ++it)
+            {
+                uint32_t size;
+                std::memcpy(&size, data - 4 + *it, 4);
+                writeBytes(run, data - 4 + *it, 4 + size);
+            }
+            if (!close(run))
+                failed = true;
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned t = 1; t < std::min(threads, numSlices); ++t)
+        workers.push_back(std::thread(worker));
+    worker();
+    for (unsigned t = 0; t < workers.size(); ++t)
+        workers[t].join();
+
+    return !failed;
+}
+
+// ==========================================================================
+// Struct BamSortWriter
+// ==========================================================================
+
+/**
+ * Output that writes records in coordinate (BAM_SORT_COORDINATE) or read name (BAM_SORT_QUERYNAME)
+ * order as 'samtools sort' and, for coordinate order, the BAI index outFile.bai unless writeIndex
+ * is unset.
+ *
+ * Records are collected in a buffer of maxMemory bytes. A full buffer is cut into one slice per
+ * thread, the slices are sorted in parallel and written to temporary run files next to the
+ * output file. On close, the runs and the sorted slices of the last buffer are merged, the output
+ * blocks are compressed by all threads.
+ */
+struct BamSortWriter
+{
+    CharString outFile;
+    BamSortOrder order;
+    unsigned threads;
+    uint64_t maxMemory;
+    bool writeIndex;
+
+    BamSortBuffer buffer;
+    String<CharString> runFiles;
+    bool failed;
+
+    BamSortWriter() : order(BAM_SORT_COORDINATE), threads(1), maxMemory(768ull << 20), writeIndex(true), failed(false)
+    {}
+
+    ~BamSortWriter()
+    {
+        for (unsigned i = 0; i < length(runFiles); ++i)
+            std::remove(toCString(runFiles[i]));
+    }
+};
+
+inline void
+open(BamSortWriter & writer,
+     CharString const & outFile,
+     BamSortOrder order,
+     unsigned threads = 1,
+     uint64_t maxMemory = 768ull << 20,
+     bool writeIndex = true)
+{
+    writer.outFile = outFile;
+    writer.order = order;
+    writer.threads = std::max(threads, 1u);
+    writer.maxMemory = maxMemory;
+    writer.writeIndex = writeIndex && order == BAM_SORT_COORDINATE;
+    writer.failed = false;
+}
+
+// Writes the buffer to run files once it is full.
+inline bool
+_flushBuffer(BamSortWriter & writer)
+{
+    if (_memoryUsage(writer.buffer) < writer.maxMemory || writer.failed)
+        return !writer.failed;
+
+    if (!_sortBuffer(writer.buffer, writer.order, writer.threads, writer.runFiles, &writer.outFile))
+    {
+        std::cerr << "ERROR: Could not write temporary files for sorting " << writer.outFile << std::endl;
+        writer.failed = true;
+    }
+    clear(writer.buffer.data);
+    clear(writer.buffer.offsets);
+    return !writer.failed;
+}
+
+// --------------------------------------------------------------------------
+// Function writeRecord()
+// --------------------------------------------------------------------------
+
+// Appends a raw record without its block size.
+inline bool
+writeRecord(BamSortWriter & writer, char const * record, uint32_t size)
+{
+    size_t offset = length(writer.buffer.data);
+    appendValue(writer.buffer.offsets, offset);
+    resize(writer.buffer.data, offset + 4 + size);
+    std::memcpy(begin(writer.buffer.data, Standard()) + offset, &size, 4);
+    std::memcpy(begin(writer.buffer.data, Standard()) + offset + 4, record, size);
+    return _flushBuffer(writer);
+}
+
+template <typename TContext>
+inline bool
+writeRecord(BamSortWriter & writer, BamAlignmentRecord const & record, TContext & context)
+{
+    appendValue(writer.buffer.offsets, length(writer.buffer.data));
+    write(writer.buffer.data, record, context, Bam());
+    return _flushBuffer(writer);
+}
+
+// --------------------------------------------------------------------------
+// Function close()
+// --------------------------------------------------------------------------
+
+// Merges the sorted records into the output file below the header. Returns 0 on success and 1 on error.
+template <typename TContext>
+inline int
+close(BamSortWriter & writer, BamHeader header, TContext & context)
+{
+    if (writer.failed)
+        return 1;
+
+    setSortOrder(header, writer.order == BAM_SORT_COORDINATE ? "coordinate" : "queryname");
+    unsigned numRefs = length(contigNames(context));
+    BamSortBuffer & buffer = writer.buffer;
+    _sortBuffer(buffer, writer.order, writer.threads, writer.runFiles, NULL);
+
+    // Set up the sources of the merge: the run files first, then the slices of the last buffer.
+    std::vector<BamSortSource> sources(length(writer.runFiles) + buffer.sliceEnds.size());
+    for (unsigned i = 0; i < length(writer.runFiles); ++i)
+    {
+        sources[i].run.reset(new BgzfReader());
+        if (!open(*sources[i].run, toCString(writer.runFiles[i])))
+        {
+            std::cerr << "ERROR: Could not open temporary file " << writer.runFiles[i] << std::endl;
+            return 1;
+        }
+    }
+    for (unsigned s = 0; s < buffer.sliceEnds.size(); ++s)
+    {
+        BamSortSource & source = sources[length(writer.runFiles) + s];
+        source.buffer = &buffer;
+        source.pos = s == 0 ? 0 : buffer.sliceEnds[s - 1];
+        source.end = buffer.sliceEnds[s];
+    }
+
+    BgzfWriter outStream;
+    if (!open(outStream, toCString(writer.outFile), writer.threads, writer.writeIndex))
+    {
+        std::cerr << "ERROR: Could not open " << writer.outFile << " for writing." << std::endl;
+        return 1;
+    }
+
+    CharString headerBytes;
+    write(headerBytes, header, context, Bam());
+    writeBytes(outStream, begin(headerBytes, Standard()), length(headerBytes));
+
+    // K-way merge.
+    BamSourceGreater greater(sources, writer.order);
+    std::priority_queue<unsigned, std::vector<unsigned>, BamSourceGreater> heap(greater);
+    for (unsigned i = 0; i < sources.size(); ++i)
+    {
+        _nextRecord(sources[i], writer.order);
+        if (sources[i].record != NULL)
+            heap.push(i);
+    }
+
+    BaiBuilder bai;
+    while (!heap.empty())
+    {
+        unsigned i = heap.top();
+        heap.pop();
+        BamSortSource & source = sources[i];
+
+        uint64_t recordBegin = virtualOffset(outStream);
+        writeBytes(outStream, reinterpret_cast<char const *>(&source.recordSize), 4);
+        writeBytes(outStream, source.record, source.recordSize);
+        if (writer.writeIndex)
+            addRecord(bai, source.record, recordBegin, virtualOffset(outStream), numRefs);
+
+        _nextRecord(source, writer.order);
+        if (source.record != NULL)
+            heap.push(i);
+    }
+
+    if (!close(outStream))
+    {
+        std::cerr << "ERROR: Could not write " << writer.outFile << std::endl;
+        return 1;
+    }
+    if (writer.writeIndex)
+    {
+        finishBai(bai, outStream, numRefs);
+        CharString baiFile = writer.outFile;
+        baiFile += ".bai";
+        if (!save(bai.index, toCString(baiFile)))
+        {
+            std::cerr << "ERROR: Could not write " << baiFile << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// ==========================================================================
+// Function sortBam()
+// ==========================================================================
+
+// Sorts a bam file with a BamSortWriter. Returns 0 on success and 1 on error.
+inline int
+sortBam(CharString const & outFile,
+        CharString const & inFile,
+        BamSortOrder order,
+        unsigned threads = 1,
+        uint64_t maxMemory = 768ull << 20,
+        bool writeIndex = true)
+{
+    BamFileIn inStream;
+    if (!open(inStream, toCString(inFile)))
+    {
+        std::cerr << "ERROR: Could not open " << inFile << std::endl;
+        return 1;
+    }
+
+    BamSortWriter writer;
+    open(writer, outFile, order, threads, maxMemory, writeIndex);
+
+    int ret = 0;
+    try
+    {
+        BamHeader header;
+        readHeader(header, inStream);
+
+        BamRecordView view;
+        while (!atEnd(inStream) && ret == 0)
+        {
+            readRecord(view, inStream);
+            if (!writeRecord(writer, begin(view.buffer, Standard()), length(view.buffer)))
+                ret = 1;
+        }
+        close(inStream);
+
+        if (ret == 0)
+            ret = close(writer, header, context(inStream));
+    }
+    catch (Exception const & e)
+    {
+        std::cerr << "ERROR while sorting " << inFile << ": " << e.what() << std::endl;
+        ret = 1;
+    }
+
+    return ret;
+}
+
+#endif // #ifndef POPINS2_BAM_SORT_H_
@@ -0,0 +1,167 @@
+#ifndef POPINS2_BATCH_SCHEDULER_H_
+#define POPINS2_BATCH_SCHEDULER_H_
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include <seqan/sequence.h>
+
+using namespace seqan;
+
+/**
+ * Resource model of the batch command. All samples of a batch share a pool of cores and memory.
+ * A job reserves its threads times the per-thread memory from the pool while it runs.
+ * I/O-bound stages (cropping reads from a bam file) get a single core and are limited in number,
+ * such that the disks are not thrashed by too many concurrent readers. CPU-bound stages (bwa and
+ * sorting) get up to the configured job threads, or fewer if only fewer cores or less memory are
+ * free, such that idle cores are used instead of waiting for a job to finish.
+ */
+
+// ==========================================================================
+// Enum BatchStageType
+// ==========================================================================
+
+enum BatchStageType
+{
+    BATCH_IO_BOUND,
+    BATCH_CPU_BOUND,
+    BATCH_SINGLE_THREADED
+};
+
+// ==========================================================================
+// Struct BatchSample
+// ==========================================================================
+
+struct BatchSample
+{
+    CharString sampleID;
+    CharString bamFile;     // empty if not listed in the sample file
+
+    unsigned nextStage;     // index of the next command to run for the sample
+    bool running;
+    bool failed;
+
+    BatchSample() : nextStage(0), running(false), failed(false)
+    {}
+};
+
+// ==========================================================================
+// Struct BatchResources
+// ==========================================================================
+
+struct BatchResources
+{
+    unsigned cores;
+    uint64_t memory;        // bytes
+    unsigned ioJobs;        // number of I/O-bound jobs that may still be started
+
+    BatchResources() : cores(0), memory(0), ioJobs(0)
+    {}
+
+    BatchResources(unsigned cores_, uint64_t memory_, unsigned ioJobs_) :
+        cores(cores_), memory(memory_), ioJobs(ioJobs_)
+    {}
+};
+
+// --------------------------------------------------------------------------
+// Function readBatchSamples()
+// --------------------------------------------------------------------------
+
+// Reads a tab-separated sample file with a sample ID and an optional bam file per line. Empty lines and
+// lines starting with '#' are skipped.
+inline bool
+readBatchSamples(String<BatchSample> & samples, CharString const & fileName)
+{
+    std::ifstream stream(toCString(fileName));
+    if (!stream.is_open())
+    {
+        std::cerr << "ERROR: Could not open sample file \'" << fileName << "\'." << std::endl;
+        return 1;
+    }
+
+    std::string line;
+    while (std::getline(stream, line))
+    {
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        std::istringstream lineStream(line);
+        std::string sampleID, bamFile, rest;
+        if (!(lineStream >> sampleID))
+            continue;
+        lineStream >> bamFile;
+        if (lineStream >> rest)
+        {
+            std::cerr << "ERROR: Expected SAMPLE_ID and optional BAM_FILE in sample file \'" << fileName << "\': " << line << std::endl;
+            return 1;
+        }
+
+        for (unsigned i = 0; i < length(samples); ++i)
+        {
+            if (samples[i].sampleID == sampleID)
+            {
+                std::cerr << "ERROR: Sample \'" << sampleID << "\' is listed twice in sample file \'" << fileName << "\'." << std::endl;
+                return 1;
+            }
+        }
+
+        BatchSample sample;
+        sample.sampleID = sampleID;
+        sample.bamFile = bamFile;
+        appendValue(samples, sample);
+    }
+
+    return 0;
+}
+
+// --------------------------------------------------------------------------
+// Function grantBatchJob()
+// --------------------------------------------------------------------------
+
+// Returns the number of threads a job of the given type can start with from the free resources, or 0 if
+// the job has to wait.
+inline unsigned
+grantBatchJob(BatchResources const & free, BatchStageType type, unsigned jobThreads, uint64_t threadMemory)
+{
+    if (free.cores == 0 || free.memory < threadMemory)
+        return 0;
+
+    if (type == BATCH_IO_BOUND)
+        return free.ioJobs > 0 ? 1 : 0;
+    if (type == BATCH_SINGLE_THREADED)
+        return 1;
+
+    uint64_t threads = std::min<uint64_t>(jobThreads, free.cores);
+    if (threadMemory > 0)
+        threads = std::min<uint64_t>(threads, free.memory / threadMemory);
+    return threads;
+}
+
+// --------------------------------------------------------------------------
+// Function reserveBatchJob()
+// --------------------------------------------------------------------------
+
+inline void
+reserveBatchJob(BatchResources & free, BatchStageType type, unsigned threads, uint64_t threadMemory)
+{
+    free.cores -= threads;
+    free.memory -= threads * threadMemory;
+    if (type == BATCH_IO_BOUND)
+        --free.ioJobs;
+}
+
+// --------------------------------------------------------------------------
+// Function releaseBatchJob()
+// --------------------------------------------------------------------------
+
+inline void
+releaseBatchJob(BatchResources & free, BatchStageType type, unsigned threads, uint64_t threadMemory)
+{
+    free.cores += threads;
+    free.memory += threads * threadMemory;
+    if (type == BATCH_IO_BOUND)
+        ++free.ioJobs;
+}
+
+#endif // #ifndef POPINS2_BATCH_SCHEDULER_H_
@@ -1,10 +1,18 @@
 #ifndef NOVINS_CROP_UNMAPPED_H_
 #define NOVINS_CROP_UNMAPPED_H_
 
+#include <atomic>
+#include <deque>
+#include <thread>
+
 #include <seqan/seq_io.h>
 #include <seqan/bam_io.h>
+#include <seqan/parallel.h>
 
 #include "adapter_removal.h"
+#include "bam_record_view.h"
+#include "bam_sort.h"
+#include "read_pairing.h"
 
 
 using namespace seqan;
@@ -24,112 +32,255 @@ using namespace seqan;
  *   - The read end is soft-clipped by 25 or more bases at both ends.
  *   - The alignment score as indicated by the AS tag is lower than 0.5 * read length.
  *
- * @param record    a read's mapping record from a bam file
+ * The checks work on the undecoded record, most records are discarded without decoding.
+ *
+ * @param view      a read's mapping record from a bam file
  *
  * @returns         true if the read has low mapping quality and otherwise false.
  */
 inline bool
-hasLowMappingQuality(BamAlignmentRecord & record, int humanSeqs, float as_factor)
+hasLowMappingQuality(BamRecordView const & view, int humanSeqs, float as_factor)
 {
-    typedef Iterator<String<CigarElement<> > >::Type TIter;
-
     // Check for mapping location of other read end. If within 1000 bp and opposite orientation, accept the mapping.
-    if (record.rID == record.rNextId && abs(record.beginPos - record.pNext) < 1000 &&
-            hasFlagRC(record) != hasFlagNextRC(record))
+    if (view.rID == view.rNextId && abs(view.beginPos - view.pNext) < 1000 &&
+            hasFlagRC(view) != hasFlagNextRC(view))
         return false;
 
-    if (record.rID > humanSeqs) return false;
+    if (view.rID > humanSeqs) return false;
 
     // Check for less than 50 bp matches ('M') in cigar string.
     unsigned matches = 0;
-    TIter itEnd = end(record.cigar);
-    for (TIter it = begin(record.cigar); it != itEnd; ++it)
-        if ((*it).operation == 'M') matches += (*it).count;
+    unsigned cigarLength = getCigarLength(view);
+    for (unsigned i = 0; i < cigarLength; ++i)
+    {
+        CigarElement<> el = getCigarElement(view, i);
+        if (el.operation == 'M') matches += el.count;
+    }
     if (matches < 50) return true;
 
     // Check for soft-clipping at BOTH ENDS by more than 24 bp.
-    if (record.cigar[0].operation == 'S' &&
-            record.cigar[0].count > 24 &&
-            record.cigar[length(record.cigar)-1].operation == 'S' &&
-            record.cigar[length(record.cigar)-1].count > 24)
+    CigarElement<> first = getCigarElement(view, 0);
+    CigarElement<> last = getCigarElement(view, cigarLength - 1);
+    if (first.operation == 'S' && first.count > 24 &&
+            last.operation == 'S' && last.count > 24)
         return true;
 
     // Check for AS (alignment score) lower than as_factor * readLength.
-    BamTagsDict tagsDict(record.tags);
-    unsigned idx;
-    if (findTagKey(idx, tagsDict, "AS"))
+    char const * asTag = findTag(view, "AS");
+    if (asTag != NULL)
     {
         unsigned score = 0;
-        extractTagValue(score, tagsDict, idx);
-        if (score < as_factor*length(record.seq))
+        extractTagValue(score, asTag);
+        if (score < as_factor*getSeqLength(view))
             return true;
     }
 
     return false;
 }
 
+// --------------------------------------------------------------------------
+// Function qualityTrimPoints()
+// --------------------------------------------------------------------------
+
+/**
+ * Finds the part of a read to keep after sliding-window quality trimming.
+ *
+ * A window of max(5, length/10) bases passes if its mean quality is at least qualThresh.
+ * The read is trimmed from the left up to the first base with quality qualThresh or more
+ * in the first passing window, and from the right after the last such base in the last
+ * passing window of the remaining read. The last window of the read is not tested from
+ * the left, the window starting at the left trim point is not tested from the right.
+ *
+ * The scans work on the raw quality bytes with the offset of 33 folded into the threshold.
+ * Only the first window of each scan is summed up in full, in a loop the compiler
+ * vectorizes, and both scans stop at the first passing window.
+ *
+ * @param trimBegin     first position to keep
+ * @param trimEnd       position after the last position to keep
+ * @param qual          the read's base qualities
+ * @param qualThresh    minimum mean quality of a window
+ *
+ * @returns             false if no window passes from the left and otherwise true.
+ */
+inline bool
+qualityTrimPoints(unsigned & trimBegin, unsigned & trimEnd, CharString const & qual, unsigned qualThresh)
+{
+    unsigned len = length(qual);
+    unsigned windowSize = std::max(5u, len / 10);
+    if (len <= windowSize)
+        return false;
+
+    unsigned char const * q = reinterpret_cast<unsigned char const *>(begin(qual, Standard()));
+    unsigned baseThresh = qualThresh + 33;
+    int windowThresh = baseThresh * windowSize;
+
+    // Check quality from the left.
+    int windowQual = 0;
+    for (unsigned i = 0; i < windowSize; ++i)
+        windowQual += q[i];
+
+    unsigned windowBegin = 0;
+    for (; windowBegin + windowSize < len; ++windowBegin)
+    {
+        if (windowQual >= windowThresh)
+            break;
+        windowQual += q[windowBegin + windowSize] - q[windowBegin];
+    }
+    if (windowBegin + windowSize == len)
+        return false;
+
+    trimBegin = windowBegin;
+    while (q[trimBegin] < baseThresh)
+        ++trimBegin;
+
+    // Check quality from the right.
+    trimEnd = len;
+    if (len - trimBegin <= windowSize)
+        return true;
+
+    windowQual = 0;
+    for (unsigned i = len - windowSize; i < len; ++i)
+        windowQual += q[i];
+
+    for (unsigned windowEnd = len; windowEnd - windowSize > trimBegin; --windowEnd)
+    {
+        if (windowQual >= windowThresh)
+        {
+            trimEnd = windowEnd;
+            while (q[trimEnd - 1] < baseThresh)
+                --trimEnd;
+            break;
+        }
+        windowQual += q[windowEnd - windowSize - 1] - q[windowEnd - 1];
+    }
+
+    return true;
+}
+
 // --------------------------------------------------------------------------
 // Function removeLowQuality()
 // --------------------------------------------------------------------------
 
+// Trims low quality bases from both ends of a read in place (see qualityTrimPoints()). Returns 1 if less than
+// 30 bases remain.
 template<typename TSize_>
 inline bool
 removeLowQuality(BamAlignmentRecord & record, TSize_ qualThresh)
 {
-    typedef Iterator<CharString, Rooted>::Type TIter;
-    typedef Size<CharString>::Type TSize;
+    unsigned trimBegin, trimEnd;
+    if (!qualityTrimPoints(trimBegin, trimEnd, record.qual, qualThresh))
+        return 1;
 
-    TSize windowSize = std::max(TSize(5), length(record.qual) / 10);
-    TSize windowThresh = qualThresh*windowSize;
+    // Shrinking and erasing from the front move the characters without reallocating.
+    resize(record.seq, trimEnd);
+    resize(record.qual, trimEnd);
+    erase(record.seq, 0, trimBegin);
+    erase(record.qual, 0, trimBegin);
 
-    // Initialize windowQual with first windowSize quality values.
-    TSize windowQual = 0;
-    TIter qualEnd = end(record.qual);
-    TIter windowEnd = begin(record.qual) + std::min(windowSize, length(record.qual));
-    TIter windowBegin = begin(record.qual);
-    for (; windowBegin != windowEnd; ++windowBegin)
-        windowQual += *windowBegin - 33;
+    if (length(record.seq) < 30) return 1;
+    return 0;
+}
 
-    // Check quality from the left.
-    for (windowBegin = begin(record.qual); windowEnd < qualEnd; ++windowEnd, ++windowBegin)
+// --------------------------------------------------------------------------
+// Function sickleTrimEnd()
+// --------------------------------------------------------------------------
+
+/**
+ * Finds the end of a read after quality trimming like sickle with the options -x (no 5' trimming)
+ * and -n (truncation at the first N).
+ *
+ * The read is scanned in sequencing direction, i.e. reads on the reverse strand from the end of the
+ * bam record. A window of length/10 bases (the whole read if shorter than 10 bases) slides from the
+ * 5' end until its mean quality drops below qualThresh, and the read is cut at the first base in
+ * this window with quality below qualThresh. As in sickle, a read containing an N is cut at its
+ * first N instead, even if this is behind the quality cut.
+ *
+ * @param trimEnd       number of bases to keep from the 5' end
+ * @param seq           the read's sequence as in the bam record
+ * @param qual          the read's base qualities as in the bam record
+ * @param rc            true if the read is on the reverse strand
+ * @param qualThresh    minimum mean quality of a window
+ * @param minLength     minimum read length before and after trimming
+ *
+ * @returns             false if the read is shorter than minLength before or after trimming.
+ */
+inline bool
+sickleTrimEnd(unsigned & trimEnd, IupacString const & seq, CharString const & qual, bool rc,
+              unsigned qualThresh, unsigned minLength)
+{
+    unsigned len = length(qual);
+    if (len < minLength || length(seq) != len)
+        return false;
+
+    unsigned windowSize = len / 10;
+    if (windowSize == 0)
+        windowSize = len;
+
+    // Raw quality bytes in sequencing direction, the offset of 33 is folded into the thresholds.
+    unsigned char const * q = reinterpret_cast<unsigned char const *>(begin(qual, Standard()));
+    auto qualAt = [&](unsigned i) -> unsigned { return q[rc ? len - 1 - i : i]; };
+    unsigned baseThresh = qualThresh + 33;
+    unsigned windowThresh = baseThresh * windowSize;
+
+    unsigned windowQual = 0;
+    for (unsigned i = 0; i < windowSize; ++i)
+        windowQual += qualAt(i);
+
+    trimEnd = len;
+    for (unsigned windowBegin = 0; windowBegin + windowSize <= len; ++windowBegin)
     {
-        if (windowQual >= (TSize)windowThresh)
+        if (windowQual < windowThresh)
         {
-            while (*windowBegin - 33 < qualThresh) ++windowBegin;
-            record.seq = suffix(record.seq, position(windowBegin));
-            record.qual = suffix(record.qual, position(windowBegin));
+            trimEnd = windowBegin;
+            while (qualAt(trimEnd) >= baseThresh)
+                ++trimEnd;
             break;
         }
-
-        windowQual -= *windowBegin - 33;
-        windowQual += *windowEnd - 33;
+        windowQual -= qualAt(windowBegin);
+        if (windowBegin + windowSize < len)
+            windowQual += qualAt(windowBegin + windowSize);
     }
-    if (windowEnd == qualEnd) return 1;
 
-    // Initialize windowQual with last windowSize quality values.
-    windowQual = 0;
-    TIter qualBegin = begin(record.qual);
-    windowEnd = end(record.qual) - 1;
-    windowBegin = windowEnd - std::min(windowSize, length(record.qual));
-    for (; windowEnd != windowBegin; --windowEnd)
-        windowQual += *windowEnd - 33;
-
-    // Check quality from the right.
-    for (windowEnd = end(record.qual) - 1; windowBegin >= qualBegin; --windowBegin, --windowEnd)
+    for (unsigned i = 0; i < len; ++i)
     {
-        if (windowQual >= (TSize)windowThresh)
+        if (seq[rc ? len - 1 - i : i] == 'N')
         {
-            while (*windowEnd - 33 < qualThresh) --windowEnd;
-            record.seq = prefix(record.seq, position(windowEnd) + 1);
-            record.qual = prefix(record.qual, position(windowEnd) + 1);
+            trimEnd = i;
             break;
         }
+    }
 
-        windowQual -= *windowEnd - 33;
-        windowQual += *windowBegin -33;
+    return trimEnd >= minLength;
+}
+
+// --------------------------------------------------------------------------
+// Function sickleTrim()
+// --------------------------------------------------------------------------
+
+// Trims a read in place like 'sickle -q qualThresh -l minLength -x -n' (see sickleTrimEnd()). Returns 1 if the
+// read is discarded, its sequence and qualities are cleared then.
+template<typename TSize_>
+inline bool
+sickleTrim(BamAlignmentRecord & record, TSize_ qualThresh, TSize_ minLength)
+{
+    unsigned trimEnd;
+    if (!sickleTrimEnd(trimEnd, record.seq, record.qual, hasFlagRC(record), qualThresh, minLength))
+    {
+        clear(record.seq);
+        clear(record.qual);
+        return 1;
     }
 
-    if (length(record.seq) < 30) return 1;
+    if (hasFlagRC(record))
+    {
+        erase(record.seq, 0, length(record.seq) - trimEnd);
+        erase(record.qual, 0, length(record.qual) - trimEnd);
+    }
+    else
+    {
+        resize(record.seq, trimEnd);
+        resize(record.qual, trimEnd);
+    }
     return 0;
 }
 
@@ -163,309 +314,1276 @@ setMateUnmapped(BamAlignmentRecord & record)
 }
 
 // --------------------------------------------------------------------------
-// Function appendFastqRecord()
+// Function _findOtherReadsOnReference()
 // --------------------------------------------------------------------------
 
-// Append a read to map of fastq records.
-bool
-appendFastqRecord(SeqFileOut & firstStream,
-        SeqFileOut & secondStream,
-        std::map<CharString, Pair<CharString> > & firstReads,
-        std::map<CharString, Pair<CharString> > & secondReads,
-        BamAlignmentRecord const & record)
+// Finds the other reads listed in [itBegin, itEnd), all on the same reference sequence. Targets close to
+// the current scan position are reached by reading on, the stream jumps only over gaps of more than maxGap bp.
+template<typename TIter, typename TOtherMap>
+int
+_findOtherReadsOnReference(String<BamAlignmentRecord> & mates,
+        BamFileIn & inStream,
+        BamIndex<Bai> const & bamIndex,
+        TIter itBegin,
+        TIter itEnd,
+        TOtherMap const & otherReads)
 {
-    CharString seq = record.seq;
-    CharString qual = record.qual;
+    typedef typename Value<typename TOtherMap::key_type, 1>::Type TPos;
+    const TPos maxGap = 1 << 16;
 
-    if (hasFlagRC(record))
-    {
-        reverseComplement(seq);
-        reverse(qual);
-    }
+    int numFound = 0;
+    TPos rID = itBegin->first.i1;
+    BamRecordView view;     // Records are skipped undecoded.
+    BamAlignmentRecord record;
+    bool positioned = false;
 
-    if (hasFlagFirst(record))
+    for (TIter it = itBegin; it != itEnd; ++it)
     {
-        if (secondReads.count(record.qName) != 0)
-        {
-            Pair<CharString> second = secondReads[record.qName];
-            writeRecord(firstStream, record.qName, record.seq, record.qual);
-            writeRecord(secondStream, record.qName, second.i1, second.i2);
-            secondReads.erase(record.qName);
-            return 1;
-        }
-        else
+        // Jump to the target if it is not within reach of the scan position.
+        if (!positioned || (view.rID == rID && view.beginPos + maxGap < it->first.i2))
         {
-            firstReads[record.qName] = Pair<CharString>(seq, qual);
-            return 0;
+            bool hasAligns;
+            jumpToRegion(inStream, hasAligns, rID, it->first.i2, maxValue<TPos>(), bamIndex);
+            if (!hasAligns) break;
+            readRecord(view, inStream);
+            positioned = true;
         }
-    }
-    else // hasFlagLast(record)
-    {
-        if (firstReads.count(record.qName) != 0)
+
+        // Skip reads not in list.
+        bool last = false;
+        while (view.rID == it->first.i1 && (view.beginPos < it->first.i2 || (view.beginPos == it->first.i2 && getQName(view) != it->second.i1)))
         {
-            Pair<CharString> first = firstReads[record.qName];
-            writeRecord(firstStream, record.qName, first.i1, first.i2);
-            writeRecord(secondStream, record.qName, record.seq, record.qual);
-            firstReads.erase(record.qName);
-            return 1;
+            if (atEnd(inStream))
+            {
+                last = true;
+                break;
+            }
+            readRecord(view, inStream);
         }
-        else
+
+        // Keep record if it matches qName, rID, and beginPos.
+        if (!last && getQName(view) == it->second.i1 && view.rID == it->first.i1 && view.beginPos == it->first.i2)
         {
-            secondReads[record.qName] = Pair<CharString>(seq, qual);
-            return 0;
+            // Check if both ends are low-quality mapped and, hence, are already in fastq files.
+            if (otherReads.count(typename TOtherMap::key_type(view.rNextId, view.pNext)) == 0)
+            {
+                decodeRecord(record, view);
+                setMateUnmapped(record);
+                appendValue(mates, record);
+            }
+            ++numFound;
         }
     }
+
+    return numFound;
 }
 
 // --------------------------------------------------------------------------
-// Function writeFastq()
+// Function collectOtherReads()
 // --------------------------------------------------------------------------
 
+// Finds the reads listed in targets and collects them in mates, one string per reference sequence, unless both
+// ends are in otherReads. The reference sequences are distributed over the threads, each with its own bam stream
+// and index. Returns the number of reads found or -1 on error.
+template<typename TPos>
 int
-writeFastq(SeqFileOut & fastqFirst,
-        SeqFileOut & fastqSecond,
-        SeqFileOut & fastqSingle,
-        std::map<CharString, Pair<CharString> > const & firstReads,
-        std::map<CharString, Pair<CharString> > const & secondReads)
+collectOtherReads(String<String<BamAlignmentRecord> > & mates,
+        std::map<Pair<TPos>, Pair<CharString, bool> > const & targets,
+        std::map<Pair<TPos>, Pair<CharString, bool> > const & otherReads,
+        CharString const & mappingBam,
+        unsigned threads = 1)
 {
-    typedef std::map<CharString, Pair<CharString> > TFastqMap;
+    typedef std::map<Pair<TPos>, Pair<CharString, bool> > TOtherMap;
+    typedef typename TOtherMap::const_iterator TIter;
+
+    // Split the list of targets by reference sequence.
+    std::vector<TIter> refBegins;
+    for (TIter it = targets.begin(); it != targets.end(); ++it)
+        if (it->first.i1 >= 0 && (refBegins.empty() || refBegins.back()->first.i1 != it->first.i1))
+            refBegins.push_back(it);
+    refBegins.push_back(targets.end());
+    unsigned numRefs = refBegins.size() - 1;
+
+    CharString baiFile = mappingBam;
+    baiFile += ".bai";
 
-    // Initialize iterators over reads in fastq maps.
-    TFastqMap::const_iterator firstIt = firstReads.begin();
-    TFastqMap::const_iterator firstEnd = firstReads.end();
-    TFastqMap::const_iterator secondIt = secondReads.begin();
-    TFastqMap::const_iterator secondEnd = secondReads.end();
+    clear(mates);
+    resize(mates, numRefs);
+    std::vector<int> numFound(numRefs, 0);
+    std::atomic<unsigned> nextRef(0);
+    std::atomic<bool> failed(false);
 
-    // Iterate over reads and output to fastq files (paired.1 and paired.2, or single).
-    while (firstIt != firstEnd && secondIt != secondEnd)
+    auto worker = [&]()
     {
-        if (firstIt->first < secondIt->first)
-        {
-            writeRecord(fastqSingle, firstIt->first, firstIt->second.i1, firstIt->second.i2);
-            ++firstIt;
-        }
-        else if (firstIt->first == secondIt->first)
+        // Open input file and load bam index.
+        BamFileIn inStream;
+        BamHeader header;
+        BamIndex<Bai> bamIndex;
+        if (!open(inStream, toCString(mappingBam)))
         {
-            writeRecord(fastqFirst, firstIt->first, firstIt->second.i1, firstIt->second.i2);
-            writeRecord(fastqSecond, secondIt->first, secondIt->second.i1, secondIt->second.i2);
-            ++firstIt; ++secondIt;
+            std::cerr << "ERROR: Could not open " << mappingBam << std::endl;
+            failed = true;
+            return;
         }
-        else // firstIt->first > secondIt->first
+        readHeader(header, inStream);
+        if (!open(bamIndex, toCString(baiFile)))
         {
-            writeRecord(fastqSingle, secondIt->first, secondIt->second.i1, secondIt->second.i2);
-            ++secondIt;
+            std::cerr << "ERROR: Could not read BAI index file " << baiFile << std::endl;
+            failed = true;
+            return;
         }
-    }
 
-    // Iterate over remaining reads and output to single.fastq.
-    while (firstIt != firstEnd)
-    {
-        writeRecord(fastqSingle, firstIt->first, firstIt->second.i1, firstIt->second.i2);
-        ++firstIt;
-    }
-    while (secondIt != secondEnd)
-    {
-        writeRecord(fastqSingle, secondIt->first, secondIt->second.i1, secondIt->second.i2);
-        ++secondIt;
-    }
+        for (unsigned r = nextRef++; r < numRefs; r = nextRef++)
+            numFound[r] = _findOtherReadsOnReference(mates[r], inStream, bamIndex, refBegins[r], refBegins[r + 1], otherReads);
+    };
 
-    return 0;
+    std::vector<std::thread> workers;
+    for (unsigned t = 1; t < std::min(threads, numRefs); ++t)
+        workers.push_back(std::thread(worker));
+    worker();
+    for (unsigned t = 0; t < workers.size(); ++t)
+        workers[t].join();
+
+    if (failed)
+        return -1;
+
+    int found = 0; // Return value.
+    for (unsigned r = 0; r < numRefs; ++r)
+        found += numFound[r];
+
+    return found;
 }
 
 // --------------------------------------------------------------------------
 // Function findOtherReads()
 // --------------------------------------------------------------------------
 
+// Finds the other reads of low quality mapping reads and writes them to the mates bam file in the order of the
+// reference sequences.
 template<typename TPos>
 int
 findOtherReads(BamFileOut & matesStream,
         std::map<Pair<TPos>, Pair<CharString, bool> > & otherReads,
-        CharString const & mappingBam)
+        CharString const & mappingBam,
+        unsigned threads = 1)
 {
-    typedef std::map<Pair<TPos>, Pair<CharString, bool> > TOtherMap;
+    String<String<BamAlignmentRecord> > mates;
+    int found = collectOtherReads(mates, otherReads, otherReads, mappingBam, threads);
 
-    int numFound = 0; // Return value.
+    for (unsigned r = 0; r < length(mates); ++r)
+        for (unsigned i = 0; i < length(mates[r]); ++i)
+            writeRecord(matesStream, mates[r][i]);
 
-    // Open input file.
-    BamFileIn inStream(toCString(mappingBam));
-    BamHeader header;
-    readHeader(header, inStream);
+    return found;
+}
 
-    // Load bam index.
-    CharString baiFile = mappingBam;
-    baiFile += ".bai";
-    BamIndex<Bai> bamIndex;
-    if (!open(bamIndex, toCString(baiFile)))
-    {
-        std::cerr << "ERROR: Could not read BAI index file " << baiFile << std::endl;
-        return -1;
-    }
+// --------------------------------------------------------------------------
+// Enum CropAction
+// --------------------------------------------------------------------------
 
-    __int32 rID = BamAlignmentRecord::INVALID_REFID;
-    BamAlignmentRecord record;
+// What happens to a record of the input bam file after filtering.
+enum CropAction
+{
+    CROP_SKIP,              // uninteresting record or filtered out
+    CROP_DISCARDED,         // unmapped or low quality mapping read removed by quality or adapter trimming
+    CROP_UNMAPPED,          // unmapped read, goes into fastq files
+    CROP_LOW_QUALITY,       // low quality mapping read, goes into fastq files, mate is cropped in second pass if unpaired
+    CROP_MATE               // mapped mate of an unmapped read, goes into mates bam file
+};
 
-    typename TOtherMap::const_iterator itEnd = otherReads.end();
-    for (typename TOtherMap::const_iterator it = otherReads.begin(); it != itEnd; ++it)
+// --------------------------------------------------------------------------
+// Function filterRecord()
+// --------------------------------------------------------------------------
+
+// Classifies a record and applies quality and adapter trimming to reads going into the fastq files.
+// The view is decoded into record unless the record is skipped. If untrimmed is given, the record is
+// copied there before trimming. With the quality filter, reads that sickle would discard keep their
+// action but lose their sequence, such that the pairing still knows about them (see ReadPairing).
+template<typename TAdapterTag>
+inline CropAction
+filterRecord(BamAlignmentRecord & record,
+        BamRecordView const & view,
+        unsigned long & alignedBaseCount,
+        int humanSeqs,
+        TAdapterTag tag,
+        float as_factor,
+        bool qualityFilter,
+        BamAlignmentRecord * untrimmed = NULL)
+{
+    // Check for flags that indicate 'uninteresting' bam records.
+    if (hasFlagDuplicate(view) or hasFlagSecondary(view) or
+            hasFlagQCNoPass(view) or hasFlagSupplementary(view)) return CROP_SKIP;
+
+    if (!hasFlagUnmapped(view))
+        alignedBaseCount += getSeqLength(view);
+
+    // Check the read's unmapped flag.
+    if (hasFlagUnmapped(view))
     {
-        if (rID != it->first.i1)
+        decodeRecord(record, view);
+        if (untrimmed != NULL) *untrimmed = record;
+        if (removeLowQuality(record, 20) != 1 && removeAdapter(record, 30, tag) != 2)
         {
-            // Jump to chromosome.
-            rID = it->first.i1;
-            bool hasAligns;
-            jumpToRegion(inStream, hasAligns, rID, it->first.i2, maxValue<TPos>(), bamIndex);
-            if (!hasAligns) continue;
-            readRecord(record, inStream);
+            if (qualityFilter)
+                sickleTrim(record, 20u, 60u);
+            return CROP_UNMAPPED;
         }
+        return CROP_DISCARDED;
+    }
 
-        // Skip reads not in list.
-        bool last = false;
-        while (record.rID == it->first.i1 && (record.beginPos < it->first.i2 || (record.beginPos == it->first.i2 && record.qName != it->second.i1)))
+    // Check for low mapping quality.
+    else if (hasLowMappingQuality(view, humanSeqs, as_factor))
+    {
+        decodeRecord(record, view);
+        if (untrimmed != NULL) *untrimmed = record;
+        if (removeLowQuality(record, 20) != 1 && removeAdapter(record, 30, tag) != 2)
         {
-            if (atEnd(inStream))
-            {
-                last = true;
-                break;
-            }
-            readRecord(record, inStream);
+            if (qualityFilter)
+                sickleTrim(record, 20u, 60u);
+            return CROP_LOW_QUALITY;
         }
+        return CROP_DISCARDED;
+    }
 
-        // Output record if it matches qName, rID, and beginPos.
-        if (!last && record.qName == it->second.i1 && record.rID == it->first.i1 && record.beginPos == it->first.i2)
-        {
-            // Check if both ends are low-quality mapped and, hence, are already in fastq files.
-            if (otherReads.count(Pair<TPos>(record.rNextId, record.pNext)) == 0)
-            {
-                setMateUnmapped(record);
-                writeRecord(matesStream, record);
-            }
-            ++numFound;
-        }
+    // Check the mate's unmapped flag.
+    else if (hasFlagNextUnmapped(view))
+    {
+        decodeRecord(record, view);
+        return CROP_MATE;
     }
 
-    return numFound;
+    return CROP_SKIP;
 }
 
-// ==========================================================================
-// Function crop_unmapped()
-// ==========================================================================
+// --------------------------------------------------------------------------
+// Function writeCroppedRecord()
+// --------------------------------------------------------------------------
 
-template<typename TAdapterTag>
-int
-crop_unmapped(double & avgCov,
-        Triple<CharString> & fastqFiles,
-        CharString & matesBam,
-        CharString const & mappingBam,
-        int humanSeqs,
-        TAdapterTag tag,
-        float as_factor)
+inline void
+_appendMate(BamFileOut & matesStream, BamAlignmentRecord const & record)
 {
-    typedef __int32 TPos;
-    typedef std::map<CharString, Pair<CharString> > TFastqMap; // Reads to go into fastq files.
-    typedef std::map<Pair<TPos>, Pair<CharString, bool> > TOtherMap; // Reads to crop in a second pass of the input file.
-    typedef StringSet<Dna5String> TStringSet;
+    writeRecord(matesStream, record);
+}
 
-    // Open the input and output bam files.
-    BamFileIn inStream(toCString(mappingBam));
-    BamFileOut matesStream(context(inStream), toCString(matesBam));
+inline void
+_appendMate(String<BamAlignmentRecord> & mates, BamAlignmentRecord const & record)
+{
+    appendValue(mates, record);
+}
 
-    // Copy the header.
-    BamHeader header;
-    readHeader(header, inStream);
-    writeHeader(matesStream, header);
+// Writes a filtered record according to its action. Must be called in the order of the input file.
+// Mates go to a bam file or are collected in a string. Returns true if the record's mate was added
+// to the reads to crop in a second pass.
+template<typename TOtherMap, typename TMates>
+inline bool
+writeCroppedRecord(CropAction action,
+        BamAlignmentRecord const & record,
+        SeqFileOut & fastqFirstStream,
+        SeqFileOut & fastqSecondStream,
+        TMates & matesStream,
+        ReadPairing & pairing,
+        TOtherMap & otherReads)
+{
+    typedef typename TOtherMap::key_type TKey;
 
-    unsigned long genomeLength = 0;
-    for (unsigned i = 0; i < length(header); ++i)
+    if (action == CROP_UNMAPPED)
     {
-        if (header[i].type != BamHeaderRecordType::BAM_HEADER_REFERENCE)
-            continue;
-
-        for (unsigned j = 0; j < length(header[i].tags); ++j)
+        appendFastqRecord(fastqFirstStream, fastqSecondStream, pairing, record);
+    }
+    else if (action == CROP_LOW_QUALITY)
+    {
+        if (appendFastqRecord(fastqFirstStream, fastqSecondStream, pairing, record) == 0)
         {
-            if (header[i].tags[j].i1 != "LN")
-                continue;
-
-            genomeLength += lexicalCast<unsigned>(header[i].tags[j].i2);
-            break;
+            otherReads[TKey(record.rNextId, record.pNext)] = Pair<CharString, bool>(record.qName, hasFlagFirst(record));
+            return true;
         }
     }
+    else if (action == CROP_MATE)
+    {
+        _appendMate(matesStream, record);
+    }
+    return false;
+}
 
-    // Create maps for fastq records (first read in pair and second read in pair) and bam records without mate.
-    TFastqMap firstReads, secondReads;
-    TOtherMap otherReads;
-
-    // Open the output fastq files.
-    SeqFileOut fastqFirstStream(toCString(fastqFiles.i1));
-    SeqFileOut fastqSecondStream(toCString(fastqFiles.i2));
-    SeqFileOut fastqSingleStream(toCString(fastqFiles.i3));
+// --------------------------------------------------------------------------
+// Struct MateLookBack
+// --------------------------------------------------------------------------
 
-    // Retrieve the adapter sequences with up to one error and create indices.
-    TStringSet universal = reverseUniversalOneError(tag);
-    TStringSet truSeqs = reverseTruSeqsOneError(tag);
-    Index<TStringSet> indexUniversal(universal);
-    Index<TStringSet> indexTruSeqs(truSeqs);
+// State of the single-pass mode on coordinate-sorted input. Mates of low quality mapping reads after the
+// scan position are captured when the scan reaches them. Mates behind the scan position are taken from a buffer
+// of recent records that may be requested later. The rare remaining mates are left to an indexed fix-up pass.
+struct MateLookBack
+{
+    typedef __int32 TPos;
+    typedef std::map<Pair<TPos>, Pair<CharString, bool> > TOtherMap;
 
-    // Iterate over the input file.
-    BamAlignmentRecord record;
-    unsigned long alignedBaseCount = 0;
-    while (!atEnd(inStream))
-    {
-        // Read the next read from input file.
-        readRecord(record, inStream);
+    TOtherMap pending;                      // Mates ahead of the scan position.
+    TOtherMap leftovers;                    // Mates at or behind the scan position that are not in the buffer.
+    std::deque<BamAlignmentRecord> buffer;  // Recent records whose mate maps after them within the window.
+    String<BamAlignmentRecord> captured;    // Mates found in the single pass.
+    TPos window;
+    unsigned maxRecords;
+    int humanSeqs;
+    int found;
 
-        // Check for flags that indicate 'uninteresting' bam records.
-        if (hasFlagDuplicate(record) or hasFlagSecondary(record) or
-                hasFlagQCNoPass(record) or hasFlagSupplementary(record)) continue;
+    MateLookBack(int humanSeqs_, TPos window_ = 1 << 16, unsigned maxRecords_ = 1 << 18) :
+        window(window_), maxRecords(maxRecords_), humanSeqs(humanSeqs_), found(0)
+    {}
+};
 
-        if (!hasFlagUnmapped(record))
-            alignedBaseCount += length(record.seq);
+// --------------------------------------------------------------------------
+// Function _isLookBackCandidate()
+// --------------------------------------------------------------------------
 
-        // Check the read's unmapped flag.
-        if (hasFlagUnmapped(record))
-        {
-            if (removeLowQuality(record, 20) != 1 && removeAdapter(record, indexUniversal, indexTruSeqs, 30, tag) != 2)
-                appendFastqRecord(fastqFirstStream, fastqSecondStream, firstReads, secondReads, record);
-        }
+// Returns true if the record's mate maps after it within the window and the mate could be a low quality mapping
+// read. A mate that maps close by in opposite orientation or to a filtered reference is never low quality.
+inline bool
+_isLookBackCandidate(MateLookBack const & lookBack, BamRecordView const & view)
+{
+    if (hasFlagUnmapped(view) || hasFlagNextUnmapped(view) || view.rNextId != view.rID || view.rNextId > lookBack.humanSeqs)
+        return false;
 
-        // Check for low mapping quality.
-        else if (hasLowMappingQuality(record, humanSeqs, as_factor))
-        {
-            if (removeLowQuality(record, 20) != 1 && removeAdapter(record, indexUniversal, indexTruSeqs, 30, tag) != 2)
-            {
-                if (appendFastqRecord(fastqFirstStream, fastqSecondStream, firstReads, secondReads, record) == 0)
-                    otherReads[Pair<TPos>(record.rNextId, record.pNext)] = Pair<CharString, bool>(record.qName, hasFlagFirst(record));
-            }
-        }
+    __int32 dist = view.pNext - view.beginPos;
+    if (dist < 0 || dist > lookBack.window)
+        return false;
 
-        // Check the mate's unmapped flag.
-        else if (hasFlagNextUnmapped(record))
-        {
-            writeRecord(matesStream, record);
-        }
-    }
-    close(inStream);
+    return dist >= 1000 || hasFlagRC(view) == hasFlagNextRC(view);
+}
 
-    avgCov = (double)alignedBaseCount / (double)genomeLength;
+inline bool
+_lessBeginPos(BamAlignmentRecord const & record, __int32 pos)
+{
+    return record.beginPos < pos;
+}
+
+inline bool
+_lessRefPos(BamAlignmentRecord const & a, BamAlignmentRecord const & b)
+{
+    return a.rID < b.rID || (a.rID == b.rID && a.beginPos < b.beginPos);
+}
+
+inline void
+_captureMate(MateLookBack & lookBack, BamAlignmentRecord const & record)
+{
+    appendValue(lookBack.captured, record);
+    ++lookBack.found;
+}
+
+// --------------------------------------------------------------------------
+// Function cropRecord()
+// --------------------------------------------------------------------------
+
+// Writes a filtered record like writeCroppedRecord() and, in single-pass mode, captures the mates of low quality
+// mapping reads. Trimmed records are captured and buffered in their untrimmed form. The captured mates are written
+// by writeCapturedMates() once the list of low quality mapping reads is complete. Records skipped by filterRecord()
+// are not decoded yet, the few of them that are captured or buffered are decoded here.
+template<typename TOtherMap>
+inline void
+cropRecord(CropAction action,
+        BamRecordView const & view,
+        BamAlignmentRecord & record,
+        BamAlignmentRecord const & untrimmed,
+        SeqFileOut & fastqFirstStream,
+        SeqFileOut & fastqSecondStream,
+        BamFileOut & matesStream,
+        ReadPairing & pairing,
+        TOtherMap & otherReads,
+        MateLookBack * lookBack)
+{
+    typedef typename TOtherMap::key_type TKey;
+    typedef typename TOtherMap::iterator TIter;
+
+    if (lookBack == NULL)
+    {
+        writeCroppedRecord(action, record, fastqFirstStream, fastqSecondStream, matesStream, pairing, otherReads);
+        return;
+    }
+
+    bool trimmed = action == CROP_UNMAPPED || action == CROP_LOW_QUALITY || action == CROP_DISCARDED;
+    bool decoded = action != CROP_SKIP;
+    BamAlignmentRecord const & original = trimmed ? untrimmed : record;
+
+    // Drop buffered records that are out of reach of the scan position.
+    std::deque<BamAlignmentRecord> & buffer = lookBack->buffer;
+    while (!buffer.empty() && (buffer.front().rID != view.rID || buffer.front().beginPos + lookBack->window < view.beginPos))
+        buffer.pop_front();
+
+    // Capture the record if a low quality mapping read registered it before.
+    if (!lookBack->pending.empty())
+    {
+        TIter it = lookBack->pending.find(TKey(view.rID, view.beginPos));
+        if (it != lookBack->pending.end() && it->second.i1 == getQName(view))
+        {
+            if (!decoded)
+            {
+                decodeRecord(record, view);
+                decoded = true;
+            }
+            _captureMate(*lookBack, original);
+            lookBack->pending.erase(it);
+        }
+    }
+
+    if (writeCroppedRecord(action, record, fastqFirstStream, fastqSecondStream, matesStream, pairing, otherReads))
+    {
+        TKey key(record.rNextId, record.pNext);
+        Pair<CharString, bool> const & value = otherReads[key];
+        lookBack->pending.erase(key);
+        lookBack->leftovers.erase(key);
+
+        // Look for the mate among the buffered records, which are sorted by position on the current reference.
+        std::deque<BamAlignmentRecord>::iterator bit = buffer.end();
+        if (key.i1 == view.rID)
+        {
+            bit = std::lower_bound(buffer.begin(), buffer.end(), key.i2, _lessBeginPos);
+            while (bit != buffer.end() && bit->beginPos == key.i2 && bit->qName != value.i1)
+                ++bit;
+            if (bit != buffer.end() && bit->beginPos != key.i2)
+                bit = buffer.end();
+        }
+
+        // Otherwise, decide whether the scan will still reach the mate. A mate at the scan position may have been
+        // read already without being buffered, it is left to the fix-up pass.
+        if (bit != buffer.end())
+            _captureMate(*lookBack, *bit);
+        else if (key.i1 > view.rID || (key.i1 == view.rID && key.i2 > view.beginPos))
+            lookBack->pending[key] = value;
+        else if (key.i1 >= 0)
+            lookBack->leftovers[key] = value;
+    }
+
+    if (buffer.size() < lookBack->maxRecords && _isLookBackCandidate(*lookBack, view))
+    {
+        if (!decoded)
+            decodeRecord(record, view);
+        buffer.push_back(original);
+    }
+}
+
+// --------------------------------------------------------------------------
+// Function writeCapturedMates()
+// --------------------------------------------------------------------------
+
+// Fetches the leftover mates in an indexed fix-up pass and writes them together with the mates captured in the
+// single pass, in the same order as findOtherReads(). Returns the number of leftover mates found or -1 on error.
+template<typename TOtherMap>
+int
+writeCapturedMates(BamFileOut & matesStream,
+        MateLookBack & lookBack,
+        TOtherMap const & otherReads,
+        CharString const & mappingBam,
+        unsigned threads)
+{
+    String<String<BamAlignmentRecord> > mates;
+    int found = 0;
+    if (!lookBack.leftovers.empty())
+        found = collectOtherReads(mates, lookBack.leftovers, otherReads, mappingBam, threads);
+    if (found == -1) return -1;
+
+    String<BamAlignmentRecord> & captured = lookBack.captured;
+    unsigned numKept = 0;
+    for (unsigned i = 0; i < length(captured); ++i)
+    {
+        // Drop mates whose entry was replaced by a later low quality mapping read with its mate at the same position.
+        typename TOtherMap::const_iterator it = otherReads.find(typename TOtherMap::key_type(captured[i].rID, captured[i].beginPos));
+        if (it == otherReads.end() || it->second.i1 != captured[i].qName)
+            continue;
+
+        // Check if both ends are low-quality mapped and, hence, are already in fastq files.
+        if (otherReads.count(typename TOtherMap::key_type(captured[i].rNextId, captured[i].pNext)) != 0)
+            continue;
+
+        setMateUnmapped(captured[i]);
+        if (numKept != i)
+            std::swap(captured[numKept], captured[i]);
+        ++numKept;
+    }
+    resize(captured, numKept);
+
+    for (unsigned r = 0; r < length(mates); ++r)
+        append(captured, mates[r]);
+    std::stable_sort(begin(captured, Standard()), end(captured, Standard()), _lessRefPos);
+
+    for (unsigned i = 0; i < length(captured); ++i)
+    {
+        // A mate is written once, even if it was requested repeatedly.
+        if (i > 0 && !_lessRefPos(captured[i - 1], captured[i]) && captured[i - 1].qName == captured[i].qName)
+            continue;
+        writeRecord(matesStream, captured[i]);
+    }
+
+    return found;
+}
+
+// --------------------------------------------------------------------------
+// Function isCoordinateSorted()
+// --------------------------------------------------------------------------
+
+inline bool
+isCoordinateSorted(BamHeader const & header)
+{
+    for (unsigned i = 0; i < length(header); ++i)
+    {
+        if (header[i].type != BamHeaderRecordType::BAM_HEADER_FIRST)
+            continue;
+
+        for (unsigned j = 0; j < length(header[i].tags); ++j)
+            if (header[i].tags[j].i1 == "SO")
+                return header[i].tags[j].i2 == "coordinate";
+    }
+    return false;
+}
+
+// --------------------------------------------------------------------------
+// Struct CropBatch
+// --------------------------------------------------------------------------
+
+// A batch of consecutive records passed through the stages of the crop_unmapped() pipeline.
+struct CropBatch
+{
+    unsigned long id;
+    String<BamRecordView> views;
+    String<BamAlignmentRecord> records;     // Decoded by the filter stage, unless skipped.
+    String<BamAlignmentRecord> untrimmed;   // Copies of trimmed records in single-pass mode.
+    String<CropAction> actions;
+    unsigned long alignedBaseCount;
+
+    CropBatch() : id(0), alignedBaseCount(0) {}
+};
+
+typedef ConcurrentQueue<CropBatch *, Suspendable<Limit> > TCropQueue;
+
+// --------------------------------------------------------------------------
+// Function readCropBatches()
+// --------------------------------------------------------------------------
+
+// Reader stage: reads batches of undecoded records from the input file into free batches. Returns false on a
+// read error.
+inline bool
+readCropBatches(TCropQueue & readQueue, TCropQueue & freeQueue, BamFileIn & inStream, unsigned batchSize)
+{
+    bool ok = true;
+    unsigned long id = 0;
+
+    try
+    {
+        CropBatch * batch;
+        while (!atEnd(inStream) && popFront(batch, freeQueue))
+        {
+            batch->id = id++;
+            batch->alignedBaseCount = 0;
+            resize(batch->views, batchSize);
+
+            unsigned i = 0;
+            for (; i < batchSize && !atEnd(inStream); ++i)
+                readRecord(batch->views[i], inStream);
+            resize(batch->views, i);
+
+            appendValue(readQueue, batch);
+        }
+    }
+    catch (Exception const & e)
+    {
+        std::cerr << "ERROR: " << e.what() << std::endl;
+        ok = false;
+    }
+
+    unlockReading(freeQueue);
+    unlockWriting(readQueue);
+    return ok;
+}
+
+// --------------------------------------------------------------------------
+// Function filterCropBatches()
+// --------------------------------------------------------------------------
+
+// Filter stage: classifies the records of batches and decodes and trims those that are not skipped.
+template<typename TAdapterTag>
+inline void
+filterCropBatches(TCropQueue & readQueue,
+        TCropQueue & writeQueue,
+        int humanSeqs,
+        TAdapterTag tag,
+        float as_factor,
+        bool qualityFilter,
+        bool keepUntrimmed)
+{
+    CropBatch * batch;
+    while (popFront(batch, readQueue))
+    {
+        resize(batch->actions, length(batch->views));
+        resize(batch->records, length(batch->views));
+        if (keepUntrimmed)
+            resize(batch->untrimmed, length(batch->views));
+        for (unsigned i = 0; i < length(batch->views); ++i)
+            batch->actions[i] = filterRecord(batch->records[i], batch->views[i], batch->alignedBaseCount, humanSeqs, tag,
+                                             as_factor, qualityFilter, keepUntrimmed ? &batch->untrimmed[i] : NULL);
+
+        appendValue(writeQueue, batch);
+    }
+
+    unlockReading(readQueue);
+    unlockWriting(writeQueue);
+}
+
+// --------------------------------------------------------------------------
+// Struct CropRegion
+// --------------------------------------------------------------------------
+
+// A region of the input bam file cropped independently. The records beginning in [beginPos, endPos) on the
+// reference sequence rID belong to the region, rID -1 stands for the unplaced unmapped reads at the end.
+struct CropRegion
+{
+    __int32 rID;
+    __int32 beginPos;
+    __int32 endPos;
+
+    CropRegion(__int32 rID_, __int32 beginPos_, __int32 endPos_) :
+        rID(rID_), beginPos(beginPos_), endPos(endPos_)
+    {}
+};
+
+// What a region worker leaves for the merge, besides its shard files.
+struct CropRegionResult
+{
+    typedef std::pair<Pair<__int32>, Pair<CharString, bool> > TRegistration;
+
+    unsigned long alignedBaseCount;
+    std::vector<TRegistration> registrations;   // Reads to crop in a second pass, in input order.
+    bool ok;
+
+    CropRegionResult() : alignedBaseCount(0), ok(false) {}
+};
+
+// --------------------------------------------------------------------------
+// Function getCropRegions()
+// --------------------------------------------------------------------------
+
+// Splits the reference sequences into regions aligned to the 16 kb windows of the bam index, about eight per
+// thread, followed by the region of unplaced unmapped reads.
+template<typename TLengths>
+inline void
+getCropRegions(std::vector<CropRegion> & regions, TLengths const & refLengths, unsigned threads)
+{
+    const unsigned long window = 1 << 14;
+
+    unsigned long genomeLength = 0;
+    for (unsigned i = 0; i < length(refLengths); ++i)
+        genomeLength += refLengths[i];
+
+    unsigned long regionSize = std::max(1ul << 20, genomeLength / (8 * threads));
+    regionSize = (regionSize + window - 1) / window * window;
+
+    regions.clear();
+    for (unsigned i = 0; i < length(refLengths); ++i)
+    {
+        unsigned long refLength = refLengths[i];
+        for (unsigned long pos = 0; pos < refLength; pos += regionSize)
+        {
+            __int32 endPos = pos + regionSize < refLength ? pos + regionSize : maxValue<__int32>();
+            regions.push_back(CropRegion(i, pos, endPos));
+        }
+    }
+    regions.push_back(CropRegion(-1, minValue<__int32>(), maxValue<__int32>()));
+}
+
+// --------------------------------------------------------------------------
+// Function _cropRegionFileName()
+// --------------------------------------------------------------------------
+
+inline std::string
+_cropRegionFileName(CharString const & fileName, unsigned region, char const * extension)
+{
+    std::ostringstream name;
+    name << fileName << ".region" << region << extension;
+    return name.str();
+}
+
+// --------------------------------------------------------------------------
+// Function _cropRegion()
+// --------------------------------------------------------------------------
+
+// Crops the records of one region into shard files next to the output files. Reads paired within the region go
+// to the fastq shards, the mapped mates of unmapped reads to the mates shard and reads still waiting for their
+// mate to a file of leftovers that is paired across regions by mergeCropRegion().
+template<typename TAdapterTag>
+inline void
+_cropRegion(CropRegionResult & result,
+        unsigned r,
+        CropRegion const & region,
+        BamFileIn & inStream,
+        BamHeader const & header,
+        BamIndex<Bai> const & bamIndex,
+        CharString const & mappingBam,
+        Triple<CharString> const & fastqFiles,
+        CharString const & matesBam,
+        int humanSeqs,
+        TAdapterTag tag,
+        float as_factor,
+        bool qualityFilter)
+{
+    typedef typename CropRegionResult::TRegistration TRegistration;
+
+    bool hasAligns = false;
+    if (region.rID >= 0)
+    {
+        jumpToRegion(inStream, hasAligns, region.rID, region.beginPos, region.endPos, bamIndex);
+    }
+    else if (!jumpToOrphans(inStream, hasAligns, bamIndex))
+    {
+        // The index has no placed reads at all, read the whole file.
+        BamHeader fileHeader;
+        close(inStream);
+        if (open(inStream, toCString(mappingBam)))
+        {
+            readHeader(fileHeader, inStream);
+            hasAligns = true;
+        }
+    }
+
+    SeqFileOut fastqFirstStream(_cropRegionFileName(fastqFiles.i1, r, ".fastq").c_str());
+    SeqFileOut fastqSecondStream(_cropRegionFileName(fastqFiles.i2, r, ".fastq").c_str());
+    BamFileOut matesStream(context(inStream), _cropRegionFileName(matesBam, r, ".bam").c_str());
+    writeHeader(matesStream, header);
+
+    ReadPairing pairing;
+    BamRecordView view;
+    BamAlignmentRecord record;
+    while (hasAligns && !atEnd(inStream))
+    {
+        readRecord(view, inStream);
+        if (view.rID != region.rID || view.beginPos >= region.endPos)
+            break;
+        if (view.beginPos < region.beginPos)
+            continue;
+
+        CropAction action = filterRecord(record, view, result.alignedBaseCount, humanSeqs, tag, as_factor, qualityFilter);
+        if (action == CROP_UNMAPPED)
+        {
+            appendFastqRecord(fastqFirstStream, fastqSecondStream, pairing, record);
+        }
+        else if (action == CROP_LOW_QUALITY)
+        {
+            if (appendFastqRecord(fastqFirstStream, fastqSecondStream, pairing, record) == 0)
+                result.registrations.push_back(TRegistration(Pair<__int32>(record.rNextId, record.pNext),
+                                                             Pair<CharString, bool>(record.qName, hasFlagFirst(record))));
+        }
+        else if (action == CROP_MATE)
+        {
+            writeRecord(matesStream, record);
+        }
+    }
+
+    result.ok = exportReads(pairing, _cropRegionFileName(fastqFiles.i3, r, ".reads")) == 0;
+}
+
+// --------------------------------------------------------------------------
+// Function cropRegions()
+// --------------------------------------------------------------------------
+
+// Crops the regions on several threads, each with its own bam stream, bam index and adapter indices.
+template<typename TAdapterTag>
+inline bool
+cropRegions(std::vector<CropRegionResult> & results,
+        std::vector<CropRegion> const & regions,
+        CharString const & mappingBam,
+        Triple<CharString> const & fastqFiles,
+        CharString const & matesBam,
+        int humanSeqs,
+        TAdapterTag tag,
+        float as_factor,
+        bool qualityFilter,
+        unsigned threads)
+{
+    CharString baiFile = mappingBam;
+    baiFile += ".bai";
+
+    results.clear();
+    results.resize(regions.size());
+    std::atomic<unsigned> nextRegion(0);
+    std::atomic<bool> failed(false);
+
+    auto worker = [&]()
+    {
+        // Open input file and load bam index.
+        BamFileIn inStream;
+        BamHeader header;
+        BamIndex<Bai> bamIndex;
+        if (!open(inStream, toCString(mappingBam)))
+        {
+            std::cerr << "ERROR: Could not open " << mappingBam << std::endl;
+            failed = true;
+            return;
+        }
+        readHeader(header, inStream);
+        if (!open(bamIndex, toCString(baiFile)))
+        {
+            std::cerr << "ERROR: Could not read BAI index file " << baiFile << std::endl;
+            failed = true;
+            return;
+        }
+
+        for (unsigned r = nextRegion++; r < regions.size() && !failed; r = nextRegion++)
+        {
+            try
+            {
+                _cropRegion(results[r], r, regions[r], inStream, header, bamIndex, mappingBam, fastqFiles, matesBam,
+                            humanSeqs, tag, as_factor, qualityFilter);
+            }
+            catch (std::exception const & e)
+            {
+                std::cerr << "ERROR: " << e.what() << std::endl;
+            }
+            if (!results[r].ok)
+                failed = true;
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned t = 1; t < std::min(threads, (unsigned)regions.size()); ++t)
+        workers.push_back(std::thread(worker));
+    worker();
+    for (unsigned t = 0; t < workers.size(); ++t)
+        workers[t].join();
+
+    return !failed;
+}
+
+// --------------------------------------------------------------------------
+// Function mergeCropRegion()
+// --------------------------------------------------------------------------
+
+// Appends the shards of a region to the output files and removes them. Its leftover reads are paired with those
+// of the previous regions. Reads that find their mate this way are not cropped in the second pass, exactly as if
+// the regions had been cropped one after another. Must be called in the order of the regions.
+template<typename TOtherMap>
+inline int
+mergeCropRegion(SeqFileOut & fastqFirstStream,
+        SeqFileOut & fastqSecondStream,
+        BamFileOut & matesStream,
+        ReadPairing & pairing,
+        TOtherMap & otherReads,
+        CropRegionResult const & result,
+        unsigned r,
+        Triple<CharString> const & fastqFiles,
+        CharString const & matesBam)
+{
+    std::string firstShard = _cropRegionFileName(fastqFiles.i1, r, ".fastq");
+    std::string secondShard = _cropRegionFileName(fastqFiles.i2, r, ".fastq");
+    std::string matesShard = _cropRegionFileName(matesBam, r, ".bam");
+    std::string leftoverShard = _cropRegionFileName(fastqFiles.i3, r, ".reads");
+
+    try
+    {
+        // Copy the reads paired within the region.
+        CharString id, seq, qual;
+        SeqFileIn firstStream(firstShard.c_str());
+        while (!atEnd(firstStream))
+        {
+            readRecord(id, seq, qual, firstStream);
+            writeRecord(fastqFirstStream, id, seq, qual);
+        }
+        SeqFileIn secondStream(secondShard.c_str());
+        while (!atEnd(secondStream))
+        {
+            readRecord(id, seq, qual, secondStream);
+            writeRecord(fastqSecondStream, id, seq, qual);
+        }
+
+        // Copy the mapped mates of unmapped reads.
+        BamFileIn inStream(matesShard.c_str());
+        BamHeader header;
+        BamAlignmentRecord record;
+        readHeader(header, inStream);
+        while (!atEnd(inStream))
+        {
+            readRecord(record, inStream);
+            writeRecord(matesStream, record);
+        }
+    }
+    catch (std::exception const & e)
+    {
+        std::cerr << "ERROR: " << e.what() << std::endl;
+        return 1;
+    }
+
+    // Pair the leftover reads across regions.
+    std::vector<std::pair<std::string, bool> > pairedEnds;
+    if (importReads(fastqFirstStream, fastqSecondStream, pairing, leftoverShard, pairedEnds) != 0)
+        return 1;
+    std::sort(pairedEnds.begin(), pairedEnds.end());
+
+    for (unsigned i = 0; i < result.registrations.size(); ++i)
+    {
+        Pair<CharString, bool> const & read = result.registrations[i].second;
+        if (!std::binary_search(pairedEnds.begin(), pairedEnds.end(), std::make_pair(std::string(toCString(read.i1)), read.i2)))
+            otherReads[result.registrations[i].first] = read;
+    }
+
+    std::remove(firstShard.c_str());
+    std::remove(secondShard.c_str());
+    std::remove(matesShard.c_str());
+    std::remove(leftoverShard.c_str());
+
+    return 0;
+}
+
+// --------------------------------------------------------------------------
+// Function _coordinateKey()
+// --------------------------------------------------------------------------
+
+// The order of 'samtools sort': reference, position, and strand. Records without reference come last.
+inline uint64_t
+_coordinateKey(BamRecordView const & view)
+{
+    return coordinateSortKey(view.rID, view.beginPos, hasFlagRC(view));
+}
+
+// --------------------------------------------------------------------------
+// Function _cropNameGroup()
+// --------------------------------------------------------------------------
+
+// Crops the records of one read name. They are filtered in coordinate order, such that the reads go into the
+// fastq files and the mates as in the two passes of crop_unmapped() on the coordinate-sorted file. The other
+// read ends of low quality mapping reads are taken from the group itself. Returns the number of them found.
+template<typename TAdapterTag>
+int
+_cropNameGroup(String<BamAlignmentRecord> & mates,
+        String<BamRecordView> const & views,
+        unsigned numViews,
+        std::vector<unsigned> & order,
+        SeqFileOut & fastqFirstStream,
+        SeqFileOut & fastqSecondStream,
+        ReadPairing & pairing,
+        int humanSeqs,
+        TAdapterTag tag,
+        float as_factor,
+        bool qualityFilter)
+{
+    typedef std::map<Pair<__int32>, Pair<CharString, bool> > TOtherMap;
+    typedef TOtherMap::key_type TKey;
+
+    order.resize(numViews);
+    for (unsigned i = 0; i < numViews; ++i)
+        order[i] = i;
+    if (numViews > 1)
+        std::stable_sort(order.begin(), order.end(), [&](unsigned a, unsigned b) {
+            return _coordinateKey(views[a]) < _coordinateKey(views[b]);
+        });
+
+    TOtherMap otherReads;
+    BamAlignmentRecord record;
+    unsigned long alignedBaseCount = 0;
+    for (unsigned i = 0; i < numViews; ++i)
+    {
+        CropAction action = filterRecord(record, views[order[i]], alignedBaseCount, humanSeqs, tag, as_factor, qualityFilter);
+        writeCroppedRecord(action, record, fastqFirstStream, fastqSecondStream, mates, pairing, otherReads);
+    }
+
+    int found = 0;
+    for (TOtherMap::const_iterator it = otherReads.begin(); it != otherReads.end(); ++it)
+    {
+        if (it->first.i1 < 0)
+            continue;
+
+        // The first record at the position, as the indexed lookup finds it.
+        for (unsigned i = 0; i < numViews; ++i)
+        {
+            BamRecordView const & view = views[order[i]];
+            if (view.rID != it->first.i1 || view.beginPos != it->first.i2)
+                continue;
+
+            // Check if both ends are low-quality mapped and, hence, are already in fastq files.
+            if (otherReads.count(TKey(view.rNextId, view.pNext)) == 0)
+            {
+                decodeRecord(record, view);
+                setMateUnmapped(record);
+                appendValue(mates, record);
+            }
+            ++found;
+            break;
+        }
+    }
+
+    return found;
+}
+
+// --------------------------------------------------------------------------
+// Function cropNameGroups()
+// --------------------------------------------------------------------------
+
+// Crops the unmapped and low quality mapping reads from a file whose records are grouped by read name, e.g. the
+// output of bwa, without sorting or indexing it. The mates are collected in the order of the input file and the
+// remaining reads are left in the pairing for writeFastq(). Returns the number of other read ends of low quality
+// mapping reads found, see findOtherReads().
+template<typename TAdapterTag>
+int
+cropNameGroups(String<BamAlignmentRecord> & mates,
+        BamFileIn & inStream,
+        SeqFileOut & fastqFirstStream,
+        SeqFileOut & fastqSecondStream,
+        ReadPairing & pairing,
+        int humanSeqs,
+        TAdapterTag tag,
+        float as_factor,
+        bool qualityFilter)
+{
+    String<BamRecordView> views;
+    std::vector<unsigned> order;
+    unsigned numViews = 0;
+    int found = 0;
+
+    while (!atEnd(inStream))
+    {
+        if (numViews == length(views))
+            resize(views, numViews + 1);
+        readRecord(views[numViews], inStream);
+
+        // A new read name closes the group, its first record starts the next one.
+        if (numViews > 0 && getQName(views[numViews]) != getQName(views[0]))
+        {
+            found += _cropNameGroup(mates, views, numViews, order, fastqFirstStream, fastqSecondStream, pairing,
+                                    humanSeqs, tag, as_factor, qualityFilter);
+            std::swap(views[0], views[numViews]);
+            numViews = 0;
+        }
+        ++numViews;
+    }
+    if (numViews > 0)
+        found += _cropNameGroup(mates, views, numViews, order, fastqFirstStream, fastqSecondStream, pairing,
+                                humanSeqs, tag, as_factor, qualityFilter);
+
+    return found;
+}
+
+// --------------------------------------------------------------------------
+// Function writeNameSortedMates()
+// --------------------------------------------------------------------------
+
+// Writes the mates in the order of 'samtools sort -n': by read name, then first before second read end.
+inline void
+writeNameSortedMates(BamFileOut & matesStream, String<BamAlignmentRecord> & mates)
+{
+    std::vector<unsigned> order(length(mates));
+    for (unsigned i = 0; i < length(mates); ++i)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](unsigned a, unsigned b) {
+        int cmp = compare_qName(mates[a].qName, mates[b].qName);
+        return cmp < 0 || (cmp == 0 && (mates[a].flag & 0xc0) < (mates[b].flag & 0xc0));
+    });
+
+    for (unsigned i = 0; i < order.size(); ++i)
+        writeRecord(matesStream, mates[order[i]]);
+}
+
+// ==========================================================================
+// Function crop_unmapped()
+// ==========================================================================
+
+template<typename TAdapterTag>
+int
+crop_unmapped(double & avgCov,
+        Triple<CharString> & fastqFiles,
+        CharString & matesBam,
+        CharString const & mappingBam,
+        int humanSeqs,
+        TAdapterTag tag,
+        float as_factor,
+        unsigned threads = 1,
+        unsigned maxMemory = 0,
+        bool singlePass = false,
+        bool splitRegions = false,
+        bool compressFastq = false,
+        bool qualityFilter = false)
+{
+    typedef __int32 TPos;
+    typedef std::map<Pair<TPos>, Pair<CharString, bool> > TOtherMap; // Reads to crop in a second pass of the input file.
+
+    // Open the input and output bam files.
+    BamFileIn inStream(toCString(mappingBam));
+    BamFileOut matesStream(context(inStream), toCString(matesBam));
+
+    // Copy the header.
+    BamHeader header;
+    readHeader(header, inStream);
+    writeHeader(matesStream, header);
+
+    unsigned long genomeLength = 0;
+    for (unsigned i = 0; i < length(header); ++i)
+    {
+        if (header[i].type != BamHeaderRecordType::BAM_HEADER_REFERENCE)
+            continue;
+
+        for (unsigned j = 0; j < length(header[i].tags); ++j)
+        {
+            if (header[i].tags[j].i1 != "LN")
+                continue;
+
+            genomeLength += lexicalCast<unsigned>(header[i].tags[j].i2);
+            break;
+        }
+    }
+
+    // Create tables for fastq records waiting for their mate (memory limit in MB) and bam records without mate.
+    ReadPairing pairing((uint64_t)maxMemory << 20, toCString(fastqFiles.i3));
+    TOtherMap otherReads;
+
+    // Splitting into regions needs the bam index.
+    CharString baiFile = mappingBam;
+    baiFile += ".bai";
+    if (splitRegions && !std::ifstream(toCString(baiFile)).good())
+    {
+        std::cerr << "WARNING: No BAI index file \'" << baiFile << "\'. Cropping without splitting into regions." << std::endl;
+        splitRegions = false;
+    }
+
+    // The single-pass mode relies on the coordinate order to know which mates the scan will still reach.
+    MateLookBack lookBackStore(humanSeqs);
+    MateLookBack * lookBack = NULL;
+    if (singlePass && splitRegions)
+    {
+        std::cerr << "WARNING: Regions are cropped in two passes, ignoring the single-pass mode." << std::endl;
+    }
+    else if (singlePass)
+    {
+        if (isCoordinateSorted(header))
+            lookBack = &lookBackStore;
+        else
+            std::cerr << "WARNING: \'" << mappingBam << "\' is not coordinate-sorted. Cropping in two passes." << std::endl;
+    }
+
+    // Open the output fastq files, block-gzip compressed by a pool of threads each if requested.
+    unsigned compressionThreads = compressFastq ? std::max(threads, 1u) : 0;
+    FastqFileOut fastqFirstStream(toCString(fastqFiles.i1), compressionThreads);
+    FastqFileOut fastqSecondStream(toCString(fastqFiles.i2), compressionThreads);
+    FastqFileOut fastqSingleStream(toCString(fastqFiles.i3), compressionThreads);
+
+    unsigned long alignedBaseCount = 0;
+
+    if (splitRegions)
+    {
+        // Regions are cropped independently, then their shards are merged in order.
+        std::vector<CropRegion> regions;
+        std::vector<CropRegionResult> results;
+        getCropRegions(regions, contigLengths(context(inStream)), threads);
+        if (!cropRegions(results, regions, mappingBam, fastqFiles, matesBam, humanSeqs, tag, as_factor, qualityFilter, threads))
+            return 1;
+
+        for (unsigned r = 0; r < regions.size(); ++r)
+        {
+            if (mergeCropRegion(fastqFirstStream, fastqSecondStream, matesStream, pairing, otherReads, results[r], r, fastqFiles, matesBam) != 0)
+                return 1;
+            alignedBaseCount += results[r].alignedBaseCount;
+        }
+    }
+    else if (threads <= 1)
+    {
+        // Iterate over the input file.
+        BamRecordView view;
+        BamAlignmentRecord record;
+        BamAlignmentRecord untrimmed;
+        while (!atEnd(inStream))
+        {
+            // Read the next read from input file.
+            readRecord(view, inStream);
+
+            CropAction action = filterRecord(record, view, alignedBaseCount, humanSeqs, tag, as_factor, qualityFilter,
+                                             lookBack != NULL ? &untrimmed : NULL);
+            cropRecord(action, view, record, untrimmed, fastqFirstStream, fastqSecondStream, matesStream, pairing, otherReads, lookBack);
+        }
+    }
+    else
+    {
+        // Pipeline: one reader thread, (threads - 1) filter threads and this thread writing the batches in input order.
+        // BGZF blocks are already inflated in parallel by the bam stream itself. A fixed pool of batches is passed
+        // around, which bounds the memory and the number of batches waiting for their turn to be written.
+        unsigned filterThreads = threads - 1;
+        unsigned numBatches = 4 * filterThreads;
+        TCropQueue freeQueue(numBatches);
+        TCropQueue readQueue(numBatches);
+        TCropQueue writeQueue(numBatches);
+        setReaderWriterCount(freeQueue, 1, 1);
+        setReaderWriterCount(readQueue, filterThreads, 1);
+        setReaderWriterCount(writeQueue, 1, filterThreads);
+        for (unsigned i = 0; i < numBatches; ++i)
+            appendValue(freeQueue, new CropBatch());
+
+        bool readOk = true;
+        std::thread reader([&]() { readOk = readCropBatches(readQueue, freeQueue, inStream, 4096); });
+        std::vector<std::thread> filters;
+        for (unsigned t = 0; t < filterThreads; ++t)
+            filters.push_back(std::thread([&]() { filterCropBatches(readQueue, writeQueue, humanSeqs, tag, as_factor, qualityFilter, lookBack != NULL); }));
+
+        // Batches arrive out of order from the filter threads.
+        std::map<unsigned long, CropBatch *> pending;
+        unsigned long nextId = 0;
+        CropBatch * batch;
+        while (popFront(batch, writeQueue))
+        {
+            pending[batch->id] = batch;
+
+            std::map<unsigned long, CropBatch *>::iterator it;
+            while ((it = pending.find(nextId)) != pending.end())
+            {
+                batch = it->second;
+                for (unsigned i = 0; i < length(batch->views); ++i)
+                    cropRecord(batch->actions[i], batch->views[i], batch->records[i], lookBack != NULL ? batch->untrimmed[i] : batch->records[i], fastqFirstStream, fastqSecondStream, matesStream, pairing, otherReads, lookBack);
+                alignedBaseCount += batch->alignedBaseCount;
+
+                pending.erase(it);
+                appendValue(freeQueue, batch);
+                ++nextId;
+            }
+        }
+        unlockReading(writeQueue);
+
+        reader.join();
+        for (unsigned t = 0; t < filterThreads; ++t)
+            filters[t].join();
+
+        unlockWriting(freeQueue);
+        while (popFront(batch, freeQueue))
+            delete batch;
+
+        if (!readOk)
+            return 1;
+    }
+    close(inStream);
+
+    avgCov = (double)alignedBaseCount / (double)genomeLength;
 
     std::ostringstream msg;
     msg << "Map of low quality mates has " << otherReads.size() << " records.";
     printStatus(msg);
 
     // Write the remaining fastq records.
-    if (writeFastq(fastqFirstStream, fastqSecondStream, fastqSingleStream, firstReads, secondReads) != 0) return 1;
-    firstReads.clear();
-    secondReads.clear();
+    if (writeFastq(fastqFirstStream, fastqSecondStream, fastqSingleStream, pairing) != 0) return 1;
 
     msg.str("");
     msg << "Unmapped reads written to " << fastqFiles.i1 << ", " << fastqFiles.i2 << ", " << fastqFiles.i3;
     printStatus(msg);
 
     // Find the other read end of the low quality mapping reads and write them to the output bam file.
-    int found = findOtherReads(matesStream, otherReads, mappingBam);
-    if (found == -1) return 1;
+    if (lookBack == NULL)
+    {
+        int found = findOtherReads(matesStream, otherReads, mappingBam, threads);
+        if (found == -1) return 1;
 
-    msg.str("");
-    msg << "Mapped mates of unmapped reads written to " << matesBam << " , " << found << " found in second pass.";
-    printStatus(msg);
+        msg.str("");
+        msg << "Mapped mates of unmapped reads written to " << matesBam << " , " << found << " found in second pass.";
+        printStatus(msg);
+    }
+    else
+    {
+        // Mates never reached by the scan are not in the input file, only the leftovers need the fix-up pass.
+        int found = writeCapturedMates(matesStream, *lookBack, otherReads, mappingBam, threads);
+        if (found == -1) return 1;
+
+        msg.str("");
+        msg << "Mapped mates of unmapped reads written to " << matesBam << " , " << lookBack->found << " found in single pass, "
+            << found << " of " << lookBack->leftovers.size() << " left over found in fix-up pass.";
+        printStatus(msg);
+    }
 
     return 0;
 }
@@ -478,10 +1596,16 @@ crop_unmapped(Triple<CharString> & fastqFiles,
         CharString const & mappingBam,
         int humanSeqs,
         TAdapterTag tag,
-        float as_factor)
+        float as_factor,
+        unsigned threads = 1,
+        unsigned maxMemory = 0,
+        bool singlePass = false,
+        bool splitRegions = false,
+        bool compressFastq = false,
+        bool qualityFilter = false)
 {
     double cov;
-    return crop_unmapped(cov, fastqFiles, matesBam, mappingBam, humanSeqs, tag, as_factor);
+    return crop_unmapped(cov, fastqFiles, matesBam, mappingBam, humanSeqs, tag, as_factor, threads, maxMemory, singlePass, splitRegions, compressFastq, qualityFilter);
 }
 
 #endif // #ifndef NOVINS_CROP_UNMAPPED_H_
@@ -10,6 +10,8 @@
 #include <seqan/stream.h>
 #include <seqan/bam_io.h>
 
+#include "bam_record_view.h"
+
 using namespace seqan;
 
 // ==========================================================================
@@ -441,7 +443,7 @@ isGoodQuality(BamAlignmentRecord & record, Pair<CigarElement<>::TCount> & interv
 unsigned
 distanceToContigEnd(BamAlignmentRecord & record,
         Pair<CigarElement<>::TCount> & interval,
-        BamFileIn & infile)
+        unsigned contigLength)
 {
     if (hasFlagRC(record))
     {
@@ -450,10 +452,18 @@ distanceToContigEnd(BamAlignmentRecord & record,
     else
     {
         unsigned endPos = record.beginPos + interval.i2 - interval.i1;
-        return getContigLength(record, infile) - endPos;
+        return contigLength - endPos;
     }
 }
 
+unsigned
+distanceToContigEnd(BamAlignmentRecord & record,
+        Pair<CigarElement<>::TCount> & interval,
+        BamFileIn & infile)
+{
+    return distanceToContigEnd(record, interval, getContigLength(record, infile));
+}
+
 // ==========================================================================
 
 inline bool
@@ -462,21 +472,29 @@ readAnchoringRecord(AnchoringRecord & record,
         BamFileIn & stream,
         unsigned nonContigSeqs)
 {
+    BamRecordView view;
     BamAlignmentRecord r;
+    String<CigarElement<> > cigar;
     while (!atEnd(stream))
     {
-        readRecord(r, stream);
+        // Most records fail the checks on the undecoded record.
+        readRecord(view, stream);
 
-        if (r.rID == r.rNextId || r.rNextId == -1 || r.rID == -1)
+        if (view.rID == view.rNextId || view.rNextId == -1 || view.rID == -1)
             continue;
 
-        Pair<CigarElement<>::TCount> interval = mappedInterval(r.cigar);
-        if (!isGoodQuality(r, interval))
+        bool isContig = ( view.rID >= static_cast<int32_t>(nonContigSeqs) ) ? true : false;
+
+        if (!isContig && view.mapQ < 20)
             continue;
 
-        bool isContig = ( r.rID >= static_cast<int32_t>(nonContigSeqs) ) ? true : false;
+        decodeCigar(cigar, view);
+        Pair<CigarElement<>::TCount> interval = mappedInterval(cigar);
+        if (interval.i2 - interval.i1 < 50 || interval.i2 - interval.i1 < getSeqLength(view) / 2)
+            continue;
 
-        if (!isContig && r.mapQ < 20)
+        decodeRecord(r, view);
+        if (!isGoodQuality(r, interval))
             continue;
 
         if (isContig && distanceToContigEnd(r, interval, stream) > 500)
@@ -516,6 +534,170 @@ readAnchoringRecord(AnchoringRecord & record,
     return 1;
 }
 
+// ==========================================================================
+// struct AnchoringCandidate
+// ==========================================================================
+
+// A record that passes the checks of readAnchoringRecord(), reduced to what is needed to pair it with its mate.
+struct AnchoringCandidate
+{
+    typedef Position<CharString>::Type TPos;
+
+    int32_t rID;
+    TPos beginPos;
+    TPos endPos;
+    bool rc;
+
+    int32_t rNextId;
+    TPos pNext;
+    bool nextRC;
+};
+
+struct AnchoringCandidateLess : public std::binary_function<AnchoringCandidate, AnchoringCandidate, bool>
+{
+    AnchoringCandidateLess() {}
+
+    // The order of records in the coordinate-sorted bam file.
+    inline bool operator() (AnchoringCandidate const & a, AnchoringCandidate const & b) const
+    {
+        if (a.rID != b.rID) return a.rID < b.rID;
+        if (a.beginPos != b.beginPos) return a.beginPos < b.beginPos;
+        return !a.rc && b.rc;
+    }
+};
+
+// ==========================================================================
+// struct AnchorCollector
+// ==========================================================================
+
+/**
+ * Finds the anchoring records while the records of non_ref_new.bam are written, instead of reading the sorted
+ * file again. The records of a read name are written one after the other, such that only the candidates of the
+ * current read name need to be kept. They are paired as in readAnchoringRecord() once the next read name starts.
+ */
+struct AnchorCollector
+{
+    unsigned nonContigSeqs;
+    CharString qName;
+    String<AnchoringCandidate> group;       // candidates with read name qName
+    String<AnchoringRecord> anchors;
+
+    AnchorCollector() : nonContigSeqs(0)
+    {}
+};
+
+// --------------------------------------------------------------------------
+// Function _flushAnchors()
+// --------------------------------------------------------------------------
+
+// Pairs the candidates of one read name in the order of the sorted file: a candidate is an anchor if its
+// mate position was kept by an earlier candidate, otherwise its own position is kept.
+template <typename TContext>
+inline void
+_flushAnchors(AnchorCollector & collector, TContext & context)
+{
+    String<AnchoringCandidate> & group = collector.group;
+    if (length(group) > 1)
+    {
+        std::stable_sort(begin(group, Standard()), end(group, Standard()), AnchoringCandidateLess());
+
+        String<AnchoringCandidate> kept;
+        for (unsigned i = 0; i < length(group); ++i)
+        {
+            AnchoringCandidate const & c = group[i];
+
+            unsigned k = 0;
+            while (k < length(kept) && (kept[k].rID != c.rNextId || kept[k].beginPos != c.pNext))
+                ++k;
+
+            if (k == length(kept))
+            {
+                // Keep the position of the candidate, replacing a candidate kept at the same position.
+                unsigned j = 0;
+                while (j < length(kept) && (kept[j].rID != c.rID || kept[j].beginPos != c.beginPos))
+                    ++j;
+                if (j == length(kept))
+                    appendValue(kept, c);
+                else
+                    kept[j] = c;
+                continue;
+            }
+
+            AnchoringRecord record;
+            if (c.rID >= static_cast<int32_t>(collector.nonContigSeqs))
+            {
+                record.chr = contigNames(context)[c.rNextId];
+                record.chrStart = c.pNext;
+                record.chrEnd = kept[k].endPos;
+                record.chrOri = !c.nextRC;
+                record.contig = contigNames(context)[c.rID];
+                record.contigOri = !c.rc;
+            }
+            else
+            {
+                record.chr = contigNames(context)[c.rID];
+                record.chrStart = c.beginPos;
+                record.chrEnd = c.endPos;
+                record.chrOri = !c.rc;
+                record.contig = contigNames(context)[c.rNextId];
+                record.contigOri = !c.nextRC;
+            }
+            appendValue(collector.anchors, record);
+        }
+    }
+    clear(group);
+}
+
+// --------------------------------------------------------------------------
+// Function collectAnchors()
+// --------------------------------------------------------------------------
+
+// Keeps the record as a candidate if it passes the checks of readAnchoringRecord(). Records have to be given
+// grouped by read name.
+template <typename TContext>
+inline void
+collectAnchors(AnchorCollector & collector, BamAlignmentRecord & record, TContext & context)
+{
+    if (record.qName != collector.qName)
+    {
+        _flushAnchors(collector, context);
+        collector.qName = record.qName;
+    }
+
+    if (record.rID == record.rNextId || record.rNextId == -1 || record.rID == -1)
+        return;
+
+    bool isContig = record.rID >= static_cast<int32_t>(collector.nonContigSeqs);
+    if (!isContig && record.mapQ < 20)
+        return;
+
+    Pair<CigarElement<>::TCount> interval = mappedInterval(record.cigar);
+    if (!isGoodQuality(record, interval))
+        return;
+
+    if (isContig && distanceToContigEnd(record, interval, contigLengths(context)[record.rID]) > 500)
+        return;
+
+    AnchoringCandidate candidate;
+    candidate.rID = record.rID;
+    candidate.beginPos = record.beginPos;
+    candidate.endPos = record.beginPos + interval.i2 - interval.i1;
+    candidate.rc = hasFlagRC(record);
+    candidate.rNextId = record.rNextId;
+    candidate.pNext = record.pNext;
+    candidate.nextRC = hasFlagNextRC(record);
+    appendValue(collector.group, candidate);
+}
+
+// Pairs the candidates of the last read name.
+template <typename TContext>
+inline void
+finishAnchors(AnchorCollector & collector, TContext & context)
+{
+    _flushAnchors(collector, context);
+    clear(collector.qName);
+}
+
 // ==========================================================================
 
 void
@@ -553,36 +735,24 @@ listToLocs(String<Location> & locs, String<AnchoringRecord> & list, unsigned max
 }
 
 // ==========================================================================
-// Function findLocations()
+// Function anchorsToLocations()
 // ==========================================================================
 
-int
-findLocations(String<Location> & locations, CharString & nonRefFile, std::set<CharString> & chromosomes, unsigned nonContigSeqs, unsigned maxInsertSize)
+void
+anchorsToLocations(String<Location> & locations, String<AnchoringRecord> & anchors, std::set<CharString> & chromosomes, unsigned maxInsertSize)
 {
     typedef Pair<CharString, unsigned> TContigEnd;
     typedef std::map<TContigEnd, unsigned> TMap;
     typedef TMap::iterator TMapIter;
 
-    BamFileIn inStream(toCString(nonRefFile));
-
-std::cout << "nonContigSeqs=" << nonContigSeqs << std::endl;
-
-    // Read the header and clear it since we don't need it.
-    BamHeader header;
-    readHeader(header, inStream);
-    clear(header);
-
     String<String<AnchoringRecord> > lists;
     resize(lists, 4);
     TMap anchorsToOther;
 
     unsigned i = 0;
-    AnchoringRecord record;
-    std::map<Triple<CharString, CharString, unsigned>, unsigned> goodReads; // Triple(qName, chrom, beginPos) -> alignEndPos
-    while (!atEnd(inStream))
+    for (unsigned a = 0; a < length(anchors); ++a)
     {
-        if (readAnchoringRecord(record, goodReads, inStream, nonContigSeqs) == 1)
-            break;
+        AnchoringRecord & record = anchors[a];
 
         if (record.chrOri)
         {
@@ -619,6 +789,35 @@ std::cout << "nonContigSeqs=" << nonContigSeqs << std::endl;
     // Sort locations by contig, contigOri, chr, chrStart, chrOri.
     LocationTypeLess less;
     std::stable_sort(begin(locations, Standard()), end(locations, Standard()), less);
+}
+
+// ==========================================================================
+// Function findLocations()
+// ==========================================================================
+
+int
+findLocations(String<Location> & locations, CharString & nonRefFile, std::set<CharString> & chromosomes, unsigned nonContigSeqs, unsigned maxInsertSize)
+{
+    BamFileIn inStream(toCString(nonRefFile));
+
+std::cout << "nonContigSeqs=" << nonContigSeqs << std::endl;
+
+    // Read the header and clear it since we don't need it.
+    BamHeader header;
+    readHeader(header, inStream);
+    clear(header);
+
+    String<AnchoringRecord> anchors;
+    AnchoringRecord record;
+    std::map<Triple<CharString, CharString, unsigned>, unsigned> goodReads; // Triple(qName, chrom, beginPos) -> alignEndPos
+    while (!atEnd(inStream))
+    {
+        if (readAnchoringRecord(record, goodReads, inStream, nonContigSeqs) == 1)
+            break;
+        appendValue(anchors, record);
+    }
+
+    anchorsToLocations(locations, anchors, chromosomes, maxInsertSize);
     return 0;
 }
 
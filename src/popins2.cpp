@@ -3,6 +3,7 @@
 
 #include "argument_parsing.h"           /* seqAn argument parser */
 #include "popins2_crop_unmapped.h"
+#include "popins2_assemble.h"
 #include "popins2_remapping.h"
 #include "popins2_merge_and_set_mate.h"
 #include "popins2_merge.h"
@@ -10,6 +11,7 @@
 #include "popins_contigmap.h"
 #include "popins_place.h"
 #include "popins_genotype.h"
+#include "popins2_batch.h"
 
 
 using namespace std;
@@ -33,6 +35,7 @@ int main(int argc, char const *argv[]){
 
     const char * command = argv[1];
     if (strcmp(command,"crop-unmapped") == 0) ret = popins2_crop_unmapped(argc, argv);
+    else if (strcmp(command,"assemble") == 0) ret = popins2_assemble(argc, argv);
     else if (strcmp(command,"remapping") == 0) ret = popins2_remapping(argc, argv);
     else if (strcmp(command,"merge-set-mate") == 0) ret = popins2_merge_and_set_mate(argc, argv);
     else if (strcmp(command,"merge") == 0) ret = popins2_merge(argc, argv);
@@ -42,6 +45,7 @@ int main(int argc, char const *argv[]){
     else if (strcmp(command,"place-splitalign") == 0) ret = popins_place_splitalign(argc, argv);
     else if (strcmp(command,"place-finish") == 0) ret = popins_place_finish(argc, argv);
     else if (strcmp(command,"genotype") == 0) ret = popins_genotype(argc, argv);
+    else if (strcmp(command,"batch") == 0) ret = popins2_batch(argc, argv);
     else if (strcmp(command, "--help") == 0 || strcmp(command, "-h") == 0){
         printHelp(prog_name);
         return 1;
@@ -1,687 +1,211 @@
-#include <sstream>
-#include <cerrno>
+#ifndef POPINS2_ASSEMBLE_H_
+#define POPINS2_ASSEMBLE_H_
 
-#include <seqan/file.h>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <bifrost/CompactedDBG.hpp>         // CompactedDBG, CDBG_Build_opt
 #include <seqan/sequence.h>
 
 #include "util.h"
 #include "argument_parsing.h"
-#include "crop_unmapped.h"
-
-#ifndef POPINS_ASSEMBLE_H_
-#define POPINS_ASSEMBLE_H_
+#include "stage_manifest.h"
 
 using namespace seqan;
 
-// ==========================================================================
+/**
+ * The assemble command builds the contigs of a sample in-process with Bifrost, from the fastq files written by
+ * crop-unmapped or remapping. Like multik, it iterates over increasing k-mer sizes. The unitigs of one graph are
+ * added to the graph of the next k-mer size in memory, such that no sequence is written to disk but the contigs.
+ */
 
-inline void
-removeAssemblyDirectory(CharString & path)
-{
-    removeFile(path, "contigs.fa");
-    removeFile(path, "Graph2");
-    removeFile(path, "LastGraph");
-    removeFile(path, "Log");
-    removeFile(path, "PreGraph");
-    removeFile(path, "Roadmaps");
-    removeFile(path, "Sequences");
-    removeFile(path, "stats.txt");
-    remove(toCString(path));
-}
+// --------------------------------------------------------------------------
+// Function assemblyInputFiles()
+// --------------------------------------------------------------------------
 
-bool retrieveSampleID(CharString & sampleID, CharString & mappingBam)
+// Collects the fastq files of a sample that contain reads. Bifrost refuses empty input files, and a sample without
+// paired or without single reads is common.
+inline void
+assemblyInputFiles(std::vector<std::string> & files, Triple<CharString> const & fastqFiles)
 {
-    BamFileIn inStream(toCString(mappingBam));
-
-    BamHeader header;
-    readHeader(header, inStream);
-
-    for (unsigned i = 0; i < length(header); ++i)
+    CharString const * names[3] = {&fastqFiles.i1, &fastqFiles.i2, &fastqFiles.i3};
+    for (unsigned i = 0; i < 3; ++i)
     {
-        if (header[i].type != BamHeaderRecordType::BAM_HEADER_READ_GROUP)
-            continue;
-
-        for (unsigned j = 0; j < length(header[i].tags); ++j)
-        {
-            if (header[i].tags[j].i1 != "SM")
-                continue;
-
-            sampleID = header[i].tags[j].i2;
-            return 0;
-        }
+        std::ifstream stream(toCString(*names[i]), std::ios::binary | std::ios::ate);
+        if (stream.is_open() && stream.tellg() > 0)
+            files.push_back(toCString(*names[i]));
     }
-    std::cerr << "ERROR: Could not find sample ID in BAM file header." << std::endl;
-    return 1;
 }
 
-// ==========================================================================
-// Function remapping()
-// ==========================================================================
+// --------------------------------------------------------------------------
+// Function assembleUnitigs()
+// --------------------------------------------------------------------------
 
-inline int remapping(Triple<CharString> & fastqFilesTemp,
-        Triple<CharString> & fastqFiles,
-        CharString const & referenceFile,
-        CharString const & workingDir,
-        unsigned humanSeqs,
-        unsigned threads,
-        CharString & memory,
-        CharString & prefix,
-        float as_factor)
+// Builds a compacted de Bruijn graph of the reads for k = k_init, k_init + delta_k, ... up to k_max. From the second
+// iteration on, the unitigs of the previous graph that are at least k long are added to the graph, such that
+// regions covered by too few reads for the larger k are kept. Returns the unitigs of the last graph.
+inline bool
+assembleUnitigs(std::vector<std::string> & unitigs,
+                std::vector<std::string> const & files,
+                AssemblyOptions const & options)
 {
-    std::stringstream cmd;
-
-    CharString f1 = prefix;
-    f1 += "remapped.sam";
-    CharString remappedSam = getFileName(workingDir, f1);
-
-    CharString f2 = prefix;
-    f2 += "remapped.bam";
-    CharString remappedBam = getFileName(workingDir, f2);
-
-    CharString f3 = prefix;
-    f3 += "remapped.bam.bai";
-    CharString remappedBai = getFileName(workingDir, f3);
-
-    CharString f4 = prefix;
-    f4 += "remapped_unsorted.bam";
-    CharString remappedUnsortedBam = getFileName(workingDir, f4);
-
     std::ostringstream msg;
-    msg << "Remapping unmapped reads using " << BWA;
-    printStatus(msg);
-
-    // Run BWA on unmapped reads (pairs).
-    cmd.str("");
-    cmd << BWA << " mem -t " << threads << " " << referenceFile << " " << fastqFilesTemp.i1 << " " << fastqFilesTemp.i2 << " > " << remappedSam;
-    if (system(cmd.str().c_str()) != 0)
-    {
-        std::cerr << "ERROR while running bwa on " << fastqFilesTemp.i1 << " and " << fastqFilesTemp.i2 << std::endl;
-        return 1;
-    }
-
-    remove(toCString(fastqFilesTemp.i1));
-    remove(toCString(fastqFilesTemp.i2));
 
-    // Run BWA on unmapped reads (single end).
-    cmd.str("");
-    cmd << BWA << " mem -t " << threads << " " << referenceFile << " " << fastqFilesTemp.i3 << " | awk '$1 !~ /@/' >> " << remappedSam;
-    if (system(cmd.str().c_str()) != 0)
-    {
-        std::cerr << "ERROR while running bwa on " << fastqFilesTemp.i3 << std::endl;
-        return 1;
-    }
-
-    remove(toCString(fastqFilesTemp.i3));
-
-    msg.str("");
-    msg << "Converting BWA output " << remappedSam << " to bam format.";
-    printStatus(msg);
-
-    // Convert BWA output to bam.
-    cmd.str("");
-    cmd << SAMTOOLS << " view -S -h -b " << remappedSam << " > " << remappedUnsortedBam;
-    if (system(cmd.str().c_str()) != 0)
-    {
-        std::cerr << "ERROR while converting BWA output " << remappedSam << " to bam." << std::endl;
-        return 1;
-    }
-    remove(toCString(remappedSam));
+    CDBG_Build_opt opt;
+    opt.filename_seq_in = files;
+    opt.deleteIsolated  = true;
+    opt.clipTips        = true;
+    opt.useMercyKmers   = false;
+    opt.nb_threads      = options.threads;
+    opt.verbose         = false;
 
-    msg.str("");
-    msg << "Sorting " << remappedUnsortedBam << " using " << SAMTOOLS;
-    printStatus(msg);
-
-    // Sort bam file.
-    cmd.str("");
-    cmd << SAMTOOLS << " sort -@ " << threads << " -m " << memory << " -o " << remappedBam << " " << remappedUnsortedBam;
-    if (system(cmd.str().c_str()) != 0)
+    unitigs.clear();
+    for (unsigned k = options.k_init; k <= options.k_max; k += options.delta_k)
     {
-        std::cerr << "ERROR while sorting BWA output " << remappedUnsortedBam << std::endl;
-        return 1;
-    }
-
-    msg.str("");
-    msg << "Indexing " << remappedBam << " using " << SAMTOOLS;
-    printStatus(msg);
-
-    // Index bam file.
-    cmd.str("");
-    cmd << SAMTOOLS << " index " << remappedBam;
-    if (system(cmd.str().c_str()) != 0)
-    {
-        std::cerr << "ERROR while indexing BWA output " << remappedBam << std::endl;
-        return 1;
-    }
-
-    msg.str("");
-    msg << "Cropping unmapped reads from " << remappedBam;
-    printStatus(msg);
-
-    // Crop unmapped and create bam file of remapping.
-    if (crop_unmapped(fastqFiles, remappedUnsortedBam, remappedBam, humanSeqs, NoAdapters(), as_factor) != 0)
-        return 1;
-    remove(toCString(remappedBai));
-
-    msg.str("");
-    msg << "Sorting " << remappedUnsortedBam << " by read name using " << SAMTOOLS;
-    printStatus(msg);
-
-    // Sort <WD>/remapped.bam by read name.
-    cmd.str("");
-    cmd << SAMTOOLS << " sort -n -@ " << threads << " -m " << memory << " -o " << remappedBam << " " << remappedUnsortedBam << " ";
-    if (system(cmd.str().c_str()) != 0)
-    {
-        std::cerr << "ERROR while sorting " << remappedUnsortedBam << std::endl;
-        return 1;
-    }
-
-    remove(toCString(remappedUnsortedBam));
-
-    return 0;
-}
-
-// ==========================================================================
-
-inline void setMates(BamAlignmentRecord & record1, BamAlignmentRecord & record2) {
-    SEQAN_ASSERT(!hasFlagFirst(record1) || !hasFlagFirst(record2));
-    SEQAN_ASSERT(!hasFlagLast(record1) || !hasFlagLast(record2));
-
-    // Set the next ref id.
-    record1.rNextId = record2.rID;
-    record2.rNextId = record1.rID;
-
-    // Set the next ref pos.
-    record1.pNext = record2.beginPos;
-    record2.pNext = record1.beginPos;
-
-    // Fix the next unmapped flag.
-    if (hasFlagUnmapped(record2)) record1.flag |= BAM_FLAG_NEXT_UNMAPPED;
-    else record1.flag &= ~BAM_FLAG_NEXT_UNMAPPED;
-    if (hasFlagUnmapped(record1)) record2.flag |= BAM_FLAG_NEXT_UNMAPPED;
-    else record2.flag &= ~BAM_FLAG_NEXT_UNMAPPED;
-
-    // Fix the next reversed flag.
-    if (hasFlagRC(record2)) record1.flag |= BAM_FLAG_NEXT_RC;
-    else record1.flag &= ~BAM_FLAG_NEXT_RC;
-    if (hasFlagRC(record1)) record2.flag |= BAM_FLAG_NEXT_RC;
-    else record2.flag &= ~BAM_FLAG_NEXT_RC;
-
-    // Fix first/second in pair flags.
-    if (hasFlagFirst(record1)) record2.flag |= BAM_FLAG_LAST;
-    if (hasFlagFirst(record2)) record1.flag |= BAM_FLAG_LAST;
-    if (hasFlagLast(record1)) record2.flag |= BAM_FLAG_FIRST;
-    if (hasFlagLast(record2)) record1.flag |= BAM_FLAG_FIRST;
-
-    // Set flag paired.
-    record1.flag |= BAM_FLAG_MULTIPLE;
-    record2.flag |= BAM_FLAG_MULTIPLE;
-}
-
-// ==========================================================================
-
-// Correct the reference ids of a BamAlignmentRecord for the concatenated header.
-template<typename TNameStore>
-inline void readRecordAndCorrectRIds(BamAlignmentRecord & record, BamFileIn & stream, NameStoreCache<TNameStore> & nameStoreCache){
-    readRecord(record, stream);
-
-    if (record.rID != BamAlignmentRecord::INVALID_REFID)
-    {
-        CharString rName = contigNames(context(stream))[record.rID];
-        getIdByName(record.rID, nameStoreCache, rName);
-    }
-    if (record.rNextId != BamAlignmentRecord::INVALID_REFID)
-    {
-        CharString rNextName = contigNames(context(stream))[record.rNextId];
-        getIdByName(record.rNextId, nameStoreCache, rNextName);
-    }
-}
-
-// ==========================================================================
-
-inline void mergeHeaders(BamHeader & header, FormattedFileContext<BamFileOut, Owner<> >::Type & context, BamFileIn & stream1, BamFileIn & stream2){
-    StringSet<CharString> contigNames;
-    NameStoreCache<StringSet<CharString> > nameStoreCache;
-    String<int32_t> contigLengths;
-
-    // Read and append the two headers. Remove duplicate entries.
-    readHeader(header, stream1);
-    BamHeader header2;
-    readHeader(header2, stream2);
-    for (unsigned i = 0; i < length(header2); ++i)
-    {
-        if (header2[i].type != BAM_HEADER_FIRST)
-            appendValue(header, header2[i]);
-    }
-    std::stable_sort(begin(header, Standard()), end(header, Standard()), BamHeaderRecordTypeLess());
-
-    // Fill sequence names into nameStoreCache.
-    for (unsigned i = 0; i < length(header); ++i)
-    {
-        if (header[i].type == BAM_HEADER_REFERENCE)
-        {
-            CharString name, len;
-            for (unsigned j = 0; j < length(header[i].tags); ++j)
-            {
-                if (header[i].tags[j].i1 == "SN")
-                    name = header[i].tags[j].i2;
-                else if (header[i].tags[j].i1 == "LN")
-                    len = header[i].tags[j].i2;
-            }
-            appendName(context._contigNamesCache, name);
-            int32_t l;
-            lexicalCast<int32_t>(l, len);
-            appendValue(context._contigLengths, l);
-        }
-    }
-}
-
-// ==========================================================================
-
-// This function is adapted from samtools code (fuction strnum_cmp in bam_sort.c) to ensure the exact same sort order.
-int
-compare_qName(CharString & nameA, CharString & nameB)
-{
-    const char * _a = toCString(nameA);
-    const char * _b = toCString(nameB);
-    const unsigned char *a = (const unsigned char*)_a, *b = (const unsigned char*)_b;
-    const unsigned char *pa = a, *pb = b;
-    while (*pa && *pb) {
-        if (isdigit(*pa) && isdigit(*pb)) {
-            while (*pa == '0') ++pa;
-            while (*pb == '0') ++pb;
-            while (isdigit(*pa) && isdigit(*pb) && *pa == *pb) ++pa, ++pb;
-            if (isdigit(*pa) && isdigit(*pb)) {
-                int i = 0;
-                while (isdigit(pa[i]) && isdigit(pb[i])) ++i;
-                return isdigit(pa[i])? 1 : isdigit(pb[i])? -1 : (int)*pa - (int)*pb;
-            } else if (isdigit(*pa)) return 1;
-            else if (isdigit(*pb)) return -1;
-            else if (pa - a != pb - b) return pa - a < pb - b? 1 : -1;
-        } else {
-            if (*pa != *pb) return (int)*pa - (int)*pb;
-            ++pa; ++pb;
-        }
-    }
-    return *pa? 1 : *pb? -1 : 0;
-}
-
-// ==========================================================================
-// Function merge_and_set_mate()
-// ==========================================================================
-
-bool
-merge_and_set_mate(CharString &mergedBam, unsigned &nonContigSeqs, CharString &nonRefBam, CharString &remappedBam)
-{
-    std::ostringstream msg;
-    msg << "Merging bam files " << nonRefBam << " and " << remappedBam;
-    printStatus(msg);
-
-    // Open the two input streams (can read SAM and BAM files).
-    BamFileIn nonRefStream(toCString(nonRefBam));
-    BamFileIn remappedStream(toCString(remappedBam));
-
-    printStatus(" - merging headers...");
-
-    // Prepare a header for the output file.
-    BamHeader outHeader;
-    FormattedFileContext<BamFileOut, Owner<> >::Type bamContext;
-    mergeHeaders(outHeader, bamContext, nonRefStream, remappedStream);
-
-    printStatus(" - writing header...");
-
-    // Open the output stream and write the header.
-    FormattedFileContext<BamFileOut, Dependent<> >::Type bamContextDep(bamContext);
-    BamFileOut outStream(bamContextDep, toCString(mergedBam));
-    writeHeader(outStream, outHeader);
-
-    nonContigSeqs = length(contigNames(context(nonRefStream)));
-
-    printStatus(" - merging read records...");
-
-    // Read the first record from each input file. Correct ids in records from remappedStreams for new header.
-    BamAlignmentRecord record1, record2;
-    if (!atEnd(nonRefStream)) readRecordAndCorrectRIds(record1, nonRefStream, contigNamesCache(bamContextDep));
-    else record1.qName = "*";
-    if (!atEnd(remappedStream)) readRecordAndCorrectRIds(record2, remappedStream, contigNamesCache(bamContextDep));
-    else record2.qName = "*";
-
-    // Iterate both input files, set mate positions in pairs, and write all records to the output file.
-    while (record1.qName != "*" || record2.qName != "*")
-    {
-        while ((compare_qName(record2.qName, record1.qName) < 0 || record1.qName == "*") && record2.qName != "*")
-        {
-            writeRecord(outStream, record2);
-            if (!atEnd(remappedStream)) readRecordAndCorrectRIds(record2, remappedStream, contigNamesCache(bamContextDep));
-            else record2.qName = "*";
-        }
+        msg.str("");
+        msg << "Building compacted de Bruijn graph with k=" << k;
+        printStatus(msg);
 
-        bool incr1 = false;
-        while (record1.qName == record2.qName && record2.qName != "*")
+        opt.k = k;
+        CompactedDBG<> graph(k);
+        if (!graph.build(opt))
         {
-            incr1 = true;
-            setMates(record1, record2);
-            writeRecord(outStream, record1);
-            writeRecord(outStream, record2);
-            if (!atEnd(remappedStream)) readRecordAndCorrectRIds(record2, remappedStream, contigNamesCache(bamContextDep));
-            else record2.qName = "*";
-        }
-        if (incr1)
-        {
-            if (!atEnd(nonRefStream)) readRecordAndCorrectRIds(record1, nonRefStream, contigNamesCache(bamContextDep));
-            else record1.qName = "*";
+            std::cerr << "ERROR: Could not build the de Bruijn graph with k=" << k << "." << std::endl;
+            return 1;
         }
 
-        while ((compare_qName(record1.qName, record2.qName) < 0 || record2.qName == "*") && record1.qName != "*")
+        for (size_t i = 0; i < unitigs.size(); ++i)
         {
-            writeRecord(outStream, record1);
-            if (!atEnd(nonRefStream)) readRecordAndCorrectRIds(record1, nonRefStream, contigNamesCache(bamContextDep));
-            else record1.qName = "*";
+            if (unitigs[i].length() >= k)
+                graph.add(unitigs[i]);
         }
-    }
 
-    return 0;
-}
+        graph.simplify(opt.deleteIsolated, opt.clipTips, opt.verbose);
 
-// ==========================================================================
-// Function sickle_filtering()
-// ==========================================================================
+        unitigs.clear();
+        for (auto const & unitig : graph)
+            unitigs.push_back(unitig.referenceUnitigToString());
 
-inline bool
-sickle_filtering(Triple<CharString> & filteredFiles,
-        Triple<CharString> & fastqFiles,
-        CharString & workingDirectory)
-{
-    std::stringstream cmd;
-
-    std::ostringstream msg;
-    msg << "Filtering fastq files using " << SICKLE ;
-    printStatus(msg);
-
-    cmd.str("");
-    cmd << SICKLE << " pe -q 20 -l 60 -x -n -t sanger -f" << fastqFiles.i1 << " -r " << fastqFiles.i2;
-    cmd << " -o " << filteredFiles.i1 << " -p " << filteredFiles.i2 << " -s " << filteredFiles.i3;
-    if (system(cmd.str().c_str()) != 0) // runs sickle on paired end reads
-    {
-        std::cerr << "ERROR while filtering " << fastqFiles.i1 << " and " << fastqFiles.i2;
-        std::cerr << " using " << SICKLE << std::endl;
-        return 1;
-    }
-
-    CharString singleFiltered2 = getFileName(workingDirectory, "filtered.single2.fastq");
-
-    cmd.str("");
-    cmd << SICKLE << " se -q 20 -l 60 -x -n -t sanger -f " << fastqFiles.i3 << " -o " << singleFiltered2;
-    if (system(cmd.str().c_str()) != 0) // runs sickle on single end reads
-    {
-        std::cerr << "ERROR while filtering " << fastqFiles.i3 << " using " << SICKLE << std::endl;
-        return 1;
-    }
-
-    cmd.str("");
-    cmd << "cat " << singleFiltered2 << " >> " << filteredFiles.i3;
-    if (system(cmd.str().c_str()) != 0) // merges the fastq files of single end reads.
-    {
-        std::cerr << "ERROR while concatenating " << singleFiltered2 << " to " << filteredFiles.i3 << std::endl;
-        return 1;
+        msg.str("");
+        msg << "Graph with k=" << k << " has " << unitigs.size() << " unitigs.";
+        printStatus(msg);
     }
 
-    remove(toCString(singleFiltered2));
-
     return 0;
 }
 
-// ==========================================================================
-// Function velvet_assembly()
-// ==========================================================================
+// --------------------------------------------------------------------------
+// Function writeAssembly()
+// --------------------------------------------------------------------------
 
+// Writes the unitigs as contigs to a temporary file next to the contig file, which replaces it once complete.
 inline bool
-velvet_assembly(Triple<CharString> & filteredFiles, Triple<CharString> & filteredMPFiles, CharString & assemblyDirectory, unsigned kmerLength, bool matepair)
+writeAssembly(CharString const & contigFile, std::vector<std::string> const & unitigs)
 {
-    std::stringstream cmd;
-
-    std::ostringstream msg;
-    msg << "Preparing assembly of unmapped reads from filtered fastq files using " << VELVETH;
-    printStatus(msg);
-
-    cmd.str("");
-    cmd << VELVETH << " " << assemblyDirectory << " " << kmerLength << " -short -fastq " << filteredFiles.i3;
-    cmd << " -shortPaired -fastq -separate " << filteredFiles.i1 << " " << filteredFiles.i2;
-    if (matepair) {
-        cmd << " -shortPaired2 -fastq -separate " << filteredMPFiles.i1 << " " << filteredMPFiles.i2;
-    }
+    CharString tmpFile = contigFile;
+    tmpFile += ".tmp";
 
-    if (system(cmd.str().c_str()) != 0) // prepares velvet assembly, use k=47 for longer contigs
-    {
-        std::cerr << "ERROR while preparing assembly with " << VELVETH << " of ";
-        std::cerr << filteredFiles.i3 << ", " << filteredFiles.i1 << ", and " << filteredFiles.i2 << std::endl;
-        if (matepair) {
-            std::cerr << "and matepair files " << filteredMPFiles.i1 << " and " << filteredMPFiles.i2 << std::endl;
-        }
-        return 1;
-    }
-
-    msg.str("");
-    msg << "Assembling unmapped reads from filtered fastq files using " << VELVETG;
-    printStatus(msg);
-
-    cmd.str("");
-    cmd << VELVETG << " " << assemblyDirectory << " -exp_cov auto -cov_cutoff 2 -max_coverage 100 -scaffolding no";
-    if (matepair) {
-        cmd << " -shortMatePaired2 yes";
-    }
-
-    if (system(cmd.str().c_str()) != 0) // runs the velvet graph part
+    std::ofstream stream(toCString(tmpFile));
+    if (!stream.is_open())
     {
-        std::cerr << "ERROR while assembling " << assemblyDirectory << " with " << VELVETG << std::endl;
+        std::cerr << "ERROR: Could not open " << tmpFile << " for writing." << std::endl;
         return 1;
     }
 
-    return 0;
-}
-
-
-// ==========================================================================
-// Function velvet_assembly()
-// ==========================================================================
-
-inline bool minia_assembly(Triple<CharString> & filteredFiles, CharString & assemblyDirectory, const unsigned threads) {
-    std::stringstream cmd;
-
-    std::ostringstream msg;
-    msg << "Preparing assembly of unmapped reads from filtered fastq files using " << MINIA;
-    printStatus(msg);
-
-    cmd.str("");
-    cmd << MINIA << " --nb-cores " << threads;
-    cmd << " -1 " << filteredFiles.i1 << " -2 " << filteredFiles.i2 << " -s " << filteredFiles.i3;
-    cmd << " -o " << assemblyDirectory << "/assembly";
-    cmd << " --no-scaffolding";
+    for (size_t i = 0; i < unitigs.size(); ++i)
+        stream << ">contig_" << i << '\n' << unitigs[i] << '\n';
 
-    if (system(cmd.str().c_str()) != 0) // prepares minia assembly, k is automatically iteratively increased
+    stream.close();
+    if (stream.fail() || rename(toCString(tmpFile), toCString(contigFile)) != 0)
     {
-        std::cerr << "ERROR while preparing assembly with " << MINIA << " of ";
-        std::cerr << filteredFiles.i3 << ", " << filteredFiles.i1 << ", and " << filteredFiles.i2 << std::endl;
+        std::cerr << "ERROR while writing " << contigFile << std::endl;
         return 1;
     }
 
     return 0;
 }
 
-
 // ==========================================================================
-// Function popins_assemble()
+// Function popins2_assemble()
 // ==========================================================================
 
-int popins2_assemble(int argc, char const ** argv)
+inline int popins2_assemble(int argc, char const ** argv)
 {
     std::ostringstream msg;
 
-    // Parse the command line to get option values.
-    Options options;
+    AssemblyOptions options;
     ArgumentParser::ParseResult res = parseCommandLine(options, argc, argv);
     if (res != ArgumentParser::PARSE_OK)
         return res;
 
-    // Retrieve the sample ID from the first read group listed in BAM file header.
-    if (options.sampleID == "" && retrieveSampleID(options.sampleID, options.mappingFile) == 1)
-        return 7;
-
-    // Create working directory if it does not exist.
     CharString workingDirectory = getFileName(options.prefix, options.sampleID);
-    if (mkdir(toCString(workingDirectory), 0755) == 0)
-    {
-        msg.str("");
-        msg << "Working directory created at " << workingDirectory;
-        printStatus(msg);
-    }
-
-    SampleInfo info = initSampleInfo(options.mappingFile, options.sampleID, options.adapters);
-
-    float as_factor = options.alignment_score_factor;
-
-    CharString matesBam = getFileName(workingDirectory, "mates.bam");
-    CharString nonRefBamTemp = getFileName(workingDirectory, "non_ref_tmp.bam");
-    CharString nonRefBam = getFileName(workingDirectory, "non_ref.bam");
 
     CharString fastqFirst = getFileName(workingDirectory, "paired.1.fastq");
     CharString fastqSecond = getFileName(workingDirectory, "paired.2.fastq");
     CharString fastqSingle = getFileName(workingDirectory, "single.fastq");
     Triple<CharString> fastqFiles = Triple<CharString>(fastqFirst, fastqSecond, fastqSingle);
+    CharString contigFile = getFileName(workingDirectory, "assembly_final.contigs.fa");
 
-    CharString firstFiltered = getFileName(workingDirectory, "filtered.paired.1.fastq");
-    CharString secondFiltered = getFileName(workingDirectory, "filtered.paired.2.fastq");
-    CharString singleFiltered = getFileName(workingDirectory, "filtered.single.fastq");
-    Triple<CharString> filteredFiles(firstFiltered, secondFiltered, singleFiltered);
-
-    // MP handling
-    CharString matesMPBam = getFileName(workingDirectory, "MP.mates.bam");
-    CharString nonRefBamMPTemp = getFileName(workingDirectory, "MP.non_ref_tmp.bam");
-    CharString nonRefMPBam = getFileName(workingDirectory, "MP.non_ref.bam");
-
-    CharString fastqMPFirst = getFileName(workingDirectory, "MP.paired.1.fastq");
-    CharString fastqMPSecond = getFileName(workingDirectory, "MP.paired.2.fastq");
-    CharString fastqMPSingle = getFileName(workingDirectory, "MP.single.fastq");
-    Triple<CharString> fastqMPFiles = Triple<CharString>(fastqMPFirst, fastqMPSecond, fastqMPSingle);
-
-    // check if files already exits
-    std::fstream stream(toCString(fastqFirst));
-    if (!stream.is_open())
+    if (!exists(fastqFirst) || !exists(fastqSecond) || !exists(fastqSingle))
     {
-        msg.str("");
-        msg << "Cropping unmapped reads from " << options.mappingFile;
-        printStatus(msg);
-
-        // Crop unmapped reads and reads with unreliable mappings from the input bam file.
-        if (options.adapters == "HiSeqX")
-        {
-            if (crop_unmapped(info.avg_cov, fastqFiles, matesBam, options.mappingFile, options.humanSeqs, HiSeqXAdapters(), as_factor) != 0)
-                return 7;
-        }
-        else if (options.adapters == "HiSeq")
-        {
-            if (crop_unmapped(info.avg_cov, fastqFiles, matesBam, options.mappingFile, options.humanSeqs, HiSeqAdapters(), as_factor) != 0)
-                return 7;
-        }
-        else
-        {
-            if (crop_unmapped(info.avg_cov, fastqFiles, matesBam, options.mappingFile, options.humanSeqs, NoAdapters(), as_factor) != 0)
-                return 7;
-        }
+        std::cerr << "ERROR: Could not find all input files ";
+        std::cerr << fastqFirst << ", " << fastqSecond << ", and " << fastqSingle << std::endl;
+        return 7;
+    }
 
-        CharString sampleInfoFile = getFileName(workingDirectory, "POPINS_SAMPLE_INFO");
-        writeSampleInfo(info, sampleInfoFile);
+    // Skip the assembly if the manifest records it with the same reads and parameters.
+    StageManifest manifest;
+    if (readManifest(manifest, getFileName(workingDirectory, "POPINS_MANIFEST")) != 0)
+        return 7;
+    StageRecord stage("assemble");
+    addParam(stage, "kInit", options.k_init);
+    addParam(stage, "deltaK", options.delta_k);
+    addParam(stage, "kMax", options.k_max);
+    addInput(stage, manifest, fastqFirst);
+    addInput(stage, manifest, fastqSecond);
+    addInput(stage, manifest, fastqSingle);
 
-        msg.str("");
-        msg << "Sample info written to \'" << sampleInfoFile << "\'.";
+    if (stageUpToDate(manifest, stage))
+    {
+        msg << "Skipping assembly, " << contigFile << " is up to date.";
         printStatus(msg);
-
-      
+        return 0;
     }
+    if (beginStage(manifest, stage) != 0)
+        return 7;
 
-    CharString firstMPFiltered = getFileName(workingDirectory, "MP.filtered.paired.1.fastq");
-    CharString secondMPFiltered = getFileName(workingDirectory, "MP.filtered.paired.2.fastq");
-    CharString singleMPFiltered = getFileName(workingDirectory, "MP.filtered.single.fastq");
+    std::vector<std::string> files;
+    assemblyInputFiles(files, fastqFiles);
 
-    Triple<CharString> filteredMPFiles(firstMPFiltered, secondMPFiltered, singleMPFiltered);
+    std::vector<std::string> unitigs;
+    if (files.empty())
+    {
+        std::cerr << "WARNING: No reads to assemble for sample " << options.sampleID << "." << std::endl;
+    }
+    else
+    {
+        msg << "Assembling reads of sample " << options.sampleID << " with Bifrost using k=" << options.k_init
+            << " to k=" << options.k_max << " in steps of " << options.delta_k;
+        printStatus(msg);
+        msg.str("");
 
-    if (options.matepairFile != ""){
-        if (sickle_filtering(filteredMPFiles,fastqMPFiles, workingDirectory) != 0)
+        if (assembleUnitigs(unitigs, files, options) != 0)
             return 7;
     }
 
-   
- 
-    
-    if (!options.skip_assembly){    // if you use the multik module or an independent assembler you might want to skip the assembly here
-
-        CharString assemblyDirectory = getFileName(workingDirectory, "assembly");
-        if (options.use_velvet){
-
-            // Assembly with velvet.
-            if (velvet_assembly(filteredFiles, filteredMPFiles, assemblyDirectory, options.kmerLength, options.matepairFile != "") != 0)
-                return 7;
-
-            if (options.matepairFile == ""){
-                remove(toCString(firstMPFiltered));
-                remove(toCString(secondMPFiltered));
-                remove(toCString(singleMPFiltered));
-            }
-
-            // Copy contigs file to workingDirectory and remove assembly directory.
-            CharString contigFileAssembly = getFileName(assemblyDirectory, "contigs.fa");
-            CharString contigFile = getFileName(workingDirectory, "contigs.fa");
-            std::ifstream src(toCString(contigFileAssembly), std::ios::binary);
-            std::ofstream dst(toCString(contigFile), std::ios::binary);
-            dst << src.rdbuf();
-            src.close();
-            dst.close();
-            removeAssemblyDirectory(assemblyDirectory);
-        }
-        else{
-
-            // Assembly with minia. (default)
-            if (mkdir(toCString(assemblyDirectory), 0755) == 0){    // in contrast to Velvet, minia does not create a missing directory at runtime
-                msg.str("");
-                msg << "Assembly directory created at " << workingDirectory;
-                printStatus(msg);
-            }
-            if (minia_assembly(filteredFiles, assemblyDirectory, options.threads) != 0)
-                return 7;
-
-            // Copy contigs file to workingDirectory
-            CharString contigFileAssembly = getFileName(assemblyDirectory, "assembly_final.contigs.fa");
-            CharString contigFile = getFileName(workingDirectory, "assembly_final.contigs.fa");
-            //cout << "assemblyDirectory: " << assemblyDirectory << endl;
-            //cout << "workingDirectory: " << workingDirectory << endl;
-            std::ifstream src(toCString(contigFileAssembly), std::ios::binary);
-            std::ofstream dst(toCString(contigFile), std::ios::binary);
-            dst << src.rdbuf();
-            src.close();
-            dst.close();
-
-            // remove assembly directory
-            std::stringstream cmd;
-            cmd.str("");
-            cmd << "rm -rf " << assemblyDirectory;
-            system(cmd.str().c_str());
-        }
-    }
-    
+    if (writeAssembly(contigFile, unitigs) != 0)
+        return 7;
 
-    remove(toCString(firstFiltered));
-    remove(toCString(secondFiltered));
-    remove(toCString(singleFiltered));
+    msg << unitigs.size() << " contigs written to " << contigFile;
+    printStatus(msg);
 
-    return res;
+    String<CharString> outputs;
+    appendValue(outputs, contigFile);
+    if (finishStage(manifest, stage, outputs) != 0)
+        return 7;
 
+    return 0;
 }
 
-#endif // #ifndef POPINS_ASSEMBLE_H_
-
-
-/*
-#try deleting part of the functions
-#rename functions
-#sickle (try to get rid)
-#conda package (help with the installation)
-*/
\ No newline at end of file
+#endif // #ifndef POPINS2_ASSEMBLE_H_
@@ -0,0 +1,530 @@
+#ifndef POPINS2_BATCH_H_
+#define POPINS2_BATCH_H_
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <seqan/sequence.h>
+
+#include "util.h"
+#include "argument_parsing.h"
+#include "bam_sort.h"
+#include "batch_scheduler.h"
+#include "popins2_crop_unmapped.h"
+#include "popins2_remapping.h"
+#include "popins_contigmap.h"
+#include "popins_place.h"
+#include "popins_genotype.h"
+
+using namespace seqan;
+
+// ==========================================================================
+// Struct BatchCommand
+// ==========================================================================
+
+struct BatchCommand
+{
+    CharString name;
+    int (*run)(int, char const **);
+    BatchStageType type;
+    std::vector<std::string> options;   // option tokens forwarded to the command
+
+    BatchCommand() : run(NULL), type(BATCH_SINGLE_THREADED)
+    {}
+};
+
+// --------------------------------------------------------------------------
+// Function _initBatchCommand()
+// --------------------------------------------------------------------------
+
+inline bool
+_initBatchCommand(BatchCommand & command, CharString const & name)
+{
+    command.name = name;
+    if (name == "crop-unmapped")
+    {
+        command.run = popins2_crop_unmapped;
+        command.type = BATCH_IO_BOUND;
+    }
+    else if (name == "remapping")
+    {
+        command.run = popins2_remapping;
+        command.type = BATCH_CPU_BOUND;
+    }
+    else if (name == "contigmap")
+    {
+        command.run = popins_contigmap;
+        command.type = BATCH_CPU_BOUND;
+    }
+    else if (name == "place-splitalign")
+    {
+        command.run = popins_place_splitalign;
+        command.type = BATCH_SINGLE_THREADED;
+    }
+    else if (name == "genotype")
+    {
+        command.run = popins_genotype;
+        command.type = BATCH_SINGLE_THREADED;
+    }
+    else
+    {
+        std::cerr << "ERROR: Command \'" << name << "\' cannot be run in a batch. Supported are crop-unmapped, "
+                  << "remapping, contigmap, place-splitalign and genotype." << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// --------------------------------------------------------------------------
+// Function _needsBamFile()
+// --------------------------------------------------------------------------
+
+inline bool
+_needsBamFile(BatchCommand const & command)
+{
+    return command.name == "crop-unmapped" || command.name == "remapping";
+}
+
+// --------------------------------------------------------------------------
+// Function parseBatchCommands()
+// --------------------------------------------------------------------------
+
+// Splits the comma-separated commands and assigns the forwarded options to them.
+inline bool
+parseBatchCommands(String<BatchCommand> & commands, BatchOptions const & options)
+{
+    std::istringstream names(toCString(options.commands));
+    std::string name;
+    while (std::getline(names, name, ','))
+    {
+        BatchCommand command;
+        if (_initBatchCommand(command, name) != 0)
+            return 1;
+        appendValue(commands, command);
+    }
+    if (empty(commands))
+    {
+        std::cerr << "ERROR: No commands given." << std::endl;
+        return 1;
+    }
+
+    for (unsigned i = 0; i < length(options.commandOptions); ++i)
+    {
+        std::string value = toCString(options.commandOptions[i]);
+        size_t colonPos = value.find(':');
+        std::string target = value.substr(0, colonPos);
+
+        unsigned c = 0;
+        while (c < length(commands) && commands[c].name != target)
+            ++c;
+        if (colonPos == std::string::npos || c == length(commands))
+        {
+            std::cerr << "ERROR: Options \'" << value << "\' are not given as COMMAND:OPTIONS for one of the commands "
+                      << options.commands << "." << std::endl;
+            return 1;
+        }
+
+        // The prefix, sample, threads and memory of a command are set by the batch.
+        std::istringstream tokens(value.substr(colonPos + 1));
+        std::string token;
+        while (tokens >> token)
+        {
+            if (token == "-p" || token == "--prefix" || token == "-s" || token == "--sample" ||
+                token == "-t" || token == "--threads" ||
+                ((token == "-m" || token == "--memory") && commands[c].name == "contigmap") ||
+                ((token == "-M" || token == "--max-memory") && commands[c].name == "crop-unmapped"))
+            {
+                std::cerr << "ERROR: Option \'" << token << "\' of " << target << " is set by the batch." << std::endl;
+                return 1;
+            }
+            commands[c].options.push_back(token);
+        }
+    }
+
+    return 0;
+}
+
+// --------------------------------------------------------------------------
+// Function _batchJobArguments()
+// --------------------------------------------------------------------------
+
+// Returns the command line of a job, such that the command parses it as if it was called on its own.
+inline std::vector<std::string>
+_batchJobArguments(char const * programName,
+                   BatchCommand const & command,
+                   BatchSample const & sample,
+                   BatchOptions const & options,
+                   unsigned threads,
+                   uint64_t threadMemory)
+{
+    std::vector<std::string> args;
+    args.push_back(programName);
+    args.push_back(toCString(command.name));
+
+    if (_needsBamFile(command))
+    {
+        args.push_back(toCString(sample.bamFile));
+        args.push_back("-s");
+    }
+    args.push_back(toCString(sample.sampleID));
+
+    args.push_back("-p");
+    args.push_back(toCString(options.prefix));
+
+    if (command.type != BATCH_SINGLE_THREADED)
+    {
+        std::ostringstream threadsStr;
+        threadsStr << threads;
+        args.push_back("-t");
+        args.push_back(threadsStr.str());
+    }
+    if (command.name == "contigmap")
+    {
+        // The memory per thread bounds the in-memory sort of the bam files.
+        args.push_back("-m");
+        args.push_back(toCString(options.memory));
+    }
+    if (command.name == "crop-unmapped")
+    {
+        // The memory reserved for the job bounds the reads waiting for their mate.
+        std::ostringstream memoryStr;
+        memoryStr << std::max<uint64_t>(threads * threadMemory >> 20, 1);
+        args.push_back("-M");
+        args.push_back(memoryStr.str());
+    }
+
+    args.insert(args.end(), command.options.begin(), command.options.end());
+    return args;
+}
+
+// --------------------------------------------------------------------------
+// Function _runBatchJob()
+// --------------------------------------------------------------------------
+
+inline int
+_runBatchJob(BatchCommand const & command, std::vector<std::string> const & args)
+{
+    std::vector<char const *> argv;
+    for (unsigned i = 0; i < args.size(); ++i)
+        argv.push_back(args[i].c_str());
+
+    try
+    {
+        return command.run(argv.size(), &argv[0]);
+    }
+    catch (std::exception const & e)
+    {
+        std::cerr << "ERROR: " << e.what() << std::endl;
+        return 7;
+    }
+}
+
+// ==========================================================================
+// Struct SharedContigIndex
+// ==========================================================================
+
+// The bwa index of the contigs in shared memory, where every 'bwa mem' of the contigmap jobs finds it instead of
+// loading it from disk. The index is dropped again when the batch is done, unless it was loaded before the batch.
+struct SharedContigIndex
+{
+    CharString contigFile;
+    bool loaded;        // loaded to shared memory by the batch
+
+    SharedContigIndex() : loaded(false)
+    {}
+
+    ~SharedContigIndex();
+};
+
+// --------------------------------------------------------------------------
+// Function _batchContigFile()
+// --------------------------------------------------------------------------
+
+// Returns the contig file given to the contigmap command.
+inline CharString
+_batchContigFile(BatchCommand const & command)
+{
+    CharString contigFile = ContigMapOptions().contigFile;
+    for (unsigned i = 0; i < command.options.size(); ++i)
+    {
+        std::string const & token = command.options[i];
+        if ((token == "-c" || token == "--contigs") && i + 1 < command.options.size())
+            contigFile = command.options[++i];
+        else if (token.compare(0, 10, "--contigs=") == 0)
+            contigFile = token.substr(10);
+    }
+    return contigFile;
+}
+
+// --------------------------------------------------------------------------
+// Function _sharedBwaIndices()
+// --------------------------------------------------------------------------
+
+// Returns the names of the indices that 'bwa shm -l' lists.
+inline std::vector<std::string>
+_sharedBwaIndices()
+{
+    std::vector<std::string> names;
+    std::ostringstream cmd;
+    cmd << BWA << " shm -l 2> /dev/null";
+    FILE * pipe = popen(cmd.str().c_str(), "r");
+    if (pipe == NULL)
+        return names;
+
+    char line[4096];
+    while (fgets(line, sizeof(line), pipe) != NULL)
+    {
+        std::istringstream lineStream(line);
+        std::string name;
+        if (lineStream >> name)
+            names.push_back(name);
+    }
+    pclose(pipe);
+    return names;
+}
+
+// --------------------------------------------------------------------------
+// Function shareContigIndex()
+// --------------------------------------------------------------------------
+
+// Indexes the contigs once for all samples if there is no index yet and loads the index to shared memory.
+// Returns 1 only if the contigs cannot be indexed; without shared memory each bwa run loads the index itself.
+inline bool
+shareContigIndex(SharedContigIndex & index, CharString const & contigFile)
+{
+    std::ostringstream msg;
+    std::ostringstream cmd;
+    index.contigFile = contigFile;
+
+    CharString indexFile = contigFile;
+    indexFile += ".bwt";
+    if (!exists(indexFile))
+    {
+        msg << "Indexing contigs in \'" << contigFile << "\' using " << BWA;
+        printStatus(msg);
+
+        cmd << BWA << " index " << contigFile;
+        if (system(cmd.str().c_str()) != 0)
+        {
+            std::cerr << "ERROR while indexing \'" << contigFile << "\' using " << BWA << std::endl;
+            return 1;
+        }
+    }
+
+    // bwa identifies indices in shared memory by the file name without the path.
+    std::string name = toCString(contigFile);
+    name = name.substr(name.find_last_of('/') + 1);
+    std::vector<std::string> shared = _sharedBwaIndices();
+    if (std::find(shared.begin(), shared.end(), name) != shared.end())
+        return 0;
+
+    msg.str("");
+    msg << "Loading the index of \'" << contigFile << "\' to shared memory for all contigmap jobs";
+    printStatus(msg);
+
+    cmd.str("");
+    cmd << BWA << " shm " << contigFile;
+    if (system(cmd.str().c_str()) != 0)
+    {
+        std::cerr << "WARNING: Could not load the index of \'" << contigFile << "\' to shared memory. "
+                  << "Each contigmap job loads it from disk." << std::endl;
+        return 0;
+    }
+    index.loaded = true;
+    return 0;
+}
+
+// --------------------------------------------------------------------------
+// Function releaseContigIndex()
+// --------------------------------------------------------------------------
+
+// Drops the index from shared memory. 'bwa shm -d' drops all indices, so other indices are left alone.
+inline void
+releaseContigIndex(SharedContigIndex & index)
+{
+    if (!index.loaded)
+        return;
+    index.loaded = false;
+
+    std::ostringstream cmd;
+    if (_sharedBwaIndices().size() > 1)
+    {
+        std::cerr << "WARNING: The index of \'" << index.contigFile << "\' is left in shared memory with other "
+                  << "indices. Drop them with \'" << BWA << " shm -d\'." << std::endl;
+        return;
+    }
+    cmd << BWA << " shm -d";
+    if (system(cmd.str().c_str()) != 0)
+        std::cerr << "WARNING: Could not drop the index of \'" << index.contigFile << "\' from shared memory." << std::endl;
+}
+
+inline SharedContigIndex::~SharedContigIndex()
+{
+    releaseContigIndex(*this);
+}
+
+// ==========================================================================
+// Function popins2_batch()
+// ==========================================================================
+
+int popins2_batch(int argc, char const ** argv)
+{
+    std::ostringstream msg;
+
+    // Parse the command line to get option values.
+    BatchOptions options;
+    ArgumentParser::ParseResult res = parseCommandLine(options, argc, argv);
+    if (res != ArgumentParser::PARSE_OK)
+        return res;
+
+    String<BatchCommand> commands;
+    if (parseBatchCommands(commands, options) != 0)
+        return 7;
+
+    String<BatchSample> samples;
+    if (readBatchSamples(samples, options.sampleFile) != 0)
+        return 7;
+
+    for (unsigned c = 0; c < length(commands); ++c)
+    {
+        if (!_needsBamFile(commands[c]))
+            continue;
+        for (unsigned i = 0; i < length(samples); ++i)
+        {
+            if (empty(samples[i].bamFile))
+            {
+                std::cerr << "ERROR: No BAM file given for sample \'" << samples[i].sampleID << "\', which is required by "
+                          << commands[c].name << "." << std::endl;
+                return 7;
+            }
+        }
+    }
+
+    uint64_t threadMemory;
+    if (!parseMemorySize(threadMemory, options.memory))
+    {
+        std::cerr << "ERROR: Invalid memory size " << options.memory << std::endl;
+        return 7;
+    }
+    uint64_t totalMemory = threadMemory * options.threads;
+    if (options.maxMemory != 0)
+        totalMemory = (uint64_t)options.maxMemory << 20;
+    if (totalMemory < threadMemory)
+    {
+        std::cerr << "ERROR: The total memory of " << options.maxMemory << " MB is less than the memory per thread "
+                  << options.memory << "." << std::endl;
+        return 7;
+    }
+
+    // The contigmap jobs of all samples map against one index of the contigs.
+    SharedContigIndex contigIndex;
+    for (unsigned c = 0; c < length(commands); ++c)
+        if (commands[c].name == "contigmap" && shareContigIndex(contigIndex, _batchContigFile(commands[c])) != 0)
+            return 7;
+
+    msg.str("");
+    msg << "Running " << options.commands << " for " << length(samples) << " samples on " << options.threads
+        << " threads with " << (totalMemory >> 20) << " MB of memory";
+    printStatus(msg);
+
+    // The main thread starts the jobs whenever the free resources suffice and waits for jobs to finish. Since
+    // all resources are free while no job is running, every waiting job can be started eventually. A sample runs
+    // one job at a time in its thread, which is joined as soon as the job has finished.
+    BatchResources pool(options.threads, totalMemory, options.ioJobs);
+    unsigned running = 0;
+    std::mutex mutex;
+    std::condition_variable jobFinished;
+    std::vector<std::thread> jobs(length(samples));
+    std::vector<unsigned> finished;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+        // Start I/O-bound jobs first, such that they overlap with the CPU-bound jobs of other samples.
+        for (unsigned pass = 0; pass < 2; ++pass)
+        {
+            for (unsigned i = 0; i < length(samples); ++i)
+            {
+                BatchSample & sample = samples[i];
+                if (sample.running || sample.failed || sample.nextStage == length(commands))
+                    continue;
+
+                BatchCommand const & command = commands[sample.nextStage];
+                if ((command.type == BATCH_IO_BOUND) != (pass == 0))
+                    continue;
+
+                unsigned threads = grantBatchJob(pool, command.type, options.jobThreads, threadMemory);
+                if (threads == 0)
+                    continue;
+
+                reserveBatchJob(pool, command.type, threads, threadMemory);
+                sample.running = true;
+                ++running;
+
+                msg.str("");
+                msg << "Starting " << command.name << " for sample " << sample.sampleID << " on " << threads << " thread"
+                    << (threads == 1 ? "" : "s");
+                printStatus(msg);
+
+                std::vector<std::string> args = _batchJobArguments(argv[0], command, sample, options, threads, threadMemory);
+                jobs[i] = std::thread([&, i, threads, args]()
+                {
+                    BatchCommand const & job = commands[samples[i].nextStage];
+                    int ret = _runBatchJob(job, args);
+
+                    std::lock_guard<std::mutex> jobLock(mutex);
+                    releaseBatchJob(pool, job.type, threads, threadMemory);
+                    --running;
+                    samples[i].running = false;
+
+                    std::ostringstream jobMsg;
+                    if (ret != 0)
+                    {
+                        samples[i].failed = true;
+                        std::cerr << "ERROR: " << job.name << " failed for sample " << samples[i].sampleID
+                                  << ", skipping its remaining commands." << std::endl;
+                    }
+                    else
+                    {
+                        ++samples[i].nextStage;
+                        jobMsg << "Finished " << job.name << " for sample " << samples[i].sampleID;
+                        printStatus(jobMsg);
+                    }
+                    finished.push_back(i);
+                    jobFinished.notify_one();
+                });
+            }
+        }
+
+        if (running == 0)
+            break;
+        jobFinished.wait(lock);
+
+        // A finished job has released the lock, so its thread ends without waiting for the main thread.
+        for (unsigned i = 0; i < finished.size(); ++i)
+            jobs[finished[i]].join();
+        finished.clear();
+    }
+    lock.unlock();
+
+    releaseContigIndex(contigIndex);
+
+    unsigned failed = 0;
+    for (unsigned i = 0; i < length(samples); ++i)
+        if (samples[i].failed)
+            ++failed;
+    if (failed > 0)
+    {
+        std::cerr << "ERROR: " << failed << " of " << length(samples) << " samples failed." << std::endl;
+        return 7;
+    }
+
+    return 0;
+}
+
+#endif // #ifndef POPINS2_BATCH_H_
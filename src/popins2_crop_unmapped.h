@@ -7,6 +7,7 @@
 #include "util.h"
 #include "argument_parsing.h"
 #include "crop_unmapped.h"
+#include "stage_manifest.h"
 
 #ifndef POPINS2_CROP_UNMAPPED_H_
 #define POPINS2_CROP_UNMAPPED_H_
@@ -82,10 +83,31 @@ int popins2_crop_unmapped(int argc, char const ** argv)
 
 
 
-    // check if files already exits
-    std::fstream stream(toCString(fastqFirst));
-    if (!stream.is_open())
+    CharString sampleInfoFile = getFileName(workingDirectory, "POPINS_SAMPLE_INFO");
+
+    // Skip the cropping if the manifest records it with the same input and parameters.
+    StageManifest manifest;
+    if (readManifest(manifest, getFileName(workingDirectory, "POPINS_MANIFEST")) != 0)
+        return 7;
+    StageRecord stage("crop-unmapped");
+    addParam(stage, "adapters", options.adapters);
+    addParam(stage, "humanSeqs", options.humanSeqs);
+    addParam(stage, "alignmentScoreFactor", options.alignment_score_factor);
+    addParam(stage, "compressFastq", options.compressFastq);
+    addParam(stage, "qualityFilter", options.qualityFilter);
+    addInput(stage, manifest, options.mappingFile);
+
+    if (stageUpToDate(manifest, stage))
     {
+        msg.str("");
+        msg << "Skipping cropping, output files in " << workingDirectory << " are up to date.";
+        printStatus(msg);
+    }
+    else
+    {
+        if (beginStage(manifest, stage) != 0)
+            return 7;
+
         msg.str("");
         msg << "Cropping unmapped reads from " << options.mappingFile;
         printStatus(msg);
@@ -93,28 +115,34 @@ int popins2_crop_unmapped(int argc, char const ** argv)
         // Crop unmapped reads and reads with unreliable mappings from the input bam file.
         if (options.adapters == "HiSeqX")
         {
-            if (crop_unmapped(info.avg_cov, fastqFiles, matesBam, options.mappingFile, options.humanSeqs, HiSeqXAdapters(), as_factor) != 0)
+            if (crop_unmapped(info.avg_cov, fastqFiles, matesBam, options.mappingFile, options.humanSeqs, HiSeqXAdapters(), as_factor, options.threads, options.maxMemory, options.singlePass, options.splitRegions, options.compressFastq, options.qualityFilter) != 0)
                 return 7;
         }
         else if (options.adapters == "HiSeq")
         {
-            if (crop_unmapped(info.avg_cov, fastqFiles, matesBam, options.mappingFile, options.humanSeqs, HiSeqAdapters(), as_factor) != 0)
+            if (crop_unmapped(info.avg_cov, fastqFiles, matesBam, options.mappingFile, options.humanSeqs, HiSeqAdapters(), as_factor, options.threads, options.maxMemory, options.singlePass, options.splitRegions, options.compressFastq, options.qualityFilter) != 0)
                 return 7;
         }
         else
         {
-            if (crop_unmapped(info.avg_cov, fastqFiles, matesBam, options.mappingFile, options.humanSeqs, NoAdapters(), as_factor) != 0)
+            if (crop_unmapped(info.avg_cov, fastqFiles, matesBam, options.mappingFile, options.humanSeqs, NoAdapters(), as_factor, options.threads, options.maxMemory, options.singlePass, options.splitRegions, options.compressFastq, options.qualityFilter) != 0)
                 return 7;
         }
 
-        CharString sampleInfoFile = getFileName(workingDirectory, "POPINS_SAMPLE_INFO");
         writeSampleInfo(info, sampleInfoFile);
 
         msg.str("");
         msg << "Sample info written to \'" << sampleInfoFile << "\'.";
         printStatus(msg);
 
-      
+        String<CharString> outputs;
+        appendValue(outputs, fastqFirst);
+        appendValue(outputs, fastqSecond);
+        appendValue(outputs, fastqSingle);
+        appendValue(outputs, matesBam);
+        appendValue(outputs, sampleInfoFile);
+        if (finishStage(manifest, stage, outputs) != 0)
+            return 7;
     }
 
     return res;
@@ -54,21 +54,42 @@ inline void setMates(BamAlignmentRecord & record1, BamAlignmentRecord & record2)
 
 // ==========================================================================
 
-// Correct the reference ids of a BamAlignmentRecord for the concatenated header.
+// Extends the translation of the reference ids of a stream to the ids of the concatenated header by
+// the references added to the stream's context since the last call, e.g. by the header or by a SAM
+// record with a reference that is missing from the header. References not found keep their id.
 template<typename TNameStore>
-inline void readRecordAndCorrectRIds(BamAlignmentRecord & record, BamFileIn & stream, NameStoreCache<TNameStore> & nameStoreCache){
+inline void updateRIdMap(String<int32_t> & rIdMap, BamFileIn & stream, NameStoreCache<TNameStore> & nameStoreCache){
+    for (unsigned i = length(rIdMap); i < length(contigNames(context(stream))); ++i)
+    {
+        int32_t rID = i;
+        getIdByName(rID, nameStoreCache, contigNames(context(stream))[i]);
+        appendValue(rIdMap, rID);
+    }
+}
+
+// Correct the reference ids of a BamAlignmentRecord for the concatenated header. The names are only
+// looked up once per reference of the stream and stored in rIdMap.
+template<typename TNameStore>
+inline void readRecordAndCorrectRIds(BamAlignmentRecord & record, BamFileIn & stream, String<int32_t> & rIdMap, NameStoreCache<TNameStore> & nameStoreCache){
     readRecord(record, stream);
 
+    if (length(rIdMap) < length(contigNames(context(stream))))
+        updateRIdMap(rIdMap, stream, nameStoreCache);
+
     if (record.rID != BamAlignmentRecord::INVALID_REFID)
-    {
-        CharString rName = contigNames(context(stream))[record.rID];
-        getIdByName(record.rID, nameStoreCache, rName);
-    }
+        record.rID = rIdMap[record.rID];
     if (record.rNextId != BamAlignmentRecord::INVALID_REFID)
-    {
-        CharString rNextName = contigNames(context(stream))[record.rNextId];
-        getIdByName(record.rNextId, nameStoreCache, rNextName);
-    }
+        record.rNextId = rIdMap[record.rNextId];
+}
+
+// Reads the next record of a name-sorted stream and its name sort key. Returns false at the end of the stream.
+template<typename TNameStore>
+inline bool readMergeRecord(BamAlignmentRecord & record, CharString & key, BamFileIn & stream, String<int32_t> & rIdMap, NameStoreCache<TNameStore> & nameStoreCache){
+    if (atEnd(stream))
+        return false;
+    readRecordAndCorrectRIds(record, stream, rIdMap, nameStoreCache);
+    qNameSortKey(key, record.qName);
+    return true;
 }
 
 // ==========================================================================
@@ -110,36 +131,6 @@ inline void mergeHeaders(BamHeader & header, FormattedFileContext<BamFileOut, Ow
     }
 }
 
-// ==========================================================================
-
-// This function is adapted from samtools code (fuction strnum_cmp in bam_sort.c) to ensure the exact same sort order.
-int
-compare_qName(CharString & nameA, CharString & nameB)
-{
-    const char * _a = toCString(nameA);
-    const char * _b = toCString(nameB);
-    const unsigned char *a = (const unsigned char*)_a, *b = (const unsigned char*)_b;
-    const unsigned char *pa = a, *pb = b;
-    while (*pa && *pb) {
-        if (isdigit(*pa) && isdigit(*pb)) {
-            while (*pa == '0') ++pa;
-            while (*pb == '0') ++pb;
-            while (isdigit(*pa) && isdigit(*pb) && *pa == *pb) ++pa, ++pb;
-            if (isdigit(*pa) && isdigit(*pb)) {
-                int i = 0;
-                while (isdigit(pa[i]) && isdigit(pb[i])) ++i;
-                return isdigit(pa[i])? 1 : isdigit(pb[i])? -1 : (int)*pa - (int)*pb;
-            } else if (isdigit(*pa)) return 1;
-            else if (isdigit(*pb)) return -1;
-            else if (pa - a != pb - b) return pa - a < pb - b? 1 : -1;
-        } else {
-            if (*pa != *pb) return (int)*pa - (int)*pb;
-            ++pa; ++pb;
-        }
-    }
-    return *pa? 1 : *pb? -1 : 0;
-}
-
 // ==========================================================================
 // Function merge_and_set_mate()
 // ==========================================================================
@@ -174,43 +165,38 @@ merge_and_set_mate(CharString &mergedBam, unsigned &nonContigSeqs, CharString &n
     printStatus(" - merging read records...");
 
     // Read the first record from each input file. Correct ids in records from remappedStreams for new header.
+    // The read names are compared by their sort keys, which are computed once per record.
     BamAlignmentRecord record1, record2;
-    if (!atEnd(nonRefStream)) readRecordAndCorrectRIds(record1, nonRefStream, contigNamesCache(bamContextDep));
-    else record1.qName = "*";
-    if (!atEnd(remappedStream)) readRecordAndCorrectRIds(record2, remappedStream, contigNamesCache(bamContextDep));
-    else record2.qName = "*";
+    CharString key1, key2;
+    String<int32_t> rIdMap1, rIdMap2;
+    bool has1 = readMergeRecord(record1, key1, nonRefStream, rIdMap1, contigNamesCache(bamContextDep));
+    bool has2 = readMergeRecord(record2, key2, remappedStream, rIdMap2, contigNamesCache(bamContextDep));
 
     // Iterate both input files, set mate positions in pairs, and write all records to the output file.
-    while (record1.qName != "*" || record2.qName != "*")
+    while (has1 || has2)
     {
-        while ((compare_qName(record2.qName, record1.qName) < 0 || record1.qName == "*") && record2.qName != "*")
+        while (has2 && (!has1 || compareSortKeys(key2, key1) < 0))
         {
             writeRecord(outStream, record2);
-            if (!atEnd(remappedStream)) readRecordAndCorrectRIds(record2, remappedStream, contigNamesCache(bamContextDep));
-            else record2.qName = "*";
+            has2 = readMergeRecord(record2, key2, remappedStream, rIdMap2, contigNamesCache(bamContextDep));
         }
 
         bool incr1 = false;
-        while (record1.qName == record2.qName && record2.qName != "*")
+        while (has1 && has2 && key1 == key2)
         {
             incr1 = true;
             setMates(record1, record2);
             writeRecord(outStream, record1);
             writeRecord(outStream, record2);
-            if (!atEnd(remappedStream)) readRecordAndCorrectRIds(record2, remappedStream, contigNamesCache(bamContextDep));
-            else record2.qName = "*";
+            has2 = readMergeRecord(record2, key2, remappedStream, rIdMap2, contigNamesCache(bamContextDep));
         }
         if (incr1)
-        {
-            if (!atEnd(nonRefStream)) readRecordAndCorrectRIds(record1, nonRefStream, contigNamesCache(bamContextDep));
-            else record1.qName = "*";
-        }
+            has1 = readMergeRecord(record1, key1, nonRefStream, rIdMap1, contigNamesCache(bamContextDep));
 
-        while ((compare_qName(record1.qName, record2.qName) < 0 || record2.qName == "*") && record1.qName != "*")
+        while (has1 && (!has2 || compareSortKeys(key1, key2) < 0))
         {
             writeRecord(outStream, record1);
-            if (!atEnd(nonRefStream)) readRecordAndCorrectRIds(record1, nonRefStream, contigNamesCache(bamContextDep));
-            else record1.qName = "*";
+            has1 = readMergeRecord(record1, key1, nonRefStream, rIdMap1, contigNamesCache(bamContextDep));
         }
     }
 
@@ -11,6 +11,10 @@
 #ifndef POPINS2_MULTIK_H_
 #define POPINS2_MULTIK_H_
 
+#include <atomic>
+#include <unordered_map>
+#include <thread>
+#include <zlib.h>                           // gzopen, gzwrite, gzclose, crc32
 #include <bifrost/ColoredCDBG.hpp>          // ColoredCDBG
 #include <seqan/seq_io.h>                   // getAbsolutePath, toCString, readRecords
 #include "util.h"                           // getFastx, printTimeStatus, getAbsoluteFileName
@@ -20,32 +24,73 @@ using namespace seqan;
 
 
 
+/**
+ *          Function to get the name of the sample spool of an input file.
+ * @param   fastq_file is the name of the input file, including its full path
+ * @param   outpath is a (optional) string to define an output directory for the FASTA.
+ *          If outpath is "" the FASTA will be written to the current working directory
+ * @return  string; the name of the gzip-compressed FASTA
+ */
+inline std::string getSpoolFileName(const std::string &fastq_file, const std::string &outpath){
+    // get FASTQ filename without path and without file ending
+    size_t lastSlashPos = fastq_file.find_last_of("/");
+    std::string fname   = fastq_file.substr(lastSlashPos+1);
+    size_t lastDotPos   = fname.find_last_of(".");
+    std::string fname_  = fname.substr(0,lastDotPos);
+
+    if (strcmp(outpath.c_str(), "") == 0)
+        return fname_+".fasta.gz";
+
+    return getAbsoluteFileName(outpath, fname_+".fasta.gz");
+}
+
+
 /**
  *          Function to convert FASTQ to FASTA.
  * @details This is the seqAn2 way to do this. Converting this with the new C++20 concepts used in
  *          seqAn3 is so much more elegant.
+ *          The FASTA is written gzip-compressed (*.fasta.gz) and serves as the sample spool of the
+ *          multi-k iterations, i.e. it is read by every buildGraph() and only ever appended to.
+ *          The records are streamed in chunks of at most chunk_size bases, hence the memory usage
+ *          does not depend on the size of the FASTQ.
  * @param   fastq_file is the name of the fastq file to convert to fasta, including its full path
- * @param   outpath is a (optional) string to define an output directory for the FASTA.
- *          If outpath is "" the FASTA will be written to the current working directory
- * @param   fasta_names is a vector reference to store the absolute FASTA filenames in
+ * @param   fasta_file is the name of the FASTA to write
+ * @param   chunk_size is the maximum number of bases to hold in memory
  * @return  bool; 1 if error, 0 else
  */
-inline bool fastq2fasta(const std::string &fastq_file, const std::string &outpath, std::vector<std::string> &fasta_names){
-    // read FASTQ
-    CharString seqFileName = fastq_file;
-    SeqFileIn seqFileIn;
+inline bool fastq2fasta(const std::string &fastq_file, const std::string &fasta_file, const size_t chunk_size){
+    FastqFileIn seqFileIn;     // the FASTQ may be block-gzip compressed regardless of its name
+    if (!open(seqFileIn, fastq_file.c_str())){
+        std::cerr << "ERROR: Could not open FASTQ file \'" << fastq_file << "\' to read from.\n";
+        return 1;
+    }
 
-    if (!open(seqFileIn, toCString(seqFileName))){
-        std::cerr << "ERROR: Could not open FASTQ file to read from.\n";
+    SeqFileOut seqFileOut;
+    if (!open(seqFileOut, fasta_file.c_str())){
+        std::cerr << "ERROR: Could not open FASTA file \'" << fasta_file << "\' to write into.\n";
         return 1;
     }
 
     StringSet<CharString> ids;
     StringSet<Dna5String> seqs;
-    StringSet<CharString> quals;
+    CharString id;
+    Dna5String seq;
+    CharString qual;    // we don't need them
 
     try{
-        readRecords(ids, seqs, quals, seqFileIn);
+        while (!atEnd(seqFileIn)){
+            size_t chunk_bases = 0;
+            while (!atEnd(seqFileIn) && chunk_bases < chunk_size){
+                readRecord(id, seq, qual, seqFileIn);
+                appendValue(ids, id);
+                appendValue(seqs, seq);
+                chunk_bases += length(id) + length(seq);
+            }
+
+            writeRecords(seqFileOut, ids, seqs);
+            clear(ids);
+            clear(seqs);
+        }
     }
     catch (Exception const & e){
         std::cout << "ERROR: " << e.what() << std::endl;
@@ -53,41 +98,297 @@ inline bool fastq2fasta(const std::string &fastq_file, const std::string &outpat
     }
 
     close(seqFileIn);
-    clear(quals);   // we don't need them
+    close(seqFileOut);
+
+    return 0;
+}
 
-    // get FASTQ filename without path and without file ending
-    size_t lastSlashPos = fastq_file.find_last_of("/");
-    std::string fname   = fastq_file.substr(lastSlashPos+1);
-    size_t lastDotPos   = fname.find_last_of(".");
-    std::string fname_  = fname.substr(0,lastDotPos);
 
-    // create FASTA filename
-    std::string ofile_name;
-    if (strcmp(outpath.c_str(), "") == 0){
-        ofile_name = fname_+".fasta";
+/**
+ *          Function to convert all input files to sample spools.
+ * @details Up to nb_threads samples are converted concurrently. Every conversion streams its
+ *          sample with an equal share of max_memory.
+ * @param   input_files are the names of the input FASTQ files
+ * @param   fasta_files are the names of the FASTAs to write, in the order of input_files
+ * @param   nb_threads is the maximum number of concurrent conversions
+ * @param   max_memory is the memory cap of all conversions in MB
+ * @return  bool; 1 if error, 0 else
+ */
+inline bool convertSamples(const std::vector<std::string> &input_files,
+                           const std::vector<std::string> &fasta_files,
+                           const size_t nb_threads,
+                           const size_t max_memory){
+    const size_t nb_workers = std::max((size_t)1, std::min(nb_threads, input_files.size()));
+    // a base takes about two bytes while buffered (sequence and id, plus StringSet overhead)
+    const size_t chunk_size = std::max((size_t)1 << 20, (max_memory << 19) / nb_workers);
+
+    std::atomic<size_t> next_sample(0);
+    std::atomic<bool> failed(false);
+    std::vector<std::thread> workers;
+
+    for (size_t t = 0; t < nb_workers; ++t){
+        workers.push_back(std::thread([&](){
+            for (size_t i = next_sample++; i < input_files.size(); i = next_sample++)
+                if (fastq2fasta(input_files[i], fasta_files[i], chunk_size))
+                    failed = true;
+        }));
     }
-    else{
-        ofile_name = getAbsoluteFileName(outpath, fname_+".fasta");
+    for (auto &worker : workers)
+        worker.join();
+
+    return failed;
+}
+
+
+/**
+ *          Function to append FASTA records to a sample spool.
+ * @details The records are compressed into a new gzip member at the end of the spool. Concatenated
+ *          gzip members form a valid gzip file, hence the spool grows from iteration to iteration
+ *          without rewriting (or re-compressing) the sequences it already holds.
+ * @param   spool_file is the name of the gzip-compressed sample FASTA
+ * @param   records is a buffer of FASTA records
+ * @return  bool; 1 if error, 0 else
+ */
+inline bool appendToSpool(const std::string &spool_file, const std::string &records){
+    if (records.empty())
+        return 0;
+
+    gzFile gz = gzopen(spool_file.c_str(), "ab1");
+    if (gz == NULL){
+        std::cerr << "ERROR: Could not open sample file \'" << spool_file << "\' for writing." << std::endl;
+        return 1;
     }
-    fasta_names.push_back(ofile_name);
 
-    // write FASTA
-    SeqFileOut seqFileOut(ofile_name.c_str());
-    if (!open(seqFileOut, ofile_name.c_str())){
-        std::cerr << "ERROR: Could not open FASTA file to write into.\n";
+    int written = gzwrite(gz, records.data(), (unsigned)records.size());
+
+    if (gzclose(gz) != Z_OK || written != (int)records.size()){
+        std::cerr << "ERROR: Could not write to sample file \'" << spool_file << "\'." << std::endl;
         return 1;
     }
 
-    try{
-        writeRecords(seqFileOut, ids, seqs);
+    return 0;
+}
+
+
+/**
+ *          Joins a thread when it goes out of scope.
+ * @details Any exit path of popins2_multik() may leave the FASTQ to FASTA conversion running,
+ *          destroying it while still joinable would terminate the program.
+ */
+struct ThreadJoinGuard
+{
+    std::thread &thread;
+
+    explicit ThreadJoinGuard(std::thread &thread_) : thread(thread_) {}
+
+    ~ThreadJoinGuard(){
+        if (thread.joinable())
+            thread.join();
     }
-    catch (Exception const & e){
-        std::cout << "ERROR: " << e.what() << std::endl;
+};
+
+
+/**
+ *          Pool of buffered writers to the sample spools of one multi-k iteration.
+ * @details The pool holds one record buffer per color (dense, indexed by the color ID of the graph).
+ *          A buffer is appended to its spool only once it exceeds flush_size, hence the unitigs of
+ *          a single pass over the graph reach all their samples with few, large writes.
+ */
+struct SpoolWriterPool
+{
+    std::vector<std::string> spool_files;
+    std::vector<std::string> buffers;
+    size_t flush_size;
+
+    SpoolWriterPool(const std::vector<std::string> &files, const size_t flush_size_ = 1 << 20) :
+        spool_files(files), buffers(files.size()), flush_size(flush_size_) {}
+};
+
+
+/**
+ *          Function to add a FASTA record to the buffer of a color.
+ * @param   pool is the writer pool of the current iteration
+ * @param   color is the color ID of the target sample
+ * @param   record is the FASTA record (header and sequence line)
+ * @return  bool; 1 if error, 0 else
+ */
+inline bool appendRecord(SpoolWriterPool &pool, const size_t color, const std::string &record){
+    std::string &buffer = pool.buffers[color];
+    buffer += record;
+
+    if (buffer.size() < pool.flush_size)
+        return 0;
+
+    bool ret = appendToSpool(pool.spool_files[color], buffer);
+    buffer.clear();
+    return ret;
+}
+
+
+/**
+ *          Function to write all remaining buffers of the pool to their spools.
+ * @param   pool is the writer pool of the current iteration
+ * @return  bool; 1 if error, 0 else
+ */
+inline bool flushSpoolWriterPool(SpoolWriterPool &pool){
+    bool failed = false;
+    for (size_t color = 0; color < pool.buffers.size(); ++color){
+        failed = appendToSpool(pool.spool_files[color], pool.buffers[color]) || failed;
+        std::string().swap(pool.buffers[color]);
+    }
+    return failed;
+}
+
+
+/**
+ *          Checkpoint of a multi-k run.
+ * @details The manifest is written after every completed iteration and lists the k of the next
+ *          iteration together with the size and CRC-32 of every sample spool. The spools are only
+ *          appended to, hence their checksums are extended by the appended bytes only.
+ */
+struct MultikManifest
+{
+    unsigned iteration;
+    int next_k;
+    std::vector<std::string> spool_files;
+    std::vector<uint64_t> sizes;
+    std::vector<uLong> checksums;
+
+    MultikManifest() : iteration(0), next_k(0) {}
+};
+
+
+/**
+ *          Function to extend the CRC-32 of a file by the bytes following the first size bytes.
+ * @param   file is the name of the file
+ * @param   size is the number of bytes covered by crc, updated to the number of bytes read
+ * @param   crc is the CRC-32 of the first size bytes, updated to the CRC-32 of all bytes read
+ * @param   limit is the maximum number of bytes to cover
+ * @return  bool; 1 if error, 0 else
+ */
+inline bool extendChecksum(const std::string &file, uint64_t &size, uLong &crc, const uint64_t limit = (uint64_t)-1){
+    std::ifstream stream(file.c_str(), std::ios::binary);
+    if (!stream.good()){
+        std::cerr << "ERROR: Could not open sample file \'" << file << "\' for reading." << std::endl;
         return 1;
     }
+    stream.seekg(size);
 
+    std::vector<char> buffer(1 << 20);
+    while (size < limit && stream.good()){
+        stream.read(&buffer[0], std::min((uint64_t)buffer.size(), limit - size));
+        crc   = crc32(crc, (const Bytef *)&buffer[0], (uInt)stream.gcount());
+        size += stream.gcount();
+    }
 
-    close(seqFileOut);
+    return 0;
+}
+
+
+/**
+ *          Function to update the spool checksums of the manifest to the current spool contents.
+ * @return  bool; 1 if error, 0 else
+ */
+inline bool updateSpoolChecksums(MultikManifest &manifest){
+    for (size_t i = 0; i < manifest.spool_files.size(); ++i)
+        if (extendChecksum(manifest.spool_files[i], manifest.sizes[i], manifest.checksums[i]))
+            return 1;
+    return 0;
+}
+
+
+/**
+ *          Function to write the manifest. It is written to a temporary file first and renamed,
+ *          hence an interruption never leaves a partial manifest behind.
+ * @return  bool; 1 if error, 0 else
+ */
+inline bool writeMultikManifest(const MultikManifest &manifest, const std::string &filename){
+    std::string temp_filename = filename + ".tmp";
+    std::ofstream stream(temp_filename.c_str());
+    if (!stream.good()){
+        std::cerr << "ERROR: Could not open manifest file \'" << temp_filename << "\' for writing." << std::endl;
+        return 1;
+    }
+
+    stream << "iteration\t" << manifest.iteration << "\n";
+    stream << "next_k\t" << manifest.next_k << "\n";
+    for (size_t i = 0; i < manifest.spool_files.size(); ++i)
+        stream << "spool\t" << manifest.spool_files[i] << "\t" << manifest.sizes[i] << "\t" << manifest.checksums[i] << "\n";
+    stream.close();
+
+    if (stream.fail() || std::rename(temp_filename.c_str(), filename.c_str()) != 0){
+        std::cerr << "ERROR: Could not write manifest file \'" << filename << "\'." << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/**
+ *          Function to read the manifest.
+ * @return  bool; 1 if error, 0 else
+ */
+inline bool readMultikManifest(MultikManifest &manifest, const std::string &filename){
+    std::ifstream stream(filename.c_str());
+    if (!stream.good()){
+        std::cerr << "ERROR: Could not open manifest file \'" << filename << "\' for reading." << std::endl;
+        return 1;
+    }
+
+    std::string line, field;
+    while (std::getline(stream, line)){
+        std::istringstream iss(line);
+        iss >> field;
+        if (field == "iteration")
+            iss >> manifest.iteration;
+        else if (field == "next_k")
+            iss >> manifest.next_k;
+        else if (field == "spool"){
+            std::string file;
+            uint64_t size;
+            uLong checksum;
+            std::getline(iss >> std::ws, file, '\t');
+            iss >> size >> checksum;
+            manifest.spool_files.push_back(file);
+            manifest.sizes.push_back(size);
+            manifest.checksums.push_back(checksum);
+        }
+        if (iss.fail()){
+            std::cerr << "ERROR: Malformed line in manifest file \'" << filename << "\': " << line << std::endl;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+ *          Function to restore the spools to the state recorded in the manifest.
+ * @details Bytes appended by an interrupted iteration are truncated, then the checksum of every
+ *          spool is verified.
+ * @return  bool; 1 if error, 0 else
+ */
+inline bool restoreSpools(const MultikManifest &manifest){
+    for (size_t i = 0; i < manifest.spool_files.size(); ++i){
+        const std::string &file = manifest.spool_files[i];
+
+        if (truncate(file.c_str(), manifest.sizes[i]) != 0){
+            std::cerr << "ERROR: Could not truncate sample file \'" << file << "\': " << strerror(errno) << std::endl;
+            return 1;
+        }
+
+        uint64_t size = 0;
+        uLong crc = crc32(0L, Z_NULL, 0);
+        if (extendChecksum(file, size, crc, manifest.sizes[i]))
+            return 1;
+
+        if (size != manifest.sizes[i] || crc != manifest.checksums[i]){
+            std::cerr << "ERROR: Sample file \'" << file << "\' does not match the manifest." << std::endl;
+            return 1;
+        }
+    }
 
     return 0;
 }
@@ -95,30 +396,32 @@ inline bool fastq2fasta(const std::string &fastq_file, const std::string &outpat
 
 /**
  *          This function defines the boolean logic to decide if a color for unitig is significant.
- *  @param  b1, b2, b3 are boolean values to compare
+ * @details Evaluated on 64 colors at once: a bit is set if it is set in at least 2 out of 3 words.
+ *  @param  b1, b2, b3 are bitset words to compare
  */
-inline bool logicDecision(const bool b1, const bool b2, const bool b3){
-    // true if at least 2 out of 3 are true
-    return b1 ? (b2 || b3) : (b2 && b3);
+inline uint64_t logicDecision(const uint64_t b1, const uint64_t b2, const uint64_t b3){
+    return (b1 & b2) | (b1 & b3) | (b2 & b3);
 }
 
 
 /**
  *          This function extract the color bits of a kmer position of UnitigColorMap
  *  @param  ucm is a unitig of the graph
- *  @param  colorBits is a vector to store the color bits of the kmer
+ *  @param  colorBits is a bitset of 64-bit words to store the color bits of the kmer
  *  @param  pos is the position of the kmer in the unitig (ucm)
  */
-inline void getColorBitsOfPosition(const UnitigColorMap<void> &ucm, std::vector<bool> &colorBits, const size_t pos){
+inline void getColorBitsOfPosition(const UnitigColorMap<void> &ucm, uint64_t *colorBits, const size_t pos){
     UnitigColorMap<void> kmer;
-    UnitigColors* colors;
+    const UnitigColors* colors;
 
     kmer   = ucm.getKmerMapping(pos);
     colors = kmer.getData()->getUnitigColors(kmer);
 
     UnitigColors::const_iterator cit = colors->begin(kmer);
-    for (; cit != colors->end(); ++cit)
-        colorBits[cit.getColorID()] = true;
+    for (; cit != colors->end(); ++cit){
+        const size_t color = cit.getColorID();
+        colorBits[color >> 6] |= uint64_t(1) << (color & 63);
+    }
 }
 
 
@@ -126,24 +429,82 @@ inline void getColorBitsOfPosition(const UnitigColorMap<void> &ucm, std::vector<
  *          This function defines how to subsample kmers from a unitig.
  *  @param  ucm is a unitig of the graph
  *  @param  color_indices is a list of samples the unitig should be added to
+ *  @param  colorBits is a buffer of three bitsets of nb_words words each, reused between calls
+ *  @param  nb_words is the number of 64-bit words per bitset
  */
-inline void colorProbing(const UnitigColorMap<void> &ucm, std::vector<size_t> &color_indices, const size_t nb_colors){
+inline void colorProbing(const UnitigColorMap<void> &ucm, std::vector<size_t> &color_indices, std::vector<uint64_t> &colorBits, const size_t nb_words){
     // the current approach is to ckeck the unitig colors at three positions: start, middle and end
     // NOTE: finding the end position usually requires strand awareness, but this is not important here
     size_t end = ucm.len - 1;
     size_t mid = floor(end / 2);
 
-    std::vector<bool> startColorBits(nb_colors, false);
-    std::vector<bool> middleColorBits(nb_colors, false);
-    std::vector<bool> endColorBits(nb_colors, false);
+    std::fill(colorBits.begin(), colorBits.end(), 0);
+    uint64_t *startColorBits  = &colorBits[0];
+    uint64_t *middleColorBits = &colorBits[nb_words];
+    uint64_t *endColorBits    = &colorBits[2 * nb_words];
 
     getColorBitsOfPosition(ucm, startColorBits, 0);
     getColorBitsOfPosition(ucm, middleColorBits, mid);
     getColorBitsOfPosition(ucm, endColorBits, end);
 
-    for (size_t i = 0; i < nb_colors; ++i)
-        if (logicDecision(startColorBits[i], middleColorBits[i], endColorBits[i]))
-            color_indices.push_back(i);
+    for (size_t w = 0; w < nb_words; ++w){
+        uint64_t word = logicDecision(startColorBits[w], middleColorBits[w], endColorBits[w]);
+        while (word != 0){
+            color_indices.push_back((w << 6) + __builtin_ctzll(word));
+            word &= word - 1;
+        }
+    }
+}
+
+
+/**
+ *          Colors assigned to a consecutive range of unitigs, stored in compressed sparse rows.
+ * @details The colors of unitig unitig_ids[i] are colors[offsets[i]] to colors[offsets[i+1]-1].
+ */
+struct UnitigColorAssignment
+{
+    std::vector<size_t> unitig_ids;
+    std::vector<size_t> offsets;
+    std::vector<size_t> colors;
+
+    UnitigColorAssignment() : offsets(1, 0) {}
+};
+
+
+/**
+ *          Function to assign colors to a range of unitigs. Each thread of the probing runs this
+ *          function on its own range and result buffer, the graph is only read.
+ *  @param  unitigs are all unitigs of the graph in iteration order
+ *  @param  begin, end define the range [begin, end) of unitigs to process
+ *  @param  k is the kmer length of the current iteration
+ *  @param  nb_colors is the number of colors of the graph
+ *  @param  assignment is the result buffer of the range
+ */
+inline void probeUnitigRange(const std::vector<UnitigColorMap<void> > &unitigs,
+                             const size_t begin,
+                             const size_t end,
+                             const size_t k,
+                             const size_t nb_colors,
+                             UnitigColorAssignment &assignment){
+    const size_t nb_words = (nb_colors + 63) / 64;
+    std::vector<uint64_t> colorBits(3 * nb_words);
+    std::vector<size_t> color_indices;
+
+    for (size_t i = begin; i < end; ++i){
+        // don't process unitigs of size less than current k, they wouldn't survive the include of the next k iteration anyway
+        if (unitigs[i].size < k)
+            continue;
+
+        colorProbing(unitigs[i], color_indices, colorBits, nb_words);
+
+        if (color_indices.empty())
+            continue;
+
+        assignment.unitig_ids.push_back(i);
+        assignment.colors.insert(assignment.colors.end(), color_indices.begin(), color_indices.end());
+        assignment.offsets.push_back(assignment.colors.size());
+        color_indices.clear();
+    }
 }
 
 
@@ -182,37 +543,75 @@ int popins2_multik(int argc, char const *argv[]){
 
     // create a FASTA at tempDir for every input FASTQ
     std::vector<std::string> temp_fastas;
-    bool fastq2fasta_failed = false;
-
-    for (auto &sample : mko.inputFiles){
-        bool ret = fastq2fasta(sample, mko.tempPath, temp_fastas);
-        fastq2fasta_failed = fastq2fasta_failed || ret;
+    std::unordered_map<std::string, size_t> sample_of_file;
+    for (size_t i = 0; i < mko.inputFiles.size(); ++i){
+        temp_fastas.push_back(getSpoolFileName(mko.inputFiles[i], mko.tempPath));
+        sample_of_file[mko.inputFiles[i]] = i;
+        sample_of_file[temp_fastas[i]]    = i;
     }
-    if (fastq2fasta_failed){
-        std::cerr << "[Error] Initial FASTQ to FASTA conversion failed]" << '\n';
-        return 1;
+
+    // initial checkpoint: converted spools, no iteration completed yet
+    const std::string manifest_file = getAbsoluteFileName(mko.tempPath, "multik.manifest");
+    MultikManifest manifest;
+    manifest.next_k      = mko.k_init;
+    manifest.spool_files = temp_fastas;
+    manifest.sizes.assign(temp_fastas.size(), 0);
+    manifest.checksums.assign(temp_fastas.size(), crc32(0L, Z_NULL, 0));
+
+    if (mko.resume){
+        msg << "[popins2 multik] Resuming from "+manifest_file+"..."; printTimeStatus(msg);
+        MultikManifest checkpoint;
+        if (readMultikManifest(checkpoint, manifest_file))
+            return 1;
+        if (checkpoint.spool_files != temp_fastas){
+            std::cerr << "ERROR: The sample files of the manifest do not match the input files." << std::endl;
+            return 1;
+        }
+        if (restoreSpools(checkpoint))
+            return 1;
+        manifest = checkpoint;
+        mko.direct_fastq = false;
     }
 
-    (mko.inputFiles).clear();
+    // with --direct-fastq the first graph is built from the input files and the conversion runs meanwhile,
+    // it is not needed at all if there is only one iteration; a resumed run has complete spools already
+    std::thread conversion;
+    std::atomic<bool> fastq2fasta_failed(false);
+    ThreadJoinGuard conversion_guard(conversion);
+
+    if (!mko.resume && !mko.direct_fastq){
+        msg << "[popins2 multik] Converting FASTQ to FASTA..."; printTimeStatus(msg);
+        if (convertSamples(mko.inputFiles, temp_fastas, mko.nb_threads, mko.max_memory)){
+            std::cerr << "[Error] Initial FASTQ to FASTA conversion failed]" << '\n';
+            return 1;
+        }
+        if (updateSpoolChecksums(manifest) || writeMultikManifest(manifest, manifest_file))
+            return 1;
+    }
+    else if (!mko.resume && (unsigned)mko.k_init + delta_k <= (unsigned)k_max){
+        conversion = std::thread([&](){
+            fastq2fasta_failed = convertSamples(mko.inputFiles, temp_fastas, mko.nb_threads, mko.max_memory);
+        });
+    }
 
     // =====================
     // Graph options
     // =====================
     CCDBG_Build_opt opt;
-    opt.filename_seq_in   = temp_fastas;
+    opt.filename_seq_in   = mko.direct_fastq ? mko.inputFiles : temp_fastas;
     opt.deleteIsolated    = true;
     opt.clipTips          = true;
     opt.useMercyKmers     = false;
     opt.prefixFilenameOut = mko.prefixFilenameOut;
-    opt.nb_threads        = 16;
+    opt.nb_threads        = mko.nb_threads;
     opt.outputGFA         = true;
     opt.verbose           = false;
-    opt.k                 = mko.k_init;
+    opt.k                 = manifest.next_k;
 
     // =====================
     // Multi-k framework
     // =====================
-    unsigned k_iter_counter = 0;
+    unsigned k_iter_counter = manifest.iteration;
     while (opt.k <= k_max) {
         ++k_iter_counter;
         msg << "[popins2 multik] Multi-k iteration "+std::to_string(k_iter_counter)+" using k="+std::to_string(opt.k); printTimeStatus(msg);
@@ -237,66 +636,75 @@ int popins2_multik(int argc, char const *argv[]){
             break;
         }
 
-        // get sample-unitig assignment
-        msg << "[popins2 multik] Get sample-unitig assignment..."; printTimeStatus(msg);
+        // get sample-unitig assignment and append the unitigs to their sample spools in a single pass
+        msg << "[popins2 multik] Adding (k + delta_k)-unitigs to sample spools..."; printTimeStatus(msg);
         const size_t nb_colors = g.getNbColors();
-        std::unordered_map <std::string, std::vector<unsigned> > unitig_propagation_table;
-        std::vector<size_t> color_indices;
-        unsigned ucm_index = 0;
-
-        for (auto &ucm : g){
-            // don't process unitigs of size less than current k, they wouldn't survive the include of the next k iteration anyway
-            if (ucm.size < (unsigned)opt.k){
-                ++ucm_index;
-                continue;
-            }
 
-            colorProbing(ucm, color_indices, nb_colors);
-
-            for (size_t i = 0; i < color_indices.size(); ++i)
-                unitig_propagation_table[g.getColorName(i)].push_back(ucm_index);
+        // the spools have to be complete before the first unitigs are appended
+        if (conversion.joinable()){
+            conversion.join();
+            if (fastq2fasta_failed){
+                std::cerr << "[Error] Initial FASTQ to FASTA conversion failed]" << '\n';
+                return 1;
+            }
+            opt.filename_seq_in = temp_fastas;
 
-            ++ucm_index;
-            color_indices.clear();
+            if (updateSpoolChecksums(manifest))
+                return 1;
         }
 
-        // write unitig file per sample
-        msg << "[popins2 multik] Adding (k + delta_k)-unitigs to temp FASTAs..."; printTimeStatus(msg);
-        for (auto sample = unitig_propagation_table.cbegin(); sample != unitig_propagation_table.cend(); ++sample){
-
-            std::ofstream stream(sample->first, std::ofstream::out | std::ofstream::app);
-            if (!stream.good())
-            {
-                std::cerr << "ERROR: Could not open sample file \'" << sample->first << "\' for writing." << std::endl;
+        std::vector<std::string> spool_files(nb_colors);
+        for (size_t color = 0; color < nb_colors; ++color){
+            auto sample = sample_of_file.find(g.getColorName(color));
+            if (sample == sample_of_file.end()){
+                std::cerr << "ERROR: Unknown color name \'" << g.getColorName(color) << "\'." << std::endl;
                 return 1;
             }
+            spool_files[color] = temp_fastas[sample->second];
+        }
 
-            // iterators pointing to the unitig ID list of a sample
-            std::vector<unsigned>::const_iterator idx = sample->second.cbegin();
-            std::vector<unsigned>::const_iterator idx_end = sample->second.cend();
-
-            // loop through graph
-            unsigned current_ucm_idx = 0;
-            for (auto &ucm : g){
-
-                if (*idx == current_ucm_idx){
-
-                    // write unitig to file
-                    stream << ">unitig_" << std::to_string(current_ucm_idx) << "\n";
-                    stream << ucm.referenceUnitigToString() << "\n";
+        // probe the unitig colors with one consecutive range of unitigs per thread
+        std::vector<UnitigColorMap<void> > unitigs;
+        unitigs.reserve(g.size());
+        for (auto &ucm : g)
+            unitigs.push_back(ucm);
+
+        const size_t nb_ranges  = std::max((size_t)1, std::min((size_t)opt.nb_threads, unitigs.size()));
+        const size_t range_size = (unitigs.size() + nb_ranges - 1) / nb_ranges;
+        std::vector<UnitigColorAssignment> assignments(nb_ranges);
+        std::vector<std::thread> workers;
+
+        for (size_t r = 0; r < nb_ranges; ++r){
+            size_t begin = std::min(r * range_size, unitigs.size());
+            size_t end   = std::min(begin + range_size, unitigs.size());
+            workers.push_back(std::thread(probeUnitigRange, std::cref(unitigs), begin, end, (size_t)opt.k, nb_colors, std::ref(assignments[r])));
+        }
+        for (auto &worker : workers)
+            worker.join();
 
-                    ++idx;
+        // write the unitigs to their samples in graph order
+        SpoolWriterPool pool(spool_files);
+        std::string record;
 
-                    if (idx == idx_end)
-                        break;
-                }
+        for (auto &assignment : assignments){
+            for (size_t i = 0; i < assignment.unitig_ids.size(); ++i){
+                const size_t ucm_index = assignment.unitig_ids[i];
+                record = ">unitig_" + std::to_string(ucm_index) + "\n" + unitigs[ucm_index].referenceUnitigToString() + "\n";
 
-                current_ucm_idx += 1;
+                for (size_t c = assignment.offsets[i]; c < assignment.offsets[i+1]; ++c)
+                    if (appendRecord(pool, assignment.colors[c], record))
+                        return 1;
             }
-
-            stream.close();
         }
 
+        if (flushSpoolWriterPool(pool))
+            return 1;
+
+        // checkpoint
+        manifest.iteration = k_iter_counter;
+        manifest.next_k    = opt.k;
+        if (updateSpoolChecksums(manifest) || writeMultikManifest(manifest, manifest_file))
+            return 1;
     }
 
     // =====================
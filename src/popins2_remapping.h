@@ -7,6 +7,7 @@
 #include "util.h"
 #include "argument_parsing.h"
 #include "crop_unmapped.h"
+#include "stage_manifest.h"
 
 #ifndef POPINS2_REMAPPING_H_
 #define POPINS2_REMAPPING_H_
@@ -14,6 +15,48 @@
 using namespace seqan;
 
 
+// ==========================================================================
+// Function cropCommandSam()
+// ==========================================================================
+
+// Runs the command and crops its sam output, which has to be grouped by read name, see cropNameGroups().
+// The header is read into header, the mates are appended to mates. Returns false if the command fails.
+template<typename TAdapterTag>
+inline bool
+cropCommandSam(int & found,
+        String<BamAlignmentRecord> & mates,
+        BamHeader & header,
+        SamPipeIn & samFile,
+        char const * command,
+        SeqFileOut & fastqFirstStream,
+        SeqFileOut & fastqSecondStream,
+        ReadPairing & pairing,
+        int humanSeqs,
+        TAdapterTag tag,
+        float as_factor,
+        bool qualityFilter)
+{
+    if (!open(samFile, command))
+    {
+        close(samFile);
+        return false;
+    }
+
+    bool ok = true;
+    try
+    {
+        readHeader(header, samFile);
+        found += cropNameGroups(mates, samFile, fastqFirstStream, fastqSecondStream, pairing, humanSeqs, tag, as_factor, qualityFilter);
+    }
+    catch (Exception const & e)
+    {
+        std::cerr << "ERROR: " << e.what() << std::endl;
+        ok = false;
+    }
+
+    return close(samFile) == 0 && ok;
+}
+
 // ==========================================================================
 // Function popins2_remapping()
 // could be taken apart in snakemake, only calling external functions(SAMTOOLS/BWA)
@@ -47,32 +90,62 @@ inline int popins2_remapping(int argc, char const ** argv)
     Triple<CharString> fastqFilesTemp = fastqFiles;
        
 
-    CharString f1 = options.prefix;
-    f1 += "remapped.sam";
-    CharString remappedSam = getFileName(options.workingDir, f1);
+    // The remapped reads are written to temporary files while bwa reads the current ones.
+    Triple<CharString> remappedFastqFiles = fastqFiles;
+    remappedFastqFiles.i1 += ".remapped";
+    remappedFastqFiles.i2 += ".remapped";
+    remappedFastqFiles.i3 += ".remapped";
 
     CharString f2 = options.prefix;
     f2 += "remapped.bam";
     CharString remappedBam = getFileName(options.workingDir, f2);
 
-    CharString f3 = options.prefix;
-    f3 += "remapped.bam.bai";
-    CharString remappedBai = getFileName(options.workingDir, f3);
-
-    CharString f4 = options.prefix;
-    f4 += "remapped_unsorted.bam";
-    CharString remappedUnsortedBam = getFileName(options.workingDir, f4);
+    // Skip the remapping if the manifest records it with the same inputs and parameters. The fastq files are
+    // replaced by the remapping, they match if they are its outputs.
+    StageManifest manifest;
+    if (readManifest(manifest, getFileName(workingDirectory, "POPINS_MANIFEST")) != 0)
+        return 1;
+    StageRecord stage("remapping");
+    addParam(stage, "humanSeqs", options.humanSeqs);
+    addParam(stage, "alignmentScoreFactor", options.alignment_score_factor);
+    addParam(stage, "compressFastq", options.compressFastq);
+    addParam(stage, "qualityFilter", options.qualityFilter);
+    addInput(stage, manifest, fastqFiles.i1);
+    addInput(stage, manifest, fastqFiles.i2);
+    addInput(stage, manifest, fastqFiles.i3);
+    addInput(stage, manifest, options.referenceFile);
+
+    if (stageUpToDate(manifest, stage))
+    {
+        msg << "Skipping remapping, " << fastqFiles.i1 << ", " << fastqFiles.i2 << ", " << fastqFiles.i3 << ", and " << remappedBam << " are up to date.";
+        printStatus(msg);
+        return 0;
+    }
+    if (beginStage(manifest, stage) != 0)
+        return 1;
 
-    
-    msg << "Remapping unmapped reads using " << BWA;
+    msg << "Remapping unmapped reads using " << BWA << " and cropping them from the bwa output";
     printStatus(msg);
 
-    
+    // The bwa output is grouped by read name and cropped as it is read from the pipes. The output
+    // for single end reads shares the reference names with the output for pairs.
+    SamPipeIn pairedSam;
+    SamPipeIn singleSam(context(pairedSam));
+    BamHeader header;
+    String<BamAlignmentRecord> mates;
+    int found = 0;
+
+    unsigned compressionThreads = options.compressFastq ? std::max(options.threads, 1u) : 0;
+    FastqFileOut fastqFirstStream(toCString(remappedFastqFiles.i1), compressionThreads);
+    FastqFileOut fastqSecondStream(toCString(remappedFastqFiles.i2), compressionThreads);
+    FastqFileOut fastqSingleStream(toCString(remappedFastqFiles.i3), compressionThreads);
+    ReadPairing pairing(0, toCString(remappedFastqFiles.i3));
 
     // Run BWA on unmapped reads (pairs).
     cmd.str("");
-    cmd << BWA << " mem -t " << options.threads << " " << options.referenceFile << " " << fastqFilesTemp.i1 << " " << fastqFilesTemp.i2 << " > " << remappedSam;
-    if (system(cmd.str().c_str()) != 0)
+    cmd << BWA << " mem -t " << options.threads << " " << options.referenceFile << " " << fastqFilesTemp.i1 << " " << fastqFilesTemp.i2;
+    if (!cropCommandSam(found, mates, header, pairedSam, cmd.str().c_str(), fastqFirstStream, fastqSecondStream, pairing,
+                        options.humanSeqs, NoAdapters(), options.alignment_score_factor, options.qualityFilter))
     {
         std::cerr << "ERROR while running bwa on " << fastqFilesTemp.i1 << " and " << fastqFilesTemp.i2 << std::endl;
         return 1;
@@ -82,9 +155,11 @@ inline int popins2_remapping(int argc, char const ** argv)
     remove(toCString(fastqFilesTemp.i2));
 
     // Run BWA on unmapped reads (single end).
+    BamHeader singleHeader;
     cmd.str("");
-    cmd << BWA << " mem -t " << options.threads << " " << options.referenceFile << " " << fastqFilesTemp.i3 << " | awk '$1 !~ /@/' >> " << remappedSam;
-    if (system(cmd.str().c_str()) != 0)
+    cmd << BWA << " mem -t " << options.threads << " " << options.referenceFile << " " << fastqFilesTemp.i3;
+    if (!cropCommandSam(found, mates, singleHeader, singleSam, cmd.str().c_str(), fastqFirstStream, fastqSecondStream, pairing,
+                        options.humanSeqs, NoAdapters(), options.alignment_score_factor, options.qualityFilter))
     {
         std::cerr << "ERROR while running bwa on " << fastqFilesTemp.i3 << std::endl;
         return 1;
@@ -92,69 +167,45 @@ inline int popins2_remapping(int argc, char const ** argv)
 
     remove(toCString(fastqFilesTemp.i3));
 
-    msg.str("");
-    msg << "Converting BWA output " << remappedSam << " to bam format.";
-    printStatus(msg);
-
-    // Convert BWA output to bam.
-    cmd.str("");
-    cmd << SAMTOOLS << " view -S -h -b " << remappedSam << " > " << remappedUnsortedBam;
-    if (system(cmd.str().c_str()) != 0)
-    {
-        std::cerr << "ERROR while converting BWA output " << remappedSam << " to bam." << std::endl;
+    // Write the remaining fastq records and replace the fastq files.
+    if (writeFastq(fastqFirstStream, fastqSecondStream, fastqSingleStream, pairing) != 0)
         return 1;
-    }
-    remove(toCString(remappedSam));
-
-    msg.str("");
-    msg << "Sorting " << remappedUnsortedBam << " using " << SAMTOOLS;
-    printStatus(msg);
-
-    // Sort bam file.
-    cmd.str("");
-    cmd << SAMTOOLS << " sort -@ " << options.threads << " -m " << options.memory << " -o " << remappedBam << " " << remappedUnsortedBam;
-    if (system(cmd.str().c_str()) != 0)
+    if (!close(fastqFirstStream) || !close(fastqSecondStream) || !close(fastqSingleStream) ||
+            rename(toCString(remappedFastqFiles.i1), toCString(fastqFiles.i1)) != 0 ||
+            rename(toCString(remappedFastqFiles.i2), toCString(fastqFiles.i2)) != 0 ||
+            rename(toCString(remappedFastqFiles.i3), toCString(fastqFiles.i3)) != 0)
     {
-        std::cerr << "ERROR while sorting BWA output " << remappedUnsortedBam << std::endl;
+        std::cerr << "ERROR while writing " << fastqFiles.i1 << ", " << fastqFiles.i2 << ", " << fastqFiles.i3 << std::endl;
         return 1;
     }
 
     msg.str("");
-    msg << "Indexing " << remappedBam << " using " << SAMTOOLS;
+    msg << "Unmapped reads written to " << fastqFiles.i1 << ", " << fastqFiles.i2 << ", " << fastqFiles.i3;
     printStatus(msg);
 
-    // Index bam file.
-    cmd.str("");
-    cmd << SAMTOOLS << " index " << remappedBam;
-    if (system(cmd.str().c_str()) != 0)
+    // Only the mates are sorted by read name, as merge_and_set_mate() expects them.
+    BamFileOut matesStream(context(pairedSam));
+    if (!open(matesStream, toCString(remappedBam)))
     {
-        std::cerr << "ERROR while indexing BWA output " << remappedBam << std::endl;
+        std::cerr << "ERROR: Could not open " << remappedBam << " for writing." << std::endl;
         return 1;
     }
+    setSortOrder(header, "queryname");
+    writeHeader(matesStream, header);
+    writeNameSortedMates(matesStream, mates);
 
     msg.str("");
-    msg << "Cropping unmapped reads from " << remappedBam;
+    msg << "Mapped mates of unmapped reads written to " << remappedBam << " , " << found << " found in read groups.";
     printStatus(msg);
 
-    // Crop unmapped and create bam file of remapping.
-    if (crop_unmapped(fastqFiles, remappedUnsortedBam, remappedBam, options.humanSeqs, NoAdapters(), options.alignment_score_factor) != 0)
+    close(matesStream);
+    String<CharString> outputs;
+    appendValue(outputs, fastqFiles.i1);
+    appendValue(outputs, fastqFiles.i2);
+    appendValue(outputs, fastqFiles.i3);
+    appendValue(outputs, remappedBam);
+    if (finishStage(manifest, stage, outputs) != 0)
         return 1;
-    remove(toCString(remappedBai));
-
-    msg.str("");
-    msg << "Sorting " << remappedUnsortedBam << " by read name using " << SAMTOOLS;
-    printStatus(msg);
-
-    // Sort <WD>/remapped.bam by read name.
-    cmd.str("");
-    cmd << SAMTOOLS << " sort -n -@ " << options.threads << " -m " << options.memory << " -o " << remappedBam << " " << remappedUnsortedBam << " ";
-    if (system(cmd.str().c_str()) != 0)
-    {
-        std::cerr << "ERROR while sorting " << remappedUnsortedBam << std::endl;
-        return 1;
-    }
-
-    remove(toCString(remappedUnsortedBam));
 
     return 0;
 }
@@ -2,6 +2,7 @@
 #define POPINS_CONTIGMAP_H_
 
 #include <sstream>
+#include <unordered_map>
 
 #include <seqan/file.h>
 #include <seqan/sequence.h>
@@ -10,117 +11,231 @@
 #include "util.h"
 #include "argument_parsing.h"
 #include "popins2_merge_and_set_mate.h"
+#include "bam_sort.h"
+#include "stage_manifest.h"
 #include "location.h"
 
 using namespace seqan;
 
 // ==========================================================================
-// Function write_fastq()
+// Function fill_sequence()
 // ==========================================================================
 
-bool
-write_fastq(CharString & fastqFirst,
-        CharString & fastqSecond,
-        CharString & fastqSingle,
-        CharString & unmappedBam)
+// Fills in the sequence and quality string of a secondary record from the first record of the
+// read, which is kept in firstRecord between calls.
+inline bool
+fill_sequence(BamAlignmentRecord & record, BamAlignmentRecord & firstRecord)
 {
-    typedef std::map<CharString, Pair<CharString> > TFastqMap;
+    typedef Position<Dna5String>::Type TPos;
 
-    // Create maps for fastq records (first read in pair and second read in pair).
-    TFastqMap firstReads, secondReads;
+    if (firstRecord.qName != record.qName || hasFlagFirst(firstRecord) != hasFlagFirst(record))
+    {
+        // update first record
+        firstRecord = record;
+        if (length(firstRecord.seq) == 0 || length(firstRecord.qual) == 0)
+        {
+            std::cerr << "ERROR: First record of read " << firstRecord.qName << " has no sequence." << std::endl;
+            return 1;
+        }
+    }
+    else if (length(record.seq) == 0 || length(record.qual) == 0)
+    {
+        // fill sequence field and quality string
+        TPos last = length(record.cigar)-1;
+        if (record.cigar[0].operation == 'H' || record.cigar[last].operation == 'H')
+        {
+            TPos begin = 0;
+            if (record.cigar[0].operation == 'H')
+                begin = record.cigar[0].count;
 
-    // Open bam file.
-    BamFileIn inStream(toCString(unmappedBam));
+            TPos end = length(firstRecord.seq);
+            if (record.cigar[last].operation == 'H')
+                end -= record.cigar[last].count;
 
-    // Read bam header and clear it since we don't need it.
-    BamHeader header;
-    readHeader(header, inStream);
-    clear(header);
+            record.seq = infix(firstRecord.seq, begin, end);
+            record.qual = infix(firstRecord.qual, begin, end);
+        }
+        else
+        {
+            record.seq = firstRecord.seq;
+            record.qual = firstRecord.qual;
+        }
+    }
 
-    // Open the output fastq files.    
-    SeqFileOut fastqFirstStream(toCString(fastqFirst));
-    SeqFileOut fastqSecondStream(toCString(fastqSecond));
-    SeqFileOut fastqSingleStream(toCString(fastqSingle));
+    return 0;
+}
 
-    // Iterate over bam file and append fastq records.
+// ==========================================================================
+// Struct NonRefMates
+// ==========================================================================
+
+// The records of the non_ref.bam file, looked up by read name when the reads come out of bwa.
+struct NonRefMates
+{
+    String<BamAlignmentRecord> records;
+    String<bool> matched;
+    std::unordered_map<std::string, unsigned> index;    // first record of each read name
+};
+
+// --------------------------------------------------------------------------
+// Function readNonRefMates()
+// --------------------------------------------------------------------------
+
+template <typename TNameStore>
+inline void
+readNonRefMates(NonRefMates & mates, BamFileIn & nonRefStream, NameStoreCache<TNameStore> & nameStoreCache)
+{
     BamAlignmentRecord record;
-    while(!atEnd(inStream))
+    String<int32_t> rIdMap;
+    while (!atEnd(nonRefStream))
     {
-        readRecord(record, inStream);
-        if (hasFlagUnmapped(record))
-            appendFastqRecord(fastqFirstStream, fastqSecondStream, firstReads, secondReads, record);
+        readRecordAndCorrectRIds(record, nonRefStream, rIdMap, nameStoreCache);
+        mates.index.insert(std::make_pair(std::string(toCString(record.qName)), (unsigned)length(mates.records)));
+        appendValue(mates.records, record);
+        appendValue(mates.matched, false);
     }
-
-    // Write the fastq files.
-    if (writeFastq(fastqFirstStream, fastqSecondStream, fastqSingleStream, firstReads, secondReads) != 0) return 1;
-
-    return 0;
 }
 
 // ==========================================================================
-// Function fill_sequences()
+// Function map_and_set_mates()
 // ==========================================================================
 
-bool
-fill_sequences(CharString & outFile, CharString & inFile)
+// Reads the bwa output, fills in the sequences of secondary records and sets the mates of reads in
+// non_ref.bam as merge_and_set_mate() does: the non_ref.bam record is written once per alignment
+// of its mate. rIdMap translates the reference ids of the bwa output to the merged header. The records
+// are passed to the anchor collector on their way to the sorter.
+template <typename TContext>
+inline bool
+map_and_set_mates(BamSortWriter & sorter,
+                  AnchorCollector & anchors,
+                  NonRefMates & mates,
+                  SamPipeIn & samStream,
+                  String<int32_t> & rIdMap,
+                  BamAlignmentRecord & firstRecord,
+                  TContext & bamContext)
 {
-    typedef Position<Dna5String>::Type TPos;
+    BamAlignmentRecord record;
+    while (!atEnd(samStream))
+    {
+        readRecordAndCorrectRIds(record, samStream, rIdMap, contigNamesCache(bamContext));
+        if (fill_sequence(record, firstRecord) != 0)
+            return 1;
+
+        std::unordered_map<std::string, unsigned>::const_iterator mate = mates.index.find(toCString(record.qName));
+        if (mate != mates.index.end())
+        {
+            BamAlignmentRecord & mateRecord = mates.records[mate->second];
+            mates.matched[mate->second] = true;
+            setMates(mateRecord, record);
+            collectAnchors(anchors, mateRecord, bamContext);
+            if (!writeRecord(sorter, mateRecord, bamContext))
+                return 1;
+        }
+
+        collectAnchors(anchors, record, bamContext);
+        if (!writeRecord(sorter, record, bamContext))
+            return 1;
+    }
+    return 0;
+}
+
+// --------------------------------------------------------------------------
+
+// Runs bwa on the paired and single end reads and writes the records merged with non_ref.bam, sorted by
+// coordinate and indexed, to nonRefNew. Nothing but the sorter's runs is written to disk in between. The
+// anchoring records of contigs are found on the way and returned in anchors.
+inline bool
+map_and_set_mates(CharString const & nonRefNew,
+                  String<AnchoringRecord> & anchors,
+                  unsigned & nonContigSeqs,
+                  CharString const & nonRefBam,
+                  char const * pairedCommand,
+                  char const * singleCommand,
+                  unsigned threads,
+                  uint64_t sortMemory)
+{
+    BamFileIn nonRefStream;
+    if (!open(nonRefStream, toCString(nonRefBam)))
+    {
+        std::cerr << "ERROR: Could not open " << nonRefBam << std::endl;
+        return 1;
+    }
 
-    BamFileIn inStream(toCString(inFile));
-    BamFileOut outStream(context(inStream), toCString(outFile));
+    // The bwa output is read through pipes, the output for single end reads
+    // shares the contig names with the output for pairs.
+    SamPipeIn pairedSam;
+    SamPipeIn singleSam(context(pairedSam));
+    if (!open(pairedSam, pairedCommand))
+    {
+        std::cerr << "ERROR while running " << pairedCommand << std::endl;
+        close(pairedSam);
+        return 1;
+    }
 
-    BamHeader header;
-    readHeader(header, inStream);
-    writeHeader(outStream, header);
+    BamSortWriter sorter;
+    open(sorter, nonRefNew, BAM_SORT_COORDINATE, threads, sortMemory, true);
 
-    BamAlignmentRecord firstRecord, nextRecord;
-    while (!atEnd(inStream))
+    bool ret = 0;
+    try
     {
-        readRecord(nextRecord, inStream);
+        // The contigs follow the reference sequences of non_ref.bam in the header.
+        BamHeader header;
+        FormattedFileContext<BamFileOut, Owner<> >::Type bamContext;
+        mergeHeaders(header, bamContext, nonRefStream, pairedSam);
+        nonContigSeqs = length(contigNames(context(nonRefStream)));
 
-        if (firstRecord.qName != nextRecord.qName || hasFlagFirst(firstRecord) != hasFlagFirst(nextRecord))
+        AnchorCollector collector;
+        collector.nonContigSeqs = nonContigSeqs;
+
+        NonRefMates mates;
+        readNonRefMates(mates, nonRefStream, contigNamesCache(bamContext));
+
+        BamAlignmentRecord firstRecord;
+        String<int32_t> samRIdMap;
+        ret = map_and_set_mates(sorter, collector, mates, pairedSam, samRIdMap, firstRecord, bamContext);
+        if (close(pairedSam) != 0 && ret == 0)
         {
-            // update first record
-            firstRecord = nextRecord;
-            if (length(firstRecord.seq) == 0 || length(firstRecord.qual) == 0)
-            {
-                std::cerr << "ERROR: First record of read " << firstRecord.qName << " has no sequence." << std::endl;
-                return 1;
-            }
+            std::cerr << "ERROR while running " << pairedCommand << std::endl;
+            ret = 1;
         }
-        else
+
+        if (ret == 0)
         {
-            // fill sequence field and quality string
-            if (length(nextRecord.seq) == 0 || length(nextRecord.qual) == 0)
+            if (open(singleSam, singleCommand))
             {
-                TPos last = length(nextRecord.cigar)-1;
-                if (nextRecord.cigar[0].operation == 'H' || nextRecord.cigar[last].operation == 'H')
-                {
-                    TPos begin = 0;
-                    if (nextRecord.cigar[0].operation == 'H')
-                        begin = nextRecord.cigar[0].count;
-
-                    TPos end = length(firstRecord.seq);
-                    if (nextRecord.cigar[last].operation == 'H')
-                        end -= nextRecord.cigar[last].count;
-
-                    nextRecord.seq = infix(firstRecord.seq, begin, end);
-                    nextRecord.qual = infix(firstRecord.qual, begin, end);
-                }
-                else
-                {
-                    nextRecord.seq = firstRecord.seq;
-                    nextRecord.qual = firstRecord.qual;
-                }
+                BamHeader singleHeader;
+                readHeader(singleHeader, singleSam);
+                ret = map_and_set_mates(sorter, collector, mates, singleSam, samRIdMap, firstRecord, bamContext);
+            }
+            if (close(singleSam) != 0 && ret == 0)
+            {
+                std::cerr << "ERROR while running " << singleCommand << std::endl;
+                ret = 1;
             }
         }
 
-        writeRecord(outStream, nextRecord);
-    }
+        // Records of non_ref.bam whose mates bwa did not output are kept unchanged.
+        for (unsigned i = 0; i < length(mates.records) && ret == 0; ++i)
+        {
+            if (mates.matched[i])
+                continue;
+            collectAnchors(collector, mates.records[i], bamContext);
+            if (!writeRecord(sorter, mates.records[i], bamContext))
+                ret = 1;
+        }
+        finishAnchors(collector, bamContext);
+        swap(anchors, collector.anchors);
 
-    close(outStream);
+        if (ret == 0)
+            ret = close(sorter, header, bamContext);
+    }
+    catch (Exception const & e)
+    {
+        std::cerr << "ERROR: " << e.what() << std::endl;
+        ret = 1;
+    }
 
-    return 0;
+    return ret;
 }
 
 
@@ -157,16 +272,55 @@ int popins_contigmap(int argc, char const ** argv)
 
     std::ostringstream msg;
 
-    if (!exists(nonRefNew))
+    // Skip the whole command if the manifest records it with the same inputs and parameters, and the mapping of reads
+    // to contigs if only the locations are outdated.
+    StageManifest manifest;
+    if (readManifest(manifest, getFileName(workingDirectory, "POPINS_MANIFEST")) != 0)
+        return 7;
+    StageRecord alignmentStage("contigmap-alignment");
+    addParam(alignmentStage, "bestAlignment", options.bestAlignment);
+    addInput(alignmentStage, manifest, fastqFirst);
+    addInput(alignmentStage, manifest, fastqSecond);
+    addInput(alignmentStage, manifest, fastqSingle);
+    addInput(alignmentStage, manifest, nonRefBam);
+    addInput(alignmentStage, manifest, options.contigFile);
+
+    StageRecord stage = alignmentStage;
+    stage.name = "contigmap";
+    addParam(stage, "maxInsertSize", options.maxInsertSize);
+    addInput(stage, manifest, options.referenceFile);
+
+    if (stageUpToDate(manifest, stage))
+    {
+        msg << "Skipping contigmap, " << locationsFile << " is up to date.";
+        printStatus(msg);
+        return 0;
+    }
+    if (beginStage(manifest, stage) != 0)
+        return 7;
+
+    CharString nonRefIndex = nonRefNew;
+    nonRefIndex += ".bai";
+
+    // The anchoring records are found while mapping, or read from non_ref_new.bam if the mapping is skipped.
+    String<AnchoringRecord> anchors;
+    bool anchorsFound = false;
+
+    if (!stageUpToDate(manifest, alignmentStage))
     {
-        // Create names of temporary files.
-        CharString mappedSam = getFileName(workingDirectory, "contig_mapped_unsorted.sam");
-        CharString mappedBamUnsorted = getFileName(workingDirectory, "contig_mapped_unsorted.bam");
-        CharString mappedBam = getFileName(workingDirectory, "contig_mapped.bam");
-        CharString mergedBam = getFileName(workingDirectory, "merged.bam");
+        if (beginStage(manifest, alignmentStage) != 0)
+            return 7;
 
         std::stringstream cmd;
 
+        uint64_t sortMemory;
+        if (!parseMemorySize(sortMemory, options.memory))
+        {
+            std::cerr << "ERROR: Invalid memory size " << options.memory << std::endl;
+            return 7;
+        }
+        sortMemory *= options.threads;
+
         CharString indexFile = options.contigFile;
         indexFile += ".bwt";
         if (!exists(indexFile))
@@ -184,92 +338,43 @@ int popins_contigmap(int argc, char const ** argv)
             }
         }
 
-        msg << "Mapping reads to contigs using " << BWA;
+        msg << "Mapping reads to contigs using " << BWA << ", setting mates from " << nonRefBam << " and sorting by beginPos";
         printStatus(msg);
 
         // Remapping to contigs with bwa.
-        cmd.str("");
-        if (!options.bestAlignment) cmd << BWA << " mem -a ";
-        else cmd << BWA << " mem ";
-        cmd << "-t " << options.threads << " " << options.contigFile << " " << fastqFirst << " " << fastqSecond << " > " << mappedSam;
-        if (system(cmd.str().c_str()) != 0)
+        std::ostringstream pairedCmd;
+        if (!options.bestAlignment) pairedCmd << BWA << " mem -a ";
+        else pairedCmd << BWA << " mem ";
+        pairedCmd << "-t " << options.threads << " " << options.contigFile << " " << fastqFirst << " " << fastqSecond;
+
+        std::ostringstream singleCmd;
+        if (!options.bestAlignment) singleCmd << BWA << " mem -a ";
+        else singleCmd << BWA << " mem ";
+        singleCmd << "-t " << options.threads << " " << options.contigFile << " " << fastqSingle;
+
+        // Fill in sequences of secondary records, merge with non_ref.bam and set the mates, find the anchoring
+        // records, sort by beginPos and index in one pass over the bwa output. The output is <WD>/non_ref_new.bam
+        // with its index.
+        if (map_and_set_mates(nonRefNew, anchors, nonContigSeqs, nonRefBam, pairedCmd.str().c_str(), singleCmd.str().c_str(),
+                              options.threads, sortMemory) != 0)
         {
-            std::cerr << "ERROR while running bwa on " << fastqFirst << " and " << fastqSecond << std::endl;
+            std::cerr << "ERROR while mapping reads of " << fastqFirst << ", " << fastqSecond << ", and " << fastqSingle
+                      << " to contigs." << std::endl;
             return 7;
         }
-        //remove(toCString(fastqFirst));
-        //remove(toCString(fastqSecond));
-
-        cmd.str("");
-        if (!options.bestAlignment) cmd << BWA << " mem -a ";
-        else cmd << BWA << " mem ";
-        cmd << "-t " << options.threads << " " << options.contigFile << " " << fastqSingle << " | awk '$1 !~ /@/' >> " << mappedSam;
-        if (system(cmd.str().c_str()) != 0)
-        {
-            std::cerr << "ERROR while running bwa on " << fastqSingle << std::endl;
-            return 7;
-        }
-        //remove(toCString(fastqSingle));
-
-        printStatus("Filling in sequences of secondary records in bwa output");
+        anchorsFound = true;
 
-        // Fill in sequences in bwa output.
-        if (fill_sequences(mappedBamUnsorted, mappedSam) != 0)
-        {
-            return 7;
-        }
-        remove(toCString(mappedSam));
-
-        msg.str("");
-        msg << "Sorting " << mappedBamUnsorted << " by read name using " << SAMTOOLS;
-        printStatus(msg);
-
-        // Sort <WD>/contig_mapped.bam by read name
-        cmd.str("");
-        cmd << SAMTOOLS << " sort -n -@ " << options.threads << " -m " << options.memory << " -o " << mappedBam << " " << mappedBamUnsorted;
-        if (system(cmd.str().c_str()) != 0)
-        {
-            std::cerr << "ERROR while sorting " << mappedBamUnsorted << " by read name using " << SAMTOOLS << std::endl;
+        String<CharString> outputs;
+        appendValue(outputs, nonRefNew);
+        appendValue(outputs, nonRefIndex);
+        if (finishStage(manifest, alignmentStage, outputs) != 0)
             return 7;
-        }
-        remove(toCString(mappedBamUnsorted));
-
-        // Merge non_ref.bam with contig_mapped and set the mates.
-        if (merge_and_set_mate(mergedBam, nonContigSeqs, nonRefBam, mappedBam) != 0)
-            return 7;
-
-        remove(toCString(mappedBam));
-        //remove(toCString(nonRefBam));
-
-        msg.str("");
-        msg << "Sorting " << mergedBam << " using " << SAMTOOLS;
-        printStatus(msg);
-
-        // Sort <WD>/merged.bam by beginPos, output is <WD>/non_ref.bam.
-        cmd.str("");
-        cmd << SAMTOOLS << " sort -@ " << options.threads << " -m " << options.memory << " -o " << nonRefNew << " " << mergedBam;
-        if (system(cmd.str().c_str()) != 0)
-        {
-            std::cerr << "ERROR while sorting " << mergedBam << " by beginPos using " << SAMTOOLS << std::endl;
-            return 7;
-        }
-        remove(toCString(mergedBam));
-
-        msg.str("");
-        msg << "Indexing " << nonRefNew << " by beginPos using " << SAMTOOLS;
-        printStatus(msg);
-
-        // Index <WD>/non_ref_new.bam.
-        cmd.str("");
-        cmd << SAMTOOLS << " index " << nonRefNew;
-        if (system(cmd.str().c_str()) != 0)
-        {
-            std::cerr << "ERROR while indexing " << nonRefNew << " using " << SAMTOOLS << std::endl;
-            return 7;
-        }
     }
     else
     {
+        msg << "Skipping mapping reads to contigs, " << nonRefNew << " is up to date.";
+        printStatus(msg);
+
         BamFileIn nonRefStream(toCString(nonRefBam));
         BamHeader header;
         readHeader(header, nonRefStream);
@@ -290,13 +395,29 @@ int popins_contigmap(int argc, char const ** argv)
 
     // Find anchoring locations of contigs for this individual.
     String<Location> locations;
-    findLocations(locations, nonRefNew, chromosomes, nonContigSeqs, options.maxInsertSize);
+    if (anchorsFound)
+        anchorsToLocations(locations, anchors, chromosomes, options.maxInsertSize);
+    else
+        findLocations(locations, nonRefNew, chromosomes, nonContigSeqs, options.maxInsertSize);
     scoreLocations(locations);
     if (writeLocations(locationsFile, locations) != 0) return 7;
 
+    String<CharString> outputs;
+    appendValue(outputs, locationsFile);
+
     // Remove the non_ref_new.bam file.
     if (options.deleteNonRefNew)
+    {
         remove(toCString(nonRefNew));
+        remove(toCString(nonRefIndex));
+    }
+    else
+    {
+        appendValue(outputs, nonRefNew);
+        appendValue(outputs, nonRefIndex);
+    }
+    if (finishStage(manifest, stage, outputs) != 0)
+        return 7;
 
     return 0;
 }
@@ -4,6 +4,7 @@
 #include "util.h"
 #include "argument_parsing.h"
 #include "variant_caller.h"
+#include "stage_manifest.h"
 
 
 using namespace seqan;
@@ -69,19 +70,57 @@ popins_genotype(int argc, char const ** argv)
     if (res != ArgumentParser::PARSE_OK)
         return res;
 
-    printStatus("Opening input files.");
-
     CharString samplePath = getFileName(options.prefix, options.sampleID);
+    CharString sampleInfoFile = getFileName(samplePath, "POPINS_SAMPLE_INFO");
+    CharString outfile = getFileName(samplePath, "insertions.vcf");
+    CharString altBamFile = getFileName(samplePath, "non_ref_new.bam");
+
+    // Skip the genotyping if the manifest records it with the same inputs and parameters.
+    StageManifest manifest;
+    if (readManifest(manifest, getFileName(samplePath, "POPINS_MANIFEST")) != 0)
+        return 7;
+    StageRecord stage("genotype");
+    addParam(stage, "model", options.genotypingModel);
+    addParam(stage, "window", options.regionWindowSize);
+    addParam(stage, "addReadGroup", options.addReadGroup);
+    addParam(stage, "maxInsertSize", options.maxInsertSize);
+    addParam(stage, "bpQclip", options.bpQclip);
+    addParam(stage, "minSeqLen", options.minSeqLen);
+    addParam(stage, "minReadProb", options.minReadProb);
+    addParam(stage, "maxBARcount", options.maxBARcount);
+    addParam(stage, "match", options.match);
+    addParam(stage, "mismatch", options.mismatch);
+    addParam(stage, "gapOpen", options.gapOpen);
+    addParam(stage, "gapExtend", options.gapExtend);
+    addParam(stage, "minAlignScore", options.minAlignScore);
+    addParam(stage, "callBoth", options.callBoth);
+    addParam(stage, "useReadCounts", options.useReadCounts);
+    addParam(stage, "fullOverlap", options.fullOverlap);
+    addInput(stage, manifest, sampleInfoFile);
+    addInput(stage, manifest, options.vcfFile);
+    addInput(stage, manifest, options.referenceFile);
+    addInput(stage, manifest, options.supercontigFile);
+    addInput(stage, manifest, altBamFile);
+
+    if (stageUpToDate(manifest, stage))
+    {
+        std::ostringstream msg;
+        msg << "Skipping genotyping, " << outfile << " is up to date.";
+        printStatus(msg);
+        return 0;
+    }
+    if (beginStage(manifest, stage) != 0)
+        return 7;
+
+    printStatus("Opening input files.");
 
     // Load the POPINS_SAMPLE_INFO file.
     SampleInfo sampleInfo;
-    CharString sampleInfoFile = getFileName(samplePath, "POPINS_SAMPLE_INFO");
     if (readSampleInfo(sampleInfo, sampleInfoFile) != 0)
        return 1;
 
     // Open the input VCF file and prepare output VCF stream.
     VcfFileIn vcfIn(toCString(options.vcfFile));
-    CharString outfile = getFileName(samplePath, "insertions.vcf");
     std::ofstream vcfStream(toCString(outfile));
     VcfFileOut vcfOut(vcfIn);
     open(vcfOut, vcfStream, Vcf());
@@ -140,7 +179,6 @@ popins_genotype(int argc, char const ** argv)
     // Open the bam file. (A bam file needs the bai index and the bam file stream.)
     BamIndex<Bai> bamIndexAlt;
     BamFileIn bamStreamAlt;
-    CharString altBamFile = getFileName(samplePath, "non_ref_new.bam");
     if (initializeBam(toCString(altBamFile), bamIndexAlt, bamStreamAlt))
         return 7;
 
@@ -164,6 +202,13 @@ popins_genotype(int argc, char const ** argv)
         writeRecord(vcfOut, record);
     }
 
+    close(vcfOut);
+    vcfStream.close();
+    String<CharString> outputs;
+    appendValue(outputs, outfile);
+    if (finishStage(manifest, stage, outputs) != 0)
+        return 7;
+
     return 0;
 }
 
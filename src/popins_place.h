@@ -15,6 +15,7 @@
 #include "ref_align.h"
 #include "split_align.h"
 #include "combine.h"
+#include "stage_manifest.h"
 
 using namespace seqan;
 
@@ -312,11 +313,40 @@ int popins_place_splitalign(int argc, char const ** argv)
         return 7;
     }
 
-    // Do the split read alignment for the specified sample.
+    // Skip the split read alignment if the manifest records it with the same inputs and parameters.
     CharString samplePath = getFileName(options.prefix, options.sampleID);
+    StageManifest manifest;
+    if (readManifest(manifest, getFileName(samplePath, "POPINS_MANIFEST")) != 0)
+        return 7;
+    StageRecord stage("place-splitalign");
+    addParam(stage, "readLength", options.readLength);
+    addParam(stage, "maxInsertSize", options.maxInsertSize);
+    addInput(stage, manifest, getFileName(samplePath, "POPINS_SAMPLE_INFO"));
+    addInput(stage, manifest, getFileName(samplePath, "locations_unplaced.txt"));
+    addInput(stage, manifest, options.supercontigFile);
+    addInput(stage, manifest, options.referenceFile);
+
+    CharString outfile = getFileName(samplePath, "locations_placed.txt");
+    if (stageUpToDate(manifest, stage))
+    {
+        std::ostringstream msg;
+        msg << "Skipping split-read alignment, " << outfile << " is up to date.";
+        printStatus(msg);
+        return 0;
+    }
+    if (beginStage(manifest, stage) != 0)
+        return 7;
+
+    // Do the split read alignment for the specified sample.
     if (loadInputAndSplitReadAlign(samplePath, options, fai) != 0)
        return 7;
 
+    String<CharString> outputs;
+    if (exists(outfile))
+        appendValue(outputs, outfile);
+    if (finishStage(manifest, stage, outputs) != 0)
+        return 7;
+
     return 0;
 }
 
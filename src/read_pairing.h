@@ -0,0 +1,672 @@
+#ifndef POPINS2_READ_PAIRING_H_
+#define POPINS2_READ_PAIRING_H_
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+#include <algorithm>
+
+#include <seqan/seq_io.h>
+#include <seqan/bam_io.h>
+
+
+using namespace seqan;
+
+
+// ==========================================================================
+// Struct ReadPairing
+// ==========================================================================
+
+/**
+ * Reads waiting for their mate while writing the fastq files.
+ *
+ * Each unpaired read is stored once in an arena of raw bytes,
+ *   [first][rc][name length][sequence length][name][sequence][qualities],
+ * and is referenced from an open-addressing hash table (linear probing) keyed by a
+ * fingerprint of the read name. Sequence and qualities are stored as in the bam record
+ * and reverse complemented when the read is written.
+ *
+ * If the table and arena exceed maxMemory bytes, all stored reads are spilled to
+ * numPartitions files, partitioned by fingerprint such that both ends of a pair end up
+ * in the same file. Later reads of a spilled read name are not added to the table but
+ * appended to the partitions in the order they come, and the partitions are paired one
+ * by one in writeFastq(). The pairing state of each spilled read name stays in memory,
+ * so the reads are reported as paired exactly as without spilling.
+ *
+ * Reads without sequence were discarded by the quality filter. They still pair with their
+ * mate like any other read, but are never written. The mate of a discarded read is kept
+ * as a read without mate and written to the single end reads, as sickle does.
+ */
+struct ReadPairing
+{
+    static const unsigned numPartitions = 16;
+    static const unsigned headerSize = 2 + 2 * sizeof(uint32_t);
+
+    std::vector<uint64_t> fingerprints;     // 0 for empty slots
+    std::vector<uint64_t> offsets;          // offsets of the reads in the arena
+    std::vector<char> arena;
+    uint64_t numReads;
+    uint64_t deadBytes;                     // bytes of paired reads still in the arena
+
+    uint64_t maxMemory;                     // 0 for no limit
+    std::string spillPrefix;
+    unsigned numSpills;
+    std::vector<uint64_t> spilledNames;     // sorted fingerprints of spilled read names with their pairing state
+    std::vector<char> diverted;             // reads of spilled read names, in the format of the arena
+
+    ReadPairing(uint64_t maxMemory_ = 0, std::string spillPrefix_ = "") :
+        fingerprints(1024, 0), offsets(1024, 0), numReads(0), deadBytes(0),
+        maxMemory(maxMemory_), spillPrefix(spillPrefix_), numSpills(0)
+    {}
+};
+
+// --------------------------------------------------------------------------
+// Function readNameFingerprint()
+// --------------------------------------------------------------------------
+
+// 64 bit FNV-1a hash of the read name, never 0.
+inline uint64_t
+readNameFingerprint(char const * name, uint32_t len)
+{
+    uint64_t h = 14695981039346656037ull;
+    for (uint32_t i = 0; i < len; ++i)
+    {
+        h ^= (unsigned char)name[i];
+        h *= 1099511628211ull;
+    }
+    h ^= h >> 29;
+    return h != 0 ? h : 1;
+}
+
+// --------------------------------------------------------------------------
+// Functions for the arena records
+// --------------------------------------------------------------------------
+
+inline uint32_t
+_arenaUInt32(ReadPairing const & pairing, uint64_t pos)
+{
+    uint32_t val;
+    std::memcpy(&val, &pairing.arena[pos], sizeof(uint32_t));
+    return val;
+}
+
+inline bool
+_arenaFirst(ReadPairing const & pairing, uint64_t offset)
+{
+    return pairing.arena[offset] != 0;
+}
+
+inline uint32_t
+_arenaNameLength(ReadPairing const & pairing, uint64_t offset)
+{
+    return _arenaUInt32(pairing, offset + 2);
+}
+
+inline uint32_t
+_arenaSeqLength(ReadPairing const & pairing, uint64_t offset)
+{
+    return _arenaUInt32(pairing, offset + 2 + sizeof(uint32_t));
+}
+
+inline char const *
+_arenaName(ReadPairing const & pairing, uint64_t offset)
+{
+    return &pairing.arena[offset + ReadPairing::headerSize];
+}
+
+inline uint64_t
+_arenaRecordSize(ReadPairing const & pairing, uint64_t offset)
+{
+    return ReadPairing::headerSize + _arenaNameLength(pairing, offset) + 2 * (uint64_t)_arenaSeqLength(pairing, offset);
+}
+
+// Appends a read to the arena and returns its offset.
+inline uint64_t
+_arenaAppend(std::vector<char> & arena, bool first, bool rc,
+        char const * name, uint32_t nameLen, char const * seq, char const * qual, uint32_t seqLen)
+{
+    uint64_t offset = arena.size();
+    arena.push_back(first ? 1 : 0);
+    arena.push_back(rc ? 1 : 0);
+    arena.insert(arena.end(), (char const *)&nameLen, (char const *)&nameLen + sizeof(uint32_t));
+    arena.insert(arena.end(), (char const *)&seqLen, (char const *)&seqLen + sizeof(uint32_t));
+    arena.insert(arena.end(), name, name + nameLen);
+    arena.insert(arena.end(), seq, seq + seqLen);
+    arena.insert(arena.end(), qual, qual + seqLen);
+    return offset;
+}
+
+// Writes a stored read to a fastq file. Reads from the reverse strand are reverse complemented.
+inline void
+_writeStoredRead(SeqFileOut & stream, ReadPairing const & pairing, uint64_t offset)
+{
+    uint32_t nameLen = _arenaNameLength(pairing, offset);
+    uint32_t seqLen = _arenaSeqLength(pairing, offset);
+    char const * name = _arenaName(pairing, offset);
+
+    CharString qName, seq, qual;
+    assign(qName, std::string(name, nameLen));
+    assign(seq, std::string(name + nameLen, seqLen));
+    assign(qual, std::string(name + nameLen + seqLen, seqLen));
+
+    if (pairing.arena[offset + 1] != 0)
+    {
+        reverseComplement(seq);
+        reverse(qual);
+    }
+
+    writeRecord(stream, qName, seq, qual);
+}
+
+// --------------------------------------------------------------------------
+// Function _findSlot()
+// --------------------------------------------------------------------------
+
+// Returns the slot of the read with the given name or the empty slot where it would be inserted.
+inline uint64_t
+_findSlot(ReadPairing const & pairing, uint64_t fingerprint, char const * name, uint32_t nameLen)
+{
+    uint64_t mask = pairing.fingerprints.size() - 1;
+    uint64_t slot = fingerprint & mask;
+
+    while (pairing.fingerprints[slot] != 0)
+    {
+        uint64_t offset = pairing.offsets[slot];
+        if (pairing.fingerprints[slot] == fingerprint &&
+                _arenaNameLength(pairing, offset) == nameLen &&
+                std::memcmp(_arenaName(pairing, offset), name, nameLen) == 0)
+            return slot;
+        slot = (slot + 1) & mask;
+    }
+
+    return slot;
+}
+
+// --------------------------------------------------------------------------
+// Function _eraseSlot()
+// --------------------------------------------------------------------------
+
+// Removes a read from the table by shifting the following entries of its probe sequence backwards.
+inline void
+_eraseSlot(ReadPairing & pairing, uint64_t slot)
+{
+    uint64_t mask = pairing.fingerprints.size() - 1;
+
+    pairing.deadBytes += _arenaRecordSize(pairing, pairing.offsets[slot]);
+    --pairing.numReads;
+
+    uint64_t hole = slot;
+    uint64_t next = (slot + 1) & mask;
+    while (pairing.fingerprints[next] != 0)
+    {
+        uint64_t home = pairing.fingerprints[next] & mask;
+        // Move the entry into the hole if its home slot is not within (hole, next].
+        if (((next - home) & mask) >= ((next - hole) & mask))
+        {
+            pairing.fingerprints[hole] = pairing.fingerprints[next];
+            pairing.offsets[hole] = pairing.offsets[next];
+            hole = next;
+        }
+        next = (next + 1) & mask;
+    }
+    pairing.fingerprints[hole] = 0;
+}
+
+// --------------------------------------------------------------------------
+// Function _rebuildTable()
+// --------------------------------------------------------------------------
+
+// Rehashes all stored reads into a table of the given size and copies them into a fresh arena without gaps.
+inline void
+_rebuildTable(ReadPairing & pairing, uint64_t tableSize)
+{
+    std::vector<uint64_t> fingerprints(tableSize, 0);
+    std::vector<uint64_t> offsets(tableSize, 0);
+    std::vector<char> arena;
+    arena.reserve(pairing.arena.size() - pairing.deadBytes);
+
+    // Keep the reads in the order they were added.
+    std::vector<std::pair<uint64_t, uint64_t> > reads;
+    reads.reserve(pairing.numReads);
+    for (uint64_t i = 0; i < pairing.fingerprints.size(); ++i)
+        if (pairing.fingerprints[i] != 0)
+            reads.push_back(std::make_pair(pairing.offsets[i], pairing.fingerprints[i]));
+    std::sort(reads.begin(), reads.end());
+
+    uint64_t mask = tableSize - 1;
+    for (uint64_t i = 0; i < reads.size(); ++i)
+    {
+        uint64_t offset = reads[i].first;
+        uint64_t size = _arenaRecordSize(pairing, offset);
+
+        uint64_t slot = reads[i].second & mask;
+        while (fingerprints[slot] != 0)
+            slot = (slot + 1) & mask;
+        fingerprints[slot] = reads[i].second;
+        offsets[slot] = arena.size();
+        arena.insert(arena.end(), pairing.arena.begin() + offset, pairing.arena.begin() + offset + size);
+    }
+
+    pairing.fingerprints.swap(fingerprints);
+    pairing.offsets.swap(offsets);
+    pairing.arena.swap(arena);
+    pairing.deadBytes = 0;
+}
+
+// --------------------------------------------------------------------------
+// Functions for the spilled read names
+// --------------------------------------------------------------------------
+
+// The pairing state of a spilled read name is the read end stored for it in the table without spilling, if any.
+enum SpilledNameState
+{
+    SPILLED_NONE = 0,
+    SPILLED_FIRST = 1,
+    SPILLED_SECOND = 2,
+    SPILLED_DISCARDED = 4
+};
+
+inline unsigned
+_spilledState(bool first, bool discarded)
+{
+    return (first ? SPILLED_FIRST : SPILLED_SECOND) | (discarded ? SPILLED_DISCARDED : 0);
+}
+
+// Returns the entry of a spilled read name, or the end of spilledNames if its reads were not spilled.
+inline std::vector<uint64_t>::iterator
+_findSpilledName(ReadPairing & pairing, uint64_t fingerprint)
+{
+    std::vector<uint64_t>::iterator it = std::lower_bound(pairing.spilledNames.begin(), pairing.spilledNames.end(), fingerprint << 3);
+    if (it != pairing.spilledNames.end() && (*it & ~(uint64_t)7) == fingerprint << 3)
+        return it;
+    return pairing.spilledNames.end();
+}
+
+// Updates the pairing state of a spilled read name like _addRead() updates the table. Returns true if the read
+// was paired.
+inline bool
+_addSpilledRead(uint64_t & entry, bool first, bool discarded)
+{
+    unsigned stored = entry & 7;
+    unsigned state = _spilledState(first, discarded);
+    bool paired = false;
+
+    if (stored != SPILLED_NONE && ((stored & SPILLED_FIRST) != 0) != first)
+    {
+        paired = true;
+        bool storedDiscarded = (stored & SPILLED_DISCARDED) != 0;
+        if (!discarded && !storedDiscarded)
+            state = SPILLED_NONE;   // the pair is written
+        else if (discarded && !storedDiscarded)
+            state = stored;         // the kept read stays without mate
+        else if (discarded)
+            state = SPILLED_NONE;   // both reads are discarded
+    }
+
+    entry = (entry & ~(uint64_t)7) | state;
+    return paired;
+}
+
+// --------------------------------------------------------------------------
+// Function _spillPartitionName()
+// --------------------------------------------------------------------------
+
+inline std::string
+_spillPartitionName(ReadPairing const & pairing, unsigned partition)
+{
+    std::ostringstream name;
+    name << pairing.spillPrefix << ".spill." << partition;
+    return name.str();
+}
+
+// --------------------------------------------------------------------------
+// Function spillReads()
+// --------------------------------------------------------------------------
+
+// Appends all stored reads to the partition files and clears the table. The first spill truncates the files, such
+// that partitions left behind by a killed run are not paired with the reads of this one.
+inline bool
+spillReads(ReadPairing & pairing)
+{
+    std::ios::openmode mode = std::ios::binary | (pairing.numSpills == 0 ? std::ios::trunc : std::ios::app);
+    std::vector<std::ofstream *> partitions(ReadPairing::numPartitions);
+    for (unsigned p = 0; p < ReadPairing::numPartitions; ++p)
+        partitions[p] = new std::ofstream(_spillPartitionName(pairing, p).c_str(), mode);
+
+    // Write the reads in arena order, i.e. in the order they were added.
+    std::vector<std::pair<uint64_t, uint64_t> > reads;
+    reads.reserve(pairing.numReads);
+    for (uint64_t i = 0; i < pairing.fingerprints.size(); ++i)
+        if (pairing.fingerprints[i] != 0)
+            reads.push_back(std::make_pair(pairing.offsets[i], pairing.fingerprints[i]));
+    std::sort(reads.begin(), reads.end());
+
+    uint64_t numNames = pairing.spilledNames.size();
+    for (uint64_t i = 0; i < reads.size(); ++i)
+    {
+        uint64_t offset = reads[i].first;
+        partitions[reads[i].second % ReadPairing::numPartitions]->write(&pairing.arena[offset], _arenaRecordSize(pairing, offset));
+        bool discarded = _arenaSeqLength(pairing, offset) == 0;
+        pairing.spilledNames.push_back((reads[i].second << 3) | _spilledState(_arenaFirst(pairing, offset), discarded));
+    }
+    std::sort(pairing.spilledNames.begin() + numNames, pairing.spilledNames.end());
+    std::inplace_merge(pairing.spilledNames.begin(), pairing.spilledNames.begin() + numNames, pairing.spilledNames.end());
+
+    // The reads of names spilled before go to the partitions of their names, in the order they were added.
+    for (uint64_t offset = 0; offset < pairing.diverted.size(); )
+    {
+        uint32_t nameLen, seqLen;
+        std::memcpy(&nameLen, &pairing.diverted[offset + 2], sizeof(uint32_t));
+        std::memcpy(&seqLen, &pairing.diverted[offset + 2 + sizeof(uint32_t)], sizeof(uint32_t));
+        uint64_t size = ReadPairing::headerSize + nameLen + 2 * (uint64_t)seqLen;
+        uint64_t fingerprint = readNameFingerprint(&pairing.diverted[offset + ReadPairing::headerSize], nameLen);
+        partitions[fingerprint % ReadPairing::numPartitions]->write(&pairing.diverted[offset], size);
+        offset += size;
+    }
+
+    bool ok = true;
+    for (unsigned p = 0; p < ReadPairing::numPartitions; ++p)
+    {
+        partitions[p]->close();
+        ok = ok && !partitions[p]->fail();
+        delete partitions[p];
+    }
+    if (!ok)
+    {
+        std::cerr << "ERROR: Could not spill unpaired reads to " << pairing.spillPrefix << ".spill.*" << std::endl;
+        return 1;
+    }
+
+    std::fill(pairing.fingerprints.begin(), pairing.fingerprints.end(), 0);
+    pairing.arena.clear();
+    pairing.diverted.clear();
+    pairing.numReads = 0;
+    pairing.deadBytes = 0;
+    ++pairing.numSpills;
+
+    return 0;
+}
+
+// --------------------------------------------------------------------------
+// Function _addRead()
+// --------------------------------------------------------------------------
+
+// Pairs a read with its stored mate or stores it. Returns 1 if the read was paired, for a spilled read name also
+// if the pair will be written by writeFastq().
+inline bool
+_addRead(SeqFileOut & firstStream,
+        SeqFileOut & secondStream,
+        ReadPairing & pairing,
+        bool first,
+        bool rc,
+        CharString const & qName,
+        CharString const & seq,
+        CharString const & qual,
+        char const * name, uint32_t nameLen,
+        char const * seqBegin, char const * qualBegin, uint32_t seqLen)
+{
+    uint64_t fingerprint = readNameFingerprint(name, nameLen);
+
+    // Reads of spilled read names are paired with the spilled reads in writeFastq().
+    if (!pairing.spilledNames.empty())
+    {
+        std::vector<uint64_t>::iterator it = _findSpilledName(pairing, fingerprint);
+        if (it != pairing.spilledNames.end())
+        {
+            _arenaAppend(pairing.diverted, first, rc, name, nameLen, seqBegin, qualBegin, seqLen);
+            bool spilledPaired = _addSpilledRead(*it, first, seqLen == 0);
+            if (pairing.arena.size() + pairing.diverted.size() + 32 * pairing.numReads > pairing.maxMemory &&
+                    spillReads(pairing) != 0)
+                throw std::runtime_error("Spilling unpaired reads failed.");
+            return spilledPaired;
+        }
+    }
+
+    uint64_t slot = _findSlot(pairing, fingerprint, name, nameLen);
+    bool paired = false;
+
+    if (pairing.fingerprints[slot] != 0)
+    {
+        uint64_t offset = pairing.offsets[slot];
+        bool storedDiscarded = _arenaSeqLength(pairing, offset) == 0;
+        if (_arenaFirst(pairing, offset) != first && seqLen != 0 && !storedDiscarded)
+        {
+            // The current read is written as it is, its mate as stored.
+            if (first)
+            {
+                writeRecord(firstStream, qName, seq, qual);
+                _writeStoredRead(secondStream, pairing, offset);
+            }
+            else
+            {
+                _writeStoredRead(firstStream, pairing, offset);
+                writeRecord(secondStream, qName, seq, qual);
+            }
+            _eraseSlot(pairing, slot);
+
+            if (pairing.deadBytes > (1u << 20) && pairing.deadBytes > pairing.arena.size() / 2)
+                _rebuildTable(pairing, pairing.fingerprints.size());
+            return 1;
+        }
+
+        if (_arenaFirst(pairing, offset) != first)
+        {
+            // Paired with a discarded read: a kept read stays in the table without mate.
+            paired = true;
+            if (seqLen == 0 && !storedDiscarded)
+                return 1;
+        }
+
+        // Otherwise the same read end is seen again and the later record replaces the stored one.
+        _eraseSlot(pairing, slot);
+        slot = _findSlot(pairing, fingerprint, name, nameLen);
+        if (paired && seqLen == 0)
+            return 1;
+    }
+
+    pairing.fingerprints[slot] = fingerprint;
+    pairing.offsets[slot] = _arenaAppend(pairing.arena, first, rc, name, nameLen, seqBegin, qualBegin, seqLen);
+    ++pairing.numReads;
+
+    if (2 * pairing.numReads > pairing.fingerprints.size())
+        _rebuildTable(pairing, 2 * pairing.fingerprints.size());
+
+    if (pairing.maxMemory != 0 &&
+            pairing.arena.size() + pairing.diverted.size() + 32 * pairing.numReads > pairing.maxMemory &&
+            spillReads(pairing) != 0)
+        throw std::runtime_error("Spilling unpaired reads failed.");
+
+    return paired;
+}
+
+// --------------------------------------------------------------------------
+// Function appendFastqRecord()
+// --------------------------------------------------------------------------
+
+// Append a read to the table of fastq records. Returns 1 if the read was paired and written.
+inline bool
+appendFastqRecord(SeqFileOut & firstStream,
+        SeqFileOut & secondStream,
+        ReadPairing & pairing,
+        BamAlignmentRecord const & record)
+{
+    CharString seq = record.seq;
+
+    return _addRead(firstStream, secondStream, pairing, hasFlagFirst(record), hasFlagRC(record),
+            record.qName, seq, record.qual,
+            begin(record.qName, Standard()), length(record.qName),
+            begin(seq, Standard()), begin(record.qual, Standard()), length(seq));
+}
+
+// --------------------------------------------------------------------------
+// Function _writeSingles()
+// --------------------------------------------------------------------------
+
+// Writes all stored reads sorted by read name and clears the table.
+inline void
+_writeSingles(SeqFileOut & singleStream, ReadPairing & pairing)
+{
+    std::vector<uint64_t> reads;
+    reads.reserve(pairing.numReads);
+    for (uint64_t i = 0; i < pairing.fingerprints.size(); ++i)
+        if (pairing.fingerprints[i] != 0 && _arenaSeqLength(pairing, pairing.offsets[i]) != 0)
+            reads.push_back(pairing.offsets[i]);
+
+    ReadPairing const & p = pairing;
+    std::sort(reads.begin(), reads.end(), [&p](uint64_t a, uint64_t b) {
+        uint32_t lenA = _arenaNameLength(p, a), lenB = _arenaNameLength(p, b);
+        int cmp = std::memcmp(_arenaName(p, a), _arenaName(p, b), std::min(lenA, lenB));
+        return cmp < 0 || (cmp == 0 && lenA < lenB);
+    });
+
+    for (uint64_t i = 0; i < reads.size(); ++i)
+        _writeStoredRead(singleStream, pairing, reads[i]);
+
+    std::fill(pairing.fingerprints.begin(), pairing.fingerprints.end(), 0);
+    pairing.arena.clear();
+    pairing.numReads = 0;
+    pairing.deadBytes = 0;
+}
+
+// --------------------------------------------------------------------------
+// Function exportReads()
+// --------------------------------------------------------------------------
+
+// Writes all stored reads in the order they were added to a file in the format of the spill files and clears
+// the table. Only for tables that have not spilled.
+inline int
+exportReads(ReadPairing & pairing, std::string const & fileName)
+{
+    if (pairing.numSpills != 0)
+    {
+        std::cerr << "ERROR: Cannot export unpaired reads after spilling." << std::endl;
+        return 1;
+    }
+
+    std::vector<uint64_t> reads;
+    reads.reserve(pairing.numReads);
+    for (uint64_t i = 0; i < pairing.fingerprints.size(); ++i)
+        if (pairing.fingerprints[i] != 0)
+            reads.push_back(pairing.offsets[i]);
+    std::sort(reads.begin(), reads.end());
+
+    std::ofstream stream(fileName.c_str(), std::ios::binary);
+    for (uint64_t i = 0; i < reads.size(); ++i)
+        stream.write(&pairing.arena[reads[i]], _arenaRecordSize(pairing, reads[i]));
+    stream.close();
+    if (stream.fail())
+    {
+        std::cerr << "ERROR: Could not write unpaired reads to " << fileName << std::endl;
+        return 1;
+    }
+
+    std::fill(pairing.fingerprints.begin(), pairing.fingerprints.end(), 0);
+    pairing.arena.clear();
+    pairing.numReads = 0;
+    pairing.deadBytes = 0;
+
+    return 0;
+}
+
+// --------------------------------------------------------------------------
+// Function _addStoredReads()
+// --------------------------------------------------------------------------
+
+// Adds the reads of a file in the format of the spill files to the table. The names and read ends of reads that
+// found their mate are appended to pairedEnds if given.
+inline int
+_addStoredReads(SeqFileOut & firstStream,
+        SeqFileOut & secondStream,
+        ReadPairing & pairing,
+        std::string const & fileName,
+        std::vector<std::pair<std::string, bool> > * pairedEnds)
+{
+    std::ifstream stream(fileName.c_str(), std::ios::binary);
+    if (!stream.good())
+    {
+        std::cerr << "ERROR: Could not open spill file " << fileName << std::endl;
+        return 1;
+    }
+
+    std::vector<char> buffer;
+    char header[ReadPairing::headerSize];
+    CharString qName, seq, qual;
+    while (stream.read(header, ReadPairing::headerSize))
+    {
+        uint32_t nameLen, seqLen;
+        std::memcpy(&nameLen, header + 2, sizeof(uint32_t));
+        std::memcpy(&seqLen, header + 2 + sizeof(uint32_t), sizeof(uint32_t));
+        buffer.resize(nameLen + 2 * (uint64_t)seqLen);
+        if (!stream.read(&buffer[0], buffer.size()))
+        {
+            std::cerr << "ERROR: Truncated spill file " << fileName << std::endl;
+            return 1;
+        }
+
+        char const * name = &buffer[0];
+        assign(qName, std::string(name, nameLen));
+        assign(seq, std::string(name + nameLen, seqLen));
+        assign(qual, std::string(name + nameLen + seqLen, seqLen));
+        if (_addRead(firstStream, secondStream, pairing, header[0] != 0, header[1] != 0, qName, seq, qual,
+                name, nameLen, name + nameLen, name + nameLen + seqLen, seqLen) && pairedEnds != NULL)
+            pairedEnds->push_back(std::make_pair(std::string(name, nameLen), header[0] != 0));
+    }
+
+    return 0;
+}
+
+// --------------------------------------------------------------------------
+// Function importReads()
+// --------------------------------------------------------------------------
+
+// Pairs the reads written by exportReads() with the stored reads or stores them, in their original order. The
+// names and read ends of the imported reads that were paired are appended to pairedEnds.
+inline int
+importReads(SeqFileOut & firstStream,
+        SeqFileOut & secondStream,
+        ReadPairing & pairing,
+        std::string const & fileName,
+        std::vector<std::pair<std::string, bool> > & pairedEnds)
+{
+    return _addStoredReads(firstStream, secondStream, pairing, fileName, &pairedEnds);
+}
+
+// --------------------------------------------------------------------------
+// Function writeFastq()
+// --------------------------------------------------------------------------
+
+// Writes the remaining reads. Reads without mate go to the single fastq file sorted by read name.
+// If reads were spilled, the partitions are paired one after another.
+inline int
+writeFastq(SeqFileOut & fastqFirst,
+        SeqFileOut & fastqSecond,
+        SeqFileOut & fastqSingle,
+        ReadPairing & pairing)
+{
+    if (pairing.numSpills == 0)
+    {
+        _writeSingles(fastqSingle, pairing);
+        return 0;
+    }
+
+    if (spillReads(pairing) != 0)
+        return 1;
+    std::vector<uint64_t>().swap(pairing.spilledNames);
+
+    ReadPairing partitionPairing;
+    for (unsigned p = 0; p < ReadPairing::numPartitions; ++p)
+    {
+        std::string fileName = _spillPartitionName(pairing, p);
+        if (_addStoredReads(fastqFirst, fastqSecond, partitionPairing, fileName, NULL) != 0)
+            return 1;
+        std::remove(fileName.c_str());
+
+        _writeSingles(fastqSingle, partitionPairing);
+    }
+
+    return 0;
+}
+
+#endif // #ifndef POPINS2_READ_PAIRING_H_
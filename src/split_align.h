@@ -63,19 +63,22 @@ hasGoodClippedPrefix(TQualString & qual, TCigar & cigar, unsigned minQual)
 
 // Returns true if read is unmapped and it's mate is mapped in correct orientation or
 //              if the read is soft-clipped and the clipped prefix/suffix is of good quality.
+// The view is decoded into record only if cigar and flags do not rule out the read.
 
 bool
-isCandidateSplitRead(BamAlignmentRecord & record, bool locOri)
+isCandidateSplitRead(BamAlignmentRecord & record, BamRecordView const & view, bool locOri)
 {
     // Check cigar.
-    if (length(record.cigar) == 1 || (length(record.cigar) == 3 &&
-            record.cigar[1].count < 10 && (record.cigar[1].operation == 'D' || record.cigar[1].operation == 'I')))
+    if (getCigarLength(view) == 1 || (getCigarLength(view) == 3 && getCigarElement(view, 1).count < 10 &&
+            (getCigarElement(view, 1).operation == 'D' || getCigarElement(view, 1).operation == 'I')))
         return false; // read matches the reference
 
     // Check flags.
-    if (hasFlagSecondary(record) || hasFlagQCNoPass(record) || hasFlagDuplicate(record) || hasFlagSupplementary(record))
+    if (hasFlagSecondary(view) || hasFlagQCNoPass(view) || hasFlagDuplicate(view) || hasFlagSupplementary(view))
         return false;
 
+    decodeRecord(record, view);
+
     // Check if unmapped and otherwise for quality of interesting read end.
     // Reverse complement the read sequence if necessary.
     if (locOri)
@@ -250,19 +253,20 @@ splitAlignReads(std::map<std::pair<unsigned, unsigned>, unsigned> & insPos,
     unsigned readCount = 0;
 
     // Iterate reads in region and align candidate split reads.
+    BamRecordView view;
     BamAlignmentRecord record;
     std::pair<unsigned, unsigned> posPair;
     while (!atEnd(bamStream))
     {
-        // Read record from BAM file.
-        readRecord(record, bamStream);
+        // Read record from BAM file, it is decoded only if it is a candidate split read.
+        readRecord(view, bamStream);
 
         // Skip records before the region's start.
-        if (record.rID == rID && record.beginPos < (int32_t)loc.chrStart)
+        if (view.rID == rID && view.beginPos < (int32_t)loc.chrStart)
             continue;
 
         // Check if read's alignment position is still within the location.
-        if (record.rID != rID || record.beginPos > (int32_t)loc.chrEnd)
+        if (view.rID != rID || view.beginPos > (int32_t)loc.chrEnd)
             return 0;
 
         // Check for too high coverage.
@@ -271,7 +275,7 @@ splitAlignReads(std::map<std::pair<unsigned, unsigned>, unsigned> & insPos,
             return 1;
 
         // Check quality of record.
-        if (!isCandidateSplitRead(record, loc.chrOri))
+        if (!isCandidateSplitRead(record, view, loc.chrOri))
             continue;
 
         // Reverse complement record.seq if (loc.chrOri == true).
@@ -0,0 +1,446 @@
+#ifndef POPINS2_STAGE_MANIFEST_H_
+#define POPINS2_STAGE_MANIFEST_H_
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <sys/stat.h>
+
+#include <zlib.h>
+
+#include <seqan/sequence.h>
+
+#include "util.h"
+
+using namespace seqan;
+
+/**
+ * The manifest of a sample (POPINS_MANIFEST in the sample's working directory) records for every
+ * completed stage the popins2 version, the parameters that affect the output, and the inputs and
+ * outputs with their sizes, modification times and CRC32 checksums. A stage is skipped on a rerun
+ * if the recorded entry still matches. Inputs that were written by an earlier stage are identified
+ * by the checksum recorded for them, other inputs (e.g. the sample's bam file or the reference
+ * genome) by their size and modification time only.
+ *
+ * The entry of a stage is removed when the stage starts and written after all outputs are
+ * complete, such that the outputs of a killed job are never reused.
+ */
+
+// ==========================================================================
+// Struct StageFile
+// ==========================================================================
+
+struct StageFile
+{
+    CharString path;
+    uint64_t size;
+    int64_t mtime;          // nanoseconds
+    CharString checksum;    // "-" if not computed
+
+    StageFile() : size(0), mtime(0), checksum("-")
+    {}
+};
+
+inline bool
+operator==(StageFile const & a, StageFile const & b)
+{
+    return a.path == b.path && a.size == b.size && a.mtime == b.mtime && a.checksum == b.checksum;
+}
+
+// ==========================================================================
+// Struct StageRecord
+// ==========================================================================
+
+struct StageRecord
+{
+    CharString name;
+    CharString version;
+    String<Pair<CharString> > params;
+    String<StageFile> inputs;
+    String<StageFile> outputs;
+
+    StageRecord() : version(VERSION)
+    {}
+
+    StageRecord(char const * name_) : name(name_), version(VERSION)
+    {}
+};
+
+// ==========================================================================
+// Struct StageManifest
+// ==========================================================================
+
+struct StageManifest
+{
+    CharString fileName;
+    String<StageRecord> stages;
+};
+
+// --------------------------------------------------------------------------
+// Function statFile()
+// --------------------------------------------------------------------------
+
+// Sets the size and modification time (in nanoseconds) of the file. Returns false if the file does not exist.
+inline bool
+statFile(StageFile & file, CharString const & path)
+{
+    struct stat buffer;
+    file.path = path;
+    if (stat(toCString(path), &buffer) != 0)
+        return false;
+
+    file.size = buffer.st_size;
+#ifdef __APPLE__
+    file.mtime = (int64_t)buffer.st_mtimespec.tv_sec * 1000000000 + buffer.st_mtimespec.tv_nsec;
+#else
+    file.mtime = (int64_t)buffer.st_mtim.tv_sec * 1000000000 + buffer.st_mtim.tv_nsec;
+#endif
+    return true;
+}
+
+// --------------------------------------------------------------------------
+// Function checksumFile()
+// --------------------------------------------------------------------------
+
+// Computes the CRC32 checksum of the file's content as an 8-digit hex string.
+inline bool
+checksumFile(CharString & checksum, CharString const & path)
+{
+    std::ifstream stream(toCString(path), std::ios::binary);
+    if (!stream.is_open())
+        return false;
+
+    std::vector<char> buffer(1 << 20);
+    uLong crc = crc32(0L, Z_NULL, 0);
+    while (stream)
+    {
+        stream.read(&buffer[0], buffer.size());
+        crc = crc32(crc, reinterpret_cast<Bytef const *>(&buffer[0]), stream.gcount());
+    }
+    if (stream.bad())
+        return false;
+
+    char hex[9];
+    std::snprintf(hex, sizeof(hex), "%08lx", (unsigned long)crc);
+    checksum = hex;
+    return true;
+}
+
+// --------------------------------------------------------------------------
+// Function readManifest()
+// --------------------------------------------------------------------------
+
+// Reads the manifest of a sample. A missing manifest file is an empty manifest.
+inline bool
+readManifest(StageManifest & manifest, CharString const & fileName)
+{
+    manifest.fileName = fileName;
+    clear(manifest.stages);
+
+    std::ifstream stream(toCString(fileName));
+    if (!stream.good())
+        return 0;
+
+    std::string line;
+    StageRecord * stage = NULL;
+    while (std::getline(stream, line))
+    {
+        // The fields are tab-separated, paths and parameter values may contain spaces.
+        std::vector<std::string> fields;
+        std::istringstream lineStream(line);
+        std::string field;
+        while (std::getline(lineStream, field, '\t'))
+            fields.push_back(field);
+        if (fields.empty())
+            continue;
+        if (line[line.size() - 1] == '\t')
+            fields.push_back("");   // getline() drops an empty last field, e.g. an empty parameter value
+
+        std::string const & type = fields[0];
+        if (type == "STAGE" && fields.size() == 2)
+        {
+            appendValue(manifest.stages, StageRecord(fields[1].c_str()));
+            stage = &back(manifest.stages);
+        }
+        else if (type == "END")
+        {
+            stage = NULL;
+        }
+        else if (stage != NULL && type == "VERSION" && fields.size() == 2)
+        {
+            stage->version = fields[1];
+        }
+        else if (stage != NULL && type == "PARAM" && fields.size() == 3)
+        {
+            appendValue(stage->params, Pair<CharString>(fields[1], fields[2]));
+        }
+        else if (stage != NULL && (type == "INPUT" || type == "OUTPUT") && fields.size() == 5)
+        {
+            StageFile file;
+            file.path = fields[1];
+            file.checksum = fields[4];
+            if (!lexicalCast(file.size, fields[2]) || !lexicalCast(file.mtime, fields[3]))
+            {
+                std::cerr << "ERROR: Invalid file entry in manifest file \'" << fileName << "\': " << line << std::endl;
+                return 1;
+            }
+            appendValue(type == "INPUT" ? stage->inputs : stage->outputs, file);
+        }
+        else
+        {
+            std::cerr << "ERROR: Unexpected line in manifest file \'" << fileName << "\': " << line << std::endl;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// --------------------------------------------------------------------------
+// Function writeManifest()
+// --------------------------------------------------------------------------
+
+// Writes the manifest to a temporary file that replaces the manifest file, such that it is never half-written.
+inline bool
+writeManifest(StageManifest const & manifest)
+{
+    CharString tmpFile = manifest.fileName;
+    tmpFile += ".tmp";
+
+    std::ofstream stream(toCString(tmpFile));
+    if (!stream.good())
+    {
+        std::cerr << "ERROR: Could not open manifest file \'" << tmpFile << "\' for writing." << std::endl;
+        return 1;
+    }
+
+    for (unsigned i = 0; i < length(manifest.stages); ++i)
+    {
+        StageRecord const & stage = manifest.stages[i];
+        stream << "STAGE" << "\t" << stage.name << "\n";
+        stream << "VERSION" << "\t" << stage.version << "\n";
+        for (unsigned j = 0; j < length(stage.params); ++j)
+            stream << "PARAM" << "\t" << stage.params[j].i1 << "\t" << stage.params[j].i2 << "\n";
+        for (unsigned j = 0; j < length(stage.inputs); ++j)
+            stream << "INPUT" << "\t" << stage.inputs[j].path << "\t" << stage.inputs[j].size << "\t"
+                   << stage.inputs[j].mtime << "\t" << stage.inputs[j].checksum << "\n";
+        for (unsigned j = 0; j < length(stage.outputs); ++j)
+            stream << "OUTPUT" << "\t" << stage.outputs[j].path << "\t" << stage.outputs[j].size << "\t"
+                   << stage.outputs[j].mtime << "\t" << stage.outputs[j].checksum << "\n";
+        stream << "END" << "\n";
+    }
+
+    stream.close();
+    if (stream.fail() || rename(toCString(tmpFile), toCString(manifest.fileName)) != 0)
+    {
+        std::cerr << "ERROR: Could not write manifest file \'" << manifest.fileName << "\'." << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// --------------------------------------------------------------------------
+// Function addParam()
+// --------------------------------------------------------------------------
+
+template <typename TValue>
+inline void
+addParam(StageRecord & stage, char const * key, TValue const & value)
+{
+    std::ostringstream str;
+    str << value;
+    appendValue(stage.params, Pair<CharString>(key, str.str()));
+}
+
+// --------------------------------------------------------------------------
+// Function _fingerprintFile()
+// --------------------------------------------------------------------------
+
+// Sets size and modification time of the file, and the checksum if the manifest records the unchanged file as output
+// of a stage. Returns false if the file does not exist.
+inline bool
+_fingerprintFile(StageFile & file, StageManifest const & manifest, CharString const & path)
+{
+    if (!statFile(file, path))
+        return false;
+
+    for (unsigned i = 0; i < length(manifest.stages); ++i)
+    {
+        for (unsigned j = 0; j < length(manifest.stages[i].outputs); ++j)
+        {
+            StageFile const & output = manifest.stages[i].outputs[j];
+            if (output.path == file.path && output.size == file.size && output.mtime == file.mtime)
+                file.checksum = output.checksum;
+        }
+    }
+    return true;
+}
+
+// --------------------------------------------------------------------------
+// Function addInput()
+// --------------------------------------------------------------------------
+
+// Adds an input file to the stage. A file that does not exist is added with the checksum "missing", such that the
+// stage is never up to date. Returns false if the file does not exist.
+inline bool
+addInput(StageRecord & stage, StageManifest const & manifest, CharString const & path)
+{
+    StageFile file;
+    bool found = _fingerprintFile(file, manifest, path);
+    if (!found)
+        file.checksum = "missing";
+
+    appendValue(stage.inputs, file);
+    return found;
+}
+
+// --------------------------------------------------------------------------
+// Function addOutput()
+// --------------------------------------------------------------------------
+
+// Adds a completed output file with its checksum to the stage.
+inline bool
+addOutput(StageRecord & stage, StageManifest const & manifest, CharString const & path)
+{
+    StageFile file;
+    if (!_fingerprintFile(file, manifest, path) || (file.checksum == "-" && !checksumFile(file.checksum, path)))
+    {
+        std::cerr << "ERROR: Could not read output file \'" << path << "\' for the manifest." << std::endl;
+        return false;
+    }
+
+    appendValue(stage.outputs, file);
+    return true;
+}
+
+// --------------------------------------------------------------------------
+// Function _findStage()
+// --------------------------------------------------------------------------
+
+inline int
+_findStage(StageManifest const & manifest, CharString const & name)
+{
+    for (unsigned i = 0; i < length(manifest.stages); ++i)
+        if (manifest.stages[i].name == name)
+            return i;
+    return -1;
+}
+
+// --------------------------------------------------------------------------
+// Function _outputReplaced()
+// --------------------------------------------------------------------------
+
+// Returns true if another stage in the manifest took the output as its input and replaced it by its own output,
+// which is the current file.
+inline bool
+_outputReplaced(StageManifest const & manifest, StageFile const & output, StageFile const & current)
+{
+    for (unsigned i = 0; i < length(manifest.stages); ++i)
+    {
+        StageRecord const & later = manifest.stages[i];
+        bool consumed = false;
+        for (unsigned j = 0; j < length(later.inputs); ++j)
+            if (later.inputs[j] == output)
+                consumed = true;
+        if (!consumed)
+            continue;
+
+        for (unsigned j = 0; j < length(later.outputs); ++j)
+            if (later.outputs[j].path == output.path &&
+                    later.outputs[j].size == current.size && later.outputs[j].mtime == current.mtime)
+                return true;
+    }
+    return false;
+}
+
+// --------------------------------------------------------------------------
+// Function stageUpToDate()
+// --------------------------------------------------------------------------
+
+/**
+ * Returns true if the manifest records the stage with the same version, parameters, and inputs, and
+ * all recorded outputs are still present unchanged in size and modification time. An input that the
+ * stage replaces by its own output (as remapping does with the fastq files) matches if the file
+ * is that output. Likewise, an output that a later stage replaced this way is still current for this
+ * stage. A stage with a missing input is never up to date.
+ */
+inline bool
+stageUpToDate(StageManifest const & manifest, StageRecord const & stage)
+{
+    int i = _findStage(manifest, stage.name);
+    if (i < 0)
+        return false;
+
+    StageRecord const & recorded = manifest.stages[i];
+    if (recorded.version != stage.version || recorded.params != stage.params)
+        return false;
+
+    StageFile current;
+    for (unsigned j = 0; j < length(recorded.outputs); ++j)
+    {
+        StageFile const & output = recorded.outputs[j];
+        if (!statFile(current, output.path))
+            return false;
+        if ((current.size != output.size || current.mtime != output.mtime) &&
+                !_outputReplaced(manifest, output, current))
+            return false;
+    }
+
+    if (length(recorded.inputs) != length(stage.inputs))
+        return false;
+    for (unsigned j = 0; j < length(stage.inputs); ++j)
+    {
+        if (stage.inputs[j].checksum == "missing")
+            return false;
+        if (stage.inputs[j] == recorded.inputs[j])
+            continue;
+
+        bool replaced = false;
+        for (unsigned k = 0; k < length(recorded.outputs); ++k)
+            if (recorded.inputs[j].path == recorded.outputs[k].path && stage.inputs[j] == recorded.outputs[k])
+                replaced = true;
+        if (!replaced)
+            return false;
+    }
+
+    return true;
+}
+
+// --------------------------------------------------------------------------
+// Function beginStage()
+// --------------------------------------------------------------------------
+
+// Removes the stage's entry from the manifest before its outputs are (re)written.
+inline bool
+beginStage(StageManifest & manifest, StageRecord const & stage)
+{
+    int i = _findStage(manifest, stage.name);
+    if (i < 0)
+        return 0;
+
+    erase(manifest.stages, i);
+    return writeManifest(manifest);
+}
+
+// --------------------------------------------------------------------------
+// Function finishStage()
+// --------------------------------------------------------------------------
+
+// Records the completed stage with its outputs in the manifest.
+inline bool
+finishStage(StageManifest & manifest, StageRecord & stage, String<CharString> const & outputs)
+{
+    for (unsigned i = 0; i < length(outputs); ++i)
+        if (!addOutput(stage, manifest, outputs[i]))
+            return 1;
+
+    int i = _findStage(manifest, stage.name);
+    if (i >= 0)
+        erase(manifest.stages, i);
+    appendValue(manifest.stages, stage);
+
+    return writeManifest(manifest);
+}
+
+#endif // #ifndef POPINS2_STAGE_MANIFEST_H_
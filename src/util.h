@@ -11,10 +11,14 @@
 #include <seqan/seq_io.h>
 
 #include <iostream>
+#include <fstream>
+#include <memory>               // std::unique_ptr
 #include <vector>
 #include <algorithm>            // std::sort
 #include <dirent.h>             // read folder
 #include <cerrno>
+#include <cstdio>               // popen
+#include <sys/wait.h>           // WEXITSTATUS
 
 using namespace seqan;
 
@@ -50,7 +54,7 @@ inline void printTimeStatus(const char * message){
         char timestamp[80];
         time_t now = time(0);
         struct tm tstruct;
-        tstruct = *localtime(&now);
+        localtime_r(&now, &tstruct);
         strftime(timestamp, sizeof(timestamp), "[popins2 %Y-%m-%d %X] ", &tstruct);
 
         // Print time and message.
@@ -354,7 +358,7 @@ void printStatus(const char * message)
         char timestamp[80];
         time_t now = time(0);
         struct tm tstruct;
-        tstruct = *localtime(&now);
+        localtime_r(&now, &tstruct);
         strftime(timestamp, sizeof(timestamp), "[popins2 %Y-%m-%d %X] ", &tstruct);
 
         // Print time and message.
@@ -466,6 +470,244 @@ removeFile(CharString const & path, const char * filename)
     remove(toCString(file));
 }
 
+// ==========================================================================
+// Class FastqFileOut
+// ==========================================================================
+
+// FASTQ output file that is optionally written block-gzip compressed (BGZF).
+// The blocks are deflated by a pool of compressionThreads threads, zero threads
+// write plain FASTQ. The file name is kept as given in both cases, readers
+// detect the compression from the file content (see FastqFileIn).
+struct FastqFileOut : public SeqFileOut
+{
+    std::ofstream file;
+    std::unique_ptr<basic_bgzf_streambuf<char> > bgzfBuffer;
+    std::unique_ptr<std::ostream> bgzfStream;
+
+    FastqFileOut() {}
+    FastqFileOut(char const * fileName, unsigned compressionThreads = 0);
+    ~FastqFileOut();
+};
+
+inline bool
+open(FastqFileOut & fastqFile, char const * fileName, unsigned compressionThreads = 0)
+{
+    if (compressionThreads == 0)
+        return open(static_cast<SeqFileOut &>(fastqFile), fileName);
+
+    fastqFile.file.open(fileName, std::ios::binary | std::ios::out | std::ios::trunc);
+    if (!fastqFile.file.is_open())
+        return false;
+
+    fastqFile.bgzfBuffer.reset(new basic_bgzf_streambuf<char>(fastqFile.file, compressionThreads));
+    fastqFile.bgzfStream.reset(new std::ostream(fastqFile.bgzfBuffer.get()));
+    return open(static_cast<SeqFileOut &>(fastqFile), *fastqFile.bgzfStream, Fastq());
+}
+
+inline bool
+close(FastqFileOut & fastqFile)
+{
+    bool success = close(static_cast<SeqFileOut &>(fastqFile));
+    if (fastqFile.bgzfBuffer)
+    {
+        fastqFile.bgzfStream->flush();
+        fastqFile.bgzfBuffer->addFooter();
+        fastqFile.bgzfStream.reset();
+        fastqFile.bgzfBuffer.reset();   // appends the empty EOF block and joins the compression threads
+        fastqFile.file.close();
+        success = success && !fastqFile.file.fail();
+    }
+    return success;
+}
+
+inline
+FastqFileOut::FastqFileOut(char const * fileName, unsigned compressionThreads)
+{
+    if (!open(*this, fileName, compressionThreads))
+        SEQAN_THROW(FileOpenError(fileName));
+}
+
+inline
+FastqFileOut::~FastqFileOut()
+{
+    close(*this);
+}
+
+// ==========================================================================
+// Class FastqFileIn
+// ==========================================================================
+
+// FASTQ input file that detects gzip or BGZF compression from the file content
+// instead of the file extension, e.g. for files written by FastqFileOut.
+struct FastqFileIn : public SeqFileIn
+{
+    std::ifstream file;
+
+    FastqFileIn() {}
+    FastqFileIn(char const * fileName);
+
+    ~FastqFileIn()
+    {
+        close(static_cast<SeqFileIn &>(*this));    // before the file stream goes away
+    }
+};
+
+inline bool
+open(FastqFileIn & fastqFile, char const * fileName)
+{
+    fastqFile.file.open(fileName, std::ios::binary | std::ios::in);
+    if (!fastqFile.file.is_open())
+        return false;
+
+    return open(static_cast<SeqFileIn &>(fastqFile), fastqFile.file);
+}
+
+// Shadows the generic atEnd(T const &) of SeqAn, which would copy the file.
+inline bool
+atEnd(FastqFileIn & fastqFile)
+{
+    return atEnd(static_cast<SeqFileIn &>(fastqFile));
+}
+
+inline
+FastqFileIn::FastqFileIn(char const * fileName)
+{
+    if (!open(*this, fileName))
+        SEQAN_THROW(FileOpenError(fileName));
+}
+
+// ==========================================================================
+// Class CommandPipeBuf
+// ==========================================================================
+
+// Read-only stream buffer over the standard output of a shell command.
+class CommandPipeBuf : public std::streambuf
+{
+public:
+    FILE * pipe;
+    char buffer[64 * 1024];
+
+    CommandPipeBuf() : pipe(NULL) {}
+
+    ~CommandPipeBuf()
+    {
+        if (pipe != NULL)
+            pclose(pipe);
+    }
+
+protected:
+    int_type underflow()
+    {
+        if (gptr() < egptr())
+            return traits_type::to_int_type(*gptr());
+
+        size_t n = (pipe == NULL) ? 0 : fread(buffer, 1, sizeof(buffer), pipe);
+        if (n == 0)
+            return traits_type::eof();
+
+        setg(buffer, buffer, buffer + n);
+        return traits_type::to_int_type(*gptr());
+    }
+};
+
+// ==========================================================================
+// Class SamPipeIn
+// ==========================================================================
+
+// Sam (or bam) input read from the standard output of a command, e.g. bwa mem,
+// so that the alignments never reach the disk as a text file. A SamPipeIn that
+// is constructed from the context of another file shares its reference names,
+// and the records of both files can be written to the same output file.
+struct SamPipeIn : public BamFileIn
+{
+    CommandPipeBuf pipeBuf;
+    std::unique_ptr<std::istream> pipeStream;
+
+    SamPipeIn() {}
+    SamPipeIn(TDependentContext & otherCtx) : BamFileIn(otherCtx) {}
+
+    ~SamPipeIn()
+    {
+        close(static_cast<BamFileIn &>(*this));    // before the pipe goes away
+    }
+};
+
+// Starts the command, returns false if it cannot be started or writes no sam or bam output.
+inline bool
+open(SamPipeIn & samFile, char const * command)
+{
+    samFile.pipeBuf.pipe = popen(command, "r");
+    if (samFile.pipeBuf.pipe == NULL)
+        return false;
+
+    samFile.pipeStream.reset(new std::istream(&samFile.pipeBuf));
+    return open(static_cast<BamFileIn &>(samFile), *samFile.pipeStream);
+}
+
+// Waits for the command to terminate and returns its exit status.
+inline int
+close(SamPipeIn & samFile)
+{
+    close(static_cast<BamFileIn &>(samFile));
+    samFile.pipeStream.reset();
+
+    if (samFile.pipeBuf.pipe == NULL)
+        return -1;
+
+    int status = pclose(samFile.pipeBuf.pipe);
+    samFile.pipeBuf.pipe = NULL;
+    if (status == -1 || !WIFEXITED(status))
+        return -1;
+    return WEXITSTATUS(status);
+}
+
+// Shadows the generic atEnd(T const &) of SeqAn, which would copy the file.
+inline bool
+atEnd(SamPipeIn & samFile)
+{
+    return atEnd(static_cast<BamFileIn &>(samFile));
+}
+
+// ==========================================================================
+// Function appendCommandSam()
+// ==========================================================================
+
+// Runs the command and appends the records of its sam output to the bam file. The header
+// is written only if writeSamHeader is set, e.g. for the first of several commands whose
+// output is collected in the same file. Returns false if the command fails.
+inline bool
+appendCommandSam(BamFileOut & bamFile, SamPipeIn & samFile, char const * command, bool writeSamHeader)
+{
+    if (!open(samFile, command))
+    {
+        close(samFile);
+        return false;
+    }
+
+    bool ok = true;
+    try
+    {
+        BamHeader header;
+        readHeader(header, samFile);
+        if (writeSamHeader)
+            writeHeader(bamFile, header);
+
+        BamAlignmentRecord record;
+        while (!atEnd(samFile))
+        {
+            readRecord(record, samFile);
+            writeRecord(bamFile, record);
+        }
+    }
+    catch (Exception const & e)
+    {
+        std::cerr << "ERROR: " << e.what() << std::endl;
+        ok = false;
+    }
+
+    return close(samFile) == 0 && ok;
+}
+
 // ==========================================================================
 // Function checkFileEnding()
 // ==========================================================================
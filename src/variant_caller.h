@@ -17,6 +17,7 @@
 #include <seqan/bam_io.h>
 #include <seqan/vcf_io.h>
 
+#include "bam_record_view.h"
 
 using namespace seqan;
 
@@ -254,19 +255,22 @@ int readBamRegion(BamIndex< Bai>& baiI, BamFileIn& bamS,
     if (!hasAlignments)
         return 0;  // No alignments here.
 
+    // Records are decoded only once they pass the position and flag checks.
+    BamRecordView view;
     while (!atEnd(bamS))
     {
-        readRecord(record, bamS);
+        readRecord(view, bamS);
 
         //  if( verbose ) std::cout << "Reading " << record.qName << std::endl;
         // If we are on the next reference or at the end already then we stop.
-        if (record.rID == -1 || record.rID > rID || record.beginPos >= end )
+        if (view.rID == -1 || view.rID > rID || view.beginPos >= end )
             break;
         // If we are left of the selected position then we skip this record.
-        if (record.beginPos + getAlignmentLengthInRef(record)  < (unsigned)beg) // We would like to read the read even if the end pos is less than the begin of our region
+        if (view.beginPos + getAlignmentLengthInRef(view)  < (unsigned)beg) // We would like to read the read even if the end pos is less than the begin of our region
             continue;
 
-        if( (not hasFlagDuplicate( record )) and (not hasFlagQCNoPass( record )) ){
+        if( (not hasFlagDuplicate( view )) and (not hasFlagQCNoPass( view )) ){
+            decodeRecord(record, view);
             if( addReadGroup ){
                 BamTagsDict tagsDict(record.tags);
                 unsigned idx;
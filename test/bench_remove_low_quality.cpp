@@ -0,0 +1,48 @@
+#include <chrono>
+#include <iostream>
+
+#include <seqan/bam_io.h>
+
+#include "../src/util.h"
+#include "../src/crop_unmapped.h"
+#include "quality_reads.h"
+
+using namespace seqan;
+
+// Times removeLowQuality() against the iterator-based implementation it replaced, on batches of reads small enough
+// to stay in cache, like freshly decoded bam records.
+int main()
+{
+    unsigned readLengths[] = {150, 250};
+    for (unsigned l = 0; l < 2; ++l)
+    {
+        String<BamAlignmentRecord> reads, work;
+        simulate_quality_reads(reads, readLengths[l], 1000, 42);
+
+        unsigned kept[2] = {0, 0};
+        double seconds[2] = {0, 0};
+        for (unsigned rep = 0; rep < 100; ++rep)
+        {
+            for (unsigned impl = 0; impl < 2; ++impl)
+            {
+                work = reads;
+                auto start = std::chrono::steady_clock::now();
+                for (unsigned r = 0; r < length(work); ++r)
+                    kept[impl] += (impl == 0 ? removeLowQualityReference(work[r], 20) : removeLowQuality(work[r], 20)) == 0;
+                seconds[impl] += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            }
+        }
+
+        if (kept[0] != kept[1])
+        {
+            std::cerr << "ERROR: The implementations keep " << kept[0] << " and " << kept[1] << " reads of "
+                      << readLengths[l] << " bp." << std::endl;
+            return 1;
+        }
+
+        std::cout << "removeLowQuality on " << 100 * length(reads) << " reads of " << readLengths[l] << " bp: reference "
+                  << seconds[0] << " s, in place " << seconds[1] << " s" << std::endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,90 @@
+#ifndef POPINS2_TEST_QUALITY_READS_H_
+#define POPINS2_TEST_QUALITY_READS_H_
+
+#include <random>
+
+#include <seqan/bam_io.h>
+
+using namespace seqan;
+
+// Shared by the unit tests and the benchmark of removeLowQuality().
+
+// The iterator-based implementation removeLowQuality() replaced, kept as reference.
+template<typename TSize_>
+inline bool
+removeLowQualityReference(BamAlignmentRecord & record, TSize_ qualThresh)
+{
+    typedef Iterator<CharString, Rooted>::Type TIter;
+    typedef Size<CharString>::Type TSize;
+
+    TSize windowSize = std::max(TSize(5), length(record.qual) / 10);
+    TSize windowThresh = qualThresh*windowSize;
+
+    TSize windowQual = 0;
+    TIter qualEnd = end(record.qual);
+    TIter windowEnd = begin(record.qual) + std::min(windowSize, length(record.qual));
+    TIter windowBegin = begin(record.qual);
+    for (; windowBegin != windowEnd; ++windowBegin)
+        windowQual += *windowBegin - 33;
+
+    for (windowBegin = begin(record.qual); windowEnd < qualEnd; ++windowEnd, ++windowBegin)
+    {
+        if (windowQual >= (TSize)windowThresh)
+        {
+            while (*windowBegin - 33 < qualThresh) ++windowBegin;
+            record.seq = suffix(record.seq, position(windowBegin));
+            record.qual = suffix(record.qual, position(windowBegin));
+            break;
+        }
+
+        windowQual -= *windowBegin - 33;
+        windowQual += *windowEnd - 33;
+    }
+    if (windowEnd == qualEnd) return 1;
+
+    windowQual = 0;
+    TIter qualBegin = begin(record.qual);
+    windowEnd = end(record.qual) - 1;
+    windowBegin = windowEnd - std::min(windowSize, length(record.qual));
+    for (; windowEnd != windowBegin; --windowEnd)
+        windowQual += *windowEnd - 33;
+
+    for (windowEnd = end(record.qual) - 1; windowBegin >= qualBegin; --windowBegin, --windowEnd)
+    {
+        if (windowQual >= (TSize)windowThresh)
+        {
+            while (*windowEnd - 33 < qualThresh) --windowEnd;
+            record.seq = prefix(record.seq, position(windowEnd) + 1);
+            record.qual = prefix(record.qual, position(windowEnd) + 1);
+            break;
+        }
+
+        windowQual -= *windowEnd - 33;
+        windowQual += *windowBegin -33;
+    }
+
+    if (length(record.seq) < 30) return 1;
+    return 0;
+}
+
+// Random reads with high quality in the middle and low quality tails of random length.
+inline void simulate_quality_reads(String<BamAlignmentRecord> & reads, unsigned readLength, unsigned numReads, unsigned seed){
+
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<int> high(20, 40), low(2, 19), base(0, 3), tail(0, readLength / 3);
+
+    resize(reads, numReads);
+    for (unsigned r = 0; r < numReads; ++r){
+        BamAlignmentRecord & record = reads[r];
+        clear(record.seq);
+        clear(record.qual);
+        unsigned leftTail = tail(rng) / 2, rightTail = tail(rng);
+        for (unsigned i = 0; i < readLength; ++i){
+            appendValue(record.seq, Dna5(base(rng)));
+            bool isLow = i < leftTail || i + rightTail >= readLength || rng() % 8 == 0;
+            appendValue(record.qual, (char)(33 + (isLow ? low(rng) : high(rng))));
+        }
+    }
+}
+
+#endif // #ifndef POPINS2_TEST_QUALITY_READS_H_
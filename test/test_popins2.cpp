@@ -1,11 +1,19 @@
 #undef SEQAN_ENABLE_TESTING
 #define SEQAN_ENABLE_TESTING 1
 
+#include <random>
+
 #include <seqan/seq_io.h>
 
 #include <bifrost/ColoredCDBG.hpp>
 #include <../src/ColoredDeBruijnGraph.h>
 #include <../src/LECC_Finder.h>
+#include <../src/util.h>
+#include <../src/crop_unmapped.h>
+#include <../src/stage_manifest.h>
+#include <../src/batch_scheduler.h>
+#include <../src/location.h>
+#include "quality_reads.h"
 
 
 typedef std::unordered_map<Kmer, bool, KmerHash> border_map_t;
@@ -456,6 +464,958 @@ SEQAN_DEFINE_TEST(call_5simu_test){
 }
 
 
+// --------------------
+// | QUALITY TRIMMING |
+// --------------------
+
+SEQAN_DEFINE_TEST(remove_low_quality_test){
+
+    // Short reads down to the window size, and the read lengths of the benchmark.
+    unsigned readLengths[] = {0, 4, 5, 6, 11, 30, 49, 60, 101, 150, 250};
+    for (unsigned l = 0; l < sizeof(readLengths) / sizeof(unsigned); ++l){
+        String<BamAlignmentRecord> reads;
+        simulate_quality_reads(reads, readLengths[l], 2000, l);
+
+        for (unsigned r = 0; r < length(reads); ++r){
+            BamAlignmentRecord expected = reads[r];
+            BamAlignmentRecord trimmed = reads[r];
+            SEQAN_ASSERT_EQ(removeLowQuality(trimmed, 20), removeLowQualityReference(expected, 20));
+            SEQAN_ASSERT_EQ(trimmed.seq, expected.seq);
+            SEQAN_ASSERT_EQ(trimmed.qual, expected.qual);
+        }
+    }
+}
+
+// -------------------
+// | ADAPTER REMOVAL |
+// -------------------
+SEQAN_DEFINE_TEST(remove_adapter_test){
+
+    CharString genomic = "GATTACATGCCAGTTCAAGGCTTACGATCGTTAGCCATGACTTGCAGGTACCTAGGATCCAATGCTGACGTTCAGTCAATCGGCTAGTCCAGATTGCA";
+    CharString truSeq = "AGATCGGAAGAGCACACGTCTGAACTCCAGTCACATCACG";
+
+    BamAlignmentRecord record;
+    record.flag = BAM_FLAG_NEXT_UNMAPPED | BAM_FLAG_LAST;
+
+    // Adapter prefix with one mismatch at the read end.
+    CharString seq = genomic;
+    append(seq, truSeq);
+    seq[length(genomic) + 20] = 'A';
+    record.seq = seq;
+    record.qual = std::string(length(seq), 'I');
+    SEQAN_ASSERT_EQ(removeAdapter(record, 30, HiSeqAdapters()), 1);
+    SEQAN_ASSERT_EQ(record.seq, IupacString(genomic));
+    SEQAN_ASSERT_EQ(length(record.qual), length(genomic));
+
+    // The same read on the reverse strand is trimmed at the begin.
+    record.seq = seq;
+    reverseComplement(record.seq);
+    record.qual = std::string(length(seq), 'I');
+    record.flag |= BAM_FLAG_RC;
+    SEQAN_ASSERT_EQ(removeAdapter(record, 30, HiSeqAdapters()), 1);
+    IupacString expected = genomic;
+    reverseComplement(expected);
+    SEQAN_ASSERT_EQ(record.seq, expected);
+
+    // Two mismatches are too many.
+    seq[length(genomic) + 30] = 'G';
+    record.seq = seq;
+    record.qual = std::string(length(seq), 'I');
+    record.flag &= ~BAM_FLAG_RC;
+    SEQAN_ASSERT_EQ(removeAdapter(record, 30, HiSeqAdapters()), 0);
+    SEQAN_ASSERT_EQ(length(record.seq), length(seq));
+
+    // A read within the adapter is discarded.
+    record.seq = infix(truSeq, 2, 38);
+    record.qual = std::string(36, 'I');
+    SEQAN_ASSERT_EQ(removeAdapter(record, 30, HiSeqAdapters()), 2);
+}
+
+
+// ------------------
+// | SICKLE TRIMMING |
+// ------------------
+SEQAN_DEFINE_TEST(sickle_trim_test){
+
+    BamAlignmentRecord record;
+    record.seq = std::string(100, 'A');
+    record.qual = std::string(100, 'I');
+
+    // Nothing to trim.
+    unsigned trimEnd = 0;
+    SEQAN_ASSERT(sickleTrimEnd(trimEnd, record.seq, record.qual, false, 20, 60));
+    SEQAN_ASSERT_EQ(trimEnd, 100u);
+
+    // The window of 10 bases containing the low quality stretch is cut at its first low quality base.
+    for (unsigned i = 80; i < 86; ++i)
+        record.qual[i] = '#';
+    SEQAN_ASSERT(sickleTrimEnd(trimEnd, record.seq, record.qual, false, 20, 60));
+    SEQAN_ASSERT_EQ(trimEnd, 80u);
+
+    // Reads on the reverse strand are trimmed from the begin of the record.
+    SEQAN_ASSERT_NOT(sickleTrimEnd(trimEnd, record.seq, record.qual, true, 20, 60));
+    record.qual = std::string(100, 'I');
+    for (unsigned i = 10; i < 16; ++i)
+        record.qual[i] = '#';
+    record.flag = BAM_FLAG_RC;
+    SEQAN_ASSERT_EQ(sickleTrim(record, 20u, 60u), 0);
+    SEQAN_ASSERT_EQ(length(record.seq), 84u);
+    SEQAN_ASSERT_EQ(record.qual, std::string(84, 'I'));
+
+    // Reads are truncated at the first N, reads shorter than 60 bases are discarded and cleared.
+    record.flag = 0;
+    record.seq[70] = 'N';
+    SEQAN_ASSERT_EQ(sickleTrim(record, 20u, 60u), 0);
+    SEQAN_ASSERT_EQ(length(record.seq), 70u);
+    record.seq[50] = 'N';
+    SEQAN_ASSERT_EQ(sickleTrim(record, 20u, 60u), 1);
+    SEQAN_ASSERT(empty(record.seq));
+    SEQAN_ASSERT(empty(record.qual));
+}
+
+
+// ------------------------------
+// | PAIRING READS WITH SPILLING |
+// ------------------------------
+unsigned pair_reads(String<BamAlignmentRecord> const & reads, Triple<CharString> const & fastqFiles, ReadPairing & pairing){
+
+    unsigned paired = 0;
+    SeqFileOut first(toCString(fastqFiles.i1));
+    SeqFileOut second(toCString(fastqFiles.i2));
+    SeqFileOut single(toCString(fastqFiles.i3));
+    for (unsigned r = 0; r < length(reads); ++r)
+        paired += appendFastqRecord(first, second, pairing, reads[r]);
+    SEQAN_ASSERT_EQ(writeFastq(first, second, single, pairing), 0);
+    return paired;
+}
+
+// Reads the pairs (or single reads) of the fastq files as sorted lines, they are written in a different order if
+// the reads were spilled.
+void read_fastq_records(std::vector<std::string> & records, CharString const & fileName, CharString const & mateFile){
+
+    CharString id, seq, qual, mateId, mateSeq, mateQual;
+    SeqFileIn in(toCString(fileName));
+    std::unique_ptr<SeqFileIn> mateIn;
+    if (!empty(mateFile))
+        mateIn.reset(new SeqFileIn(toCString(mateFile)));
+    while (!atEnd(in)){
+        readRecord(id, seq, qual, in);
+        std::string record = toCString(id);
+        record += std::string(" ") + toCString(seq) + " " + toCString(qual);
+        if (mateIn){
+            readRecord(mateId, mateSeq, mateQual, *mateIn);
+            record += std::string(" ") + toCString(mateId) + " " + toCString(mateSeq) + " " + toCString(mateQual);
+        }
+        records.push_back(record);
+    }
+    if (mateIn)
+        SEQAN_ASSERT(atEnd(*mateIn));
+    std::sort(records.begin(), records.end());
+}
+
+SEQAN_DEFINE_TEST(read_pairing_spill_test){
+
+    // Pairs, reads without mate, discarded reads and repeated read ends in random order.
+    std::mt19937 rng(7);
+    String<BamAlignmentRecord> reads;
+    simulate_quality_reads(reads, 100, 12000, 7);
+    for (unsigned r = 0; r < length(reads); ++r){
+        std::stringstream name;
+        name << "read" << r / 2;
+        reads[r].qName = name.str();
+        reads[r].flag = BAM_FLAG_MULTIPLE | (r % 2 == 0 ? BAM_FLAG_FIRST : BAM_FLAG_LAST);
+        if (rng() % 2 == 0)
+            reads[r].flag |= BAM_FLAG_RC;
+        if (r % 10 == 3)
+            reads[r].qName += "_single";
+        if (r % 50 == 5){
+            clear(reads[r].seq);
+            clear(reads[r].qual);
+        }
+    }
+    for (unsigned r = 0; r < 100; ++r)
+        appendValue(reads, reads[rng() % length(reads)]);
+    std::shuffle(begin(reads, Standard()), end(reads, Standard()), rng);
+
+    Triple<CharString> inMemory, spilled;
+    CharString * names[6] = {&inMemory.i1, &inMemory.i2, &inMemory.i3, &spilled.i1, &spilled.i2, &spilled.i3};
+    for (unsigned i = 0; i < 6; ++i){
+        *names[i] = SEQAN_TEMP_FILENAME();
+        append(*names[i], ".fastq");
+    }
+
+    ReadPairing memoryPairing;
+    unsigned memoryPaired = pair_reads(reads, inMemory, memoryPairing);
+
+    // A partition file left behind by a killed run is not paired with the reads.
+    std::string spillPrefix = toCString(spilled.i3);
+    {
+        std::vector<char> stale;
+        _arenaAppend(stale, true, false, "stale", 5, "ACGT", "IIII", 4);
+        std::ofstream out((spillPrefix + ".spill.0").c_str(), std::ios::binary);
+        for (unsigned p = 0; p < ReadPairing::numPartitions; ++p)
+            out.write(&stale[0], stale.size());
+    }
+
+    ReadPairing spillPairing(64 * 1024, spillPrefix);
+    unsigned spillPaired = pair_reads(reads, spilled, spillPairing);
+    SEQAN_ASSERT_GT(spillPairing.numSpills, 1u);
+    SEQAN_ASSERT_EQ(memoryPaired, spillPaired);
+
+    std::vector<std::string> expected, actual;
+    read_fastq_records(expected, inMemory.i1, inMemory.i2);
+    read_fastq_records(actual, spilled.i1, spilled.i2);
+    SEQAN_ASSERT_GT(expected.size(), 0u);
+    SEQAN_ASSERT(expected == actual);
+
+    expected.clear();
+    actual.clear();
+    read_fastq_records(expected, inMemory.i3, "");
+    read_fastq_records(actual, spilled.i3, "");
+    SEQAN_ASSERT_GT(expected.size(), 0u);
+    SEQAN_ASSERT(expected == actual);
+}
+
+// ---------------------------
+// | COMPRESSED FASTQ OUTPUT |
+// ---------------------------
+SEQAN_DEFINE_TEST(fastq_file_compression_test){
+
+    CharString fileName = SEQAN_TEMP_FILENAME();
+    append(fileName, ".fastq");
+
+    // Enough records for several BGZF blocks.
+    StringSet<CharString> ids;
+    StringSet<Dna5String> seqs;
+    StringSet<CharString> quals;
+    for (unsigned i = 0; i < 5000; ++i)
+    {
+        std::ostringstream id;
+        id << "read" << i;
+        appendValue(ids, id.str());
+        appendValue(seqs, Dna5String(i % 2 == 0 ? "GATTACATGCCAGTTCAAGGCTTACGATCGTTAGCC" : "ACGTNACGTTTGCA"));
+        appendValue(quals, std::string(length(seqs[i]), 'I'));
+    }
+
+    for (unsigned threads = 0; threads < 3; threads += 2)
+    {
+        {
+            FastqFileOut out(toCString(fileName), threads);
+            writeRecords(out, ids, seqs, quals);
+        }
+
+        // The compression is detected from the content, the file name is the same.
+        FastqFileIn in(toCString(fileName));
+        CharString id, qual;
+        Dna5String seq;
+        unsigned i = 0;
+        while (!atEnd(in))
+        {
+            readRecord(id, seq, qual, in);
+            SEQAN_ASSERT_EQ(id, ids[i]);
+            SEQAN_ASSERT_EQ(seq, seqs[i]);
+            SEQAN_ASSERT_EQ(qual, quals[i]);
+            ++i;
+        }
+        SEQAN_ASSERT_EQ(i, length(ids));
+    }
+}
+
+// -------------------
+// | BAM RECORD VIEW |
+// -------------------
+SEQAN_DEFINE_TEST(bam_record_view_test){
+
+    CharString fileName = SEQAN_TEMP_FILENAME();
+    append(fileName, ".bam");
+
+    {
+        BamFileOut out(toCString(fileName));
+        BamHeader header;
+        appendValue(contigNames(context(out)), "chr1");
+        appendValue(contigLengths(context(out)), 1000);
+        writeHeader(out, header);
+
+        BamAlignmentRecord record;
+        record.qName = "read1";
+        record.flag = BAM_FLAG_MULTIPLE | BAM_FLAG_FIRST | BAM_FLAG_RC;
+        record.rID = 0;
+        record.beginPos = 100;
+        record.mapQ = 60;
+        record.rNextId = 0;
+        record.pNext = 400;
+        record.seq = "ACGTACGTAAC";
+        record.qual = "IIIIIIIII#!";
+        appendValue(record.cigar, CigarElement<>('S', 2));
+        appendValue(record.cigar, CigarElement<>('M', 6));
+        appendValue(record.cigar, CigarElement<>('D', 3));
+        appendValue(record.cigar, CigarElement<>('M', 3));
+        BamTagsDict tags(record.tags);
+        setTagValue(tags, "RG", "group");
+        setTagValue(tags, "AS", 42);
+        writeRecord(out, record);
+
+        record.qName = "read2";
+        record.flag = BAM_FLAG_UNMAPPED | BAM_FLAG_DUPLICATE;
+        record.seq = "GATTACA";
+        clear(record.qual);
+        clear(record.cigar);
+        clear(record.tags);
+        writeRecord(out, record);
+    }
+
+    BamFileIn recordIn(toCString(fileName));
+    BamFileIn viewIn(toCString(fileName));
+    BamHeader header;
+    readHeader(header, recordIn);
+    readHeader(header, viewIn);
+
+    BamAlignmentRecord record;
+    BamAlignmentRecord decoded;
+    BamRecordView view;
+
+    // The cheap fields and lookups work on the undecoded record.
+    readRecord(record, recordIn);
+    readRecord(view, viewIn);
+    SEQAN_ASSERT_EQ(view.beginPos, 100);
+    SEQAN_ASSERT(hasFlagRC(view));
+    SEQAN_ASSERT_NOT(hasFlagUnmapped(view));
+    SEQAN_ASSERT_EQ(getQName(view), "read1");
+    SEQAN_ASSERT_EQ(getSeqLength(view), 11u);
+    SEQAN_ASSERT_EQ(getCigarLength(view), 4u);
+    SEQAN_ASSERT_EQ(getCigarElement(view, 2).operation, 'D');
+    SEQAN_ASSERT_EQ(getAlignmentLengthInRef(view), getAlignmentLengthInRef(record));
+    unsigned score = 0;
+    SEQAN_ASSERT(extractTagValue(score, findTag(view, "AS")));
+    SEQAN_ASSERT_EQ(score, 42u);
+    SEQAN_ASSERT(findTag(view, "NM") == NULL);
+
+    // Decoding gives the record as read by SeqAn.
+    decodeRecord(decoded, view);
+    SEQAN_ASSERT_EQ(decoded.qName, record.qName);
+    SEQAN_ASSERT_EQ(decoded.flag, record.flag);
+    SEQAN_ASSERT_EQ(decoded.pNext, record.pNext);
+    SEQAN_ASSERT(decoded.cigar == record.cigar);
+    SEQAN_ASSERT_EQ(decoded.seq, record.seq);
+    SEQAN_ASSERT_EQ(decoded.qual, record.qual);
+    SEQAN_ASSERT_EQ(decoded.tags, record.tags);
+
+    readRecord(record, recordIn);
+    readRecord(view, viewIn);
+    SEQAN_ASSERT(hasFlagDuplicate(view));
+    SEQAN_ASSERT_EQ(getCigarLength(view), 0u);
+    SEQAN_ASSERT(findTag(view, "AS") == NULL);
+    decodeRecord(decoded, view);
+    SEQAN_ASSERT_EQ(decoded.qName, record.qName);
+    SEQAN_ASSERT_EQ(decoded.seq, record.seq);
+    SEQAN_ASSERT_EQ(decoded.qual, record.qual);
+    SEQAN_ASSERT(atEnd(viewIn));
+}
+
+// -------------------------
+// | SAM OUTPUT OF COMMANDS |
+// -------------------------
+SEQAN_DEFINE_TEST(sam_pipe_test){
+
+    CharString samName = SEQAN_TEMP_FILENAME();
+    append(samName, ".sam");
+    CharString bamName = SEQAN_TEMP_FILENAME();
+    append(bamName, ".bam");
+
+    {
+        std::ofstream sam(toCString(samName));
+        sam << "@HD\tVN:1.4\n@SQ\tSN:contig_1\tLN:1000\n";
+        sam << "read1\t65\tcontig_1\t101\t60\t8M\t*\t0\t0\tACGTACGT\tIIIIIIII\tAS:i:8\n";
+        sam << "read2\t4\t*\t0\t0\t*\t*\t0\t0\tGATTACA\tIIIIIII\n";
+    }
+    std::string command = "cat " + std::string(toCString(samName));
+
+    // The output of two commands ends up in one bam file with one header.
+    {
+        SamPipeIn first;
+        SamPipeIn second(context(first));
+        BamFileOut out(context(first), toCString(bamName));
+        SEQAN_ASSERT(appendCommandSam(out, first, command.c_str(), true));
+        SEQAN_ASSERT(appendCommandSam(out, second, command.c_str(), false));
+    }
+
+    BamFileIn in(toCString(bamName));
+    BamHeader header;
+    readHeader(header, in);
+    SEQAN_ASSERT_EQ(length(contigNames(context(in))), 1u);
+
+    BamAlignmentRecord record;
+    unsigned n = 0;
+    while (!atEnd(in))
+    {
+        readRecord(record, in);
+        SEQAN_ASSERT_EQ(record.qName, (n % 2 == 0) ? "read1" : "read2");
+        ++n;
+    }
+    SEQAN_ASSERT_EQ(n, 4u);
+    SEQAN_ASSERT_EQ(record.seq, "GATTACA");
+
+    // The exit status of the command is reported.
+    SamPipeIn failing;
+    BamFileOut out(context(failing), toCString(bamName));
+    command += "; exit 1";
+    SEQAN_ASSERT_NOT(appendCommandSam(out, failing, command.c_str(), true));
+}
+
+// ------------------------------
+// | CROPPING NAME-GROUPED READS |
+// ------------------------------
+SEQAN_DEFINE_TEST(crop_name_groups_test){
+
+    CharString samName = SEQAN_TEMP_FILENAME();
+    append(samName, ".sam");
+    Triple<CharString> fastqFiles;
+    fastqFiles.i1 = SEQAN_TEMP_FILENAME();
+    append(fastqFiles.i1, ".1.fastq");
+    fastqFiles.i2 = SEQAN_TEMP_FILENAME();
+    append(fastqFiles.i2, ".2.fastq");
+    fastqFiles.i3 = SEQAN_TEMP_FILENAME();
+    append(fastqFiles.i3, ".fastq");
+
+    std::string seq(60, 'A');
+    std::string qual(60, 'I');
+    {
+        // Groups in input order, not sorted by name or position.
+        std::ofstream sam(toCString(samName));
+        sam << "@HD\tVN:1.4\n@SQ\tSN:contig_1\tLN:10000\n";
+        // both read ends unmapped
+        sam << "read10\t77\t*\t0\t0\t*\t*\t0\t0\t" << seq << "\t" << qual << "\n";
+        sam << "read10\t141\t*\t0\t0\t*\t*\t0\t0\t" << seq << "\t" << qual << "\n";
+        // mapped mate of an unmapped read
+        sam << "read9\t73\tcontig_1\t101\t60\t60M\t=\t101\t0\t" << seq << "\t" << qual << "\tAS:i:60\n";
+        sam << "read9\t133\tcontig_1\t101\t0\t*\t=\t101\t0\t" << seq << "\t" << qual << "\n";
+        // low quality mapping read, its other read end comes first in the file but maps after it
+        sam << "read2\t145\tcontig_1\t5001\t60\t60M\t=\t2001\t0\t" << seq << "\t" << qual << "\tAS:i:60\n";
+        sam << "read2\t97\tcontig_1\t2001\t60\t60M\t=\t5001\t0\t" << seq << "\t" << qual << "\tAS:i:10\n";
+    }
+
+    String<BamAlignmentRecord> mates;
+    BamFileIn in(toCString(samName));
+    BamHeader header;
+    readHeader(header, in);
+    {
+        SeqFileOut first(toCString(fastqFiles.i1));
+        SeqFileOut second(toCString(fastqFiles.i2));
+        SeqFileOut single(toCString(fastqFiles.i3));
+        ReadPairing pairing;
+        SEQAN_ASSERT_EQ(cropNameGroups(mates, in, first, second, pairing, 1, NoAdapters(), 0.67f, false), 1);
+        SEQAN_ASSERT_EQ(writeFastq(first, second, single, pairing), 0);
+    }
+
+    // The pair goes to the paired fastq files, the reads without mate in the fastq files to the single end reads.
+    CharString id;
+    CharString readSeq;
+    StringSet<CharString> ids;
+    SeqFileIn firstIn(toCString(fastqFiles.i1));
+    readRecord(id, readSeq, firstIn);
+    SEQAN_ASSERT_EQ(id, "read10");
+    SEQAN_ASSERT(atEnd(firstIn));
+    SeqFileIn singleIn(toCString(fastqFiles.i3));
+    while (!atEnd(singleIn))
+    {
+        readRecord(id, readSeq, singleIn);
+        appendValue(ids, id);
+    }
+    SEQAN_ASSERT_EQ(length(ids), 2u);
+    SEQAN_ASSERT_EQ(ids[0], "read2");
+    SEQAN_ASSERT_EQ(ids[1], "read9");
+
+    // The mates are written in the order of 'samtools sort -n', the other read end is marked as mate unmapped.
+    CharString bamName = SEQAN_TEMP_FILENAME();
+    append(bamName, ".bam");
+    {
+        BamFileOut out(context(in), toCString(bamName));
+        setSortOrder(header, "queryname");
+        writeHeader(out, header);
+        writeNameSortedMates(out, mates);
+    }
+    BamFileIn matesIn(toCString(bamName));
+    readHeader(header, matesIn);
+    SEQAN_ASSERT_NOT(isCoordinateSorted(header));
+
+    BamAlignmentRecord record;
+    readRecord(record, matesIn);
+    SEQAN_ASSERT_EQ(record.qName, "read2");
+    SEQAN_ASSERT_EQ(record.beginPos, 5000);
+    SEQAN_ASSERT(hasFlagNextUnmapped(record));
+    readRecord(record, matesIn);
+    SEQAN_ASSERT_EQ(record.qName, "read9");
+    SEQAN_ASSERT(atEnd(matesIn));
+}
+
+// ------------------------------
+// | SINGLE-PASS MATE LOOK-BACK |
+// ------------------------------
+SEQAN_DEFINE_TEST(mate_look_back_test){
+
+    CharString bamName = SEQAN_TEMP_FILENAME();
+    append(bamName, ".bam");
+    CharString matesName = SEQAN_TEMP_FILENAME();
+    append(matesName, ".bam");
+    Triple<CharString> fastqFiles;
+    fastqFiles.i1 = SEQAN_TEMP_FILENAME();
+    append(fastqFiles.i1, ".1.fastq");
+    fastqFiles.i2 = SEQAN_TEMP_FILENAME();
+    append(fastqFiles.i2, ".2.fastq");
+    fastqFiles.i3 = SEQAN_TEMP_FILENAME();
+    append(fastqFiles.i3, ".fastq");
+
+    // Both ends of a pair map to the same position, the mate comes first in the file.
+    FormattedFileContext<BamFileOut, Owner<> >::Type bamContext;
+    appendValue(contigNames(bamContext), "chr1");
+    appendValue(contigLengths(bamContext), 10000);
+    {
+        BamSortWriter writer;
+        open(writer, bamName, BAM_SORT_COORDINATE, 1, 1 << 20);
+        BamAlignmentRecord record;
+        record.qName = "read1";
+        record.rID = 0;
+        record.beginPos = 100;
+        record.rNextId = 0;
+        record.pNext = 100;
+        record.seq = "ACGTACGTAC";
+        record.qual = "IIIIIIIIII";
+        appendValue(record.cigar, CigarElement<>('M', 10));
+        record.flag = BAM_FLAG_MULTIPLE | BAM_FLAG_FIRST;
+        SEQAN_ASSERT(writeRecord(writer, record, bamContext));
+        record.flag = BAM_FLAG_MULTIPLE | BAM_FLAG_LAST | BAM_FLAG_RC;
+        SEQAN_ASSERT(writeRecord(writer, record, bamContext));
+        SEQAN_ASSERT_EQ(close(writer, BamHeader(), bamContext), 0);
+    }
+
+    BamFileIn in(toCString(bamName));
+    BamHeader header;
+    readHeader(header, in);
+
+    // The buffer is full, the mate is read but not buffered before the low quality mapping read registers it.
+    MateLookBack lookBack(1, 1 << 16, 0);
+    MateLookBack::TOtherMap otherReads;
+    {
+        SeqFileOut first(toCString(fastqFiles.i1));
+        SeqFileOut second(toCString(fastqFiles.i2));
+        BamFileOut matesStream(context(in), toCString(matesName));
+        ReadPairing pairing;
+        BamRecordView view;
+        BamAlignmentRecord record;
+
+        readRecord(view, in);
+        SEQAN_ASSERT(hasFlagFirst(view));
+        cropRecord(CROP_SKIP, view, record, record, first, second, matesStream, pairing, otherReads, &lookBack);
+
+        readRecord(view, in);
+        decodeRecord(record, view);
+        cropRecord(CROP_LOW_QUALITY, view, record, record, first, second, matesStream, pairing, otherReads, &lookBack);
+        SEQAN_ASSERT(atEnd(in));
+
+        // The mate is left to the fix-up pass instead of waiting for a record the scan has passed.
+        SEQAN_ASSERT(lookBack.pending.empty());
+        SEQAN_ASSERT_EQ(lookBack.leftovers.size(), 1u);
+        SEQAN_ASSERT_EQ(lookBack.leftovers.begin()->second.i1, "read1");
+        SEQAN_ASSERT_EQ(writeCapturedMates(matesStream, lookBack, otherReads, bamName, 1), 1);
+    }
+}
+
+// ---------------------
+// | SORTING BAM FILES |
+// ---------------------
+SEQAN_DEFINE_TEST(bam_sort_test){
+
+    CharString inName = SEQAN_TEMP_FILENAME();
+    append(inName, ".bam");
+    CharString coordName = SEQAN_TEMP_FILENAME();
+    append(coordName, ".bam");
+    CharString nameName = SEQAN_TEMP_FILENAME();
+    append(nameName, ".bam");
+
+    std::mt19937 rng(42);
+    {
+        BamFileOut out(toCString(inName));
+        BamHeader header;
+        appendValue(contigNames(context(out)), "chr1");
+        appendValue(contigLengths(context(out)), 100000);
+        appendValue(contigNames(context(out)), "chr2");
+        appendValue(contigLengths(context(out)), 100000);
+        writeHeader(out, header);
+
+        BamAlignmentRecord record;
+        record.seq = "ACGTACGTAC";
+        appendValue(record.cigar, CigarElement<>('M', 10));
+        for (unsigned i = 0; i < 3000; ++i)
+        {
+            std::stringstream name;
+            name << "read" << rng() % 1000;
+            record.qName = name.str();
+            record.flag = BAM_FLAG_MULTIPLE | (i % 2 == 0 ? BAM_FLAG_FIRST : BAM_FLAG_LAST) | (i % 3 == 0 ? BAM_FLAG_RC : 0);
+            record.rID = (i % 10 == 0) ? BamAlignmentRecord::INVALID_REFID : rng() % 2;
+            record.beginPos = (i % 10 == 0) ? BamAlignmentRecord::INVALID_POS : rng() % 100000;
+            if (i % 10 == 0)
+                record.flag |= BAM_FLAG_UNMAPPED;
+            writeRecord(out, record);
+        }
+    }
+
+    // A small memory budget makes the sort go through temporary runs.
+    SEQAN_ASSERT_EQ(sortBam(coordName, inName, BAM_SORT_COORDINATE, 3, 16 * 1024, true), 0);
+    SEQAN_ASSERT_EQ(sortBam(nameName, inName, BAM_SORT_QUERYNAME, 2, 16 * 1024, false), 0);
+
+    BamAlignmentRecord record;
+    BamAlignmentRecord previous;
+    BamHeader header;
+    unsigned n = 0;
+
+    BamFileIn coordIn(toCString(coordName));
+    readHeader(header, coordIn);
+    SEQAN_ASSERT(isCoordinateSorted(header));
+    while (!atEnd(coordIn))
+    {
+        readRecord(record, coordIn);
+        if (n > 0)
+            SEQAN_ASSERT_LEQ(coordinateSortKey(previous.rID, previous.beginPos, hasFlagRC(previous)),
+                             coordinateSortKey(record.rID, record.beginPos, hasFlagRC(record)));
+        previous = record;
+        ++n;
+    }
+    SEQAN_ASSERT_EQ(n, 3000u);
+
+    BamFileIn nameIn(toCString(nameName));
+    readHeader(header, nameIn);
+    SEQAN_ASSERT_NOT(isCoordinateSorted(header));
+    n = 0;
+    while (!atEnd(nameIn))
+    {
+        readRecord(record, nameIn);
+        if (n > 0)
+            SEQAN_ASSERT_LEQ(compare_qName(previous.qName, record.qName), 0);
+        previous = record;
+        ++n;
+    }
+    SEQAN_ASSERT_EQ(n, 3000u);
+
+    // The index finds all records overlapping a region.
+    BamIndex<Bai> index;
+    CharString baiName = coordName;
+    append(baiName, ".bai");
+    SEQAN_ASSERT(open(index, toCString(baiName)));
+    unsigned expected = 0;
+    BamFileIn scanIn(toCString(coordName));
+    readHeader(header, scanIn);
+    while (!atEnd(scanIn))
+    {
+        readRecord(record, scanIn);
+        if (record.rID == 1 && record.beginPos < 60000 && record.beginPos + 10 > 50000)
+            ++expected;
+    }
+    bool hasAlignments = false;
+    SEQAN_ASSERT(jumpToRegion(coordIn, hasAlignments, 1, 50000, 60000, index));
+    SEQAN_ASSERT(hasAlignments);
+    unsigned found = 0;
+    while (!atEnd(coordIn))
+    {
+        readRecord(record, coordIn);
+        if (record.rID != 1 || record.beginPos >= 60000)
+            break;
+        if (record.beginPos + 10 > 50000)
+            ++found;
+    }
+    SEQAN_ASSERT_EQ(found, expected);
+}
+
+// -------------------
+// | BAM SORT WRITER |
+// -------------------
+SEQAN_DEFINE_TEST(bam_sort_writer_test){
+
+    CharString outName = SEQAN_TEMP_FILENAME();
+    append(outName, ".bam");
+
+    FormattedFileContext<BamFileOut, Owner<> >::Type bamContext;
+    appendValue(contigNames(bamContext), "contig_0");
+    appendValue(contigLengths(bamContext), 100000);
+
+    // Records are written in decreasing order and spill to temporary runs.
+    BamSortWriter writer;
+    open(writer, outName, BAM_SORT_COORDINATE, 2, 8 * 1024);
+    BamAlignmentRecord record;
+    record.seq = "ACGTACGTAC";
+    appendValue(record.cigar, CigarElement<>('M', 10));
+    for (unsigned i = 0; i < 1000; ++i)
+    {
+        std::stringstream name;
+        name << "read" << i;
+        record.qName = name.str();
+        record.rID = 0;
+        record.beginPos = 10 * (999 - i);
+        SEQAN_ASSERT(writeRecord(writer, record, bamContext));
+    }
+    SEQAN_ASSERT_GT(length(writer.runFiles), 0u);
+    SEQAN_ASSERT_EQ(close(writer, BamHeader(), bamContext), 0);
+
+    BamHeader header;
+    BamFileIn in(toCString(outName));
+    readHeader(header, in);
+    SEQAN_ASSERT(isCoordinateSorted(header));
+    unsigned n = 0;
+    while (!atEnd(in))
+    {
+        readRecord(record, in);
+        SEQAN_ASSERT_EQ(record.beginPos, (int32_t)(10 * n));
+        ++n;
+    }
+    SEQAN_ASSERT_EQ(n, 1000u);
+
+    CharString baiName = outName;
+    append(baiName, ".bai");
+    BamIndex<Bai> index;
+    SEQAN_ASSERT(open(index, toCString(baiName)));
+}
+
+// -----------------------
+// | READ NAME SORT KEYS |
+// -----------------------
+SEQAN_DEFINE_TEST(qname_sort_key_test){
+
+    // Names from few characters, such that digit runs of different lengths and leading zeros meet.
+    std::mt19937 rng(7);
+    char const alphabet[] = "0019:_Ab";
+    String<CharString> names;
+    appendValue(names, "");
+    for (unsigned i = 0; i < 2000; ++i)
+    {
+        CharString name;
+        unsigned len = rng() % 8;
+        for (unsigned j = 0; j < len; ++j)
+            appendValue(name, alphabet[rng() % 8]);
+        appendValue(names, name);
+    }
+
+    String<CharString> keys;
+    resize(keys, length(names));
+    for (unsigned i = 0; i < length(names); ++i)
+        qNameSortKey(keys[i], names[i]);
+
+    for (unsigned i = 0; i < length(names); ++i)
+    {
+        for (unsigned j = 0; j < length(names); j += 7)
+        {
+            int expected = compare_qName(names[i], names[j]);
+            int cmp = compareSortKeys(keys[i], keys[j]);
+            SEQAN_ASSERT_EQ(expected < 0, cmp < 0);
+            SEQAN_ASSERT_EQ(expected == 0, cmp == 0);
+        }
+    }
+}
+
+// ---------------------
+// | ANCHOR COLLECTION |
+// ---------------------
+SEQAN_DEFINE_TEST(anchor_collector_test){
+
+    FormattedFileContext<BamFileOut, Owner<> >::Type bamContext;
+    appendValue(contigNames(bamContext), "chr1");
+    appendValue(contigLengths(bamContext), 100000);
+    appendValue(contigNames(bamContext), "contig_1");
+    appendValue(contigLengths(bamContext), 1000);
+
+    AnchorCollector collector;
+    collector.nonContigSeqs = 1;
+
+    BamAlignmentRecord genome, contig;
+    genome.qName = "read1";
+    genome.mapQ = 60;
+    genome.seq = std::string(100, 'A');
+    genome.qual = std::string(100, 'I');
+    appendValue(genome.cigar, CigarElement<>('M', 100));
+    contig = genome;
+    genome.rID = 0;
+    genome.beginPos = 100;
+    contig.rID = 1;
+    contig.beginPos = 50;
+    contig.flag = BAM_FLAG_RC;
+    contig.rNextId = genome.rID;
+    contig.pNext = genome.beginPos;
+    genome.rNextId = contig.rID;
+    genome.pNext = contig.beginPos;
+    genome.flag = BAM_FLAG_NEXT_RC;
+
+    // The contig record comes first, but is paired as in the coordinate-sorted file.
+    collectAnchors(collector, contig, bamContext);
+    collectAnchors(collector, genome, bamContext);
+
+    // Not an anchor: the alignment ends far from the contig end.
+    genome.qName = contig.qName = "read2";
+    contig.beginPos = 300;
+    contig.flag = 0;
+    genome.pNext = contig.beginPos;
+    collectAnchors(collector, genome, bamContext);
+    collectAnchors(collector, contig, bamContext);
+    finishAnchors(collector, bamContext);
+
+    SEQAN_ASSERT_EQ(length(collector.anchors), 1u);
+    AnchoringRecord & anchor = collector.anchors[0];
+    SEQAN_ASSERT_EQ(anchor.chr, "chr1");
+    SEQAN_ASSERT_EQ(anchor.chrStart, 100u);
+    SEQAN_ASSERT_EQ(anchor.chrEnd, 200u);
+    SEQAN_ASSERT(anchor.chrOri);
+    SEQAN_ASSERT_EQ(anchor.contig, "contig_1");
+    SEQAN_ASSERT_NOT(anchor.contigOri);
+}
+
+// ------------------
+// | STAGE MANIFEST |
+// ------------------
+SEQAN_DEFINE_TEST(stage_manifest_test){
+
+    CharString inName = SEQAN_TEMP_FILENAME();
+    CharString outName = SEQAN_TEMP_FILENAME();
+    CharString manifestName = SEQAN_TEMP_FILENAME();
+    {
+        std::ofstream in(toCString(inName));
+        in << "input\n";
+    }
+
+    StageManifest manifest;
+    SEQAN_ASSERT_EQ(readManifest(manifest, manifestName), 0);
+    SEQAN_ASSERT(empty(manifest.stages));
+
+    // A stage is up to date once it is recorded with its outputs.
+    StageRecord stage("first");
+    addParam(stage, "factor", 0.67f);
+    addParam(stage, "adapters", CharString());
+    SEQAN_ASSERT(addInput(stage, manifest, inName));
+    SEQAN_ASSERT_NOT(stageUpToDate(manifest, stage));
+    SEQAN_ASSERT_EQ(beginStage(manifest, stage), 0);
+    {
+        std::ofstream out(toCString(outName));
+        out << "output\n";
+    }
+    String<CharString> outputs;
+    appendValue(outputs, outName);
+    SEQAN_ASSERT_EQ(finishStage(manifest, stage, outputs), 0);
+
+    StageManifest reread;
+    SEQAN_ASSERT_EQ(readManifest(reread, manifestName), 0);
+    SEQAN_ASSERT_EQ(length(reread.stages), 1u);
+    SEQAN_ASSERT_EQ(reread.stages[0].outputs[0].checksum, "25ac66c4");
+
+    StageRecord rerun("first");
+    addParam(rerun, "factor", 0.67f);
+    addParam(rerun, "adapters", CharString());
+    addInput(rerun, reread, inName);
+    SEQAN_ASSERT(stageUpToDate(reread, rerun));
+
+    // Other parameters do not match.
+    StageRecord changed("first");
+    addParam(changed, "factor", 0.5f);
+    addInput(changed, reread, inName);
+    SEQAN_ASSERT_NOT(stageUpToDate(reread, changed));
+
+    // A later stage identifies its input by the checksum of the earlier stage's output.
+    StageRecord second("second");
+    addInput(second, reread, outName);
+    SEQAN_ASSERT_EQ(second.inputs[0].checksum, "25ac66c4");
+
+    // A changed output invalidates the stage.
+    {
+        std::ofstream out(toCString(outName));
+        out << "half-written";
+    }
+    SEQAN_ASSERT_NOT(stageUpToDate(reread, rerun));
+
+    // A missing input is recorded, but the stage is never up to date.
+    CharString missingName = SEQAN_TEMP_FILENAME();
+    StageRecord third("third");
+    SEQAN_ASSERT_NOT(addInput(third, reread, missingName));
+    SEQAN_ASSERT_EQ(length(third.inputs), 1u);
+    SEQAN_ASSERT_EQ(finishStage(reread, third, String<CharString>()), 0);
+    StageRecord thirdRerun("third");
+    addInput(thirdRerun, reread, missingName);
+    SEQAN_ASSERT_NOT(stageUpToDate(reread, thirdRerun));
+
+    // An output that a later stage replaced by its own output, as remapping does, is still current.
+    CharString cropName = SEQAN_TEMP_FILENAME();
+    StageManifest pipeline;
+    SEQAN_ASSERT_EQ(readManifest(pipeline, SEQAN_TEMP_FILENAME()), 0);
+    StageRecord crop("crop");
+    addInput(crop, pipeline, inName);
+    {
+        std::ofstream out(toCString(cropName));
+        out << "cropped\n";
+    }
+    String<CharString> cropOutputs;
+    appendValue(cropOutputs, cropName);
+    SEQAN_ASSERT_EQ(finishStage(pipeline, crop, cropOutputs), 0);
+
+    StageRecord remap("remap");
+    addInput(remap, pipeline, cropName);
+    {
+        std::ofstream out(toCString(cropName));
+        out << "remapped reads\n";
+    }
+    SEQAN_ASSERT_EQ(finishStage(pipeline, remap, cropOutputs), 0);
+
+    StageRecord cropRerun("crop");
+    addInput(cropRerun, pipeline, inName);
+    SEQAN_ASSERT(stageUpToDate(pipeline, cropRerun));
+
+    // Once the file changes otherwise, the stage is not up to date.
+    {
+        std::ofstream out(toCString(cropName));
+        out << "partly remapped\n";
+    }
+    SEQAN_ASSERT_NOT(stageUpToDate(pipeline, cropRerun));
+}
+
+// -------------------
+// | BATCH SCHEDULER |
+// -------------------
+SEQAN_DEFINE_TEST(batch_scheduler_test){
+
+    CharString sampleName = SEQAN_TEMP_FILENAME();
+    {
+        std::ofstream out(toCString(sampleName));
+        out << "# SAMPLE_ID\tBAM_FILE\n";
+        out << "s1\t/data/s1.bam\n";
+        out << "\n";
+        out << "s2\n";
+    }
+    String<BatchSample> samples;
+    SEQAN_ASSERT_EQ(readBatchSamples(samples, sampleName), 0);
+    SEQAN_ASSERT_EQ(length(samples), 2u);
+    SEQAN_ASSERT_EQ(samples[0].sampleID, "s1");
+    SEQAN_ASSERT_EQ(samples[0].bamFile, "/data/s1.bam");
+    SEQAN_ASSERT_EQ(samples[1].sampleID, "s2");
+    SEQAN_ASSERT(empty(samples[1].bamFile));
+
+    uint64_t threadMemory = 1 << 20;
+    BatchResources pool(6, 16 * threadMemory, 1);
+
+    // CPU-bound jobs take up to the job threads, the last one starts on the remaining cores.
+    SEQAN_ASSERT_EQ(grantBatchJob(pool, BATCH_CPU_BOUND, 4, threadMemory), 4u);
+    reserveBatchJob(pool, BATCH_CPU_BOUND, 4, threadMemory);
+    SEQAN_ASSERT_EQ(grantBatchJob(pool, BATCH_CPU_BOUND, 4, threadMemory), 2u);
+
+    // I/O-bound jobs are limited in number.
+    SEQAN_ASSERT_EQ(grantBatchJob(pool, BATCH_IO_BOUND, 4, threadMemory), 1u);
+    reserveBatchJob(pool, BATCH_IO_BOUND, 1, threadMemory);
+    SEQAN_ASSERT_EQ(grantBatchJob(pool, BATCH_IO_BOUND, 4, threadMemory), 0u);
+    SEQAN_ASSERT_EQ(grantBatchJob(pool, BATCH_SINGLE_THREADED, 4, threadMemory), 1u);
+
+    // Memory limits the threads of a job.
+    SEQAN_ASSERT_EQ(grantBatchJob(pool, BATCH_CPU_BOUND, 4, 8 * threadMemory), 1u);
+    SEQAN_ASSERT_EQ(grantBatchJob(pool, BATCH_CPU_BOUND, 4, 12 * threadMemory), 0u);
+
+    releaseBatchJob(pool, BATCH_IO_BOUND, 1, threadMemory);
+    releaseBatchJob(pool, BATCH_CPU_BOUND, 4, threadMemory);
+    SEQAN_ASSERT_EQ(pool.cores, 6u);
+    SEQAN_ASSERT_EQ(pool.memory, 16 * threadMemory);
+    SEQAN_ASSERT_EQ(pool.ioJobs, 1u);
+}
+
 // --------------
 // | CALL TESTS |
 // --------------
@@ -468,6 +1428,36 @@ SEQAN_BEGIN_TESTSUITE(test_popins2){
     SEQAN_CALL_TEST(setup_5simu_test);
 
     SEQAN_CALL_TEST(call_5simu_test);
+
+    SEQAN_CALL_TEST(remove_low_quality_test);
+
+    SEQAN_CALL_TEST(remove_adapter_test);
+
+    SEQAN_CALL_TEST(sickle_trim_test);
+
+    SEQAN_CALL_TEST(read_pairing_spill_test);
+
+    SEQAN_CALL_TEST(fastq_file_compression_test);
+
+    SEQAN_CALL_TEST(bam_record_view_test);
+
+    SEQAN_CALL_TEST(sam_pipe_test);
+
+    SEQAN_CALL_TEST(crop_name_groups_test);
+
+    SEQAN_CALL_TEST(mate_look_back_test);
+
+    SEQAN_CALL_TEST(bam_sort_test);
+
+    SEQAN_CALL_TEST(bam_sort_writer_test);
+
+    SEQAN_CALL_TEST(qname_sort_key_test);
+
+    SEQAN_CALL_TEST(anchor_collector_test);
+
+    SEQAN_CALL_TEST(stage_manifest_test);
+
+    SEQAN_CALL_TEST(batch_scheduler_test);
 }
 
 